@@ -0,0 +1,221 @@
+#ifndef _BINARY_PROTOCOL_H
+#define _BINARY_PROTOCOL_H
+
+#include "Memcached.h"
+
+// The memcached binary protocol. Every request and response starts
+// with a 24 byte header, followed by extras, the key and the value,
+// whose lengths the header gives. All numbers are in network byte
+// order. A connection speaks it if its first byte is the request
+// magic, the text protocol never starts with it.
+//
+// The quiet variants of the commands don't answer when they succeed,
+// or for GETQ and GETKQ when the key is missing. Clients send a batch
+// of them ended by a NOOP, whose answer tells them the batch is done.
+
+#define BINARY_HEADER_SIZE 24
+#define BINARY_REQUEST_MAGIC 0x80
+#define BINARY_RESPONSE_MAGIC 0x81
+
+// Opcodes we serve.
+#define BINARY_GET 0x00
+#define BINARY_SET 0x01
+#define BINARY_DELETE 0x04
+#define BINARY_GETQ 0x09
+#define BINARY_NOOP 0x0a
+#define BINARY_GETK 0x0c
+#define BINARY_GETKQ 0x0d
+#define BINARY_SETQ 0x11
+#define BINARY_DELETEQ 0x14
+
+// Response status.
+#define BINARY_STATUS_OK 0x00
+#define BINARY_STATUS_KEY_ENOENT 0x01
+#define BINARY_STATUS_E2BIG 0x03
+#define BINARY_STATUS_EINVAL 0x04
+#define BINARY_STATUS_UNKNOWN_COMMAND 0x81
+#define BINARY_STATUS_ENOMEM 0x82
+
+// Extras of a set, flags and exptime.
+#define BINARY_SET_EXTRAS 8
+// Extras of a get response, the flags.
+#define BINARY_GET_EXTRAS 4
+// Biggest body of a request other than a set, it is read in place.
+#define BINARY_MAX_BODY MAX_COMMAND_LINE
+// Biggest value of a set. The connection is closed beyond it.
+#define BINARY_MAX_VALUE ( 1 << 30 )
+
+// Header of a request, in host byte order.
+struct BinaryRequest {
+    uint8_t magic_;
+    uint8_t opcode_;
+    uint16_t keyLen_;
+    uint8_t extrasLen_;
+    uint32_t bodyLen_;      // Extras, key and value.
+    uint32_t opaque_;       // Returned as is in the response.
+    uint64_t cas_;
+};
+
+static inline uint16_t loadBE16( const char *p ) {
+    uint16_t v;
+    memcpy( &v, p, sizeof( v ) );
+    return ntohs( v );
+}
+
+static inline uint32_t loadBE32( const char *p ) {
+    uint32_t v;
+    memcpy( &v, p, sizeof( v ) );
+    return ntohl( v );
+}
+
+static inline void storeBE16( char *p, uint16_t v ) {
+    v = htons( v );
+    memcpy( p, &v, sizeof( v ) );
+}
+
+static inline void storeBE32( char *p, uint32_t v ) {
+    v = htonl( v );
+    memcpy( p, &v, sizeof( v ) );
+}
+
+static inline void decodeBinaryRequest( const char *p, BinaryRequest *req ) {
+    req->magic_ = p[0];
+    req->opcode_ = p[1];
+    req->keyLen_ = loadBE16( p + 2 );
+    req->extrasLen_ = p[4];
+    req->bodyLen_ = loadBE32( p + 8 );
+    req->opaque_ = loadBE32( p + 12 );
+    req->cas_ = ( (uint64_t)loadBE32( p + 16 ) << 32 ) | loadBE32( p + 20 );
+}
+
+// Fill a response header of BINARY_HEADER_SIZE bytes at p.
+static inline void encodeBinaryResponse( char *p, uint8_t opcode, uint16_t status,
+                                         uint16_t keyLen, uint8_t extrasLen,
+                                         uint32_t bodyLen, uint32_t opaque ) {
+    memset( p, 0, BINARY_HEADER_SIZE );
+    p[0] = (char)BINARY_RESPONSE_MAGIC;
+    p[1] = opcode;
+    storeBE16( p + 2, keyLen );
+    p[4] = extrasLen;
+    storeBE16( p + 6, status );
+    storeBE32( p + 8, bodyLen );
+    storeBE32( p + 12, opaque );
+}
+
+// Fill a request header, for clients and benchmarks.
+static inline void encodeBinaryRequest( char *p, uint8_t opcode, uint16_t keyLen,
+                                        uint8_t extrasLen, uint32_t bodyLen,
+                                        uint32_t opaque ) {
+    memset( p, 0, BINARY_HEADER_SIZE );
+    p[0] = (char)BINARY_REQUEST_MAGIC;
+    p[1] = opcode;
+    storeBE16( p + 2, keyLen );
+    p[4] = extrasLen;
+    storeBE32( p + 8, bodyLen );
+    storeBE32( p + 12, opaque );
+}
+
+// Body of an error response, as memcached sends it.
+static inline const char *binaryStatusMessage( uint16_t status ) {
+    switch ( status ) {
+    case BINARY_STATUS_KEY_ENOENT: return "Not found";
+    case BINARY_STATUS_E2BIG: return "Too large.";
+    case BINARY_STATUS_EINVAL: return "Invalid arguments";
+    case BINARY_STATUS_UNKNOWN_COMMAND: return "Unknown command";
+    case BINARY_STATUS_ENOMEM: return "Out of memory";
+    default: return "";
+    }
+}
+
+// Whether the opcode is a quiet one.
+static inline bool binaryQuiet( uint8_t opcode ) {
+    return opcode == BINARY_GETQ || opcode == BINARY_GETKQ ||
+           opcode == BINARY_SETQ || opcode == BINARY_DELETEQ;
+}
+
+// Responses of the binary commands served from one read of a
+// connection, so a batch goes out with a single writev. Headers and
+// flags are formatted into headers_, values and keys of hits are
+// pointed at in their items, which the batch holds references on.
+// Entries of iov_ pointing into headers_ hold an offset until
+// finish(), since headers_ may move while it grows.
+class ReplyBatch {
+public:
+    vector< struct iovec > iov_;
+    vector< size_t > headerIovs_;     // Entries of iov_ into headers_.
+    string headers_;
+    vector< MemcachedItem * > refs_;
+
+    bool empty() {
+        return iov_.empty();
+    }
+
+    // Copy size bytes into the batch.
+    void addCopy( const void *data, size_t size ) {
+        struct iovec v;
+        v.iov_base = (void *)headers_.size();
+        v.iov_len = size;
+        headerIovs_.push_back( iov_.size() );
+        iov_.push_back( v );
+        headers_.append( (const char *)data, size );
+    }
+
+    // Point at size bytes of an item the batch holds a reference on.
+    void addItemData( const void *data, size_t size ) {
+        struct iovec v;
+        v.iov_base = (void *)data;
+        v.iov_len = size;
+        iov_.push_back( v );
+    }
+
+    // A response with a header and an optional body that is copied.
+    void addResponse( uint8_t opcode, uint16_t status, uint32_t opaque,
+                      const char *body = NULL, size_t bodyLen = 0 ) {
+        char header[BINARY_HEADER_SIZE];
+        encodeBinaryResponse( header, opcode, status, 0, 0, bodyLen, opaque );
+        addCopy( header, sizeof( header ) );
+        if ( bodyLen > 0 ) {
+            addCopy( body, bodyLen );
+        }
+    }
+
+    // An error response with the message of its status.
+    void addError( uint8_t opcode, uint16_t status, uint32_t opaque ) {
+        const char *message = binaryStatusMessage( status );
+        addResponse( opcode, status, opaque, message, strlen( message ) );
+    }
+
+    // The hit of a get. The caller's reference on item goes to the
+    // batch. The value is sent without the \r\n of the text protocol.
+    void addItem( uint8_t opcode, uint32_t opaque, MemcachedItem *item, bool withKey ) {
+        char header[BINARY_HEADER_SIZE + BINARY_GET_EXTRAS];
+        uint16_t keyLen = withKey ? item->keyLen_ : 0;
+        uint32_t valueLen = item->size_ - 2;
+        encodeBinaryResponse( header, opcode, BINARY_STATUS_OK, keyLen, BINARY_GET_EXTRAS,
+                              BINARY_GET_EXTRAS + keyLen + valueLen, opaque );
+        storeBE32( header + BINARY_HEADER_SIZE, item->flags_ );
+        addCopy( header, sizeof( header ) );
+        if ( withKey ) {
+            addItemData( item->key(), keyLen );
+        }
+        item->valueIovecs( 0, valueLen, &iov_ );
+        refs_.push_back( item );
+    }
+
+    // Point the copied entries at base, where headers_ ended up.
+    void finish( const char *base ) {
+        for ( size_t i = 0; i < headerIovs_.size(); i++ ) {
+            struct iovec *v = &iov_[headerIovs_[i]];
+            v->iov_base = (void *)( base + (size_t)v->iov_base );
+        }
+    }
+
+    void clear() {
+        iov_.clear();
+        headerIovs_.clear();
+        headers_.clear();
+        refs_.clear();
+    }
+};
+
+#endif // _BINARY_PROTOCOL_H
@@ -0,0 +1,222 @@
+#ifndef _BUFFERED_READER_H
+#define _BUFFERED_READER_H
+
+#include "Memcached.h"
+
+// This is a buffered reader used to read from the socket. Every read
+// takes as much as the socket has and the buffer has room for, so a
+// client pipelining commands gets many of them parsed out of a single
+// read. We can just extract commands and values from this buffer like
+// we would be reading from any stream like socket, but it hides or
+// abstraction of how many time we might have to read form the socket
+// to read a command or a value.
+//
+// The bytes not consumed yet are buff_[start_, end_). Command lines are
+// found with memchr and handed out in place, they are never copied.
+//
+// The socket is non-blocking. When it runs dry in the middle of a
+// command or value we return READ_AGAIN and the caller comes back on
+// the next EPOLLIN, so everything that has to survive between two
+// calls lives in this object and not on the stack.
+//
+// With the io_uring backend we don't read at all, the loop feeds us
+// what its receive completions brought and fill() only says there is
+// nothing more for now.
+class BufferedReader {
+private:
+    char *buff_;          // Buffer to buffer reads
+    size_t capacity_;     // Size of buff_, grows for long command lines.
+    size_t start_;        // Offset at which next read from buff_ should happen.
+    size_t end_;          // End of the bytes read from the socket.
+    size_t scanned_;      // Bytes from start_ already searched for '\n'.
+    int connfd_;          // Connection file descriptor.
+    bool fed_;            // Bytes come in through feed(), not read().
+
+public:
+    BufferedReader( int pConnfd ) {
+        connfd_ = pConnfd;
+        capacity_ = BUFFSIZE;
+        buff_ = (char *)malloc( capacity_ );
+        start_ = 0;
+        end_ = 0;
+        scanned_ = 0;
+        fed_ = false;
+    }
+
+    ~BufferedReader() {
+        free( buff_ );
+    }
+
+    // Number of bytes read from the socket and not consumed yet.
+    size_t pendingBytes() {
+        return end_ - start_;
+    }
+
+    // Read what the socket has into the free space at the end of
+    // buff_. Consumed bytes are dropped first, and the buffer doubles
+    // if it is full of a single command line.
+    ReadStatus fill() {
+        if ( fed_ ) {
+            return READ_AGAIN;
+        }
+        if ( start_ == end_ ) {
+            start_ = 0;
+            end_ = 0;
+        } else if ( end_ == capacity_ ) {
+            if ( start_ > 0 ) {
+                memmove( buff_, buff_ + start_, end_ - start_ );
+                end_ -= start_;
+                start_ = 0;
+            } else {
+                capacity_ *= 2;
+                buff_ = (char *)realloc( buff_, capacity_ );
+            }
+        }
+
+        size_t readBytes;
+        ReadStatus status = readSocket( buff_ + end_, capacity_ - end_, &readBytes );
+        end_ += readBytes;
+        return status;
+    }
+
+    // One read of up to len bytes from the socket into dest.
+    ReadStatus readSocket( char *dest, size_t len, size_t *readBytes ) {
+        *readBytes = 0;
+        while ( 1 ) {
+            countSyscall();
+            ssize_t got = read( connfd_, dest, len );
+            if ( got > 0 ) {
+                *readBytes = got;
+                return READ_OK;
+            }
+            if ( got == 0 ) {
+                return READ_CLOSED;
+            }
+            if ( errno == EINTR ) {
+                continue;
+            }
+            if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                return READ_AGAIN;
+            }
+            return READ_CLOSED;
+        }
+    }
+
+    // Append len bytes received by someone else. From then on fill()
+    // never reads the socket. The buffer grows if they don't fit.
+    void feed( const char *data, size_t len ) {
+        fed_ = true;
+        if ( start_ == end_ ) {
+            start_ = 0;
+            end_ = 0;
+        } else if ( capacity_ - end_ < len && start_ > 0 ) {
+            memmove( buff_, buff_ + start_, end_ - start_ );
+            end_ -= start_;
+            start_ = 0;
+        }
+        if ( capacity_ - end_ < len ) {
+            while ( capacity_ - end_ < len ) {
+                capacity_ *= 2;
+            }
+            buff_ = (char *)realloc( buff_, capacity_ );
+        }
+        memcpy( buff_ + end_, data, len );
+        end_ += len;
+    }
+
+    // Find the next command line. On READ_OK *line points at it in the
+    // buffer and *len is its length without the \r\n. It stays valid
+    // until the next call to readCommand or readValue. If we dont find
+    // a full command in what we have, we try to read more from socket.
+    // On READ_AGAIN the partial command stays in the buffer and the
+    // next call only searches the bytes that came in since.
+    ReadStatus readCommand( char **line, size_t *len ) {
+        while ( 1 ) {
+            char *begin = buff_ + start_;
+            char *nl = (char *)memchr( begin + scanned_, '\n',
+                                       end_ - start_ - scanned_ );
+            if ( nl != NULL ) {
+                size_t lineLen = nl - begin;
+                start_ += lineLen + 1;
+                scanned_ = 0;
+                if ( lineLen > 0 && begin[lineLen - 1] == '\r' ) {
+                    lineLen--;
+                }
+                *line = begin;
+                *len = lineLen;
+                return READ_OK;
+            }
+            scanned_ = end_ - start_;
+            if ( scanned_ >= MAX_COMMAND_LINE ) {
+                pr_info( "Command line too long on socket %d\n", connfd_ );
+                return READ_CLOSED;
+            }
+
+            ReadStatus status = fill();
+            if ( status != READ_OK ) {
+                return status;
+            }
+        }
+    }
+
+    // Make sure the next len bytes are in the buffer and point *data
+    // at them, for the fixed size frames of the binary protocol. They
+    // are not consumed, so after READ_AGAIN the caller just asks again
+    // once more came in. len must not be over MAX_COMMAND_LINE.
+    ReadStatus peek( char **data, size_t len ) {
+        while ( end_ - start_ < len ) {
+            ReadStatus status = fill();
+            if ( status != READ_OK ) {
+                return status;
+            }
+        }
+        *data = buff_ + start_;
+        return READ_OK;
+    }
+
+    // Drop len bytes a peek returned.
+    void consume( size_t len ) {
+        start_ += len;
+    }
+
+    // This is used to read the value section of the set command.
+    // It works similar to command above. bytesRead is set to number
+    // of bytes copied in to buffer by this call. Once the buffer is
+    // drained, BUFFSIZE or more bytes still to come are read from the
+    // socket straight into buffer, never more than asked for, so the
+    // commands behind the value stay in the socket for the next fill.
+    ReadStatus readValue( char *buffer, int bytes, int *bytesRead ) {
+        *bytesRead = 0;
+        while ( 1 ) {
+            size_t pending = end_ - start_;
+            if ( pending > 0 ) {
+                int toRead = pending;
+                if( (size_t)bytes < pending ) {
+                    toRead = bytes;
+                }
+                memcpy( buffer + *bytesRead, buff_ + start_, toRead );
+                bytes -= toRead;
+                *bytesRead += toRead;
+                start_ += toRead;
+            }
+            if ( bytes == 0 ) {
+                return READ_OK;
+            }
+
+            ReadStatus status;
+            if ( !fed_ && bytes >= BUFFSIZE ) {
+                size_t readBytes;
+                status = readSocket( buffer + *bytesRead, bytes, &readBytes );
+                bytes -= readBytes;
+                *bytesRead += readBytes;
+            } else {
+                status = fill();
+            }
+            if ( status != READ_OK ) {
+                return status;
+            }
+        }
+    }
+};
+
+#endif // _BUFFERED_READER_H
@@ -0,0 +1,210 @@
+#ifndef _EPOCH_H
+#define _EPOCH_H
+
+#include "Memcached.h"
+
+// Epoch based reclamation. Gets look items up without taking the lock
+// of the shard, so an item or an index table taken out of the cache by
+// another thread can still be read by a get that found it a moment
+// ago. Instead of freeing such memory right away it is retired, and
+// freed once every thread that was reading the cache at that time has
+// finished.
+//
+// There is a global epoch. A reader publishes the global epoch it saw
+// in its own record while it is inside a read section, and 0 outside.
+// Memory is retired with the global epoch at that time into a list of
+// the retiring thread. It can be freed once no reader is in that epoch
+// or an older one. The global epoch moves forward when every reader
+// inside a section has seen the current one.
+//
+// Retired lists are only touched by their own thread. A thread frees
+// its list when it gets long, and from reclaim(), which threads that
+// may go quiet call periodically.
+
+#define EPOCH_MAX_THREADS 256
+// Retired entries a thread collects before it tries to free them.
+#define EPOCH_RECLAIM_BATCH 64
+
+// Frees a retired pointer. ctx is what was given to retire.
+typedef void (*EpochFreeFunc)( void *ctx, void *ptr );
+
+struct EpochRetired {
+    void *ptr_;
+    EpochFreeFunc free_;
+    void *ctx_;
+    uint64_t epoch_;
+};
+
+// Record of one thread. Records are a cache line each since readers
+// write their epoch on every get.
+struct EpochThread {
+    uint64_t epoch_;          // Epoch of the read section, 0 outside.
+    pthread_t owner_;
+    vector< EpochRetired > retired_;
+    char pad_[64 - sizeof( uint64_t ) - sizeof( pthread_t ) -
+              sizeof( vector< EpochRetired > )];
+};
+
+// Records of the calling thread in the managers it used, found by the
+// id of the manager modulo EPOCH_TLS_SLOTS. Ids are never reused, so a
+// slot of a manager that is gone just doesn't match any more. A thread
+// going back and forth between a few caches only registers once with
+// each.
+#define EPOCH_TLS_SLOTS 64
+
+struct EpochTlsSlot {
+    uint64_t id_;
+    EpochThread *thread_;
+};
+
+static __thread EpochTlsSlot epochTls[EPOCH_TLS_SLOTS];
+static uint64_t epochNextId = 1;
+
+class EpochManager {
+private:
+    uint64_t id_;
+    uint64_t epoch_;          // Global epoch, starts at 1.
+    int numThreads_;
+    EpochThread *threads_;    // EPOCH_MAX_THREADS records, cache line aligned.
+    pthread_mutex_t registerLock_;
+
+    EpochThread *registerThread() {
+        pthread_t self = pthread_self();
+        pthread_mutex_lock( &registerLock_ );
+        EpochThread *thread = NULL;
+        for ( int i = 0; i < numThreads_; i++ ) {
+            if ( pthread_equal( threads_[i].owner_, self ) ) {
+                thread = &threads_[i];
+                break;
+            }
+        }
+        if ( thread == NULL ) {
+            if ( numThreads_ == EPOCH_MAX_THREADS ) {
+                pr_info( "Too many threads using the cache\n" );
+                exit( 5 );
+            }
+            thread = &threads_[numThreads_];
+            thread->owner_ = self;
+            __atomic_store_n( &numThreads_, numThreads_ + 1, __ATOMIC_RELEASE );
+        }
+        pthread_mutex_unlock( &registerLock_ );
+        return thread;
+    }
+
+    EpochThread *self() {
+        EpochTlsSlot *slot = &epochTls[id_ % EPOCH_TLS_SLOTS];
+        if ( slot->id_ != id_ ) {
+            slot->thread_ = registerThread();
+            slot->id_ = id_;
+        }
+        return slot->thread_;
+    }
+
+    // Move the global epoch forward if every reader has caught up with
+    // it, and return the oldest epoch a reader may still be in.
+    uint64_t tryAdvance() {
+        uint64_t global = __atomic_load_n( &epoch_, __ATOMIC_SEQ_CST );
+        uint64_t oldest = global;
+        int count = __atomic_load_n( &numThreads_, __ATOMIC_ACQUIRE );
+        for ( int i = 0; i < count; i++ ) {
+            uint64_t epoch = __atomic_load_n( &threads_[i].epoch_, __ATOMIC_SEQ_CST );
+            if ( epoch != 0 && epoch < oldest ) {
+                oldest = epoch;
+            }
+        }
+        if ( oldest == global ) {
+            // Nobody is behind. Whoever wins the race moves it on.
+            __atomic_compare_exchange_n( &epoch_, &global, global + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST );
+        }
+        return oldest;
+    }
+
+    void freeRetired( EpochThread *thread, uint64_t oldest ) {
+        vector< EpochRetired > &retired = thread->retired_;
+        size_t kept = 0;
+        for ( size_t i = 0; i < retired.size(); i++ ) {
+            if ( retired[i].epoch_ < oldest ) {
+                retired[i].free_( retired[i].ctx_, retired[i].ptr_ );
+            } else {
+                retired[kept++] = retired[i];
+            }
+        }
+        retired.resize( kept );
+    }
+
+public:
+    EpochManager() {
+        id_ = __atomic_fetch_add( &epochNextId, 1, __ATOMIC_RELAXED );
+        epoch_ = 1;
+        numThreads_ = 0;
+        void *mem;
+        if ( posix_memalign( &mem, 64, sizeof( EpochThread ) * EPOCH_MAX_THREADS ) != 0 ) {
+            pr_info( "Out of memory allocating epoch records\n" );
+            exit( 5 );
+        }
+        threads_ = (EpochThread *)mem;
+        for ( int i = 0; i < EPOCH_MAX_THREADS; i++ ) {
+            new ( &threads_[i] ) EpochThread();
+            threads_[i].epoch_ = 0;
+        }
+        pthread_mutex_init( &registerLock_, NULL );
+    }
+
+    ~EpochManager() {
+        reclaimAll();
+        for ( int i = 0; i < EPOCH_MAX_THREADS; i++ ) {
+            threads_[i].~EpochThread();
+        }
+        free( threads_ );
+        pthread_mutex_destroy( &registerLock_ );
+    }
+
+    // Start a read section. Memory retired from now on stays valid
+    // until the matching exit. Sections don't nest.
+    void beginRead() {
+        EpochThread *thread = self();
+        __atomic_store_n( &thread->epoch_, __atomic_load_n( &epoch_, __ATOMIC_SEQ_CST ),
+                          __ATOMIC_SEQ_CST );
+        __atomic_thread_fence( __ATOMIC_SEQ_CST );
+    }
+
+    void endRead() {
+        __atomic_store_n( &self()->epoch_, 0, __ATOMIC_RELEASE );
+    }
+
+    // Free ptr with freeFunc( ctx, ptr ) once no reader can see it. It
+    // must already be unreachable for new readers.
+    void retire( void *ptr, EpochFreeFunc freeFunc, void *ctx ) {
+        EpochThread *thread = self();
+        EpochRetired r;
+        r.ptr_ = ptr;
+        r.free_ = freeFunc;
+        r.ctx_ = ctx;
+        r.epoch_ = __atomic_load_n( &epoch_, __ATOMIC_SEQ_CST );
+        thread->retired_.push_back( r );
+        if ( thread->retired_.size() >= EPOCH_RECLAIM_BATCH ) {
+            freeRetired( thread, tryAdvance() );
+        }
+    }
+
+    // Free what the calling thread retired and readers are done with.
+    void reclaim() {
+        EpochThread *thread = self();
+        if ( !thread->retired_.empty() ) {
+            // Memory just retired needs a second move of the epoch.
+            tryAdvance();
+            freeRetired( thread, tryAdvance() );
+        }
+    }
+
+    // Free everything retired by any thread. Only when there are no
+    // readers left, like at destruction.
+    void reclaimAll() {
+        for ( int i = 0; i < numThreads_; i++ ) {
+            freeRetired( &threads_[i], UINT64_MAX );
+        }
+    }
+};
+
+#endif // _EPOCH_H
@@ -0,0 +1,112 @@
+#ifndef _FREQUENCY_SKETCH_H
+#define _FREQUENCY_SKETCH_H
+
+#include "Memcached.h"
+
+// Count-Min Sketch of how often the keys of a shard were used lately,
+// for the TinyLFU admission of LRUMemCacheShard. A key has a counter of
+// 4 bits in each of SKETCH_ROWS rows and its frequency is the smallest
+// of them, which only ever overestimates it.
+//
+// Counters are packed 16 to a 64 bit word, and all the counters of a
+// key are in one block of 8 words, a cache line: row i uses word 2i or
+// 2i + 1 of the block. An increment only raises the counters that hold
+// the smallest value (conservative update), which keeps the estimate
+// closer, and stops at 15, so the counters of hot keys are mostly just
+// read. Once the increments reach the sample size every counter is
+// halved, so the sketch forgets what was hot a while ago.
+//
+// Gets increment without the shard lock, with a compare and swap on the
+// word. An increment lost to aging running at the same time doesn't
+// matter for an estimate. Aging runs under the shard lock.
+
+#define SKETCH_ROWS 4
+#define SKETCH_COUNTER_MAX 15
+
+class FrequencySketch {
+private:
+    vector< uint64_t > table_;
+    size_t blockMask_;       // Blocks of 8 words - 1.
+    uint64_t additions_;     // Increments since the last aging.
+    uint64_t sampleSize_;
+
+    // Word and shift of the counter of hash in row.
+    uint64_t *counter( uint64_t hash, int row, int *shift ) {
+        size_t block = hash & blockMask_;
+        size_t word = block * 8 + row * 2 + ( ( hash >> ( 24 + row ) ) & 1 );
+        *shift = ( ( hash >> ( 28 + row * 4 ) ) & 15 ) * 4;
+        return &table_[word];
+    }
+
+public:
+    // counters is rounded up to a power of two of at least a block.
+    // Aging comes after about as many increments as there are counters.
+    FrequencySketch( size_t counters ) {
+        size_t words = 8;
+        while ( words * 16 < counters ) {
+            words <<= 1;
+        }
+        table_.assign( words, 0 );
+        blockMask_ = words / 8 - 1;
+        additions_ = 0;
+        sampleSize_ = words * 16;
+    }
+
+    // Count a use of the key of hash.
+    void increment( uint64_t hash ) {
+        uint64_t *words[SKETCH_ROWS];
+        int shifts[SKETCH_ROWS];
+        uint64_t values[SKETCH_ROWS];
+        int least = SKETCH_COUNTER_MAX;
+        for ( int row = 0; row < SKETCH_ROWS; row++ ) {
+            words[row] = counter( hash, row, &shifts[row] );
+            values[row] = __atomic_load_n( words[row], __ATOMIC_RELAXED );
+            least = min( least, (int)( ( values[row] >> shifts[row] ) & 15 ) );
+        }
+        if ( least == SKETCH_COUNTER_MAX ) {
+            return;
+        }
+        for ( int row = 0; row < SKETCH_ROWS; row++ ) {
+            uint64_t value = values[row];
+            while ( (int)( ( value >> shifts[row] ) & 15 ) == least ) {
+                if ( __atomic_compare_exchange_n( words[row], &value,
+                                                  value + ( 1ULL << shifts[row] ), true,
+                                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED ) ) {
+                    break;
+                }
+            }
+        }
+        __atomic_add_fetch( &additions_, 1, __ATOMIC_RELAXED );
+    }
+
+    // Estimate of the uses of the key of hash, 0 to 15.
+    int frequency( uint64_t hash ) {
+        int least = SKETCH_COUNTER_MAX;
+        for ( int row = 0; row < SKETCH_ROWS; row++ ) {
+            int shift;
+            uint64_t value = __atomic_load_n( counter( hash, row, &shift ), __ATOMIC_RELAXED );
+            least = min( least, (int)( ( value >> shift ) & 15 ) );
+        }
+        return least;
+    }
+
+    // Halve every counter if enough increments came since the last
+    // time. Called with the shard lock held.
+    void ageIfDue() {
+        uint64_t additions = __atomic_load_n( &additions_, __ATOMIC_RELAXED );
+        if ( additions < sampleSize_ ) {
+            return;
+        }
+        for ( size_t i = 0; i < table_.size(); i++ ) {
+            uint64_t value = __atomic_load_n( &table_[i], __ATOMIC_RELAXED );
+            while ( !__atomic_compare_exchange_n( &table_[i], &value,
+                                                  ( value >> 1 ) & 0x7777777777777777ULL,
+                                                  true, __ATOMIC_RELAXED,
+                                                  __ATOMIC_RELAXED ) ) {
+            }
+        }
+        __atomic_store_n( &additions_, additions / 2, __ATOMIC_RELAXED );
+    }
+};
+
+#endif // _FREQUENCY_SKETCH_H
@@ -0,0 +1,143 @@
+#ifndef _HDR_HISTOGRAM_H
+#define _HDR_HISTOGRAM_H
+
+#include <math.h>
+#include "Memcached.h"
+
+// Latency histogram in the manner of HdrHistogram. Values below
+// 2^HDR_SUB_BITS get a bucket each, above that every power of two is
+// cut in 2^(HDR_SUB_BITS - 1) buckets, so a value is known to within
+// 1 / 64 of itself whatever its size. Recording is an index
+// computation and an increment, and histograms of several threads
+// simply add up.
+#define HDR_SUB_BITS 7
+// Values are clamped below 2^HDR_MAX_BITS, 18 minutes in nanoseconds.
+#define HDR_MAX_BITS 40
+
+class HdrHistogram {
+private:
+    vector< uint64_t > counts_;
+    uint64_t total_;
+    uint64_t min_;
+    uint64_t max_;
+    double sum_;
+
+    static const uint64_t half_ = 1ULL << ( HDR_SUB_BITS - 1 );
+
+    static size_t indexOf( uint64_t value ) {
+        if ( value < ( 1ULL << HDR_SUB_BITS ) ) {
+            return value;
+        }
+        int shift = 63 - __builtin_clzll( value ) - ( HDR_SUB_BITS - 1 );
+        return ( shift << ( HDR_SUB_BITS - 1 ) ) + ( value >> shift );
+    }
+
+    // Highest value that lands in bucket index.
+    static uint64_t valueOf( size_t index ) {
+        if ( index < ( 1ULL << HDR_SUB_BITS ) ) {
+            return index;
+        }
+        int shift = ( index >> ( HDR_SUB_BITS - 1 ) ) - 1;
+        uint64_t sub = index - ( (uint64_t)shift << ( HDR_SUB_BITS - 1 ) );
+        return ( ( sub + 1 ) << shift ) - 1;
+    }
+
+public:
+    HdrHistogram() : counts_( ( HDR_MAX_BITS - HDR_SUB_BITS + 2 ) * half_, 0 ) {
+        total_ = 0;
+        min_ = 0;
+        max_ = 0;
+        sum_ = 0;
+    }
+
+    void record( uint64_t value, uint64_t count = 1 ) {
+        if ( value >= ( 1ULL << HDR_MAX_BITS ) ) {
+            value = ( 1ULL << HDR_MAX_BITS ) - 1;
+        }
+        counts_[indexOf( value )] += count;
+        if ( total_ == 0 || value < min_ ) {
+            min_ = value;
+        }
+        if ( value > max_ ) {
+            max_ = value;
+        }
+        total_ += count;
+        sum_ += (double)value * count;
+    }
+
+    void add( const HdrHistogram &other ) {
+        for ( size_t i = 0; i < counts_.size(); i++ ) {
+            counts_[i] += other.counts_[i];
+        }
+        if ( other.total_ > 0 && ( total_ == 0 || other.min_ < min_ ) ) {
+            min_ = other.min_;
+        }
+        max_ = max( max_, other.max_ );
+        total_ += other.total_;
+        sum_ += other.sum_;
+    }
+
+    // Add raw as if a closed loop client had sent a request every
+    // interval while it waited. A value v stands for the requests that
+    // would have been sent during it and waited v - interval,
+    // v - 2 * interval and so on, which the client never measured:
+    // the coordinated omission correction of HdrHistogram.
+    void addCorrected( const HdrHistogram &raw, uint64_t interval ) {
+        add( raw );
+        if ( interval == 0 ) {
+            return;
+        }
+        for ( size_t i = 0; i < raw.counts_.size(); i++ ) {
+            uint64_t count = raw.counts_[i];
+            if ( count == 0 ) {
+                continue;
+            }
+            uint64_t value = min( valueOf( i ), raw.max_ );
+            for ( uint64_t missed = value; missed > interval; ) {
+                missed -= interval;
+                record( missed, count );
+            }
+        }
+    }
+
+    // Smallest value that q of the values are at or below, q in [0, 1].
+    uint64_t percentile( double q ) const {
+        if ( total_ == 0 ) {
+            return 0;
+        }
+        uint64_t target = (uint64_t)ceil( q * total_ );
+        if ( target == 0 ) {
+            target = 1;
+        }
+        uint64_t seen = 0;
+        for ( size_t i = 0; i < counts_.size(); i++ ) {
+            seen += counts_[i];
+            if ( seen >= target ) {
+                return min( valueOf( i ), max_ );
+            }
+        }
+        return max_;
+    }
+
+    uint64_t count() const {
+        return total_;
+    }
+
+    uint64_t maxValue() const {
+        return max_;
+    }
+
+    double mean() const {
+        return total_ == 0 ? 0 : sum_ / total_;
+    }
+
+    void clear() {
+        fill( counts_.begin(), counts_.end(), 0 );
+        total_ = 0;
+        min_ = 0;
+        max_ = 0;
+        sum_ = 0;
+    }
+};
+
+#endif // _HDR_HISTOGRAM_H
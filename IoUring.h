@@ -0,0 +1,372 @@
+#ifndef _IO_URING_H
+#define _IO_URING_H
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include "Memcached.h"
+
+// A small io_uring, set up and driven with the raw system calls. An
+// event loop fills submission queue entries for everything it wants
+// done, hands all of them to the kernel with one io_uring_enter that
+// also waits for completions, and then walks the completions.
+//
+// Received data lands in a provided buffer ring: a group of buffers we
+// register once, which multishot receives take buffers from as data
+// comes in. Each completion names the buffer it used, and the buffer
+// is handed back to the ring once the data has been copied out.
+//
+// Only one thread may use a ring.
+
+// Ring sizes. The completion queue is twice the submission queue.
+#define URING_ENTRIES 1024
+// Provided receive buffers of a ring, a power of two, and their size.
+#define URING_BUFFERS 256
+#define URING_BUFFER_SIZE BUFFSIZE
+// Buffer group of the receive buffers.
+#define URING_BUFFER_GROUP 0
+// Input a connection may have waiting while its replies are backed up.
+// Past it we stop receiving from it until the replies went out.
+#define URING_MAX_BACKLOG ( 1024 * 1024 )
+
+static inline int uringSetup( unsigned entries, struct io_uring_params *params ) {
+    return syscall( __NR_io_uring_setup, entries, params );
+}
+
+static inline int uringEnter( int fd, unsigned toSubmit, unsigned minComplete,
+                              unsigned flags ) {
+    return syscall( __NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0 );
+}
+
+static inline int uringRegister( int fd, unsigned opcode, void *arg, unsigned nrArgs ) {
+    return syscall( __NR_io_uring_register, fd, opcode, arg, nrArgs );
+}
+
+class IoUring {
+private:
+    int fd_;
+    // Submission queue.
+    unsigned *sqHead_;
+    unsigned *sqTail_;
+    unsigned sqMask_;
+    unsigned sqEntries_;
+    struct io_uring_sqe *sqes_;
+    unsigned sqLocalTail_;     // Entries filled, up to here.
+    unsigned sqSubmitted_;     // Entries handed to the kernel, up to here.
+    // Completion queue.
+    unsigned *cqHead_;
+    unsigned *cqTail_;
+    unsigned cqMask_;
+    struct io_uring_cqe *cqes_;
+    // Mappings to undo.
+    void *sqRing_;
+    size_t sqRingSize_;
+    void *cqRing_;
+    size_t cqRingSize_;
+    size_t sqesSize_;
+    // Provided buffer ring and the buffers it hands out.
+    struct io_uring_buf_ring *bufRing_;
+    // Entries of bufRing_. Not bufRing_->bufs, in C++ the flexible
+    // array of the header lands 8 bytes off.
+    struct io_uring_buf *bufs_;
+    size_t bufRingSize_;
+    char *buffers_;
+    unsigned bufCount_;
+    size_t bufSize_;
+    unsigned short bufTail_;
+
+    void unmap() {
+        if ( sqes_ != NULL ) {
+            munmap( sqes_, sqesSize_ );
+        }
+        if ( cqRing_ != NULL && cqRing_ != sqRing_ ) {
+            munmap( cqRing_, cqRingSize_ );
+        }
+        if ( sqRing_ != NULL ) {
+            munmap( sqRing_, sqRingSize_ );
+        }
+        sqes_ = NULL;
+        sqRing_ = NULL;
+        cqRing_ = NULL;
+    }
+
+public:
+    IoUring() {
+        fd_ = -1;
+        sqes_ = NULL;
+        sqRing_ = NULL;
+        cqRing_ = NULL;
+        bufRing_ = NULL;
+        buffers_ = NULL;
+        sqLocalTail_ = 0;
+        sqSubmitted_ = 0;
+    }
+
+    ~IoUring() {
+        if ( bufRing_ != NULL ) {
+            munmap( bufRing_, bufRingSize_ );
+        }
+        free( buffers_ );
+        unmap();
+        if ( fd_ >= 0 ) {
+            close( fd_ );
+        }
+    }
+
+    // Create the ring. Returns false if the kernel can't.
+    bool init( unsigned entries ) {
+        struct io_uring_params params;
+        memset( &params, 0, sizeof( params ) );
+        // Completions are only run when we enter the kernel anyway.
+        params.flags = IORING_SETUP_COOP_TASKRUN;
+        fd_ = uringSetup( entries, &params );
+        if ( fd_ < 0 && errno == EINVAL ) {
+            memset( &params, 0, sizeof( params ) );
+            fd_ = uringSetup( entries, &params );
+        }
+        if ( fd_ < 0 ) {
+            return false;
+        }
+
+        sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof( unsigned );
+        cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof( struct io_uring_cqe );
+        if ( params.features & IORING_FEAT_SINGLE_MMAP ) {
+            sqRingSize_ = max( sqRingSize_, cqRingSize_ );
+            cqRingSize_ = sqRingSize_;
+        }
+        sqRing_ = mmap( NULL, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        fd_, IORING_OFF_SQ_RING );
+        if ( sqRing_ == MAP_FAILED ) {
+            sqRing_ = NULL;
+            return false;
+        }
+        if ( params.features & IORING_FEAT_SINGLE_MMAP ) {
+            cqRing_ = sqRing_;
+        } else {
+            cqRing_ = mmap( NULL, cqRingSize_, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING );
+            if ( cqRing_ == MAP_FAILED ) {
+                cqRing_ = NULL;
+                return false;
+            }
+        }
+        sqesSize_ = params.sq_entries * sizeof( struct io_uring_sqe );
+        void *sqes = mmap( NULL, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           fd_, IORING_OFF_SQES );
+        if ( sqes == MAP_FAILED ) {
+            return false;
+        }
+        sqes_ = (struct io_uring_sqe *)sqes;
+
+        char *sq = (char *)sqRing_;
+        sqHead_ = (unsigned *)( sq + params.sq_off.head );
+        sqTail_ = (unsigned *)( sq + params.sq_off.tail );
+        sqMask_ = *(unsigned *)( sq + params.sq_off.ring_mask );
+        sqEntries_ = params.sq_entries;
+        // Entry i of the array always names sqe i.
+        unsigned *array = (unsigned *)( sq + params.sq_off.array );
+        for ( unsigned i = 0; i < sqEntries_; i++ ) {
+            array[i] = i;
+        }
+        sqLocalTail_ = *sqTail_;
+        sqSubmitted_ = sqLocalTail_;
+
+        char *cq = (char *)cqRing_;
+        cqHead_ = (unsigned *)( cq + params.cq_off.head );
+        cqTail_ = (unsigned *)( cq + params.cq_off.tail );
+        cqMask_ = *(unsigned *)( cq + params.cq_off.ring_mask );
+        cqes_ = (struct io_uring_cqe *)( cq + params.cq_off.cqes );
+        return true;
+    }
+
+    // Register count buffers of size bytes as the provided buffer ring
+    // of URING_BUFFER_GROUP. count must be a power of two.
+    bool setupBuffers( unsigned count, size_t size ) {
+        bufRingSize_ = count * sizeof( struct io_uring_buf );
+        void *ring = mmap( NULL, bufRingSize_, PROT_READ | PROT_WRITE,
+                           MAP_ANONYMOUS | MAP_PRIVATE, -1, 0 );
+        if ( ring == MAP_FAILED ) {
+            return false;
+        }
+        bufRing_ = (struct io_uring_buf_ring *)ring;
+        bufs_ = (struct io_uring_buf *)ring;
+        bufCount_ = count;
+        bufSize_ = size;
+        buffers_ = (char *)malloc( count * size );
+
+        struct io_uring_buf_reg reg;
+        memset( &reg, 0, sizeof( reg ) );
+        reg.ring_addr = (unsigned long)bufRing_;
+        reg.ring_entries = count;
+        reg.bgid = URING_BUFFER_GROUP;
+        if ( uringRegister( fd_, IORING_REGISTER_PBUF_RING, &reg, 1 ) < 0 ) {
+            return false;
+        }
+        bufTail_ = 0;
+        for ( unsigned i = 0; i < count; i++ ) {
+            struct io_uring_buf *buf = &bufs_[bufTail_ & ( count - 1 )];
+            buf->addr = (unsigned long)( buffers_ + i * size );
+            buf->len = size;
+            buf->bid = i;
+            bufTail_++;
+        }
+        __atomic_store_n( &bufRing_->tail, bufTail_, __ATOMIC_RELEASE );
+        return true;
+    }
+
+    char *buffer( unsigned bid ) {
+        return buffers_ + bid * bufSize_;
+    }
+
+    // Give a buffer a completion used back to the ring.
+    void returnBuffer( unsigned bid ) {
+        struct io_uring_buf *buf = &bufs_[bufTail_ & ( bufCount_ - 1 )];
+        buf->addr = (unsigned long)buffer( bid );
+        buf->len = bufSize_;
+        buf->bid = bid;
+        bufTail_++;
+        __atomic_store_n( &bufRing_->tail, bufTail_, __ATOMIC_RELEASE );
+    }
+
+    // A cleared submission entry, handing the ones filled so far to the
+    // kernel first if the queue is full.
+    struct io_uring_sqe *getSqe() {
+        unsigned head = __atomic_load_n( sqHead_, __ATOMIC_ACQUIRE );
+        if ( sqLocalTail_ - head >= sqEntries_ ) {
+            submit( 0 );
+            head = __atomic_load_n( sqHead_, __ATOMIC_ACQUIRE );
+            if ( sqLocalTail_ - head >= sqEntries_ ) {
+                return NULL;
+            }
+        }
+        struct io_uring_sqe *sqe = &sqes_[sqLocalTail_ & sqMask_];
+        memset( sqe, 0, sizeof( *sqe ) );
+        sqLocalTail_++;
+        return sqe;
+    }
+
+    // Hand the filled entries to the kernel and wait until at least
+    // waitFor completions are there. One system call.
+    int submit( unsigned waitFor ) {
+        __atomic_store_n( sqTail_, sqLocalTail_, __ATOMIC_RELEASE );
+        unsigned toSubmit = sqLocalTail_ - sqSubmitted_;
+        countSyscall();
+        int ret = uringEnter( fd_, toSubmit, waitFor, waitFor > 0 ? IORING_ENTER_GETEVENTS : 0 );
+        if ( ret >= 0 ) {
+            sqSubmitted_ += ret;
+        }
+        return ret;
+    }
+
+    // Next completion, NULL if there is none. Must be followed by
+    // seen() once it has been dealt with.
+    struct io_uring_cqe *peek() {
+        unsigned head = *cqHead_;
+        if ( head == __atomic_load_n( cqTail_, __ATOMIC_ACQUIRE ) ) {
+            return NULL;
+        }
+        return &cqes_[head & cqMask_];
+    }
+
+    void seen() {
+        __atomic_store_n( cqHead_, *cqHead_ + 1, __ATOMIC_RELEASE );
+    }
+
+    // Accept connections on fd until cancelled, one completion each.
+    bool prepMultishotAccept( int fd, uint64_t userData ) {
+        struct io_uring_sqe *sqe = getSqe();
+        if ( sqe == NULL ) {
+            return false;
+        }
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->user_data = userData;
+        return true;
+    }
+
+    // Receive from fd into provided buffers until the connection ends,
+    // one completion per buffer filled.
+    bool prepMultishotRecv( int fd, uint64_t userData ) {
+        struct io_uring_sqe *sqe = getSqe();
+        if ( sqe == NULL ) {
+            return false;
+        }
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUFFER_GROUP;
+        sqe->user_data = userData;
+        return true;
+    }
+
+    // A completion every time fd becomes readable.
+    bool prepMultishotPoll( int fd, uint64_t userData ) {
+        struct io_uring_sqe *sqe = getSqe();
+        if ( sqe == NULL ) {
+            return false;
+        }
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->user_data = userData;
+        return true;
+    }
+
+    // The kernel copies msg and its iovecs when the entry is
+    // submitted, the buffers must stay until the completion.
+    bool prepSendmsg( int fd, struct msghdr *msg, uint64_t userData ) {
+        struct io_uring_sqe *sqe = getSqe();
+        if ( sqe == NULL ) {
+            return false;
+        }
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = fd;
+        sqe->addr = (unsigned long)msg;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = userData;
+        return true;
+    }
+
+    // Cancel the operation submitted with target as its user data.
+    bool prepCancel( uint64_t target, uint64_t userData ) {
+        struct io_uring_sqe *sqe = getSqe();
+        if ( sqe == NULL ) {
+            return false;
+        }
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = target;
+        sqe->user_data = userData;
+        return true;
+    }
+
+    // Whether this kernel has everything we use: a ring, provided
+    // buffer rings and multishot receive. Tried on a socketpair.
+    static bool supported() {
+        IoUring ring;
+        if ( !ring.init( 8 ) || !ring.setupBuffers( 8, 64 ) ) {
+            return false;
+        }
+        int fds[2];
+        if ( socketpair( AF_UNIX, SOCK_STREAM, 0, fds ) < 0 ) {
+            return false;
+        }
+        bool ok = false;
+        if ( write( fds[1], "x", 1 ) == 1 && ring.prepMultishotRecv( fds[0], 1 ) &&
+             ring.submit( 1 ) >= 0 ) {
+            struct io_uring_cqe *cqe = ring.peek();
+            ok = cqe != NULL && cqe->res == 1 && ( cqe->flags & IORING_CQE_F_MORE ) &&
+                 ( cqe->flags & IORING_CQE_F_BUFFER );
+        }
+        close( fds[0] );
+        close( fds[1] );
+        return ok;
+    }
+};
+
+#endif // _IO_URING_H
@@ -0,0 +1,328 @@
+#ifndef _ITEM_INDEX_H
+#define _ITEM_INDEX_H
+
+#include "Memcached.h"
+#include "Epoch.h"
+
+// Open addressing hash index from key to MemcachedItem, used by every
+// LRU shard in place of unordered_map. It doesn't allocate anything
+// per item, the table is just two flat arrays.
+//
+// Slots are grouped by 8. Each group has one 64 bit control word with
+// a control byte per slot:
+//
+//   0x80        empty
+//   0xFE        deleted (tombstone, probe chains continue past it)
+//   0x00-0x7F   full, low 7 bits of the key hash
+//
+// A lookup loads the control word of a group and compares all 8
+// bytes against the hash tag at once with plain 64 bit arithmetic, so
+// on average it touches one control word and one item. Groups are
+// probed quadratically.
+//
+// Inserts and erases are done with the lock of the shard held, finds
+// are not. Writers store control words and slots atomically, a slot
+// before the control byte that makes it visible, so a find sees either
+// the old or the new state of a slot. It can see a slot just emptied,
+// so it checks the item pointer it loads for NULL.
+
+#define CTRL_EMPTY   0x80
+#define CTRL_DELETED 0xFE
+#define GROUP_SLOTS  8
+
+static const uint64_t ctrlLsbs = 0x0101010101010101ULL;
+static const uint64_t ctrlMsbs = 0x8080808080808080ULL;
+
+// Bit 7 of every byte of the result is set where the control byte
+// equals tag. Can have false positives next to a real match, the
+// caller verifies the item anyway.
+static inline uint64_t ctrlMatch( uint64_t ctrl, uint8_t tag ) {
+    uint64_t x = ctrl ^ ( ctrlLsbs * tag );
+    return ( x - ctrlLsbs ) & ~x & ctrlMsbs;
+}
+
+static inline uint64_t ctrlMatchEmpty( uint64_t ctrl ) {
+    return ( ctrl & ( ~ctrl << 6 ) ) & ctrlMsbs;
+}
+
+static inline uint64_t ctrlMatchEmptyOrDeleted( uint64_t ctrl ) {
+    return ctrl & ctrlMsbs;
+}
+
+// Index in the group of the lowest slot set in a match mask.
+static inline int ctrlFirstSlot( uint64_t mask ) {
+    return __builtin_ctzll( mask ) >> 3;
+}
+
+static inline uint8_t hashTag( uint64_t hash ) {
+    return hash & 0x7F;
+}
+
+// A single table of the index.
+class ItemTable {
+public:
+    size_t groupMask_;       // Number of groups - 1, a power of two.
+    uint64_t *ctrl_;         // Control word per group.
+    MemcachedItem **slots_;  // GROUP_SLOTS item pointers per group.
+    size_t used_;            // Full slots.
+    size_t deleted_;         // Tombstones.
+
+    ItemTable( size_t numGroups ) {
+        groupMask_ = numGroups - 1;
+        ctrl_ = (uint64_t *)malloc( sizeof( uint64_t ) * numGroups );
+        memset( ctrl_, CTRL_EMPTY, sizeof( uint64_t ) * numGroups );
+        slots_ = (MemcachedItem **)calloc( numGroups * GROUP_SLOTS,
+                                           sizeof( MemcachedItem * ) );
+        used_ = 0;
+        deleted_ = 0;
+    }
+
+    ~ItemTable() {
+        free( ctrl_ );
+        free( slots_ );
+    }
+
+    size_t numGroups() {
+        return groupMask_ + 1;
+    }
+
+    size_t capacity() {
+        return numGroups() * GROUP_SLOTS;
+    }
+
+    uint8_t ctrlAt( size_t slot ) {
+        return ((uint8_t *)ctrl_)[slot];
+    }
+
+    // Only writers change control bytes. The whole word is stored so
+    // finds load it in one piece.
+    void setCtrl( size_t slot, uint8_t value ) {
+        size_t group = slot / GROUP_SLOTS;
+        uint64_t ctrl = ctrl_[group];
+        ((uint8_t *)&ctrl)[slot % GROUP_SLOTS] = value;
+        __atomic_store_n( &ctrl_[group], ctrl, __ATOMIC_RELEASE );
+    }
+
+    void setSlot( size_t slot, MemcachedItem *item ) {
+        __atomic_store_n( &slots_[slot], item, __ATOMIC_RELEASE );
+    }
+
+    // Slot holding the item with this key or -1. The item is stored
+    // in *found, it can't be loaded again from the slot since it may
+    // change under a find without the lock.
+    ssize_t find( const char *key, size_t keyLen, uint64_t hash,
+                  MemcachedItem **found ) {
+        uint8_t tag = hashTag( hash );
+        size_t group = ( hash >> 7 ) & groupMask_;
+        for ( size_t probe = 1; probe <= numGroups(); probe++ ) {
+            uint64_t ctrl = __atomic_load_n( &ctrl_[group], __ATOMIC_ACQUIRE );
+            uint64_t match = ctrlMatch( ctrl, tag );
+            while ( match ) {
+                size_t slot = group * GROUP_SLOTS + ctrlFirstSlot( match );
+                MemcachedItem *item = __atomic_load_n( &slots_[slot], __ATOMIC_ACQUIRE );
+                if ( item != NULL && item->hash_ == hash && 
+                     item->hasKey( key, keyLen ) ) {
+                    *found = item;
+                    return slot;
+                }
+                match &= match - 1;
+            }
+            if ( ctrlMatchEmpty( ctrl ) ) {
+                return -1;
+            }
+            group = ( group + probe ) & groupMask_;
+        }
+        return -1;
+    }
+
+    // Insert an item whose key is known not to be in the table. The
+    // caller makes sure the table is never full.
+    void insert( MemcachedItem *item ) {
+        uint64_t hash = item->hash_;
+        size_t group = ( hash >> 7 ) & groupMask_;
+        for ( size_t probe = 1; ; probe++ ) {
+            uint64_t match = ctrlMatchEmptyOrDeleted( ctrl_[group] );
+            if ( match ) {
+                size_t slot = group * GROUP_SLOTS + ctrlFirstSlot( match );
+                if ( ctrlAt( slot ) == CTRL_DELETED ) {
+                    deleted_--;
+                }
+                setSlot( slot, item );
+                setCtrl( slot, hashTag( hash ) );
+                used_++;
+                return;
+            }
+            group = ( group + probe ) & groupMask_;
+        }
+    }
+
+    void erase( size_t slot ) {
+        setCtrl( slot, CTRL_DELETED );
+        setSlot( slot, NULL );
+        used_--;
+        deleted_++;
+    }
+};
+
+// The index of one LRU shard. When the table gets too full, a new
+// table is allocated and the entries are moved over a few groups at a
+// time by each following insert or erase, instead of rehashing the
+// whole table in the request that crossed the limit. While a resize is
+// in progress, an item can be in either table.
+//
+// An item being moved is inserted in current_ before it is erased from
+// old_, so a find that looks in old_ first and then in current_ can't
+// miss it. A find that raced with the start or end of a resize may
+// have looked at the wrong tables, so a miss is retried if the table
+// pointers changed meanwhile. Drained tables are retired to the epoch
+// manager, a find still walking one keeps it alive.
+class ItemIndex {
+private:
+    ItemTable *current_;
+    ItemTable *old_;       // Table being drained, NULL if not resizing.
+    size_t migratePos_;    // Next group of old_ to move.
+    EpochManager *epochs_;
+
+    static void freeTable( void *ctx, void *table ) {
+        delete (ItemTable *)table;
+    }
+
+    // Groups moved from old_ per insert or erase. The move is done
+    // after numGroups / migrateGroups_ operations, which can't add
+    // enough items to fill the new table.
+    static const size_t migrateGroups_ = 8;
+    static const size_t minGroups_ = 8;
+
+    // Move up to migrateGroups_ groups from old_ to current_.
+    void migrateStep() {
+        if ( old_ == NULL ) {
+            return;
+        }
+        size_t end = migratePos_ + migrateGroups_;
+        if ( end > old_->numGroups() ) {
+            end = old_->numGroups();
+        }
+        for ( ; migratePos_ < end; migratePos_++ ) {
+            for ( size_t i = 0; i < GROUP_SLOTS; i++ ) {
+                size_t slot = migratePos_ * GROUP_SLOTS + i;
+                uint8_t ctrl = old_->ctrlAt( slot );
+                if ( ctrl & CTRL_EMPTY ) {
+                    continue;
+                }
+                current_->insert( old_->slots_[slot] );
+                old_->erase( slot );
+            }
+        }
+        if ( migratePos_ == old_->numGroups() ) {
+            ItemTable *drained = old_;
+            __atomic_store_n( &old_, (ItemTable *)NULL, __ATOMIC_RELEASE );
+            epochs_->retire( drained, freeTable, NULL );
+        }
+    }
+
+    // Start a resize once full slots and tombstones take more than
+    // 7/8 of the table. If it is mostly tombstones, rebuilding at the
+    // same size is enough to clean them up.
+    void maybeGrow() {
+        if ( old_ != NULL ) {
+            return;
+        }
+        size_t capacity = current_->capacity();
+        if ( ( current_->used_ + current_->deleted_ ) * 8 < capacity * 7 ) {
+            return;
+        }
+        size_t groups = current_->numGroups();
+        if ( current_->used_ * 2 >= capacity ) {
+            groups *= 2;
+        }
+        migratePos_ = 0;
+        __atomic_store_n( &old_, current_, __ATOMIC_RELEASE );
+        __atomic_store_n( &current_, new ItemTable( groups ), __ATOMIC_RELEASE );
+    }
+
+    // Slot of exactly this item, and its table.
+    ssize_t findSlot( MemcachedItem *item, ItemTable **table ) {
+        MemcachedItem *found;
+        if ( old_ != NULL ) {
+            ssize_t slot = old_->find( item->key(), item->keyLen_, item->hash_, &found );
+            if ( slot >= 0 && found == item ) {
+                *table = old_;
+                return slot;
+            }
+        }
+        ssize_t slot = current_->find( item->key(), item->keyLen_, item->hash_, &found );
+        if ( slot >= 0 && found == item ) {
+            *table = current_;
+            return slot;
+        }
+        return -1;
+    }
+
+public:
+    ItemIndex( EpochManager *epochs ) {
+        current_ = new ItemTable( minGroups_ );
+        old_ = NULL;
+        migratePos_ = 0;
+        epochs_ = epochs;
+    }
+
+    ~ItemIndex() {
+        delete current_;
+        delete old_;
+    }
+
+    // Item with this key or NULL. Safe without the lock inside an
+    // epoch read section. The item may be unlinked right after.
+    MemcachedItem *find( const char *key, size_t keyLen, uint64_t hash ) {
+        while ( 1 ) {
+            ItemTable *old = __atomic_load_n( &old_, __ATOMIC_ACQUIRE );
+            ItemTable *current = __atomic_load_n( &current_, __ATOMIC_ACQUIRE );
+            MemcachedItem *found;
+            if ( old != NULL && old->find( key, keyLen, hash, &found ) >= 0 ) {
+                return found;
+            }
+            if ( current->find( key, keyLen, hash, &found ) >= 0 ) {
+                return found;
+            }
+            // The loads of the lookup are done before we check.
+            __atomic_thread_fence( __ATOMIC_ACQUIRE );
+            if ( __atomic_load_n( &old_, __ATOMIC_ACQUIRE ) == old &&
+                 __atomic_load_n( &current_, __ATOMIC_ACQUIRE ) == current ) {
+                return NULL;
+            }
+        }
+    }
+
+    // Insert an item whose key is not in the index.
+    void insert( MemcachedItem *item ) {
+        migrateStep();
+        maybeGrow();
+        current_->insert( item );
+    }
+
+    // Remove the item from the index if it is there.
+    void erase( MemcachedItem *item ) {
+        migrateStep();
+        ItemTable *table;
+        ssize_t slot = findSlot( item, &table );
+        if ( slot >= 0 ) {
+            table->erase( slot );
+        }
+    }
+
+    // Put val in the slot of existing, which has the same key, so a
+    // find sees one or the other and never neither.
+    void replace( MemcachedItem *existing, MemcachedItem *val ) {
+        ItemTable *table;
+        ssize_t slot = findSlot( existing, &table );
+        if ( slot >= 0 ) {
+            table->setSlot( slot, val );
+        }
+    }
+
+    size_t size() {
+        return current_->used_ + ( old_ != NULL ? old_->used_ : 0 );
+    }
+};
+
+#endif // _ITEM_INDEX_H
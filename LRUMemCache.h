@@ -0,0 +1,1231 @@
+#ifndef _LRU_MEMCACHE_H
+#define _LRU_MEMCACHE_H
+
+#include "Memcached.h"
+#include "ItemIndex.h"
+#include "SlabAllocator.h"
+#include "Epoch.h"
+#include "TimingWheel.h"
+#include "FrequencySketch.h"
+
+// Index of the cache owning a key of hash when the keys are spread
+// over count caches. The shard and the index inside a cache use other
+// bits of the hash.
+static inline size_t partitionIndex( uint64_t hash, size_t count ) {
+    return count == 1 ? 0 : ( hash >> 32 ) % count;
+}
+
+// Gives the items no get can read any more back to the slab allocator.
+// Freeing a chained value takes a class lock per chunk, so once the
+// maintenance thread of the cache runs, the threads serving requests
+// only push their dead items on a lock free stack, linked through
+// next_, and that thread frees them.
+class ItemReclaimer {
+private:
+    SlabAllocator *slabs_;
+    MemcachedItem *deferred_;    // Stack of items handed off.
+    bool handOff_;
+
+public:
+    ItemReclaimer( SlabAllocator *slabs ) {
+        slabs_ = slabs;
+        deferred_ = NULL;
+        handOff_ = false;
+    }
+
+    void reclaim( MemcachedItem *item ) {
+        if ( !__atomic_load_n( &handOff_, __ATOMIC_RELAXED ) ) {
+            slabs_->freeItem( item );
+            return;
+        }
+        // Only push and take all, so there is no ABA.
+        MemcachedItem *head = __atomic_load_n( &deferred_, __ATOMIC_RELAXED );
+        do {
+            item->next_ = head;
+        } while ( !__atomic_compare_exchange_n( &deferred_, &head, item, true,
+                                                __ATOMIC_RELEASE, __ATOMIC_RELAXED ) );
+    }
+
+    // Hand dead items off from now on, or not any more.
+    void setHandOff( bool handOff ) {
+        __atomic_store_n( &handOff_, handOff, __ATOMIC_RELAXED );
+    }
+
+    // Free the items handed off so far. Returns how many there were.
+    size_t freeDeferred() {
+        MemcachedItem *item = __atomic_exchange_n( &deferred_, (MemcachedItem *)NULL,
+                                                   __ATOMIC_ACQUIRE );
+        size_t count = 0;
+        while ( item != NULL ) {
+            MemcachedItem *next = item->next_;
+            slabs_->freeItem( item );
+            item = next;
+            count++;
+        }
+        return count;
+    }
+};
+
+// Hands a retired item to its reclaimer.
+static void freeRetiredItem( void *reclaimer, void *item ) {
+    ((ItemReclaimer *)reclaimer)->reclaim( (MemcachedItem *)item );
+}
+
+// Allocate an item of slabs for key with room for a value of size
+// bytes, its data chunks too if size is over chunkBytes, and set up
+// its header. exptime is on currentTime(). Returns NULL if we are out
+// of memory.
+static MemcachedItem *allocSlabItem( SlabAllocator *slabs, size_t chunkBytes,
+                                     const char *key, size_t keyLen, uint64_t hash,
+                                     int size, uint32_t flags, uint32_t exptime ) {
+    size_t headerLen = MemcachedItem::headerSize( keyLen, flags, size );
+    size_t chunks = 0;
+    size_t bytes = sizeof( MemcachedItem ) + headerLen + size;
+    if ( (size_t)size > chunkBytes ) {
+        chunks = ( size + chunkBytes - 1 ) / chunkBytes;
+        bytes = MemcachedItem::chainedSize( headerLen, chunks );
+    }
+    MemcachedItem *item = slabs->allocItem( bytes );
+    if ( item == NULL ) {
+        return NULL;
+    }
+    item->init( key, keyLen, flags, exptime, size );
+    item->hash_ = hash;
+    if ( chunks > 0 && !slabs->allocChunks( item, chunks, chunkBytes ) ) {
+        slabs->freeItem( item );
+        return NULL;
+    }
+    return item;
+}
+
+// Doubly linked list of items, most recently put in the front. The
+// links are stored in the items. bytes_ is the chunk bytes of the
+// items in the list.
+struct ItemList {
+    MemcachedItem *head_;
+    MemcachedItem *tail_;   // Evicted or looked at first.
+    size_t count_;
+    size_t bytes_;
+
+    ItemList() {
+        head_ = NULL;
+        tail_ = NULL;
+        count_ = 0;
+        bytes_ = 0;
+    }
+
+    void pushFront( MemcachedItem *item, size_t bytes ) {
+        item->prev_ = NULL;
+        item->next_ = head_;
+        if ( head_ ) {
+            head_->prev_ = item;
+        } else {
+            tail_ = item;
+        }
+        head_ = item;
+        count_++;
+        bytes_ += bytes;
+    }
+
+    void unlink( MemcachedItem *item, size_t bytes ) {
+        if ( item->prev_ ) {
+            item->prev_->next_ = item->next_;
+        } else {
+            head_ = item->next_;
+        }
+        if ( item->next_ ) {
+            item->next_->prev_ = item->prev_;
+        } else {
+            tail_ = item->prev_;
+        }
+        item->prev_ = NULL;
+        item->next_ = NULL;
+        count_--;
+        bytes_ -= bytes;
+    }
+};
+
+// How a shard picks the items to evict.
+enum EvictionPolicy {
+    // Strict LRU. A get takes the lock of the shard and moves the item
+    // to the front of the list.
+    EVICT_LRU = 0,
+    // CLOCK. A get only sets the active bit of the item. Eviction
+    // clears the bit of an active item at the tail and moves it to the
+    // front instead, a second chance.
+    EVICT_CLOCK,
+    // Segmented LRU. New items start in the probation list. A get only
+    // sets the active bit, promotion is lazy: an active item reaching
+    // the tail of probation moves to the protected list instead of
+    // being evicted. Protected is kept under SLRU_PROTECTED_PERCENT of
+    // the budget by moving its tail back to probation. Items read once
+    // never leave probation, so a scan can't flush the protected ones.
+    EVICT_SLRU,
+    // W-TinyLFU. New items start in a small window list with CLOCK
+    // second chances. The tail of the window goes to the SLRU lists,
+    // once they are full only if a FrequencySketch of the recent gets
+    // and sets says its key is used more often than the key SLRU would
+    // evict, else the candidate is evicted. A burst of keys read once
+    // only ever churns the window.
+    EVICT_TINYLFU
+};
+
+static const char *evictionPolicyNames[] = { "lru", "clock", "slru", "tinylfu" };
+
+// Policy called name, false if there is none.
+static inline bool parseEvictionPolicy( const char *name, EvictionPolicy *policy ) {
+    for ( int i = EVICT_LRU; i <= EVICT_TINYLFU; i++ ) {
+        if ( strcmp( name, evictionPolicyNames[i] ) == 0 ) {
+            *policy = (EvictionPolicy)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Share of the budget of a shard the protected list of SLRU can take.
+#define SLRU_PROTECTED_PERCENT 80
+// Share of the budget of a shard the window of W-TinyLFU takes, and
+// bytes of the budget per counter of its FrequencySketch.
+#define TINYLFU_WINDOW_PERCENT 1
+#define TINYLFU_BYTES_PER_COUNTER 16
+
+// One shard of the LRU cache. It has the following.
+//
+// 1. Linked lists of the items, ordered as the eviction policy says.
+// CLOCK and strict LRU use one list, SLRU a probation and a protected
+// one, W-TinyLFU a window in front of those two. New items go to the
+// front of the first list.
+// 2. An ItemIndex from key to item. This helps identify the item in
+// O(1) and we can remove it from linked list in O(1) again.
+//
+// 3. A TimingWheel of the items with an expiry time. expire() takes
+// the ones that are due out of the cache, and a get never returns an
+// expired item even before that.
+//
+// With CLOCK, SLRU and W-TinyLFU gets don't take the lock. They find
+// the item in the index inside an epoch read section and only mark it
+// active, the lists are reordered lazily by eviction with the lock held
+// for a set. W-TinyLFU also counts the key in its FrequencySketch.
+//
+class LRUMemCacheShard {
+private:
+    ItemList probation_;     // The only list of CLOCK and strict LRU.
+    ItemList protected_;     // Items of SLRU with a hit since they came in.
+    ItemList window_;        // New items of W-TinyLFU.
+    FrequencySketch *sketch_;    // W-TinyLFU only.
+    ItemIndex cacheIndex_;
+    TimingWheel wheel_;
+    vector< MemcachedItem * > expired_;    // Scratch space of expire().
+    EvictionPolicy policy_;
+    size_t limitBytes_;      // Memory budget of this shard.
+    size_t usedBytes_;       // Chunk bytes of the items in this shard.
+    SlabAllocator *slabs_;   // Where the chunks of our items come from.
+    EpochManager *epochs_;   // Where released items wait for readers.
+    ItemReclaimer *reclaimer_;   // Frees them after.
+    uint64_t casUnique_;     // Given to the last item linked.
+    uint64_t inlineEvictions_;       // Made room for a set.
+    uint64_t backgroundEvictions_;   // Made room ahead, see evictAhead.
+
+    // Ensure accesses to this shard from different threads are
+    // isolated.
+    pthread_mutex_t cacheLock;
+
+    // Take cacheLock. When another thread holds it, the time we wait
+    // for it goes to the lock wait counters of our thread.
+    void lockShard() {
+        if ( pthread_mutex_trylock( &cacheLock ) == 0 ) {
+            return;
+        }
+        uint64_t start = nowNanos();
+        pthread_mutex_lock( &cacheLock );
+        statAdd( &threadStats.lockWaits_ );
+        statAdd( &threadStats.lockWaitNanos_, nowNanos() - start );
+    }
+
+    static bool testFlag( MemcachedItem *item, uint8_t flag ) {
+        return __atomic_load_n( &item->iflags_, __ATOMIC_RELAXED ) & flag;
+    }
+
+    static void clearFlag( MemcachedItem *item, uint8_t flag ) {
+        __atomic_fetch_and( &item->iflags_, (uint8_t)~flag, __ATOMIC_RELAXED );
+    }
+
+    static void setFlag( MemcachedItem *item, uint8_t flag ) {
+        __atomic_fetch_or( &item->iflags_, flag, __ATOMIC_RELAXED );
+    }
+
+    ItemList *listOf( MemcachedItem *item ) {
+        uint8_t flags = __atomic_load_n( &item->iflags_, __ATOMIC_RELAXED );
+        if ( flags & ITEM_WINDOW ) {
+            return &window_;
+        }
+        return ( flags & ITEM_PROTECTED ) ? &protected_ : &probation_;
+    }
+
+    void unlink( MemcachedItem *item ) {
+        listOf( item )->unlink( item, slabs_->chunkSize( item ) );
+    }
+
+    // Move an item to the front of the list it is in.
+    void moveToFront( MemcachedItem *item ) {
+        ItemList *list = listOf( item );
+        size_t bytes = slabs_->chunkSize( item );
+        list->unlink( item, bytes );
+        list->pushFront( item, bytes );
+    }
+
+    // Take the item out of the index, the LRU list and the wheel. It
+    // is marked unlinked before the index lets go of it, like in
+    // setItem, so a thread that no longer finds it there also sees it
+    // unlinked if it kept it in its NearCache.
+    void unlinkItem( MemcachedItem *item ) {
+        unlink( item );
+        wheel_.remove( item );
+        usedBytes_ -= slabs_->chunkSize( item );
+        clearFlag( item, ITEM_LINKED | ITEM_PROTECTED | ITEM_WINDOW );
+        cacheIndex_.erase( item );
+    }
+
+    // Drop a reference. The chunk is retired if it was the last one.
+    void release( MemcachedItem *item ) {
+        if ( item->unref() ) {
+            epochs_->retire( item, freeRetiredItem, reclaimer_ );
+        }
+    }
+
+    // Keep the protected list of SLRU in its share of the budget. Its
+    // tail goes back to probation unless it was read again.
+    void trimProtected() {
+        size_t limit = limitBytes_ / 100 * SLRU_PROTECTED_PERCENT;
+        while ( protected_.bytes_ > limit ) {
+            MemcachedItem *last = protected_.tail_;
+            if ( testFlag( last, ITEM_ACTIVE ) ) {
+                clearFlag( last, ITEM_ACTIVE );
+                moveToFront( last );
+                continue;
+            }
+            size_t bytes = slabs_->chunkSize( last );
+            protected_.unlink( last, bytes );
+            clearFlag( last, ITEM_PROTECTED );
+            probation_.pushFront( last, bytes );
+        }
+    }
+
+    // The item eviction should take next, or NULL if the shard is
+    // empty. Active items found on the way are given their second
+    // chance. This ends since every one of them has its bit cleared.
+    MemcachedItem *nextVictim() {
+        while ( 1 ) {
+            MemcachedItem *last = probation_.tail_;
+            if ( policy_ == EVICT_LRU ) {
+                return last;
+            }
+            if ( last == NULL ) {
+                // Everything is protected.
+                return protected_.tail_;
+            }
+            if ( !testFlag( last, ITEM_ACTIVE ) ) {
+                return last;
+            }
+            clearFlag( last, ITEM_ACTIVE );
+            if ( policy_ == EVICT_CLOCK ) {
+                moveToFront( last );
+                continue;
+            }
+            size_t bytes = slabs_->chunkSize( last );
+            probation_.unlink( last, bytes );
+            setFlag( last, ITEM_PROTECTED );
+            protected_.pushFront( last, bytes );
+            trimProtected();
+        }
+    }
+
+    // Evict the item, counting it in *counter.
+    void evict( MemcachedItem *item, uint64_t *counter ) {
+        pr_debug( "Evicting key %.*s\n", item->keyLen_, item->key() );
+        unlinkItem( item );
+        slabs_->noteEviction( item );
+        release( item );
+        __atomic_add_fetch( counter, 1, __ATOMIC_RELAXED );
+    }
+
+    // Evict until extra more bytes fit in the budget, at most max
+    // items. Called with the lock held. Returns how many went.
+    size_t evictToFit( size_t extra, uint64_t *counter, size_t max = SIZE_MAX ) {
+        size_t count = 0;
+        while ( usedBytes_ + extra > limitBytes_ && count < max ) {
+            MemcachedItem *last = nextVictim();
+            if ( last == NULL ) {
+                // Only the window is left.
+                last = window_.tail_;
+            }
+            if ( last == NULL ) {
+                break;
+            }
+            evict( last, counter );
+            count++;
+        }
+        return count;
+    }
+
+    // W-TinyLFU. Make room for a new item of extra bytes in the window
+    // by moving its tail to probation. While the cache has room it just
+    // goes, after that it goes only if its key is used more often than
+    // the one of the next SLRU victim, and the loser of the two is
+    // evicted.
+    void admitFromWindow( size_t extra, uint64_t *counter ) {
+        size_t windowLimit = limitBytes_ / 100 * TINYLFU_WINDOW_PERCENT;
+        while ( window_.tail_ != NULL && window_.bytes_ + extra > windowLimit ) {
+            MemcachedItem *candidate = window_.tail_;
+            if ( testFlag( candidate, ITEM_ACTIVE ) ) {
+                clearFlag( candidate, ITEM_ACTIVE );
+                moveToFront( candidate );
+                continue;
+            }
+            if ( usedBytes_ + extra > limitBytes_ ) {
+                MemcachedItem *victim = nextVictim();
+                if ( victim == NULL ||
+                     sketch_->frequency( candidate->hash_ ) <=
+                     sketch_->frequency( victim->hash_ ) ) {
+                    evict( candidate, counter );
+                    continue;
+                }
+                evict( victim, counter );
+            }
+            size_t bytes = slabs_->chunkSize( candidate );
+            window_.unlink( candidate, bytes );
+            clearFlag( candidate, ITEM_WINDOW );
+            probation_.pushFront( candidate, bytes );
+        }
+    }
+
+    // The item of key if it is there and hasn't expired. Called with
+    // the lock held.
+    MemcachedItem *findCurrent( const char *key, size_t keyLen, uint64_t hash ) {
+        MemcachedItem *item = cacheIndex_.find( key, keyLen, hash );
+        if ( item != NULL && item->expiredAt( currentTime() ) ) {
+            return NULL;
+        }
+        return item;
+    }
+
+    // The value of item as an unsigned 64 bit number, false if it
+    // isn't one.
+    static bool parseNumber( MemcachedItem *item, uint64_t *number ) {
+        char digits[20];
+        int len = item->size_ - 2;
+        if ( len > (int)sizeof( digits ) ) {
+            return false;
+        }
+        item->copyOut( 0, digits, len );
+        return StringPiece( digits, len ).toUint64( number );
+    }
+
+    // Link val in the place of existing, or as a new key if that is
+    // NULL, with the lock held. See setItem.
+    void linkItem( MemcachedItem *val, MemcachedItem *existing ) {
+        size_t bytes = slabs_->chunkSize( val );
+        // Given before the index publishes the item.
+        val->cas_ = ++casUnique_;
+        if( existing != NULL ) {
+            unlink( existing );
+            wheel_.remove( existing );
+            usedBytes_ -= slabs_->chunkSize( existing );
+            clearFlag( existing, ITEM_LINKED | ITEM_PROTECTED | ITEM_WINDOW );
+            cacheIndex_.replace( existing, val );
+            release( existing );
+        }
+        if ( sketch_ != NULL ) {
+            sketch_->increment( val->hash_ );
+            sketch_->ageIfDue();
+        }
+        if ( policy_ == EVICT_TINYLFU ) {
+            admitFromWindow( bytes, &inlineEvictions_ );
+        }
+        evictToFit( bytes, &inlineEvictions_ );
+
+        if ( existing == NULL ) {
+            cacheIndex_.insert( val );
+        }
+        if ( policy_ == EVICT_TINYLFU ) {
+            setFlag( val, ITEM_WINDOW );
+            window_.pushFront( val, bytes );
+        } else {
+            probation_.pushFront( val, bytes );
+        }
+        if ( val->expiry() != 0 ) {
+            wheel_.add( val );
+        }
+        usedBytes_ += bytes;
+        setFlag( val, ITEM_LINKED );
+    }
+
+    void releaseList( ItemList *list ) {
+        MemcachedItem *item = list->head_;
+        while ( item != NULL ) {
+            MemcachedItem *next = item->next_;
+            release( item );
+            item = next;
+        }
+    }
+
+public:
+    LRUMemCacheShard( size_t limitBytes, SlabAllocator *slabs, EpochManager *epochs,
+                      ItemReclaimer *reclaimer, EvictionPolicy policy )
+        : cacheIndex_( epochs ) {
+        slabs_ = slabs;
+        epochs_ = epochs;
+        reclaimer_ = reclaimer;
+        // Uniques are not saved in snapshots, start above any a client may
+        // hold from before a restart, counting 2^32 per second of the time.
+        casUnique_ = (uint64_t)time( NULL ) << 32;
+        inlineEvictions_ = 0;
+        backgroundEvictions_ = 0;
+        policy_ = policy;
+        limitBytes_ = limitBytes;
+        usedBytes_ = 0;
+        sketch_ = NULL;
+        if ( policy_ == EVICT_TINYLFU ) {
+            sketch_ = new FrequencySketch( limitBytes / TINYLFU_BYTES_PER_COUNTER );
+        }
+        pthread_mutex_init( &cacheLock, NULL );
+    }
+
+    ~LRUMemCacheShard() {
+        releaseList( &window_ );
+        releaseList( &probation_ );
+        releaseList( &protected_ );
+        delete sketch_;
+        pthread_mutex_destroy( &cacheLock );
+    }
+
+    // If the item is present and not expired, return it with a
+    // reference for the caller. The caller must be in an epoch read
+    // section. Strict LRU moves the item to the front under the lock,
+    // the other policies don't take the lock and mark the item active.
+    // An expired item is unlinked right away if we hold the lock, else
+    // it is left to the next expire(). W-TinyLFU counts misses too, a
+    // key that was asked for often is worth keeping once it is set.
+    MemcachedItem * getItem( const char *key, size_t keyLen, uint64_t hash ) {
+        if ( sketch_ != NULL ) {
+            sketch_->increment( hash );
+        }
+        if ( policy_ == EVICT_LRU ) {
+            lockShard();
+            MemcachedItem *item = cacheIndex_.find( key, keyLen, hash );
+            if ( item != NULL && item->expiredAt( currentTime() ) ) {
+                unlinkItem( item );
+                release( item );
+                item = NULL;
+            }
+            if ( item != NULL ) {
+                item->ref();
+                moveToFront( item );
+            }
+            pthread_mutex_unlock ( &cacheLock );
+            return item;
+        }
+
+        while ( 1 ) {
+            MemcachedItem *item = cacheIndex_.find( key, keyLen, hash );
+            if ( item == NULL || item->expiredAt( currentTime() ) ) {
+                return NULL;
+            }
+            if ( item->tryRef() ) {
+                item->markActive();
+                return item;
+            }
+            // Replaced and released while we looked, the index has
+            // moved on already.
+        }
+    }
+
+    // If the item is present replace it, in place in the index so a
+    // concurrent get finds either of the two, and put the new one in
+    // the front of the first list. The old one is marked unlinked
+    // before the new one takes its slot, see NearCache. Items are
+    // evicted until the new item fits in the memory budget of the
+    // shard. The reference of the caller goes to the cache. Returns
+    // false, and leaves the item to the caller, if it is bigger than
+    // the whole budget.
+    bool setItem( MemcachedItem * val ) {
+        lockShard();
+        if ( slabs_->chunkSize( val ) > limitBytes_ ) {
+            pthread_mutex_unlock ( &cacheLock );
+            return false;
+        }
+        linkItem( val, cacheIndex_.find( val->key(), val->keyLen_, val->hash_ ) );
+        pthread_mutex_unlock ( &cacheLock );
+        return true;
+    }
+
+    // Store val like setItem if the item of its key is still the one
+    // whose CAS unique was cas. STORE_NOT_FOUND if the key isn't there
+    // and STORE_EXISTS if it changed since, the caller keeps val then.
+    StoreResult casItem( MemcachedItem *val, uint64_t cas ) {
+        StoreResult result = STORE_OK;
+        lockShard();
+        MemcachedItem *existing = findCurrent( val->key(), val->keyLen_, val->hash_ );
+        if ( slabs_->chunkSize( val ) > limitBytes_ ) {
+            result = STORE_TOO_LARGE;
+        } else if ( existing == NULL ) {
+            result = STORE_NOT_FOUND;
+        } else if ( existing->cas_ != cas ) {
+            result = STORE_EXISTS;
+        } else {
+            linkItem( val, existing );
+        }
+        pthread_mutex_unlock ( &cacheLock );
+        return result;
+    }
+
+    // Put the value of val after the value of the item of its key, or
+    // before it, in a new item with the flags and expiry of that one.
+    // STORE_NOT_STORED if the key isn't there. val stays the caller's.
+    StoreResult concatItem( MemcachedItem *val, bool append, size_t chunkBytes ) {
+        StoreResult result = STORE_OK;
+        lockShard();
+        MemcachedItem *existing = findCurrent( val->key(), val->keyLen_, val->hash_ );
+        if ( existing == NULL ) {
+            result = STORE_NOT_STORED;
+        } else if ( (size_t)existing->size_ + val->size_ - 4 > ITEM_SIZE_MAX ) {
+            result = STORE_TOO_LARGE;
+        } else {
+            MemcachedItem *first = append ? existing : val;
+            MemcachedItem *second = append ? val : existing;
+            MemcachedItem *item = allocSlabItem( slabs_, chunkBytes, existing->key(),
+                                                 existing->keyLen_, existing->hash_,
+                                                 first->size_ - 2 + second->size_,
+                                                 existing->flags_, existing->expiry() );
+            if ( item == NULL ) {
+                result = STORE_NO_MEMORY;
+            } else if ( slabs_->chunkSize( item ) > limitBytes_ ) {
+                release( item );
+                result = STORE_TOO_LARGE;
+            } else {
+                item->copyFrom( 0, first, 0, first->size_ - 2 );
+                item->copyFrom( first->size_ - 2, second, 0, second->size_ );
+                linkItem( item, existing );
+            }
+        }
+        pthread_mutex_unlock ( &cacheLock );
+        return result;
+    }
+
+    // Add delta to the number that is the value of key, or subtract
+    // it if incr is false, in a new item with the flags and expiry of
+    // the old one. incr wraps around at 2^64, decr stops at 0. The new
+    // number is left in *value. STORE_NOT_FOUND if the key isn't there
+    // and STORE_NOT_NUMERIC if its value isn't a 64 bit number.
+    StoreResult incrItem( const char *key, size_t keyLen, uint64_t hash, bool incr,
+                          uint64_t delta, uint64_t *value, size_t chunkBytes ) {
+        StoreResult result = STORE_OK;
+        lockShard();
+        MemcachedItem *existing = findCurrent( key, keyLen, hash );
+        char digits[24];
+        uint64_t number = 0;
+        if ( existing == NULL ) {
+            result = STORE_NOT_FOUND;
+        } else if ( !parseNumber( existing, &number ) ) {
+            result = STORE_NOT_NUMERIC;
+        } else {
+            if ( incr ) {
+                number += delta;
+            } else {
+                number = delta > number ? 0 : number - delta;
+            }
+            int len = snprintf( digits, sizeof( digits ), "%llu\r\n",
+                                (unsigned long long)number );
+            MemcachedItem *item = allocSlabItem( slabs_, chunkBytes, key, keyLen, hash, len,
+                                                 existing->flags_, existing->expiry() );
+            if ( item == NULL ) {
+                result = STORE_NO_MEMORY;
+            } else {
+                item->copyIn( 0, digits, len );
+                linkItem( item, existing );
+                *value = number;
+            }
+        }
+        pthread_mutex_unlock ( &cacheLock );
+        return result;
+    }
+
+    // Give the item of key a new expiry time, on currentTime(), 0 for
+    // never. The item stays where it is, only its expiry and its slot
+    // in the wheel change. Returns false if the key isn't there.
+    bool touchItem( const char *key, size_t keyLen, uint64_t hash, uint32_t exptime ) {
+        lockShard();
+        MemcachedItem *item = findCurrent( key, keyLen, hash );
+        if ( item != NULL ) {
+            wheel_.remove( item );
+            __atomic_store_n( &item->exptime_, exptime, __ATOMIC_RELAXED );
+            if ( exptime != 0 ) {
+                wheel_.add( item );
+            }
+        }
+        pthread_mutex_unlock ( &cacheLock );
+        return item != NULL;
+    }
+
+    // Take the item of key out of the cache. Returns false if it isn't
+    // there or has expired.
+    bool deleteItem( const char *key, size_t keyLen, uint64_t hash ) {
+        lockShard();
+        MemcachedItem *item = cacheIndex_.find( key, keyLen, hash );
+        bool found = item != NULL && !item->expiredAt( currentTime() );
+        if ( item != NULL ) {
+            unlinkItem( item );
+            release( item );
+        }
+        pthread_mutex_unlock ( &cacheLock );
+        return found;
+    }
+
+    // Take the items that expired by now out of the cache. Returns how
+    // many there were.
+    size_t expire( uint32_t now ) {
+        lockShard();
+        wheel_.advance( now, &expired_ );
+        size_t count = expired_.size();
+        for ( size_t i = 0; i < count; i++ ) {
+            pr_debug( "Expired key %.*s\n", expired_[i]->keyLen_, expired_[i]->key() );
+            unlinkItem( expired_[i] );
+            release( expired_[i] );
+        }
+        expired_.clear();
+        pthread_mutex_unlock ( &cacheLock );
+        return count;
+    }
+
+    // Evict until freePercent of the budget of the shard is left, so
+    // the sets coming next don't have to, but at most max items.
+    // W-TinyLFU first moves what is over its window share to
+    // probation. Adds the items evicted to *evicted, returns true if max
+    // stopped it before it was done.
+    bool evictAhead( size_t freePercent, size_t max, size_t *evicted ) {
+        lockShard();
+        if ( policy_ == EVICT_TINYLFU ) {
+            admitFromWindow( 0, &backgroundEvictions_ );
+        }
+        size_t free = limitBytes_ / 100 * freePercent;
+        *evicted += evictToFit( free, &backgroundEvictions_, max );
+        bool more = usedBytes_ + free > limitBytes_ && usedBytes_ > 0;
+        pthread_mutex_unlock ( &cacheLock );
+        return more;
+    }
+
+    // Change the budget of the shard, evicting right away if we are
+    // over the new one.
+    void setLimit( size_t limitBytes ) {
+        lockShard();
+        limitBytes_ = limitBytes;
+        if ( policy_ == EVICT_TINYLFU ) {
+            admitFromWindow( 0, &inlineEvictions_ );
+        }
+        evictToFit( 0, &inlineEvictions_ );
+        trimProtected();
+        pthread_mutex_unlock ( &cacheLock );
+    }
+
+    size_t usedBytes() {
+        lockShard();
+        size_t bytes = usedBytes_;
+        pthread_mutex_unlock ( &cacheLock );
+        return bytes;
+    }
+
+    uint64_t inlineEvictions() {
+        return __atomic_load_n( &inlineEvictions_, __ATOMIC_RELAXED );
+    }
+
+    uint64_t backgroundEvictions() {
+        return __atomic_load_n( &backgroundEvictions_, __ATOMIC_RELAXED );
+    }
+
+    // Called by the slab rebalancer for an item in a page it is
+    // moving. The item may have been unlinked and freed meanwhile, or
+    // not be linked yet, so we check under the lock that it is in the
+    // cache and that it is in this shard, which hash tells. If a get
+    // reply still uses the item, the chunk comes back when it is sent.
+    bool evictItem( MemcachedItem *item, uint64_t hash ) {
+        bool evicted = false;
+        lockShard();
+        if ( testFlag( item, ITEM_LINKED ) && item->hash_ == hash ) {
+            unlinkItem( item );
+            release( item );
+            evicted = true;
+        }
+        pthread_mutex_unlock ( &cacheLock );
+        return evicted;
+    }
+
+    size_t size() {
+        lockShard();
+        size_t count = probation_.count_ + protected_.count_ + window_.count_;
+        pthread_mutex_unlock ( &cacheLock );
+        return count;
+    }
+
+    // Append the items of the shard to items with a reference each,
+    // from the one eviction would take first to the most recently
+    // used, protected items of SLRU after the others and the window of
+    // W-TinyLFU last. Only walks the lists under the lock, the caller
+    // copies the items out after.
+    void collectItems( vector< MemcachedItem * > *items ) {
+        lockShard();
+        items->reserve( items->size() + probation_.count_ + protected_.count_ +
+                        window_.count_ );
+        ItemList *lists[] = { &probation_, &protected_, &window_ };
+        for ( int l = 0; l < 3; l++ ) {
+            for ( MemcachedItem *item = lists[l]->tail_; item != NULL; item = item->prev_ ) {
+                item->ref();
+                items->push_back( item );
+            }
+        }
+        pthread_mutex_unlock ( &cacheLock );
+    }
+};
+
+// Constants and steps of LRUMemCache::hashKey.
+static const uint64_t hashSecret[4] = { 0xA0761D6478BD642FULL, 0xE7037ED1A0B428DBULL,
+                                        0x8EBC6AF09C88C6E3ULL, 0x589965CC75374CC3ULL };
+
+// Both halves of the 128 bit product folded together.
+static inline uint64_t hashMix( uint64_t a, uint64_t b ) {
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)( product >> 64 );
+}
+
+static inline uint64_t hashLoad64( const char *p ) {
+    uint64_t value;
+    memcpy( &value, p, sizeof( value ) );
+    return value;
+}
+
+static inline uint64_t hashLoad32( const char *p ) {
+    uint32_t value;
+    memcpy( &value, p, sizeof( value ) );
+    return value;
+}
+
+// This serves as the LRU cache to store the key-value for Memcached.
+//
+// A single lock around one LRU list would serialize every set. So the
+// cache is split in a power of two number of shards. The hash of the
+// key picks the shard and each shard has its own lists, index, lock
+// and an equal share of the memory limit. The eviction policy works
+// per shard. Unless it is strict LRU, gets take no lock at all. Items
+// and index tables they may still be reading are freed through the
+// epoch manager.
+//
+// The memory limit is in bytes and an item is charged for the whole
+// slab chunk it occupies, header and rounding included, so a few big
+// values take as much of the cache as they really use.
+//
+class LRUMemCache : public SlabEvictor {
+private:
+    SlabAllocator slabs_;
+    ItemReclaimer reclaimer_;
+    EpochManager epochs_;    // Destroyed first, it frees into reclaimer_.
+    vector< LRUMemCacheShard * > shards_;
+    size_t shardMask_;
+    size_t limitBytes_;
+    size_t chunkBytes_;      // Values bigger than this are chained.
+    pthread_t maintainer_;
+    int maintainInterval_;   // Milliseconds between two passes.
+
+    // The thread sleeps half as long after a pass that evicted, down
+    // to MAINTAIN_MIN_SLEEP_US, and twice as long after one that had
+    // nothing to evict, up to the interval, so it keeps up with a
+    // burst of sets and stays quiet when there is none.
+    static void * maintainerFunc( void *arg ) {
+        LRUMemCache *cache = (LRUMemCache *)arg;
+        registerBackgroundStats();
+        useconds_t maxSleep = cache->maintainInterval_ * 1000;
+        useconds_t sleepUs = maxSleep;
+        while ( 1 ) {
+            usleep( sleepUs );
+            if ( cache->maintain() > 0 ) {
+                sleepUs = max( sleepUs / 2, (useconds_t)MAINTAIN_MIN_SLEEP_US );
+            } else {
+                sleepUs = min( sleepUs * 2, maxSleep );
+            }
+        }
+        return NULL;
+    }
+
+    // One pass of the maintenance thread. Every shard evicts down to
+    // its low watermark, MAINTAIN_EVICT_BATCH items at a time so the
+    // lock is let go in between, and at most MAINTAIN_EVICT_MAX per
+    // pass so a burst of sets doesn't keep the thread from the rest.
+    // Then the items due expire and the dead items are freed, those
+    // this thread retired itself included. Returns how many items were
+    // evicted.
+    size_t maintain() {
+        size_t evicted = 0;
+        for ( size_t i = 0; i < shards_.size(); i++ ) {
+            bool more = true;
+            for ( size_t n = 0; more && n < MAINTAIN_EVICT_MAX; n += MAINTAIN_EVICT_BATCH ) {
+                more = shards_[i]->evictAhead( MAINTAIN_FREE_PERCENT, MAINTAIN_EVICT_BATCH,
+                                               &evicted );
+            }
+        }
+        expireItems();
+        epochs_.reclaim();
+        reclaimer_.freeDeferred();
+        return evicted;
+    }
+
+    size_t shardIndex( uint64_t hash ) {
+        // The index of the shard uses the low bits of the same hash,
+        // pick the shard with the high ones.
+        return ( hash >> 48 ) & shardMask_;
+    }
+
+    LRUMemCacheShard *shardFor( uint64_t hash ) {
+        return shards_[ shardIndex( hash ) ];
+    }
+
+public:
+    // 64 bit hash of the key in the manner of wyhash. The key is read 8
+    // bytes at a time, or as two overlapping 4 byte halves up to 16
+    // bytes, and every 16 bytes are folded in with one 64 x 64 -> 128
+    // bit multiply, so a 250 byte key costs about as much as 20 bytes
+    // did one at a time. All bits of the result are mixed, the shard,
+    // the group and the tag each use different ones.
+    static uint64_t hashKey( const char *key, size_t keyLen ) {
+        const uint64_t *secret = hashSecret;
+        uint64_t seed = hashMix( secret[0], secret[1] );
+        uint64_t a, b;
+        if ( keyLen <= 16 ) {
+            if ( keyLen >= 4 ) {
+                size_t mid = ( keyLen >> 3 ) << 2;
+                a = ( hashLoad32( key ) << 32 ) | hashLoad32( key + mid );
+                b = ( hashLoad32( key + keyLen - 4 ) << 32 ) |
+                    hashLoad32( key + keyLen - 4 - mid );
+            } else if ( keyLen > 0 ) {
+                a = ( (uint64_t)(uint8_t)key[0] << 16 ) |
+                    ( (uint64_t)(uint8_t)key[keyLen >> 1] << 8 ) | (uint8_t)key[keyLen - 1];
+                b = 0;
+            } else {
+                a = 0;
+                b = 0;
+            }
+        } else {
+            const char *p = key;
+            size_t left = keyLen;
+            if ( left > 48 ) {
+                // Three independent lanes so the multiplies overlap.
+                uint64_t seed1 = seed;
+                uint64_t seed2 = seed;
+                do {
+                    seed = hashMix( hashLoad64( p ) ^ secret[1], hashLoad64( p + 8 ) ^ seed );
+                    seed1 = hashMix( hashLoad64( p + 16 ) ^ secret[2],
+                                     hashLoad64( p + 24 ) ^ seed1 );
+                    seed2 = hashMix( hashLoad64( p + 32 ) ^ secret[3],
+                                     hashLoad64( p + 40 ) ^ seed2 );
+                    p += 48;
+                    left -= 48;
+                } while ( left > 48 );
+                seed ^= seed1 ^ seed2;
+            }
+            while ( left > 16 ) {
+                seed = hashMix( hashLoad64( p ) ^ secret[1], hashLoad64( p + 8 ) ^ seed );
+                p += 16;
+                left -= 16;
+            }
+            // The last 16 bytes, overlapping what came before.
+            a = hashLoad64( p + left - 16 );
+            b = hashLoad64( p + left - 8 );
+        }
+        __uint128_t product = (__uint128_t)( a ^ secret[1] ) * ( b ^ seed );
+        return hashMix( (uint64_t)product ^ secret[0] ^ keyLen,
+                        (uint64_t)( product >> 64 ) ^ secret[1] );
+    }
+
+    // limitBytes is the memory limit of the whole cache. numShards is
+    // rounded up to a power of two.
+    LRUMemCache( size_t limitBytes, int numShards = LRU_CACHE_SHARDS,
+                 EvictionPolicy policy = DEFAULT_EVICTION_POLICY )
+        : reclaimer_( &slabs_ ) {
+        size_t count = 1;
+        while ( count < (size_t)numShards ) {
+            count <<= 1;
+        }
+        shardMask_ = count - 1;
+        limitBytes_ = limitBytes;
+        chunkBytes_ = DEFAULT_ITEM_CHUNK_KB * 1024;
+        maintainInterval_ = 0;
+
+        for ( size_t i = 0; i < count; i++ ) {
+            shards_.push_back( new LRUMemCacheShard( limitBytes / count, &slabs_,
+                                                     &epochs_, &reclaimer_, policy ) );
+        }
+    }
+
+    ~LRUMemCache() {
+        for ( size_t i = 0; i < shards_.size(); i++ ) {
+            delete shards_[i];
+        }
+        reclaimer_.setHandOff( false );
+        epochs_.reclaimAll();
+        reclaimer_.freeDeferred();
+    }
+
+    // If the item is present, return it and mark it active in its
+    // shard. The caller must releaseItem it when done.
+    MemcachedItem * getItem( const char *key, size_t keyLen ) {
+        return getItem( key, keyLen, hashKey( key, keyLen ) );
+    }
+
+    // Same with the hash of the key already known.
+    MemcachedItem * getItem( const char *key, size_t keyLen, uint64_t hash ) {
+        epochs_.beginRead();
+        MemcachedItem *item = shardFor( hash )->getItem( key, keyLen, hash );
+        epochs_.endRead();
+        statAdd( item != NULL ? &threadStats.getHits_ : &threadStats.getMisses_ );
+        return item;
+    }
+
+    // Look up all the keys of a multi key get in one read section.
+    // items[i] is set to the item of keys[i], or NULL if it is not in
+    // the cache. Every item returned must be given back with
+    // releaseItem.
+    void getItems( const vector< StringPiece > &keys, vector< MemcachedItem * > *items ) {
+        getItems( keys, NULL, items );
+    }
+
+    // Same with hashes[i] the hash of keys[i], if hashes isn't NULL.
+    void getItems( const vector< StringPiece > &keys, const uint64_t *hashes,
+                   vector< MemcachedItem * > *items ) {
+        size_t count = keys.size();
+        size_t hits = 0;
+        items->resize( count );
+        epochs_.beginRead();
+        for ( size_t i = 0; i < count; i++ ) {
+            uint64_t hash = hashes != NULL ? hashes[i] :
+                                             hashKey( keys[i].data, keys[i].size );
+            (*items)[i] = shardFor( hash )->getItem( keys[i].data, keys[i].size, hash );
+            hits += (*items)[i] != NULL;
+        }
+        epochs_.endRead();
+        statAdd( &threadStats.getHits_, hits );
+        statAdd( &threadStats.getMisses_, count - hits );
+    }
+
+    // Allocate an item for key with room for a value of size bytes and
+    // hash the key. exptime is on currentTime(), see expiryTime(), 0
+    // for an item that doesn't expire. The caller fills in the value
+    // and hands it to setItem, or gives it back with releaseItem.
+    // Returns NULL if we are out of memory.
+    MemcachedItem * allocItem( const char *key, size_t keyLen, int size,
+                               uint32_t flags = 0, uint32_t exptime = 0 ) {
+        return allocItem( key, keyLen, hashKey( key, keyLen ), size, flags, exptime );
+    }
+
+    // Same with the hash of the key already known. A value over the
+    // chunk size is chained, the caller writes it with
+    // MemcachedItem::copyIn or through valueAt.
+    MemcachedItem * allocItem( const char *key, size_t keyLen, uint64_t hash, int size,
+                               uint32_t flags, uint32_t exptime ) {
+        return allocSlabItem( &slabs_, chunkBytes_, key, keyLen, hash, size, flags, exptime );
+    }
+
+    // Chain values bigger than bytes from now on.
+    void setChunkSize( size_t bytes ) {
+        chunkBytes_ = bytes;
+    }
+
+    // Drop a reference the caller got from allocItem, getItem or
+    // getItems. The chunk is retired with the last reference.
+    void releaseItem( MemcachedItem *item ) {
+        if ( item->unref() ) {
+            epochs_.retire( item, freeRetiredItem, &reclaimer_ );
+        }
+    }
+
+    // Free the chunks the calling thread retired that no get can be
+    // reading any more. Threads that release items call this now and
+    // then so their retired items don't wait for the next batch.
+    void reclaimRetired() {
+        epochs_.reclaim();
+    }
+
+    // Store the item in its shard, evicting the least recently used
+    // items of that shard until it fits. Returns false if the item is
+    // too large to be stored, the caller still owns it then.
+    bool setItem( MemcachedItem * val ) {
+        if ( !shardFor( val->hash_ )->setItem( val ) ) {
+            return false;
+        }
+        statAdd( &threadStats.sets_ );
+        return true;
+    }
+
+    // Store val if the item of its key still has the CAS unique cas.
+    // The caller still owns val unless STORE_OK comes back.
+    StoreResult casItem( MemcachedItem *val, uint64_t cas ) {
+        StoreResult result = shardFor( val->hash_ )->casItem( val, cas );
+        if ( result == STORE_OK ) {
+            statAdd( &threadStats.sets_ );
+            statAdd( &threadStats.casHits_ );
+        } else if ( result == STORE_EXISTS ) {
+            statAdd( &threadStats.casBadval_ );
+        } else if ( result == STORE_NOT_FOUND ) {
+            statAdd( &threadStats.casMisses_ );
+        }
+        return result;
+    }
+
+    // append or prepend the value of val to the item of its key. val
+    // is only read, the caller still owns it.
+    StoreResult concatItem( MemcachedItem *val, bool append ) {
+        StoreResult result = shardFor( val->hash_ )->concatItem( val, append, chunkBytes_ );
+        if ( result == STORE_OK ) {
+            statAdd( &threadStats.sets_ );
+        }
+        return result;
+    }
+
+    // incr or decr the number stored under key by delta, see
+    // LRUMemCacheShard::incrItem.
+    StoreResult incrItem( const char *key, size_t keyLen, uint64_t hash, bool incr,
+                          uint64_t delta, uint64_t *value ) {
+        StoreResult result = shardFor( hash )->incrItem( key, keyLen, hash, incr, delta,
+                                                          value, chunkBytes_ );
+        // Like memcached, a value that isn't a number is neither.
+        if ( result == STORE_OK ) {
+            statAdd( &threadStats.incrHits_ );
+        } else if ( result == STORE_NOT_FOUND ) {
+            statAdd( &threadStats.incrMisses_ );
+        }
+        return result;
+    }
+
+    // New expiry time of key, on currentTime(). Returns false if it
+    // isn't there.
+    bool touchItem( const char *key, size_t keyLen, uint64_t hash, uint32_t exptime ) {
+        bool found = shardFor( hash )->touchItem( key, keyLen, hash, exptime );
+        statAdd( found ? &threadStats.touchHits_ : &threadStats.touchMisses_ );
+        return found;
+    }
+
+    // Remove key from the cache. Returns false if it wasn't there.
+    bool deleteItem( const char *key, size_t keyLen ) {
+        return deleteItem( key, keyLen, hashKey( key, keyLen ) );
+    }
+
+    bool deleteItem( const char *key, size_t keyLen, uint64_t hash ) {
+        bool found = shardFor( hash )->deleteItem( key, keyLen, hash );
+        statAdd( found ? &threadStats.deleteHits_ : &threadStats.deleteMisses_ );
+        return found;
+    }
+
+    // Take the items that have expired out of every shard. Called
+    // every second, only the shards with items due do any work.
+    size_t expireItems() {
+        uint32_t now = currentTime();
+        size_t count = 0;
+        for ( size_t i = 0; i < shards_.size(); i++ ) {
+            count += shards_[i]->expire( now );
+        }
+        return count;
+    }
+
+    // Change the memory limit without restarting. Shards over their
+    // new share evict right away.
+    void setMemoryLimit( size_t limitBytes ) {
+        limitBytes_ = limitBytes;
+        for ( size_t i = 0; i < shards_.size(); i++ ) {
+            shards_[i]->setLimit( limitBytes / shards_.size() );
+        }
+    }
+
+    size_t memoryLimit() {
+        return limitBytes_;
+    }
+
+    // Bytes charged to the items across all shards.
+    size_t usedBytes() {
+        size_t bytes = 0;
+        for ( size_t i = 0; i < shards_.size(); i++ ) {
+            bytes += shards_[i]->usedBytes();
+        }
+        return bytes;
+    }
+
+    // SlabEvictor. A data chunk goes with the item it belongs to, if
+    // that is still the one in the cache under the hash of the chunk.
+    void evictForRebalance( MemcachedItem *item ) {
+        bool chunk = __atomic_load_n( &item->iflags_, __ATOMIC_ACQUIRE ) & ITEM_CHUNK;
+        uint64_t hash = item->hash_;
+        if ( chunk ) {
+            item = item->prev_;
+        }
+        if ( shardFor( hash )->evictItem( item, hash ) ) {
+            slabs_.noteRebalanceEviction();
+        }
+    }
+
+    void reclaimEvicted() {
+        epochs_.reclaim();
+    }
+
+    void startSlabRebalancer() {
+        slabs_.startRebalancer( this, SLAB_REBALANCE_INTERVAL );
+    }
+
+    // Start the maintenance thread, see maintain(), with a pass every
+    // intervalMs milliseconds. From then on it also expires the items,
+    // expireItems needn't be called any more, and frees the dead ones.
+    void startMaintainer( int intervalMs ) {
+        maintainInterval_ = intervalMs;
+        reclaimer_.setHandOff( true );
+        pthread_create( &maintainer_, NULL, maintainerFunc, this );
+    }
+
+    // Evictions made by sets because the shard had no room, and by
+    // the maintenance thread ahead of them.
+    uint64_t inlineEvictions() {
+        uint64_t count = 0;
+        for ( size_t i = 0; i < shards_.size(); i++ ) {
+            count += shards_[i]->inlineEvictions();
+        }
+        return count;
+    }
+
+    uint64_t backgroundEvictions() {
+        uint64_t count = 0;
+        for ( size_t i = 0; i < shards_.size(); i++ ) {
+            count += shards_[i]->backgroundEvictions();
+        }
+        return count;
+    }
+
+    SlabAllocator *slabs() {
+        return &slabs_;
+    }
+
+    int numShards() {
+        return shards_.size();
+    }
+
+    // Items of shard index in eviction order, see
+    // LRUMemCacheShard::collectItems. Every item must be given back
+    // with releaseItem.
+    void collectItems( int index, vector< MemcachedItem * > *items ) {
+        shards_[index]->collectItems( items );
+    }
+
+    // Number of items across all shards.
+    size_t size() {
+        size_t count = 0;
+        for ( size_t i = 0; i < shards_.size(); i++ ) {
+            count += shards_[i]->size();
+        }
+        return count;
+    }
+};
+
+#endif // _LRU_MEMCACHE_H
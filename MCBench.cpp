@@ -0,0 +1,565 @@
+#include "Memcached.h"
+#include "Zipf.h"
+#include "HdrHistogram.h"
+
+// Load generator speaking the text protocol to a running server over
+// plain sockets. Every thread drives its share of the connections from
+// one epoll instance, with the requests of a connection pipelined and
+// its responses matched to them in order.
+//
+// Closed loop (the default) keeps depth requests in flight on every
+// connection and sends the next one as soon as a response came. The
+// latency of a request is then measured from the moment it was sent,
+// which hides how long the requests a stalled server kept us from
+// sending would have waited. With -E those are added back the way
+// HdrHistogram corrects for coordinated omission, at the interval
+// given there, which must come from the rate the workload expects and
+// not from the latencies measured. The raw percentiles are always
+// printed, the corrected ones next to them.
+//
+// Open loop (-R) sends the requests of every connection at a fixed
+// rate whatever the server does, and measures every request from the
+// time it was due to be sent, so a stall shows up in all the requests
+// it delayed and no correction is needed.
+
+#define MCBENCH_DRAIN_SECS 2    // How long we wait for the last responses.
+#define MCBENCH_MAX_INFLIGHT 4096   // Per connection, in open loop.
+#define MCBENCH_LOAD_BATCH 100
+#define MCBENCH_MAX_VALUE ( 1024 * 1024 )
+
+struct BenchConfig {
+    const char *host;
+    int port;
+    int numConns;
+    int numThreads;
+    int depth;            // Requests in flight per connection, closed loop.
+    double getRatio;
+    int numKeys;
+    double zipfTheta;     // 0 for uniform keys.
+    int minValue;         // Value sizes, uniform in [minValue, maxValue].
+    int maxValue;
+    double rate;          // Requests per second of all connections, 0 for closed loop.
+    uint64_t expectedInterval;   // Closed loop, nanoseconds between the requests
+                                 // of a connection to correct with, 0 for none.
+    double duration;      // Seconds.
+    bool load;            // Set every key before the run.
+};
+
+enum RequestType {
+    REQUEST_GET = 0,
+    REQUEST_SET,
+    NUM_REQUEST_TYPES
+};
+
+static const char *requestTypeNames[] = { "get", "set", "all" };
+
+struct Request {
+    RequestType type;
+    uint64_t start;       // Nanoseconds, sent or due to be sent.
+};
+
+struct BenchConn {
+    int fd;
+    vector< Request > inflight;   // Oldest first, from inflightPos on.
+    size_t inflightPos;
+    string out;                   // Requests the socket didn't take yet.
+    size_t outPos;
+    vector< char > in;            // Responses not parsed yet.
+    size_t inLen;
+    uint64_t nextDue;             // Open loop, when the next request is due.
+    uint64_t interval;
+    bool writable;
+};
+
+struct BenchThread {
+    pthread_t threadId;
+    int id;
+    BenchConfig *config;
+    vector< string > *keys;
+    ZipfGenerator *zipf;
+    const string *values;         // maxValue bytes to take the values from.
+    pthread_barrier_t *barrier;
+    HdrHistogram latency[NUM_REQUEST_TYPES];   // Nanoseconds.
+    uint64_t done[NUM_REQUEST_TYPES];
+    uint64_t hits;
+    uint64_t errors;
+    bool failed;
+};
+
+static int benchConnect( BenchConfig *config ) {
+    struct sockaddr_in addr;
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons( config->port );
+    if ( inet_pton( AF_INET, config->host, &addr.sin_addr ) != 1 ) {
+        return -1;
+    }
+    int fd = socket( AF_INET, SOCK_STREAM, 0 );
+    if ( fd < 0 ) {
+        return -1;
+    }
+    if ( connect( fd, (struct sockaddr *)&addr, sizeof( addr ) ) < 0 ) {
+        close( fd );
+        return -1;
+    }
+    int noDelay = 1;
+    setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof( noDelay ) );
+    return fd;
+}
+
+// Append the next request to the output of the connection.
+static void addRequest( BenchThread *bt, BenchConn *conn, uint64_t *rand, uint64_t start ) {
+    BenchConfig *config = bt->config;
+    uint64_t k = bt->zipf != NULL ? bt->zipf->next( rand ) :
+                                    zipfRandom( rand ) % config->numKeys;
+    const string &key = ( *bt->keys )[k];
+    Request req;
+    req.start = start;
+    if ( zipfRandomUnit( rand ) < config->getRatio ) {
+        req.type = REQUEST_GET;
+        conn->out += "get " + key + "\r\n";
+    } else {
+        req.type = REQUEST_SET;
+        int size = config->minValue +
+                   zipfRandom( rand ) % ( config->maxValue - config->minValue + 1 );
+        char line[64];
+        snprintf( line, sizeof( line ), " 0 0 %d\r\n", size );
+        conn->out += "set " + key + line;
+        conn->out.append( *bt->values, 0, size );
+        conn->out += "\r\n";
+    }
+    conn->inflight.push_back( req );
+}
+
+static int inflightCount( BenchConn *conn ) {
+    return conn->inflight.size() - conn->inflightPos;
+}
+
+// Write what the socket takes. False if the connection failed.
+static bool flushOut( BenchConn *conn ) {
+    while ( conn->outPos < conn->out.size() ) {
+        ssize_t n = write( conn->fd, conn->out.data() + conn->outPos,
+                           conn->out.size() - conn->outPos );
+        if ( n < 0 ) {
+            if ( errno == EINTR ) {
+                continue;
+            }
+            if ( errno == EAGAIN || errno == EWOULDBLOCK ) {
+                conn->writable = false;
+                return true;
+            }
+            return false;
+        }
+        conn->outPos += n;
+    }
+    conn->out.clear();
+    conn->outPos = 0;
+    return true;
+}
+
+// Length of the complete response of a request of type at data, 0 if
+// it isn't all in yet. *hit is set for a get that found its key,
+// *error for an answer that isn't one of a get or a set.
+static size_t parseResponse( RequestType type, const char *data, size_t len,
+                             bool *hit, bool *error ) {
+    size_t pos = 0;
+    *hit = false;
+    *error = false;
+    while ( 1 ) {
+        const char *nl = (const char *)memchr( data + pos, '\n', len - pos );
+        if ( nl == NULL ) {
+            return 0;
+        }
+        size_t lineEnd = nl - data + 1;
+        const char *line = data + pos;
+        if ( type == REQUEST_GET && strncmp( line, "VALUE ", 6 ) == 0 ) {
+            const char *lastSpace = (const char *)memrchr( line, ' ', nl - line );
+            size_t end = lineEnd + atol( lastSpace + 1 ) + 2;
+            if ( end > len ) {
+                return 0;
+            }
+            *hit = true;
+            pos = end;
+            continue;
+        }
+        if ( type == REQUEST_GET ) {
+            *error = strncmp( line, "END\r", 4 ) != 0;
+        } else {
+            *error = strncmp( line, "STORED\r", 7 ) != 0;
+        }
+        return lineEnd;
+    }
+}
+
+// Read what the socket has and record every response complete.
+static bool readResponses( BenchThread *bt, BenchConn *conn ) {
+    while ( 1 ) {
+        if ( conn->in.size() - conn->inLen < BUFFSIZE ) {
+            conn->in.resize( conn->in.size() * 2 );
+        }
+        ssize_t n = read( conn->fd, conn->in.data() + conn->inLen,
+                          conn->in.size() - conn->inLen );
+        if ( n < 0 && errno == EINTR ) {
+            continue;
+        }
+        if ( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) {
+            break;
+        }
+        if ( n <= 0 ) {
+            return false;
+        }
+        conn->inLen += n;
+    }
+
+    size_t pos = 0;
+    uint64_t now = nowNanos();
+    while ( inflightCount( conn ) > 0 ) {
+        Request *req = &conn->inflight[conn->inflightPos];
+        bool hit, error;
+        size_t len = parseResponse( req->type, conn->in.data() + pos, conn->inLen - pos,
+                                    &hit, &error );
+        if ( len == 0 ) {
+            break;
+        }
+        pos += len;
+        bt->latency[req->type].record( now > req->start ? now - req->start : 0 );
+        bt->done[req->type]++;
+        bt->hits += hit;
+        bt->errors += error;
+        conn->inflightPos++;
+    }
+    if ( conn->inflightPos == conn->inflight.size() || conn->inflightPos >= 1024 ) {
+        conn->inflight.erase( conn->inflight.begin(),
+                              conn->inflight.begin() + conn->inflightPos );
+        conn->inflightPos = 0;
+    }
+    memmove( conn->in.data(), conn->in.data() + pos, conn->inLen - pos );
+    conn->inLen -= pos;
+    return true;
+}
+
+// Add the requests that are due on the connection: up to depth in
+// flight in closed loop, the ones whose time came in open loop.
+static void addDueRequests( BenchThread *bt, BenchConn *conn, uint64_t *rand,
+                            uint64_t now ) {
+    if ( bt->config->rate == 0 ) {
+        while ( inflightCount( conn ) < bt->config->depth ) {
+            addRequest( bt, conn, rand, now );
+        }
+        return;
+    }
+    while ( conn->nextDue <= now && inflightCount( conn ) < MCBENCH_MAX_INFLIGHT ) {
+        addRequest( bt, conn, rand, conn->nextDue );
+        conn->nextDue += conn->interval;
+    }
+}
+
+static void * benchThreadFunc( void *arg ) {
+    BenchThread *bt = (BenchThread *)arg;
+    BenchConfig *config = bt->config;
+    uint64_t rand = 0x9E3779B97F4A7C15ULL * ( bt->id + 1 );
+    vector< BenchConn > conns;
+    int epollfd = epoll_create1( 0 );
+    for ( int c = bt->id; c < config->numConns; c += config->numThreads ) {
+        BenchConn conn;
+        conn.fd = benchConnect( config );
+        if ( conn.fd < 0 ) {
+            bt->failed = true;
+            break;
+        }
+        fcntl( conn.fd, F_SETFL, fcntl( conn.fd, F_GETFL, 0 ) | O_NONBLOCK );
+        conn.inflightPos = 0;
+        conn.outPos = 0;
+        conn.in.resize( 4 * BUFFSIZE );
+        conn.inLen = 0;
+        conn.interval = config->rate > 0 ? 1e9 * config->numConns / config->rate : 0;
+        conn.writable = true;
+        conns.push_back( conn );
+    }
+    for ( size_t i = 0; i < conns.size(); i++ ) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.u64 = i;
+        epoll_ctl( epollfd, EPOLL_CTL_ADD, conns[i].fd, &ev );
+    }
+    pthread_barrier_wait( bt->barrier );
+
+    uint64_t start = nowNanos();
+    uint64_t end = start + (uint64_t)( config->duration * 1e9 );
+    uint64_t drainEnd = end + MCBENCH_DRAIN_SECS * 1000000000ULL;
+    for ( size_t i = 0; i < conns.size(); i++ ) {
+        // Spread the first requests of the connections over an interval.
+        conns[i].nextDue = start + conns[i].interval * i / conns.size();
+    }
+    struct epoll_event events[64];
+    while ( !bt->failed ) {
+        uint64_t now = nowNanos();
+        bool sending = now < end;
+        int pending = 0;
+        uint64_t nextDue = UINT64_MAX;
+        for ( size_t i = 0; i < conns.size(); i++ ) {
+            BenchConn *conn = &conns[i];
+            if ( sending ) {
+                addDueRequests( bt, conn, &rand, now );
+                nextDue = min( nextDue, conn->nextDue );
+            }
+            if ( conn->writable && !flushOut( conn ) ) {
+                bt->failed = true;
+            }
+            pending += inflightCount( conn );
+        }
+        if ( ( !sending && pending == 0 ) || now >= drainEnd ) {
+            break;
+        }
+
+        // In open loop wake up for the next request due, the last
+        // millisecond of the wait spinning.
+        int timeout = 10;
+        if ( sending && config->rate > 0 ) {
+            timeout = nextDue <= now ? 0 : ( nextDue - now ) / 1000000;
+        }
+        int n = epoll_wait( epollfd, events, 64, timeout );
+        for ( int e = 0; e < n; e++ ) {
+            BenchConn *conn = &conns[events[e].data.u64];
+            if ( events[e].events & EPOLLOUT ) {
+                conn->writable = true;
+            }
+            if ( ( events[e].events & ( EPOLLIN | EPOLLHUP | EPOLLERR ) ) &&
+                 !readResponses( bt, conn ) ) {
+                bt->failed = true;
+            }
+        }
+    }
+    for ( size_t i = 0; i < conns.size(); i++ ) {
+        close( conns[i].fd );
+    }
+    close( epollfd );
+    return NULL;
+}
+
+// Set every key once, so the gets of the run find them.
+static bool loadKeys( BenchConfig *config, vector< string > *keys, const string &values ) {
+    int fd = benchConnect( config );
+    if ( fd < 0 ) {
+        return false;
+    }
+    uint64_t rand = 0x2545F4914F6CDD1DULL;
+    vector< char > in( BUFFSIZE );
+    bool ok = true;
+    for ( size_t k = 0; ok && k < keys->size(); k += MCBENCH_LOAD_BATCH ) {
+        string out;
+        size_t count = min( (size_t)MCBENCH_LOAD_BATCH, keys->size() - k );
+        for ( size_t i = 0; i < count; i++ ) {
+            int size = config->minValue +
+                       zipfRandom( &rand ) % ( config->maxValue - config->minValue + 1 );
+            char line[64];
+            snprintf( line, sizeof( line ), " 0 0 %d\r\n", size );
+            out += "set " + ( *keys )[k + i] + line;
+            out.append( values, 0, size );
+            out += "\r\n";
+        }
+        for ( size_t pos = 0; ok && pos < out.size(); ) {
+            ssize_t n = write( fd, out.data() + pos, out.size() - pos );
+            ok = n > 0;
+            pos += n;
+        }
+        // One line per set.
+        for ( size_t lines = 0; ok && lines < count; ) {
+            ssize_t n = read( fd, in.data(), in.size() );
+            ok = n > 0;
+            for ( ssize_t i = 0; i < n; i++ ) {
+                lines += in[i] == '\n';
+            }
+        }
+    }
+    close( fd );
+    return ok;
+}
+
+static void usage( const char *prog ) {
+    fprintf( stderr, "Usage: %s [-H host] [-p port] [-c connections] [-t threads] "
+             "[-d depth] [-g getRatio] [-k keys] [-z theta] [-v size|min-max] "
+             "[-R rate] [-E us] [-D seconds] [-L]\n", prog );
+    fprintf( stderr, "  -c <num>  connections, default 8\n" );
+    fprintf( stderr, "  -t <num>  client threads, default 2\n" );
+    fprintf( stderr, "  -d <num>  requests in flight per connection in closed loop, "
+             "default 1\n" );
+    fprintf( stderr, "  -g <frac> share of gets, the rest are sets, default 0.9\n" );
+    fprintf( stderr, "  -k <num>  keys, default 100000\n" );
+    fprintf( stderr, "  -z <num>  Zipf skew of the keys in (0, 1), default 0 for uniform\n" );
+    fprintf( stderr, "  -v <num>  value size in bytes, or min-max for sizes uniform in "
+             "between, default 100\n" );
+    fprintf( stderr, "  -R <num>  open loop at this many requests per second over all "
+             "connections, default 0 for closed loop\n" );
+    fprintf( stderr, "  -E <num>  closed loop, also print the latencies corrected for "
+             "coordinated omission\n"
+             "            with requests expected every num microseconds on a "
+             "connection, default 0 for none\n" );
+    fprintf( stderr, "  -D <num>  seconds to run, default 10\n" );
+    fprintf( stderr, "  -L        set every key before the run\n" );
+}
+
+// A line of percentiles per request type, of the latencies in raw
+// corrected with interval if it isn't 0.
+static void printLatencies( const char *title, const BenchConfig *config,
+                            const HdrHistogram *raw, const uint64_t *done,
+                            uint64_t interval ) {
+    printf( "# latency in us, %s\n", title );
+    printf( "%-6s %12s %10s %10s %10s %10s %10s %10s\n", "type", "ops/s", "p50", "p90",
+            "p99", "p99.9", "p99.99", "max" );
+    for ( int t = 0; t <= NUM_REQUEST_TYPES; t++ ) {
+        HdrHistogram latency;
+        latency.addCorrected( raw[t], interval );
+        printf( "%-6s %12.0f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                requestTypeNames[t], done[t] / config->duration,
+                latency.percentile( 0.5 ) / 1e3, latency.percentile( 0.9 ) / 1e3,
+                latency.percentile( 0.99 ) / 1e3, latency.percentile( 0.999 ) / 1e3,
+                latency.percentile( 0.9999 ) / 1e3, latency.maxValue() / 1e3 );
+    }
+}
+
+int main( int argc, char **argv ) {
+    BenchConfig config;
+    config.host = "127.0.0.1";
+    config.port = MEMCACHED_PORT;
+    config.numConns = 8;
+    config.numThreads = 2;
+    config.depth = 1;
+    config.getRatio = 0.9;
+    config.numKeys = 100000;
+    config.zipfTheta = 0;
+    config.minValue = 100;
+    config.maxValue = 100;
+    config.rate = 0;
+    config.expectedInterval = 0;
+    config.duration = 10;
+    config.load = false;
+
+    int opt;
+    while ( ( opt = getopt( argc, argv, "H:p:c:t:d:g:k:z:v:R:E:D:Lh" ) ) != -1 ) {
+        switch ( opt ) {
+        case 'H': config.host = optarg; break;
+        case 'p': config.port = atoi( optarg ); break;
+        case 'c': config.numConns = atoi( optarg ); break;
+        case 't': config.numThreads = atoi( optarg ); break;
+        case 'd': config.depth = atoi( optarg ); break;
+        case 'g': config.getRatio = atof( optarg ); break;
+        case 'k': config.numKeys = atoi( optarg ); break;
+        case 'z': config.zipfTheta = atof( optarg ); break;
+        case 'v':
+            if ( sscanf( optarg, "%d-%d", &config.minValue, &config.maxValue ) != 2 ) {
+                config.minValue = config.maxValue = atoi( optarg );
+            }
+            break;
+        case 'R': config.rate = atof( optarg ); break;
+        case 'E': config.expectedInterval = (uint64_t)( atof( optarg ) * 1e3 ); break;
+        case 'D': config.duration = atof( optarg ); break;
+        case 'L': config.load = true; break;
+        default:
+            usage( argv[0] );
+            return 1;
+        }
+    }
+    if ( config.numConns <= 0 || config.numThreads <= 0 || config.depth <= 0 ||
+         config.getRatio < 0 || config.getRatio > 1 || config.numKeys <= 0 ||
+         config.zipfTheta < 0 || config.zipfTheta >= 1 || config.minValue < 0 ||
+         config.maxValue < config.minValue || config.maxValue > MCBENCH_MAX_VALUE ||
+         config.rate < 0 || config.duration <= 0 ||
+         ( config.rate > 0 && config.expectedInterval > 0 ) ) {
+        usage( argv[0] );
+        return 1;
+    }
+    config.numThreads = min( config.numThreads, config.numConns );
+    signal( SIGPIPE, SIG_IGN );
+
+    vector< string > keys;
+    for ( int i = 0; i < config.numKeys; i++ ) {
+        keys.push_back( "key:" + to_string( (long long int)i ) );
+    }
+    string values( config.maxValue, 'v' );
+    ZipfGenerator *zipf = NULL;
+    if ( config.zipfTheta > 0 ) {
+        zipf = new ZipfGenerator( config.numKeys, config.zipfTheta );
+    }
+
+    char dist[32], valueDist[32], mode[48];
+    if ( zipf != NULL ) {
+        snprintf( dist, sizeof( dist ), "zipf:%.2f", config.zipfTheta );
+    } else {
+        snprintf( dist, sizeof( dist ), "uniform" );
+    }
+    snprintf( valueDist, sizeof( valueDist ), config.minValue == config.maxValue ? "%d" :
+              "%d-%d", config.minValue, config.maxValue );
+    if ( config.rate > 0 ) {
+        snprintf( mode, sizeof( mode ), "open rate=%.0f/s", config.rate );
+    } else {
+        snprintf( mode, sizeof( mode ), "closed depth=%d", config.depth );
+    }
+    printf( "# connections=%d threads=%d %s gets=%.2f keys=%d dist=%s values=%s "
+            "duration=%.0fs\n", config.numConns, config.numThreads, mode, config.getRatio,
+            config.numKeys, dist, valueDist, config.duration );
+
+    if ( config.load && !loadKeys( &config, &keys, values ) ) {
+        pr_info( "Loading the keys failed, is the server running on %s:%d?\n",
+                 config.host, config.port );
+        return 1;
+    }
+
+    pthread_barrier_t barrier;
+    pthread_barrier_init( &barrier, NULL, config.numThreads );
+    vector< BenchThread * > threads;
+    for ( int i = 0; i < config.numThreads; i++ ) {
+        BenchThread *bt = new BenchThread();
+        bt->id = i;
+        bt->config = &config;
+        bt->keys = &keys;
+        bt->zipf = zipf;
+        bt->values = &values;
+        bt->barrier = &barrier;
+        memset( bt->done, 0, sizeof( bt->done ) );
+        bt->hits = 0;
+        bt->errors = 0;
+        bt->failed = false;
+        threads.push_back( bt );
+        pthread_create( &bt->threadId, NULL, benchThreadFunc, bt );
+    }
+
+    HdrHistogram raw[NUM_REQUEST_TYPES + 1];
+    uint64_t done[NUM_REQUEST_TYPES + 1] = { 0 };
+    uint64_t hits = 0, errors = 0;
+    bool failed = false;
+    for ( int i = 0; i < config.numThreads; i++ ) {
+        pthread_join( threads[i]->threadId, NULL );
+        for ( int t = 0; t < NUM_REQUEST_TYPES; t++ ) {
+            raw[t].add( threads[i]->latency[t] );
+            raw[NUM_REQUEST_TYPES].add( threads[i]->latency[t] );
+            done[t] += threads[i]->done[t];
+            done[NUM_REQUEST_TYPES] += threads[i]->done[t];
+        }
+        hits += threads[i]->hits;
+        errors += threads[i]->errors;
+        failed = failed || threads[i]->failed;
+        delete threads[i];
+    }
+    pthread_barrier_destroy( &barrier );
+    if ( failed ) {
+        pr_info( "A connection failed, is the server running on %s:%d?\n",
+                 config.host, config.port );
+        return 1;
+    }
+
+    double gets = done[REQUEST_GET];
+    printf( "# ops/s %.0f, hit ratio %.3f, errors %llu\n",
+            done[NUM_REQUEST_TYPES] / config.duration, gets > 0 ? hits / gets : 0.0,
+            (unsigned long long)errors );
+    printLatencies( config.rate > 0 ? "from the due time" : "from the send time",
+                    &config, raw, done, 0 );
+    if ( config.expectedInterval > 0 ) {
+        char title[64];
+        snprintf( title, sizeof( title ), "corrected for a request every %.1f us",
+                  config.expectedInterval / 1e3 );
+        printLatencies( title, &config, raw, done, config.expectedInterval );
+    }
+    delete zipf;
+    return 0;
+}
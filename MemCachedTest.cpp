@@ -3,6 +3,8 @@
 #include <string.h>
 #include <iostream>
 #include <pthread.h>
+#include <string>
+#include <vector>
 
 using namespace std;
 
@@ -66,8 +68,8 @@ void simplePresentAbsentKeyTest() {
   fprintf( stderr, "FINISHED %s \n\n", __func__ );
 }
 
-// This tries to store more than 1024 keys which is the current configured
-// size of mymemcached's LRU queue. This verifies the LRU aspect of
+// This tries to store 1500 values of 100KB, more than the default 64MB
+// memory limit of mymemcached. This verifies the LRU aspect of
 // mymemcacehd.
 void lruCacheEvictionTest() {
   fprintf( stderr, "RUNNING %s \n", __func__ );
@@ -75,7 +77,7 @@ void lruCacheEvictionTest() {
   memcached_st *memc;
   memcached_return rc;
   string key = "keystring";
-  string value = "keyvalue";
+  string value = string( 100 * 1024, 'v' );
 
   int numKeys = 1500;
 
@@ -126,6 +128,257 @@ void lruCacheEvictionTest() {
   fprintf( stderr, "FINISHED %s \n\n", __func__ );
 }
 
+// Store a batch of keys and fetch them, plus some absent ones, with a
+// single multi key get.
+void multiGetTest() {
+  fprintf( stderr, "RUNNING %s \n", __func__ );
+  memcached_server_st *servers = NULL;
+  memcached_st *memc;
+  memcached_return rc;
+  string key = "mgetkey";
+  string value = "mgetvalue";
+
+  int numKeys = 100;
+
+  memc = memcached_create(NULL);
+  servers = memcached_server_list_append(servers, "localhost", 11211, &rc);
+  rc = memcached_server_push(memc, servers);
+
+  if (rc == MEMCACHED_SUCCESS)
+    fprintf(stderr, "Added server successfully\n");
+  else
+    fprintf(stderr, "Couldn't add server: %s\n", memcached_strerror(memc, rc));
+
+  // Store every other key so half of the get misses.
+  vector<string> keys;
+  for( int i = 0; i < numKeys ; i++ ) {
+      string currKey = key + to_string( (long long int)i );
+      keys.push_back( currKey );
+      if ( i % 2 == 0 ) {
+          string currValue = value + to_string( (long long int)i );
+          rc = memcached_set(memc, currKey.c_str(), currKey.size(), currValue.c_str(), currValue.size(), (time_t)0, (uint32_t)0);
+          if (rc != MEMCACHED_SUCCESS)
+            fprintf(stderr, "Couldn't store key: %s\n", memcached_strerror(memc, rc));
+      }
+  }
+
+  vector<const char *> keyPtrs;
+  vector<size_t> keyLengths;
+  for( int i = 0; i < numKeys ; i++ ) {
+      keyPtrs.push_back( keys[i].c_str() );
+      keyLengths.push_back( keys[i].size() );
+  }
+
+  rc = memcached_mget(memc, keyPtrs.data(), keyLengths.data(), numKeys);
+  if (rc != MEMCACHED_SUCCESS)
+    fprintf(stderr, "Couldn't send multi get: %s\n", memcached_strerror(memc, rc));
+
+  int successCount = 0, failureCount = 0;
+  memcached_result_st *result;
+  while ((result = memcached_fetch_result(memc, NULL, &rc)) != NULL) {
+      string gotKey( memcached_result_key_value(result), memcached_result_key_length(result) );
+      string gotValue( memcached_result_value(result), memcached_result_length(result) );
+      if ( gotValue == value + gotKey.substr( key.size() ) )
+          successCount++;
+      else
+          failureCount++;
+      memcached_result_free(result);
+  }
+  fprintf( stderr, "Multi get returned %d correct, %d wrong values, expected %d \n",
+           successCount, failureCount, numKeys / 2 );
+
+  memcached_free( memc );
+  fprintf( stderr, "FINISHED %s \n\n", __func__ );
+}
+
+// Stores a key with flags and a 2 second exptime. The flags must come
+// back with the value, and the key must be gone after it expired.
+void flagsExptimeTest() {
+  fprintf( stderr, "RUNNING %s \n", __func__ );
+  memcached_server_st *servers = NULL;
+  memcached_st *memc;
+  memcached_return rc;
+  char key[] = "expiringkey";
+  char value[] = "expiringvalue";
+
+  char *retrieved_value;
+  size_t value_length;
+  uint32_t flags;
+
+  memc = memcached_create(NULL);
+  servers = memcached_server_list_append(servers, "localhost", 11211, &rc);
+  rc = memcached_server_push(memc, servers);
+
+  if (rc == MEMCACHED_SUCCESS)
+    fprintf(stderr, "Added server successfully\n");
+  else
+    fprintf(stderr, "Couldn't add server: %s\n", memcached_strerror(memc, rc));
+
+  rc = memcached_set(memc, key, strlen(key), value, strlen(value), (time_t)2, (uint32_t)1234);
+  if (rc != MEMCACHED_SUCCESS)
+    fprintf(stderr, "Couldn't store key: %s\n", memcached_strerror(memc, rc));
+
+  retrieved_value = memcached_get(memc, key, strlen(key), &value_length, &flags, &rc);
+  if (rc == MEMCACHED_SUCCESS) {
+    fprintf(stderr, "Key retrieved with flags %u, expected 1234\n", flags);
+    free(retrieved_value);
+  }
+  else
+    fprintf(stderr, "Couldn't retrieve key : %s : %s\n", key, memcached_strerror(memc, rc));
+
+  sleep( 3 );
+  retrieved_value = memcached_get(memc, key, strlen(key), &value_length, &flags, &rc);
+  if (rc == MEMCACHED_SUCCESS) {
+    fprintf(stderr, "Key '%s' still present after its exptime\n", key);
+    free(retrieved_value);
+  }
+  else
+    fprintf(stderr, "Key expired : %s : %s\n", key, memcached_strerror(memc, rc));
+
+  memcached_free( memc );
+  fprintf( stderr, "FINISHED %s \n\n", __func__ );
+}
+
+// Same as simplePresentAbsentKeyTest over the binary protocol, and
+// deletes the key at the end.
+void binaryProtocolTest() {
+  fprintf( stderr, "RUNNING %s \n", __func__ );
+  memcached_server_st *servers = NULL;
+  memcached_st *memc;
+  memcached_return rc;
+  char key[] = "binarykey";
+  char value[] = "binaryvalue";
+
+  char *retrieved_value;
+  size_t value_length;
+  uint32_t flags;
+
+  memc = memcached_create(NULL);
+  memcached_behavior_set(memc, MEMCACHED_BEHAVIOR_BINARY_PROTOCOL, 1);
+  servers = memcached_server_list_append(servers, "localhost", 11211, &rc);
+  rc = memcached_server_push(memc, servers);
+
+  if (rc == MEMCACHED_SUCCESS)
+    fprintf(stderr, "Added server successfully\n");
+  else
+    fprintf(stderr, "Couldn't add server: %s\n", memcached_strerror(memc, rc));
+
+  rc = memcached_set(memc, key, strlen(key), value, strlen(value), (time_t)0, (uint32_t)42);
+  if (rc != MEMCACHED_SUCCESS)
+    fprintf(stderr, "Couldn't store key: %s\n", memcached_strerror(memc, rc));
+
+  retrieved_value = memcached_get(memc, key, strlen(key), &value_length, &flags, &rc);
+  if (rc == MEMCACHED_SUCCESS) {
+    fprintf(stderr, "The key '%s' returned value '%.*s' with flags %u.\n", key,
+            (int)value_length, retrieved_value, flags);
+    free(retrieved_value);
+  }
+  else
+    fprintf(stderr, "Couldn't retrieve key : %s : %s\n", key, memcached_strerror(memc, rc));
+
+  rc = memcached_delete(memc, key, strlen(key), (time_t)0);
+  if (rc != MEMCACHED_SUCCESS)
+    fprintf(stderr, "Couldn't delete key: %s\n", memcached_strerror(memc, rc));
+
+  retrieved_value = memcached_get(memc, key, strlen(key), &value_length, &flags, &rc);
+  if (rc == MEMCACHED_SUCCESS) {
+    fprintf(stderr, "Key '%s' still present after delete\n", key);
+    free(retrieved_value);
+  }
+  else
+    fprintf(stderr, "Deleted key is gone : %s : %s\n", key, memcached_strerror(memc, rc));
+
+  memcached_free( memc );
+  fprintf( stderr, "FINISHED %s \n\n", __func__ );
+}
+
+// Increments and decrements a counter, appends and prepends to a
+// value, and replaces it with cas, once with the CAS unique gets
+// returned and once with the one it had before. Then touches and
+// deletes the key.
+void mutationCommandsTest() {
+  fprintf( stderr, "RUNNING %s \n", __func__ );
+  memcached_server_st *servers = NULL;
+  memcached_st *memc;
+  memcached_return rc;
+  char key[] = "counterkey";
+  char value[] = "10";
+  const char *keys[] = { key };
+  size_t keyLengths[] = { strlen(key) };
+  uint64_t number;
+
+  memc = memcached_create(NULL);
+  memcached_behavior_set(memc, MEMCACHED_BEHAVIOR_SUPPORT_CAS, 1);
+  servers = memcached_server_list_append(servers, "localhost", 11211, &rc);
+  rc = memcached_server_push(memc, servers);
+
+  if (rc == MEMCACHED_SUCCESS)
+    fprintf(stderr, "Added server successfully\n");
+  else
+    fprintf(stderr, "Couldn't add server: %s\n", memcached_strerror(memc, rc));
+
+  rc = memcached_set(memc, key, strlen(key), value, strlen(value), (time_t)0, (uint32_t)0);
+  if (rc != MEMCACHED_SUCCESS)
+    fprintf(stderr, "Couldn't store key: %s\n", memcached_strerror(memc, rc));
+
+  rc = memcached_increment(memc, key, strlen(key), 5, &number);
+  if (rc == MEMCACHED_SUCCESS)
+    fprintf(stderr, "Incremented to %llu, expected 15\n", (unsigned long long)number);
+  else
+    fprintf(stderr, "Couldn't increment key : %s : %s\n", key, memcached_strerror(memc, rc));
+
+  rc = memcached_decrement(memc, key, strlen(key), 20, &number);
+  if (rc == MEMCACHED_SUCCESS)
+    fprintf(stderr, "Decremented to %llu, expected 0\n", (unsigned long long)number);
+  else
+    fprintf(stderr, "Couldn't decrement key : %s : %s\n", key, memcached_strerror(memc, rc));
+
+  rc = memcached_append(memc, key, strlen(key), "ab", 2, (time_t)0, (uint32_t)0);
+  if (rc != MEMCACHED_SUCCESS)
+    fprintf(stderr, "Couldn't append to key: %s\n", memcached_strerror(memc, rc));
+  rc = memcached_prepend(memc, key, strlen(key), "yz", 2, (time_t)0, (uint32_t)0);
+  if (rc != MEMCACHED_SUCCESS)
+    fprintf(stderr, "Couldn't prepend to key: %s\n", memcached_strerror(memc, rc));
+
+  uint64_t cas = 0;
+  rc = memcached_mget(memc, keys, keyLengths, 1);
+  memcached_result_st *result;
+  while ((result = memcached_fetch_result(memc, NULL, &rc)) != NULL) {
+      fprintf(stderr, "The key '%s' returned value '%.*s', expected 'yz0ab'\n", key,
+              (int)memcached_result_length(result), memcached_result_value(result));
+      cas = memcached_result_cas(result);
+      memcached_result_free(result);
+  }
+
+  rc = memcached_cas(memc, key, strlen(key), "new", 3, (time_t)0, (uint32_t)7, cas);
+  if (rc == MEMCACHED_SUCCESS)
+    fprintf(stderr, "Stored with the CAS unique of gets\n");
+  else
+    fprintf(stderr, "Couldn't cas key : %s : %s\n", key, memcached_strerror(memc, rc));
+  rc = memcached_cas(memc, key, strlen(key), "old", 3, (time_t)0, (uint32_t)7, cas);
+  if (rc == MEMCACHED_DATA_EXISTS)
+    fprintf(stderr, "Stale CAS unique refused\n");
+  else
+    fprintf(stderr, "Stale cas of key '%s' : %s\n", key, memcached_strerror(memc, rc));
+
+  rc = memcached_touch(memc, key, strlen(key), (time_t)100);
+  if (rc != MEMCACHED_SUCCESS)
+    fprintf(stderr, "Couldn't touch key: %s\n", memcached_strerror(memc, rc));
+
+  rc = memcached_delete(memc, key, strlen(key), (time_t)0);
+  if (rc != MEMCACHED_SUCCESS)
+    fprintf(stderr, "Couldn't delete key: %s\n", memcached_strerror(memc, rc));
+
+  rc = memcached_increment(memc, key, strlen(key), 1, &number);
+  if (rc == MEMCACHED_NOTFOUND)
+    fprintf(stderr, "Deleted key is gone : %s : %s\n", key, memcached_strerror(memc, rc));
+  else
+    fprintf(stderr, "Key '%s' still present after delete\n", key);
+
+  memcached_free( memc );
+  fprintf( stderr, "FINISHED %s \n\n", __func__ );
+}
+
 void *setThreadFunc( void *arg) {
   int threadNo = *((int *)arg); 
   memcached_server_st *servers = NULL;
@@ -198,6 +451,96 @@ void *getThreadFunc( void *arg) {
   pthread_exit(NULL);
 }
 
+// Value of a key in concurrentSetGetEvictTest, the key repeated so a
+// get returning memory of another item is caught.
+string evictTestValue( const string &key ) {
+  string value;
+  while ( value.size() < 64 * 1024 ) {
+    value += key;
+  }
+  return value;
+}
+
+struct EvictTestResult {
+  int threadNo;
+  int hits;
+  int misses;
+  int corrupted;
+};
+
+void *setGetEvictThreadFunc( void *arg) {
+  EvictTestResult *result = (EvictTestResult *)arg;
+  memcached_server_st *servers = NULL;
+  memcached_st *memc;
+  memcached_return rc;
+  unsigned int seed = result->threadNo + 1;
+
+  char *retrieved_value;
+  size_t value_length;
+  uint32_t flags;
+
+  memc = memcached_create(NULL);
+  servers = memcached_server_list_append(servers, "localhost", 11211, &rc);
+  rc = memcached_server_push(memc, servers);
+
+  if (rc != MEMCACHED_SUCCESS)
+    fprintf(stderr, "Couldn't add server: %s\n", memcached_strerror(memc, rc));
+
+  for( int i = 0; i < 2000; i++ ) {
+      // 2000 keys of 64KB don't fit in the default 64MB, so sets keep
+      // evicting and replacing items other threads are reading.
+      string currKey = "evictkey" + to_string( (long long int)( rand_r( &seed ) % 2000 ) );
+      if ( rand_r( &seed ) % 2 ) {
+        string currValue = evictTestValue( currKey );
+        memcached_set(memc, currKey.c_str(), currKey.size(), currValue.c_str(), currValue.size(), (time_t)0, (uint32_t)0);
+        continue;
+      }
+      retrieved_value = memcached_get(memc, currKey.c_str(), currKey.size(), &value_length, &flags, &rc);
+      if (rc == MEMCACHED_SUCCESS) {
+        if ( string( retrieved_value, value_length ) == evictTestValue( currKey ) )
+          result->hits++;
+        else
+          result->corrupted++;
+        free(retrieved_value);
+      }
+      else
+        result->misses++;
+  }
+  memcached_free( memc ); 
+  pthread_exit(NULL);
+}
+
+// Sets, gets and evictions of the same keys from several threads at
+// once. Gets don't lock, so this checks that they never see an item
+// that has been freed and reused for another key.
+void concurrentSetGetEvictTest() {
+  fprintf( stderr, "RUNNING %s \n", __func__ );
+  int numThreads = 8;
+  pthread_t threads[numThreads];
+  EvictTestResult results[numThreads];
+
+  for( int i = 0; i < numThreads ; i++ ) {
+        results[i].threadNo = i;
+        results[i].hits = 0;
+        results[i].misses = 0;
+        results[i].corrupted = 0;
+        int ret = pthread_create( &threads[i], NULL, setGetEvictThreadFunc, &results[i]);
+        if( ret ) {
+            fprintf( stderr, "ERROR creating threads %d\n", ret);
+        }
+  }
+
+  int hits = 0, misses = 0, corrupted = 0;
+  for( int i = 0; i < numThreads ; i++ ) {
+        pthread_join( threads[i], NULL );
+        hits += results[i].hits;
+        misses += results[i].misses;
+        corrupted += results[i].corrupted;
+  }
+  fprintf( stderr, "Gets hit %d, missed %d, corrupted %d \n", hits, misses, corrupted );
+  fprintf( stderr, "FINISHED %s \n\n", __func__ );
+}
+
 // This tries to store and retrive keys from multiple threads at the
 // same time.
 void multipleThreadStressTest() {
@@ -238,6 +581,11 @@ void multipleThreadStressTest() {
 int main(int argc, char **argv) {
   simplePresentAbsentKeyTest();
   lruCacheEvictionTest();
+  multiGetTest();
+  flagsExptimeTest();
+  binaryProtocolTest();
+  mutationCommandsTest();
+  concurrentSetGetEvictTest();
   multipleThreadStressTest();
   return 0;
 }
@@ -1,222 +1,350 @@
 #include "Memcached.h" 
+#include "LRUMemCache.h"
+#include "BufferedReader.h"
+#include "BinaryProtocol.h"
+#include "IoUring.h"
+#include "SpscQueue.h"
+#include "Snapshot.h"
+#include "NearCache.h"
 
-// This is a buffered reader used to read from the socket. It tries to
-// read in chunk size of 1024 bytes or whatever is available from the
-// socket. We can just extract commands and values from this buffer
-// like we would be reading from any stream like socket, but it hides
-// or abstraction of how many time we might have to read form the
-// socket to read a command or a value.
-class BufferedReader {
-private:   
-    char buff_[BUFFSIZE]; // Buffer to buffer reads
-    int buffOffset_;      // Offset at which next read from buff_ should happen.
-    int pendingBytes_;    // Number of bytes pending to be read from buff_.
-    int connfd_;          // Connection file descriptor. 
-    int zeroBytesRead_;   // Counter to identify socketimeout if the socket 
-                          // doesn't have any more data.
-public:
-    BufferedReader( int pConnfd ) {
-        connfd_ = pConnfd;
-        buffOffset_ = 0;
-        pendingBytes_ = 0;
-    }
-
-    // Reads 1K or how much every is avaiable from the socket.
-    int read1K( char *buffer ) {
-        int readBytes = read( connfd_, buffer, BUFFSIZE);
-        return readBytes; 
-    }
-
-    // This returns first available command from the buffer.
-    // It first tries to read pendingBytes_ in buffer.
-    // If we dont find a full command in that, we try to read 
-    // more from socket.
-    void readCommand( vector<char> *buffer ) {
-        static int rSeen = false;
-
-        while ( pendingBytes_ > 0 && buffOffset_ < BUFFSIZE ) {
-            if ( buff_[buffOffset_] == '\r' ) {
-                rSeen = true;
-                pendingBytes_--;
-                buffOffset_++;
-                continue;
-            } else if ( buff_[buffOffset_] == '\n' && rSeen ) {
-                rSeen = false;
-                pendingBytes_--;
-                buffOffset_++;
-                return;
-            }
-            buffer->push_back( buff_[buffOffset_]);
-            pendingBytes_--;
-            buffOffset_++;
-        }
-
-        int readBytes;
-        while( 1 ) {
-            readBytes = read1K( buff_ );
+class Connection;
+class EventLoop;
 
-            // If we read zero bytes threadTimeOutSecs number of
-            // times, we assume client has closed the connection.
-            if( readBytes == 0 ) {
-                zeroBytesRead_++;
-                if ( zeroBytesRead_ > threadTimeOutSecs ) {
-                    break;
-                } 
-                sleep( 1 );
-                continue;
-            }
+// Per core mode. The reply of a command whose keys belong to the
+// partitions of other loops, waiting for their answers. Replies of the
+// commands after it wait in line behind it, so the connection still
+// answers in order. Once complete it holds the reply the way
+// sendReplyv takes one, with the copies its buffers point into.
+struct DeferredReply {
+    int waiting_;                  // Messages not back yet, 0 once complete.
+    PartitionOp op_;
+    ConnProtocol protocol_;
+    uint8_t opcode_;               // Binary only.
+    uint32_t opaque_;
+    MemcacheCommand command_;      // Text only, what the reply answers.
+    bool noreply_;                 // Text only, nothing is sent.
+    string key_;                   // Binary get, a getk miss answers with it.
+    vector<MemcachedItem *> items_;   // Of a get, one per key in order.
+    StoreResult stored_;
+    bool deleted_;
+    uint64_t value_;               // Left by incr or decr.
 
-            buffOffset_ = 0;     
-            pendingBytes_ += readBytes;
+    vector<struct iovec> iov_;
+    vector<MemcachedItem *> refs_;
+    list<string> copies_;
 
-            while( pendingBytes_ > 0 && buffOffset_ < BUFFSIZE ) {
-                if ( buff_[buffOffset_] == '\r' ) {
-                    rSeen = true;
-                    pendingBytes_--;
-                    buffOffset_++;
-                    continue;
-                } else if ( buff_[buffOffset_] == '\n' && rSeen ) {
-                    rSeen = false;
-                    pendingBytes_--;
-                    buffOffset_++;
-                    return;
-                }
-                buffer->push_back( buff_[buffOffset_]);
-                pendingBytes_--;
-                buffOffset_++;
-           }
-        }
+    DeferredReply() {
+        waiting_ = 0;
+        op_ = PARTITION_GET;
+        protocol_ = PROTOCOL_TEXT;
+        opcode_ = 0;
+        opaque_ = 0;
+        command_ = COMMAND_INVALID;
+        noreply_ = false;
+        stored_ = STORE_OK;
+        deleted_ = false;
+        value_ = 0;
     }
+};
 
-    // This is used to read the value section of the set command.
-    // It works similar to command above.
-    int readValue( char *buffer, int bytes ) {
-        int totalToRead = bytes;
-        if ( pendingBytes_ > 0 ) {
-            int toRead = pendingBytes_; 
-            if( bytes < pendingBytes_ ) {
-                toRead = bytes;
-            }
-            memcpy( buffer, &(buff_[buffOffset_]), toRead );
-            bytes -= toRead;
-            pendingBytes_ -=toRead;
-            buffOffset_ += toRead;
-            if ( bytes == 0 ) {
-                return totalToRead;
-            }
-        }
+// Per core mode. A request to the loop owning some keys, which sends
+// it back with the answer filled in. Only the loop that sent it
+// allocates, fills and frees it.
+struct PartitionMessage {
+    PartitionOp op_;
+    int source_;                   // Loop that sent it.
+    bool done_;                    // Answered, on its way back.
+    Connection *conn_;
+    DeferredReply *reply_;
+    string keyData_;               // Keys back to back.
+    vector<StringPiece> keys_;     // Into keyData_.
+    vector<uint64_t> hashes_;      // Of keys_, the owner doesn't hash them again.
+    vector<size_t> slots_;         // Index in reply_->items_ of every key.
+    vector<MemcachedItem *> items_;   // Answer of a get, referenced.
+    MemcachedItem *item_;          // Set, its value read, ours until stored.
+    MemcacheCommand command_;      // Set, incr and touch, which one.
+    uint64_t number_;              // CAS unique of cas, delta of incr.
+    uint32_t exptime_;             // Of touch.
+    StoreResult stored_;
+    bool deleted_;
+    uint64_t value_;               // Left by incr.
+};
 
-        int readBytes = 0;
-        while( 1 ) {
-            readBytes = read1K( buff_ );
+// State we keep for every client connection. All of it is owned and
+// touched only by the event loop thread the connection was handed to.
+class Connection {
+public:
+    int fd_;
+    ConnState state_;
+    ConnProtocol protocol_;
+    BufferedReader reader_;
+    MCCommand command_;          // Command being served.
+    // A set reads its value straight into item_, allocated from the
+    // partition owning the key. Without one the value is read into
+    // valueBuffer_ piece by piece and dropped, and the set answered
+    // with itemError_.
+    MemcachedItem *item_;
+    StoreResult itemError_;
+    vector<char> valueBuffer_;
+    int valueRead_;              // Bytes of the value read so far.
+    // Reply buffers the socket didn't take yet, from writeIovPos_ on.
+    // They point into the items of writeRefs_, at constant replies or
+    // at copies in writeCopies_, so nothing moves until they are sent.
+    vector<struct iovec> writeIov_;
+    size_t writeIovPos_;
+    vector<MemcachedItem *> writeRefs_;
+    list<string> writeCopies_;
+    time_t lastActive_;          // Last time we read from the client.
+    // Binary protocol only. The set waiting for its value, and the
+    // responses not handed to sendReplyv yet.
+    uint8_t binaryOpcode_;
+    uint32_t binaryOpaque_;
+    ReplyBatch batch_;
+    // io_uring backend only. Completions the ring still owes us for the
+    // connection, it lives until they came. The send in flight covers
+    // sendBytes_ bytes of writeIov_, a send that came back short means
+    // the socket is backed up.
+    int inflight_;
+    bool recvArmed_;
+    bool sending_;
+    bool backedUp_;
+    bool queued_;                // In the send list of the loop.
+    bool shutdown_;              // Closed, waiting for the completions.
+    struct msghdr sendMsg_;
+    size_t sendBytes_;
+    // Event loop serving the connection. In per core mode its replies
+    // wait here, oldest first, while one of them waits for other loops.
+    EventLoop *loop_;
+    list<DeferredReply *> deferred_;
+    bool draining_;              // In the drain list of the loop.
+    bool deferredFull_;          // Input waits for the line to get shorter.
 
-            if( readBytes == 0 ) {
-                zeroBytesRead_++;
-                if ( zeroBytesRead_ > threadTimeOutSecs ) {
-                    return totalToRead - bytes;
-                } 
-                sleep( 1 );
-                continue;
-            }
+    // Idle list of the owning event loop, least recently active first.
+    Connection *prev_;
+    Connection *next_;
 
-            buffOffset_ = 0;     
-            pendingBytes_ += readBytes;
-            
-            int toRead = pendingBytes_; 
-            if( bytes < pendingBytes_ ) {
-                toRead = bytes;
-            }
-            memcpy( buffer, &(buff_[buffOffset_]), toRead );
-            bytes -= toRead;
-            pendingBytes_ -=toRead;
-            buffOffset_ += toRead;
-            if ( bytes == 0 ) {
-                return totalToRead;
-            }
-        }
+    Connection( int pFd ) : reader_( pFd ) {
+        fd_ = pFd;
+        state_ = CONN_READ_COMMAND;
+        protocol_ = PROTOCOL_UNKNOWN;
+        item_ = NULL;
+        itemError_ = STORE_OK;
+        valueRead_ = 0;
+        binaryOpcode_ = 0;
+        binaryOpaque_ = 0;
+        writeIovPos_ = 0;
+        lastActive_ = 0;
+        inflight_ = 0;
+        recvArmed_ = false;
+        sending_ = false;
+        backedUp_ = false;
+        queued_ = false;
+        shutdown_ = false;
+        memset( &sendMsg_, 0, sizeof( sendMsg_ ) );
+        sendBytes_ = 0;
+        loop_ = NULL;
+        draining_ = false;
+        deferredFull_ = false;
+        prev_ = NULL;
+        next_ = NULL;
+    }
+
+    bool hasPendingWrites() {
+        return writeIovPos_ < writeIov_.size();
     }
 };
 
-// This serves as the LRU cache to store the key-value for Memcached.
-// It has the following.
+// Each event loop thread owns an epoll instance and every connection
+// registered with it. Connections are handed over from the accept
+// loop through pendingFds_ and a wakeup on notifyfd_.
 //
-// 1. Linked list that has item ordered in most recently accessed or
-// stored item in the front.
-// 2. A Map that stored the Node in linked list based of this key.
-// This map helps identify the Node in the linked list in O(1) and we
-// can remove it or promote it in linked list in O(1) again.
-//
-class LRUMemCache {
-private:
-    list< MemcachedItem * > cacheQueue_;
-    unordered_map< string, list< MemcachedItem * >::iterator> cacheMap_;
-    int maxCacheSize_;
+// With the io_uring backend the loop owns a ring instead and accepts
+// its connections itself. In per core mode every loop accepts from its
+// own listening socket and serves its own partition of the cache.
+class EventLoop {
+public:
+    Memcached *memcached_;
+    int id_;
+    pthread_t threadId_;
+    int epollfd_;
+    int notifyfd_;   // eventfd used to wake the loop for new connections and messages.
+    int timerfd_;    // Fires every second to close idle connections and expire items.
+    time_t now_;     // Cached time of the current loop iteration.
+    IoUring *ring_;  // NULL with epoll.
+    vector<Connection *> sendList_;   // Connections with replies to send.
+    int listenfd_;
+    LRUMemCache *cache_;   // Partition of the loop, or the whole cache.
+    // Per core mode. Messages from every other loop, indexed by the
+    // loop sending them, the ones for every other loop waiting for room
+    // in its queue, and the messages we may reuse. sleeping_ is set
+    // while the loop may block, a loop sending to it then wakes it.
+    vector< SpscQueue< PartitionMessage * > * > inbox_;
+    vector< vector< PartitionMessage * > > outbox_;
+    vector< PartitionMessage * > freeMessages_;
+    int sleeping_;
+    vector< int > owners_;                  // Scratch of forwardGet.
+    vector< uint64_t > hashes_;             // Of the keys of the get, same.
+    vector< PartitionMessage * > messages_;
+    // Connections whose oldest deferred reply came complete, sent once
+    // all messages of the round are in. Scratch of flushDeferred.
+    vector< Connection * > drainList_;
+    vector< struct iovec > drainIov_;
+    vector< MemcachedItem * > drainRefs_;
+    // Counters of the loop thread, set once it runs.
+    ThreadStats *stats_;
 
-    // Ensure LRC cache accesses from different threads are isolated.
-    pthread_mutex_t cacheLock;
+    pthread_mutex_t pendingLock_;
+    vector<int> pendingFds_;
 
-public:
-    LRUMemCache( int size ) {
-        maxCacheSize_ = size;
-        pthread_mutex_init( &cacheLock, NULL );
-    }       
-
-    // If the item is present, return it amd move it to front of LRU
-    // list.
-    MemcachedItem * getItem( string key ) {
-        MemcachedItem *retVal = NULL;
-        pthread_mutex_lock ( &cacheLock );
-        if( cacheMap_.find( key) != cacheMap_.end() ) {
-             list< MemcachedItem * >::iterator val = 
-                 cacheMap_.find( key )->second;
-             cacheQueue_.erase( val );
-             cacheQueue_.push_front( *val );
-             retVal = *val;
-        }
-        pthread_mutex_unlock ( &cacheLock );
-        return retVal;
-    }
-
-    // If the item is present update it and move it to front or LRU
-    // list.
-    // If it is not present
-    // 1. If cache is not full, add it to front of list
-    // 2. If the cache is full, evict the last item from list and add
-    // the new item to front
-    void setItem( string key, MemcachedItem * val ) {
-        pthread_mutex_lock ( &cacheLock );
-        // If the value is already present remove it from the queue.
-        if( cacheMap_.find( key) != cacheMap_.end() ) {
-            cacheQueue_.erase( cacheMap_[key] );
+    Connection *idleHead_;
+    Connection *idleTail_;
+
+    EventLoop( Memcached *pMemcached, int pId ) {
+        memcached_ = pMemcached;
+        id_ = pId;
+        epollfd_ = -1;
+        notifyfd_ = -1;
+        timerfd_ = -1;
+        now_ = time( NULL );
+        ring_ = NULL;
+        listenfd_ = -1;
+        cache_ = NULL;
+        sleeping_ = 0;
+        stats_ = NULL;
+        idleHead_ = NULL;
+        idleTail_ = NULL;
+        pthread_mutex_init( &pendingLock_, NULL );
+    }
+
+    void idleListRemove( Connection *conn ) {
+        if ( conn->prev_ ) {
+            conn->prev_->next_ = conn->next_;
         } else {
-            // If the cache is full evict an item
-            if ( cacheQueue_.size() == maxCacheSize_ ) {
-                MemcachedItem *last = cacheQueue_.back();
-                pr_debug( "Evicting key %s\n", last->key_.c_str() );
-                // Remove the last item in queue.
-                cacheQueue_.pop_back();
-                // Update the map.
-                cacheMap_.erase( last->key_ );
-                delete last;
-            }
+            idleHead_ = conn->next_;
+        }
+        if ( conn->next_ ) {
+            conn->next_->prev_ = conn->prev_;
+        } else {
+            idleTail_ = conn->prev_;
+        }
+        conn->prev_ = NULL;
+        conn->next_ = NULL;
+    }
+
+    void idleListAppend( Connection *conn ) {
+        conn->prev_ = idleTail_;
+        conn->next_ = NULL;
+        if ( idleTail_ ) {
+            idleTail_->next_ = conn;
+        } else {
+            idleHead_ = conn;
         }
+        idleTail_ = conn;
+    }
 
-        // Update the map.
-        cacheQueue_.push_front( val );
-        cacheMap_[key] = cacheQueue_.begin();
-        pthread_mutex_unlock ( &cacheLock );
+    // Mark activity on the connection. The idle list stays sorted by
+    // lastActive_ because we only ever append with the current time.
+    void touchConnection( Connection *conn ) {
+        conn->lastActive_ = now_;
+        if ( idleTail_ != conn ) {
+            idleListRemove( conn );
+            idleListAppend( conn );
+        }
     }
+};
+
+// A thread serving the UDP socket. All of them receive from the same
+// socket, each taking up to UDP_BATCH datagrams with one recvmmsg and
+// answering all of them with as few sendmmsg calls as it can. Like
+// the TCP replies, the datagrams point into the items, whose
+// references are dropped once the batch is sent.
+class UdpWorker {
+public:
+    Memcached *memcached_;
+    int id_;
+    pthread_t threadId_;
+    int fd_;
+
+    // Receive side, a buffer, iovec, address and message per datagram.
+    vector<char> recvBuffers_;
+    vector<struct iovec> recvIov_;
+    vector<struct sockaddr_in> recvAddrs_;
+    vector<struct mmsghdr> recvMsgs_;
 
+    // Replies of the batch. Message i has its frame header at
+    // frameHeaders_[i * UDP_HEADER_SIZE] and its iovecs from
+    // sendIovStart_[i] on. The vectors grow while the batch is built,
+    // so the messages are pointed at them right before sending.
+    vector<struct mmsghdr> sendMsgs_;
+    vector<size_t> sendIovStart_;
+    vector<struct iovec> sendIov_;
+    vector<char> frameHeaders_;
+    vector<MemcachedItem *> refs_;
+
+    MCCommand command_;
+    vector<MemcachedItem *> items_;
+    vector<struct iovec> pieces_;   // Reply of one request before it is cut.
+    ThreadStats *stats_;            // Counters of the thread, set once it runs.
+
+    UdpWorker( Memcached *pMemcached, int pId, int pFd )
+        : recvBuffers_( UDP_BATCH * UDP_MAX_REQUEST ), recvIov_( UDP_BATCH ),
+          recvAddrs_( UDP_BATCH ), recvMsgs_( UDP_BATCH ) {
+        memcached_ = pMemcached;
+        id_ = pId;
+        fd_ = pFd;
+        stats_ = NULL;
+        memset( recvMsgs_.data(), 0, sizeof( struct mmsghdr ) * UDP_BATCH );
+        for ( int i = 0; i < UDP_BATCH; i++ ) {
+            recvIov_[i].iov_base = &recvBuffers_[i * UDP_MAX_REQUEST];
+            recvIov_[i].iov_len = UDP_MAX_REQUEST;
+            recvMsgs_[i].msg_hdr.msg_iov = &recvIov_[i];
+            recvMsgs_[i].msg_hdr.msg_iovlen = 1;
+            recvMsgs_[i].msg_hdr.msg_name = &recvAddrs_[i];
+        }
+    }
 };
 
+// What a completion of an event loop ring is about. The user data of
+// an operation is the connection or loop it is for, whose low bits are
+// always clear, with one of these in them.
+#define URING_OP_RECV 0
+#define URING_OP_SEND 1
+#define URING_OP_ACCEPT 2
+#define URING_OP_TIMER 3
+#define URING_OP_CANCEL 4
+#define URING_OP_NOTIFY 5
+#define URING_OP_MASK 7
+
+static inline uint64_t uringData( void *ptr, int op ) {
+    return (uint64_t)(uintptr_t)ptr | op;
+}
+
 // Main Memcached server instance
 class Memcached {
 private:
-   LRUMemCache *lruCache_; // LRU cache that Memcached maintains.
+   // LRU caches that Memcached maintains. One in shared mode, every
+   // loop serves all keys from it. One per loop in per core mode, a key
+   // belongs to the partition partitionOf its hash.
+   vector<LRUMemCache *> partitions_;
+   bool perCore_;
+   int numLoops_;          // Number of event loop threads.
+   vector<EventLoop *> loops_;
+   int nextLoop_;          // Round robin index for new connections.
+   int udpPort_;           // 0 if there is no UDP frontend.
+   int numUdpThreads_;
+   vector<UdpWorker *> udpWorkers_;
+   IoBackend backend_;
+   time_t startTime_;      // For the uptime of "stats".
+   const char *snapshotPath_;    // NULL without a snapshot.
+   int snapshotInterval_;        // Seconds between snapshots, 0 for only at exit.
+   int nearEntries_;       // NearCache of every loop and UDP thread, 0 for none.
+   int maintainInterval_;  // Milliseconds between maintenance passes, 0 for none.
 public:
 
-    // Opens TCP servers in the specified port.
-    int tcpServerOpen(int port)
+    // Opens TCP servers in the specified port. With reusePort every
+    // event loop opens its own and the kernel spreads the connections
+    // over them.
+    int tcpServerOpen(int port, bool reusePort = false)
     {
         int sockfd;
         struct sockaddr_in serveraddr;
@@ -227,12 +355,23 @@ public:
             exit(1);
         }
     
+        // Allow restarting while old connections are in TIME_WAIT.
+        int reuse = 1;
+        setsockopt( sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) );
+        if ( reusePort &&
+             setsockopt( sockfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof( reuse ) ) < 0 ) {
+            pr_info(" Error setting SO_REUSEPORT \n");
+            exit(1);
+        }
+
         bzero(&serveraddr,sizeof(serveraddr));
         serveraddr.sin_family=AF_INET;
         serveraddr.sin_port=htons(port);
         serveraddr.sin_addr.s_addr=INADDR_ANY;
     
-        pr_info("mymemcached started on %s \n",inet_ntoa(serveraddr.sin_addr));
+        if ( !reusePort ) {
+            pr_info("mymemcached started on %s \n",inet_ntoa(serveraddr.sin_addr));
+        }
     
         if(bind(sockfd,(struct sockaddr *)&serveraddr,sizeof(struct sockaddr))==-1)
         {
@@ -248,217 +387,2605 @@ public:
         return sockfd;
     }
    
-    // After we have read the first line of the command, this function
-    // tokenizes it based on space delimiter and extract the command
-    // into MCCommand.
-    void extractCommand( vector<char> *commandBuffer,
-                         MCCommand *mcCommand ) {
-        commandBuffer->push_back( '\0' );
-        char *buffStr = commandBuffer->data();
-        char *token;
-        int i = 1;
-        token = strtok( buffStr, " ");
-        while ( token !=NULL ) {
-            if( i == 1) {
-                // Checking command
-                if ( strcmp( token, "set") == 0 ) {
-                    mcCommand->command_ = COMMAND_SET;
-                } else if ( strcmp( token, "get") == 0 ) { 
-                    mcCommand->command_ = COMMAND_GET;
-                } else {
-                    // Unsupported command
-                    mcCommand->command_ = COMMAND_INVALID;
-                    return;
+    // Opens the UDP socket of the get frontend on port. Reads time out
+    // every second so an idle UDP thread still frees what it retired.
+    int udpServerOpen( int port ) {
+        int sockfd = socket( AF_INET, SOCK_DGRAM, 0 );
+        if ( sockfd < 0 ) {
+            pr_info( " UDP Socket Creation Error \n" );
+            exit( 1 );
+        }
+        int reuse = 1;
+        setsockopt( sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) );
+        struct timeval timeout;
+        timeout.tv_sec = 1;
+        timeout.tv_usec = 0;
+        setsockopt( sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof( timeout ) );
+
+        struct sockaddr_in serveraddr;
+        memset( &serveraddr, 0, sizeof( serveraddr ) );
+        serveraddr.sin_family = AF_INET;
+        serveraddr.sin_port = htons( port );
+        serveraddr.sin_addr.s_addr = INADDR_ANY;
+        if ( bind( sockfd, (struct sockaddr *)&serveraddr, sizeof( serveraddr ) ) < 0 ) {
+            pr_info( " Error in Binding with the UDP socket \n" );
+            exit( 2 );
+        }
+        pr_info( "mymemcached serving gets on UDP port %d\n", port );
+        return sockfd;
+    }
+
+    // Index of the partition owning a key.
+    size_t partitionOf( uint64_t hash ) {
+        return partitionIndex( hash, partitions_.size() );
+    }
+
+    // Partition owning key if it isn't the one of the loop serving conn,
+    // -1 otherwise. Keys we can't store are served locally, as errors.
+    // The hash of the key is left in *hash for the lookup, wherever it
+    // is done.
+    int remotePartition( Connection *conn, StringPiece key, uint64_t *hash ) {
+        *hash = LRUMemCache::hashKey( key.data, key.size );
+        if ( !perCore_ || key.size == 0 || key.size > KEY_MAX_LENGTH ) {
+            return -1;
+        }
+        int p = partitionOf( *hash );
+        return p == conn->loop_->id_ ? -1 : p;
+    }
+
+    // Any thread may drop a reference, of an item of any partition. A
+    // loan of the NearCache of the thread goes back to it.
+    void releaseItem( MemcachedItem *item ) {
+        if ( threadNearCache != NULL && threadNearCache->returnLoan( item ) ) {
+            return;
+        }
+        partitions_[partitionOf( item->hash_ )]->releaseItem( item );
+    }
+
+    // getItem of cache, which owns key, for a get the calling thread
+    // serves, through its NearCache if it has one. Gets served for
+    // another thread must not use it, only we can take the loan back.
+    MemcachedItem *lookupItem( LRUMemCache *cache, const char *key, size_t keyLen,
+                               uint64_t hash ) {
+        if ( threadNearCache != NULL ) {
+            return threadNearCache->lookup( cache, key, keyLen, hash );
+        }
+        return cache->getItem( key, keyLen, hash );
+    }
+
+    // Same for all the keys of a get, hashes may be NULL.
+    void lookupItems( LRUMemCache *cache, const vector< StringPiece > &keys,
+                      const uint64_t *hashes, vector< MemcachedItem * > *items ) {
+        if ( threadNearCache == NULL ) {
+            cache->getItems( keys, hashes, items );
+            return;
+        }
+        items->resize( keys.size() );
+        for ( size_t i = 0; i < keys.size(); i++ ) {
+            uint64_t hash = hashes != NULL ? hashes[i] :
+                                             LRUMemCache::hashKey( keys[i].data, keys[i].size );
+            (*items)[i] = threadNearCache->lookup( cache, keys[i].data, keys[i].size, hash );
+        }
+    }
+
+    void reclaimRetired() {
+        for ( size_t i = 0; i < partitions_.size(); i++ ) {
+            partitions_[i]->reclaimRetired();
+        }
+    }
+
+    // getItems on the partitions owning the keys, for the threads that
+    // don't own one.
+    void getItems( const vector< StringPiece > &keys, vector< MemcachedItem * > *items ) {
+        if ( partitions_.size() == 1 ) {
+            lookupItems( partitions_[0], keys, NULL, items );
+            return;
+        }
+        items->resize( keys.size() );
+        for ( size_t i = 0; i < keys.size(); i++ ) {
+            uint64_t hash = LRUMemCache::hashKey( keys[i].data, keys[i].size );
+            (*items)[i] = lookupItem( partitions_[partitionOf( hash )], keys[i].data,
+                                      keys[i].size, hash );
+        }
+    }
+
+    // Connections are served from non-blocking sockets.
+    static int setNonBlocking( int fd ) {
+        int flags = fcntl( fd, F_GETFL, 0 );
+        if ( flags < 0 ) {
+            return -1;
+        }
+        return fcntl( fd, F_SETFL, flags | O_NONBLOCK );
+    }
+
+    // Write as much of the iovcnt buffers at *iov as the socket takes,
+    // MAX_IOVECS at a time. *iov and *iovcnt are advanced past what
+    // went out and the first buffer left is trimmed if it went out in
+    // part. Marks the connection closing if the write fails.
+    void writeIovecs( Connection *conn, struct iovec **iov, int *iovcnt ) {
+        while ( *iovcnt > 0 ) {
+            countSyscall();
+            ssize_t written = writev( conn->fd_, *iov, 
+                                      *iovcnt < MAX_IOVECS ? *iovcnt : MAX_IOVECS );
+            if ( written < 0 ) {
+                if ( errno == EINTR ) {
+                    continue;
                 }
-            } else if( i == 2 ) {
-                mcCommand->key = string( token );
-                if ( mcCommand->command_ == COMMAND_GET ) {
-                    // We dont have to read anymore for get.
-                    return;
+                if ( errno != EAGAIN && errno != EWOULDBLOCK ) {
+                    pr_info( "Error write to socket %d\n", conn->fd_ );
+                    conn->state_ = CONN_CLOSING;
                 }
-            }  else if ( i == 5 ) {
-                // We ignore parametere 3 and 4 in our version of
-                // memcached.
-                // Extract size of get
-                mcCommand->size = atoi( token );
-                // We don't care about noreply
                 return;
             }
-            i++;
-            token = strtok(NULL, " ");
-        } 
+            // Skip what went out, the last buffer may be partial.
+            while ( *iovcnt > 0 && (size_t)written >= (*iov)->iov_len ) {
+                written -= (*iov)->iov_len;
+                (*iov)++;
+                (*iovcnt)--;
+            }
+            if ( *iovcnt > 0 ) {
+                (*iov)->iov_base = (char *)(*iov)->iov_base + written;
+                (*iov)->iov_len -= written;
+            }
+        }
     }
 
-    // Once we identify the command that has been recevied as set,
-    // this handles.
-    //
-    // 1. Read the value for the set command.
-    // 2. Storing it in LRU cache.
-    // 3. Send response to client.
-    void handleSetCommand( int connfd, BufferedReader *buffReader, MCCommand *mcCommand ) {
-        char valueBuffer[ mcCommand->size + 2];
+    // Send a reply made of iovcnt buffers to the client, with as few
+    // writev calls as the socket lets us. The buffers must be constant
+    // replies or point into the nrefs items of refs, whose references
+    // the connection takes over. If the socket can't take all of it
+    // right now, the buffers left are queued as they are, without
+    // copying the values, and flushed when epoll tells us the socket is
+    // writable again. The items are released once they are sent. With
+    // io_uring nothing is written here, all of it is queued for the
+    // loop to send. A reply behind one waiting for another loop waits
+    // in line with it.
+    void sendReplyv( Connection *conn, struct iovec *iov, int iovcnt,
+                     MemcachedItem **refs = NULL, int nrefs = 0 ) {
+        if ( !conn->deferred_.empty() ) {
+            DeferredReply *reply = readyReply( conn );
+            reply->iov_.insert( reply->iov_.end(), iov, iov + iovcnt );
+            reply->refs_.insert( reply->refs_.end(), refs, refs + nrefs );
+            return;
+        }
+        sendNow( conn, iov, iovcnt, refs, nrefs );
+    }
 
-        // Adding plus two include /r/n
-        int bytesRead = buffReader->readValue( valueBuffer, mcCommand->size + 2 );
-        if ( bytesRead != mcCommand->size + 2 ) {
-            pr_info( "Timeout waiting for value on key : %s", mcCommand->key.c_str() );
+    void sendNow( Connection *conn, struct iovec *iov, int iovcnt,
+                  MemcachedItem **refs, int nrefs ) {
+        if ( backend_ == IO_EPOLL && !conn->hasPendingWrites() ) {
+            writeIovecs( conn, &iov, &iovcnt );
         }
-        
-        pr_debug( "Set Command Value :  ");
-        for( int i = 0; i < mcCommand->size; i++ ) {
-            pr_debug( "%c", valueBuffer[i] );
+        if ( iovcnt == 0 || conn->state_ == CONN_CLOSING ) {
+            for ( int i = 0; i < nrefs; i++ ) {
+                releaseItem( refs[i] );
+            }
+            return;
         }
-        pr_debug( "\n" );
+        conn->writeIov_.insert( conn->writeIov_.end(), iov, iov + iovcnt );
+        conn->writeRefs_.insert( conn->writeRefs_.end(), refs, refs + nrefs );
+    }
 
-        MemcachedItem *mcItem = new MemcachedItem( mcCommand->key, 
-                                                   mcCommand->size + 2, 
-                                                   &(valueBuffer[0]) );
+    // Send a reply whose buffer may not outlive the call, anything the
+    // socket doesn't take right now is copied.
+    void sendReply( Connection *conn, const char *data, size_t size ) {
+        struct iovec iov;
+        struct iovec *next = &iov;
+        int iovcnt = 1;
+        iov.iov_base = (void *)data;
+        iov.iov_len = size;
+        if ( !conn->deferred_.empty() ) {
+            DeferredReply *reply = readyReply( conn );
+            reply->copies_.push_back( string( data, size ) );
+            iov.iov_base = (void *)reply->copies_.back().data();
+            reply->iov_.push_back( iov );
+            return;
+        }
+        if ( backend_ == IO_EPOLL && !conn->hasPendingWrites() ) {
+            writeIovecs( conn, &next, &iovcnt );
+        }
+        if ( iovcnt == 0 || conn->state_ == CONN_CLOSING ) {
+            return;
+        }
+        conn->writeCopies_.push_back( string( (char *)iov.iov_base, iov.iov_len ) );
+        iov.iov_base = (void *)conn->writeCopies_.back().data();
+        conn->writeIov_.push_back( iov );
+    }
 
-        lruCache_->setItem( mcCommand->key, mcItem );
+    // Drop everything queued for writing, along with the item
+    // references it held.
+    void releaseWrites( Connection *conn ) {
+        for ( size_t i = 0; i < conn->writeRefs_.size(); i++ ) {
+            releaseItem( conn->writeRefs_[i] );
+        }
+        conn->writeRefs_.clear();
+        conn->writeCopies_.clear();
+        conn->writeIov_.clear();
+        conn->writeIovPos_ = 0;
+    }
 
-        // Key has been store. Send reponse back to client
-        int written = write( connfd, storedReply, storedReplySize );
-        if ( written < 0 ) {
-            pr_info( "Error write to socket %d", connfd);
+    // Whether handleInput has to wait for replies to go out first. With
+    // epoll anything queued means the socket is full. With io_uring all
+    // replies are queued, we only wait once a send came back short.
+    // In per core mode we also wait once too many replies are waiting
+    // for other loops.
+    bool writesBlocked( Connection *conn ) {
+        if ( conn->deferred_.size() >= MAX_DEFERRED_REPLIES ) {
+            return true;
         }
+        return backend_ == IO_URING ? conn->backedUp_ : conn->hasPendingWrites();
     }
 
-    // Once we identify the command that has been recevied as set,
-    // this handle it by getting it from the LRU cache and sending
-    // right reponse back to client.
-    void handleGetCommand( int connfd, MCCommand *mcCommand ) {
-        pr_debug( "Get command key : %s\n", mcCommand->key.c_str() );    
-        MemcachedItem *mcItem = lruCache_->getItem( mcCommand->key );
+    // Per core mode. The last reply in line if it is complete, replies
+    // added behind the waiting ones go there.
+    DeferredReply * readyReply( Connection *conn ) {
+        if ( conn->deferred_.back()->waiting_ > 0 ) {
+            conn->deferred_.push_back( new DeferredReply() );
+        }
+        return conn->deferred_.back();
+    }
 
-        // If item is not in the cache just send END.
-        if( mcItem != NULL ) {
-            pr_debug( "Value :");
-            for( int i = 0; i < mcItem->size_; i++ ) {
-                pr_debug( "%c", mcItem->value_[i] );
+    // Drop the replies still in line, along with the item references
+    // they held.
+    void releaseDeferred( Connection *conn ) {
+        while ( !conn->deferred_.empty() ) {
+            DeferredReply *reply = conn->deferred_.front();
+            conn->deferred_.pop_front();
+            for ( size_t i = 0; i < reply->items_.size(); i++ ) {
+                if ( reply->items_[i] != NULL ) {
+                    releaseItem( reply->items_[i] );
+                }
             }
-            pr_debug( "\n" );
-    
-            // Reduce 2 as size stored includes /r/n
-            int retSize = mcItem->size_ - 2;
-    
-            // Write the text line for response
-            string returnBuffer = string( getReplyStart ) + " " + 
-                                   mcItem->key_ + " 0 " +
-                                   to_string( (long long int)retSize )+ "\r\n";
-            int written = write( connfd, returnBuffer.c_str(), returnBuffer.size());
-            if ( written < 0 ) {
-                pr_info( "Error write to socket %d", __func__, connfd);
+            for ( size_t i = 0; i < reply->refs_.size(); i++ ) {
+                releaseItem( reply->refs_[i] );
             }
-    
-            written = write( connfd, mcItem->value_, mcItem->size_ );
-            if ( written < 0 ) {
-                pr_info( "Error write to socket %d", __func__, connfd);
+            delete reply;
+        }
+    }
+
+    // Write out whatever sendReplyv and sendReply had to queue.
+    void flushWrites( Connection *conn ) {
+        if ( !conn->hasPendingWrites() ) {
+            return;
+        }
+        struct iovec *iov = &conn->writeIov_[conn->writeIovPos_];
+        int iovcnt = conn->writeIov_.size() - conn->writeIovPos_;
+        writeIovecs( conn, &iov, &iovcnt );
+        conn->writeIovPos_ = conn->writeIov_.size() - iovcnt;
+        if ( iovcnt == 0 ) {
+            releaseWrites( conn );
+        }
+    }
+
+    // Get ready to read the value of the set in command_ straight into
+    // a new item of the partition owning its key. The key points into
+    // the read buffer, which the value may move, the item has its own
+    // copy from here on. A set we can't store still has its value read,
+    // it is dropped and the set answered with the error.
+    void startSet( Connection *conn ) {
+        MCCommand *mcCommand = &conn->command_;
+        StringPiece key = mcCommand->key;
+        mcCommand->key = StringPiece();
+        conn->item_ = NULL;
+        conn->itemError_ = STORE_OK;
+        conn->valueRead_ = 0;
+        conn->state_ = CONN_READ_VALUE;
+        // A binary set with bad extras has no command.
+        if ( !storageCommand( mcCommand->command_ ) || key.size == 0 ||
+             key.size > KEY_MAX_LENGTH ) {
+            conn->itemError_ = STORE_BAD_KEY;
+        } else if ( mcCommand->size > ITEM_SIZE_MAX ) {
+            conn->itemError_ = STORE_TOO_LARGE;
+        } else {
+            uint64_t hash = LRUMemCache::hashKey( key.data, key.size );
+            // Adding plus two include /r/n
+            conn->item_ = partitions_[partitionOf( hash )]->allocItem( 
+                              key.data, key.size, hash, mcCommand->size + 2,
+                              mcCommand->flags, expiryTime( mcCommand->exptime ) );
+            if ( conn->item_ == NULL ) {
+                conn->itemError_ = STORE_NO_MEMORY;
+            }
+        }
+        if ( conn->item_ == NULL && conn->valueBuffer_.empty() ) {
+            conn->valueBuffer_.resize( BUFFSIZE );
+        }
+    }
+
+    // Read what came of the value of the set, size bytes in all, into
+    // its item, or into the value buffer to drop it. READ_OK once all
+    // of it is in.
+    ReadStatus readSetValue( Connection *conn, int size ) {
+        while ( conn->valueRead_ < size ) {
+            char *dest;
+            size_t room;
+            if ( conn->item_ != NULL ) {
+                dest = conn->item_->valueAt( conn->valueRead_, &room );
+            } else {
+                dest = conn->valueBuffer_.data();
+                room = conn->valueBuffer_.size();
             }
-         } else {
-            pr_debug( "Key %s not present\n", mcCommand->key.c_str() );
-         }
+            int toRead = min( room, (size_t)( size - conn->valueRead_ ) );
+            int bytesRead;
+            ReadStatus status = conn->reader_.readValue( dest, toRead, &bytesRead );
+            conn->valueRead_ += bytesRead;
+            if ( status != READ_OK ) {
+                return status;
+            }
+        }
+        return READ_OK;
+    }
 
-        int written = write( connfd, endReply, endReplySize );
-        if ( written < 0 ) {
-            pr_info( "Error write to socket %d", __func__, connfd);
+    // Store the set read completely into the item of conn in the LRU
+    // cache, or give back why it has none.
+    StoreResult storeValue( Connection *conn ) {
+        MemcachedItem *mcItem = conn->item_;
+        conn->item_ = NULL;
+        if ( mcItem == NULL ) {
+            return conn->itemError_;
         }
+        pr_debug( "Set Command Value of %d bytes on key : %.*s\n", mcItem->size_ - 2,
+                  mcItem->keyLen_, mcItem->key() );
+        return storeItem( conn->loop_->cache_, mcItem, conn->command_.command_,
+                          conn->command_.number );
     }
 
-    void handleInvalidCommand() {
-        pr_debug( "Invalid memcached command\n");
+    // Store an item of cache, its value filled in, as the storage
+    // command says, cas being the CAS unique of a cas. The item is the
+    // cache's or gone after this.
+    StoreResult storeItem( LRUMemCache *cache, MemcachedItem *mcItem,
+                           MemcacheCommand command, uint64_t cas ) {
+        StoreResult result;
+        switch ( command ) {
+        case COMMAND_CAS:
+            result = cache->casItem( mcItem, cas );
+            break;
+        case COMMAND_APPEND:
+        case COMMAND_PREPEND:
+            // Only the value is used, in a new item.
+            result = cache->concatItem( mcItem, command == COMMAND_APPEND );
+            cache->releaseItem( mcItem );
+            return result;
+        default:
+            result = cache->setItem( mcItem ) ? STORE_OK : STORE_TOO_LARGE;
+            break;
+        }
+        if ( result != STORE_OK ) {
+            cache->releaseItem( mcItem );
+        }
+        return result;
     }
 
-    // Function that handles every connection opened by the client.
-    // Client can send as many commands as it may with a single
-    // connection. 
+    // Once the value of a storage command has been read completely
+    // this handles.
     //
-    // We close the connection if we cannot read from anything from
-    // socket for threadTimeOutSecs.
-    void handleConnection( int connfd ) {
-        BufferedReader *buffReader = new BufferedReader( connfd );
-        while( 1 ) {
-            vector<char> commandBuffer;
-            buffReader->readCommand( &commandBuffer );
-
-            if( commandBuffer.size() == 0 ) {
-                // We are done with timeout. close the connection and
-                // exit the thread.
-                close( connfd );
-                break;
-            }
-    
-            MCCommand mcCommand;
-            extractCommand( &commandBuffer, &mcCommand );
-    
-            if  ( mcCommand.command_ == COMMAND_SET ) {
-                mcCommand.printCommand();
-                handleSetCommand( connfd, buffReader, &mcCommand );
-            } else if ( mcCommand.command_ == COMMAND_GET ) {
-                mcCommand.printCommand();
-                handleGetCommand( connfd, &mcCommand );
+    // 1. Storing it in LRU cache.
+    // 2. Send response to client, unless it said noreply.
+    void handleSetCommand( Connection *conn ) {
+        if ( forwardSet( conn ) ) {
+            return;
+        }
+        MCCommand *mcCommand = &conn->command_;
+        struct iovec iov = textReply( mcCommand->command_, storeValue( conn ) );
+        if ( !mcCommand->noreply ) {
+            sendReplyv( conn, &iov, 1 );
+        }
+    }
+
+    // Text reply of command with result. A successful incr or decr
+    // answers with the number instead.
+    static struct iovec textReply( MemcacheCommand command, StoreResult result ) {
+        struct iovec iov;
+        switch ( result ) {
+        case STORE_OK:
+            if ( command == COMMAND_DELETE ) {
+                iov.iov_base = (void *)deletedReply;
+                iov.iov_len = deletedReplySize;
+            } else if ( command == COMMAND_TOUCH ) {
+                iov.iov_base = (void *)touchedReply;
+                iov.iov_len = touchedReplySize;
             } else {
-                // return error to client. Command is not supported.
-                handleInvalidCommand();
-            } 
+                // Key has been stored. Send response back to client
+                iov.iov_base = (void *)storedReply;
+                iov.iov_len = storedReplySize;
+            }
+            break;
+        case STORE_BAD_KEY:
+            iov.iov_base = (void *)badFormatReply;
+            iov.iov_len = badFormatReplySize;
+            break;
+        case STORE_NO_MEMORY:
+            iov.iov_base = (void *)outOfMemoryReply;
+            iov.iov_len = outOfMemoryReplySize;
+            break;
+        case STORE_NOT_STORED:
+            iov.iov_base = (void *)notStoredReply;
+            iov.iov_len = notStoredReplySize;
+            break;
+        case STORE_EXISTS:
+            iov.iov_base = (void *)existsReply;
+            iov.iov_len = existsReplySize;
+            break;
+        case STORE_NOT_FOUND:
+            iov.iov_base = (void *)notFoundReply;
+            iov.iov_len = notFoundReplySize;
+            break;
+        case STORE_NOT_NUMERIC:
+            iov.iov_base = (void *)notNumericReply;
+            iov.iov_len = notNumericReplySize;
+            break;
+        case STORE_TOO_LARGE:
+        default:
+            iov.iov_base = (void *)tooLargeReply;
+            iov.iov_len = tooLargeReplySize;
+            break;
+        }
+        return iov;
+    }
+
+    // delete, incr, decr or touch of key on cache, which owns it.
+    // exptime is the one of touch on currentTime(), number the delta
+    // of incr and decr, which leave the new value in *value.
+    static StoreResult updateKey( LRUMemCache *cache, MemcacheCommand command,
+                                  StringPiece key, uint64_t hash, uint64_t number,
+                                  uint32_t exptime, uint64_t *value ) {
+        switch ( command ) {
+        case COMMAND_DELETE:
+            return cache->deleteItem( key.data, key.size, hash ) ? STORE_OK : STORE_NOT_FOUND;
+        case COMMAND_TOUCH:
+            return cache->touchItem( key.data, key.size, hash, exptime ) ? STORE_OK :
+                                                                           STORE_NOT_FOUND;
+        default:
+            return cache->incrItem( key.data, key.size, hash, command == COMMAND_INCR,
+                                    number, value );
+        }
+    }
+
+    // Text delete, incr, decr and touch. In per core mode a key of
+    // another loop goes there in a message and the reply waits in line
+    // for it, like the one of a get.
+    void handleUpdateCommand( Connection *conn, MCCommand *mcCommand ) {
+        StringPiece key = mcCommand->key;
+        if ( mcCommand->size < 0 || key.size == 0 || key.size > KEY_MAX_LENGTH ) {
+            sendReply( conn, badFormatReply, badFormatReplySize );
+            return;
+        }
+        MemcacheCommand command = mcCommand->command_;
+        uint32_t exptime = expiryTime( mcCommand->exptime );
+        uint64_t hash;
+        int p = remotePartition( conn, key, &hash );
+        if ( p >= 0 ) {
+            PartitionOp op = command == COMMAND_DELETE ? PARTITION_DELETE :
+                             command == COMMAND_TOUCH ? PARTITION_TOUCH : PARTITION_INCR;
+            DeferredReply *reply = deferReply( conn, op, 0, 0 );
+            PartitionMessage *msg = newMessage( conn, reply, op, p );
+            msg->command_ = command;
+            msg->number_ = mcCommand->number;
+            msg->exptime_ = exptime;
+            msg->keyData_.assign( key.data, key.size );
+            msg->keys_.push_back( StringPiece( msg->keyData_.data(), msg->keyData_.size() ) );
+            msg->hashes_.push_back( hash );
+            sendMessage( conn, msg, p );
+            return;
+        }
+        uint64_t value = 0;
+        StoreResult result = updateKey( conn->loop_->cache_, command, key, hash,
+                                        mcCommand->number, exptime, &value );
+        if ( mcCommand->noreply ) {
+            return;
+        }
+        if ( result == STORE_OK && command != COMMAND_DELETE && command != COMMAND_TOUCH ) {
+            char line[24];
+            int len = snprintf( line, sizeof( line ), "%llu\r\n", (unsigned long long)value );
+            sendReply( conn, line, len );
+            return;
+        }
+        struct iovec iov = textReply( command, result );
+        sendReplyv( conn, &iov, 1 );
+    }
+
+    // Send the binary responses collected in the batch of the
+    // connection with one writev. The formatted part of the batch
+    // moves to writeCopies_, where it stays if the socket doesn't take
+    // all of it right away.
+    void flushBatch( Connection *conn ) {
+        ReplyBatch *batch = &conn->batch_;
+        if ( batch->empty() ) {
+            return;
+        }
+        // Behind a waiting reply the copies wait in line with it.
+        list<string> *copyList = conn->deferred_.empty() ? &conn->writeCopies_ :
+                                 &readyReply( conn )->copies_;
+        copyList->push_back( string() );
+        string &copies = copyList->back();
+        copies.swap( batch->headers_ );
+        batch->finish( copies.data() );
+        sendReplyv( conn, batch->iov_.data(), batch->iov_.size(),
+                    batch->refs_.data(), batch->refs_.size() );
+        if ( conn->deferred_.empty() && !conn->hasPendingWrites() ) {
+            conn->writeCopies_.clear();
         }
+        batch->clear();
     }
 
-    // Worker function called when we create a new thread to server a
-    // connection.
-    static void * workerFunc( void *threadArg ) {
-       ThreadArg *tArg = (ThreadArg *)threadArg;
-       int connfd = tArg->sockfd_;
-       pr_info( "Created new thread %u for connection %d \n", pthread_self(), connfd );        
+    // Binary get, getq, getk and getkq. The quiet ones don't answer a
+    // miss.
+    void handleBinaryGet( Connection *conn, BinaryRequest *req, StringPiece key ) {
+        ReplyBatch *batch = &conn->batch_;
+        if ( req->extrasLen_ != 0 || key.size == 0 || key.size > KEY_MAX_LENGTH ) {
+            batch->addError( req->opcode_, BINARY_STATUS_EINVAL, req->opaque_ );
+            return;
+        }
+        uint64_t hash;
+        int p = remotePartition( conn, key, &hash );
+        if ( p >= 0 ) {
+            DeferredReply *reply = deferReply( conn, PARTITION_GET, req->opcode_,
+                                               req->opaque_ );
+            reply->key_.assign( key.data, key.size );
+            reply->items_.push_back( NULL );
+            PartitionMessage *msg = newMessage( conn, reply, PARTITION_GET, p );
+            msg->keyData_ = reply->key_;
+            msg->keys_.push_back( StringPiece( msg->keyData_.data(), msg->keyData_.size() ) );
+            msg->hashes_.push_back( hash );
+            msg->slots_.push_back( 0 );
+            sendMessage( conn, msg, p );
+            return;
+        }
+        addBinaryGetReply( batch, req->opcode_, req->opaque_, key,
+                           lookupItem( conn->loop_->cache_, key.data, key.size, hash ) );
+    }
 
-       tArg->memcached_->handleConnection( connfd );
+    // Answer a binary get of key with mcItem, which may be NULL. The
+    // batch takes over the reference.
+    static void addBinaryGetReply( ReplyBatch *batch, uint8_t opcode, uint32_t opaque,
+                                   StringPiece key, MemcachedItem *mcItem ) {
+        bool withKey = opcode == BINARY_GETK || opcode == BINARY_GETKQ;
+        if ( mcItem != NULL ) {
+            batch->addItem( opcode, opaque, mcItem, withKey );
+        } else if ( binaryQuiet( opcode ) ) {
+            return;
+        } else if ( withKey ) {
+            // A getk miss answers with the key instead of a message.
+            char header[BINARY_HEADER_SIZE];
+            encodeBinaryResponse( header, opcode, BINARY_STATUS_KEY_ENOENT, key.size,
+                                  0, key.size, opaque );
+            batch->addCopy( header, sizeof( header ) );
+            batch->addCopy( key.data, key.size );
+        } else {
+            batch->addError( opcode, BINARY_STATUS_KEY_ENOENT, opaque );
+        }
+    }
 
-       pr_info( "Exiting thread %u for connection %d \n", pthread_self(), connfd );        
+    // Binary set and setq once their value has been read. setq only
+    // answers errors.
+    void handleBinarySet( Connection *conn ) {
+        if ( conn->item_ != NULL ) {
+            // Stored like the text protocol has it, for the VALUE line.
+            conn->item_->copyIn( conn->command_.size, "\r\n", 2 );
+        }
+        if ( !forwardSet( conn ) ) {
+            addBinarySetReply( &conn->batch_, conn->binaryOpcode_, conn->binaryOpaque_,
+                               storeValue( conn ) );
+        }
+    }
 
-       free( tArg );
+    static void addBinarySetReply( ReplyBatch *batch, uint8_t opcode, uint32_t opaque,
+                                   StoreResult result ) {
+        uint16_t status = BINARY_STATUS_EINVAL;
+        switch ( result ) {
+        case STORE_OK: status = BINARY_STATUS_OK; break;
+        case STORE_BAD_KEY: status = BINARY_STATUS_EINVAL; break;
+        case STORE_NO_MEMORY: status = BINARY_STATUS_ENOMEM; break;
+        case STORE_TOO_LARGE: status = BINARY_STATUS_E2BIG; break;
+        default: break;   // Only text commands get the others.
+        }
+        if ( status != BINARY_STATUS_OK ) {
+            batch->addError( opcode, status, opaque );
+        } else if ( !binaryQuiet( opcode ) ) {
+            batch->addResponse( opcode, status, opaque );
+        }
+    }
 
-       pthread_exit( NULL ); 
+    static void addBinaryDeleteReply( ReplyBatch *batch, uint8_t opcode, uint32_t opaque,
+                                      bool deleted ) {
+        if ( !deleted ) {
+            batch->addError( opcode, BINARY_STATUS_KEY_ENOENT, opaque );
+        } else if ( !binaryQuiet( opcode ) ) {
+            batch->addResponse( opcode, BINARY_STATUS_OK, opaque );
+        }
     }
 
-    // Main memcached server. Spawns a new thread for each connection.
-    void startServer() {
-        int sockfd = tcpServerOpen( MEMCACHED_PORT );
-        int newfd; 
-        struct sockaddr_in clientaddr;
+    // Per core mode. Hand the set, cas, append or prepend read into
+    // the item of conn to the loop owning its key, if that is another
+    // one, and take its reply in line. The item came from the partition
+    // of that loop and goes along with the message, only storing it is
+    // left for the owner.
+    bool forwardSet( Connection *conn ) {
+        MemcachedItem *mcItem = conn->item_;
+        if ( !perCore_ || mcItem == NULL ) {
+            return false;
+        }
+        int p = partitionOf( mcItem->hash_ );
+        if ( p == conn->loop_->id_ ) {
+            return false;
+        }
+        DeferredReply *reply = deferReply( conn, PARTITION_SET, conn->binaryOpcode_,
+                                           conn->binaryOpaque_ );
+        PartitionMessage *msg = newMessage( conn, reply, PARTITION_SET, p );
+        msg->item_ = mcItem;
+        msg->command_ = conn->command_.command_;
+        msg->number_ = conn->command_.number;
+        conn->item_ = NULL;
+        sendMessage( conn, msg, p );
+        return true;
+    }
 
-        while ( 1 ) {
-            socklen_t sin_size=sizeof(struct sockaddr_in);
+    // Per core mode. Put a reply waiting for other loops in line. The
+    // binary responses batched so far go in line before it, they are
+    // sent along with the next replies.
+    DeferredReply * deferReply( Connection *conn, PartitionOp op, uint8_t opcode,
+                                uint32_t opaque ) {
+        if ( !conn->batch_.empty() ) {
+            if ( conn->deferred_.empty() ) {
+                conn->deferred_.push_back( new DeferredReply() );
+            }
+            flushBatch( conn );
+        }
+        DeferredReply *reply = new DeferredReply();
+        reply->op_ = op;
+        reply->protocol_ = conn->protocol_;
+        reply->opcode_ = opcode;
+        reply->opaque_ = opaque;
+        reply->command_ = conn->command_.command_;
+        reply->noreply_ = conn->command_.noreply;
+        conn->deferred_.push_back( reply );
+        return reply;
+    }
 
-            newfd = accept( sockfd,(struct sockaddr *)&clientaddr,&sin_size );
-            if ( newfd < 0 ) {
-                pr_info("Error Accepting a client \n");
+    // Serve the next binary request once its header, extras and key
+    // are in. A set goes on to read its value like a text one does.
+    // Responses are added to the batch of the connection, which goes
+    // out when we run out of input or it gets long.
+    ReadStatus handleBinaryCommand( Connection *conn ) {
+        char *frame;
+        ReadStatus status = conn->reader_.peek( &frame, BINARY_HEADER_SIZE );
+        if ( status != READ_OK ) {
+            return status;
+        }
+        BinaryRequest req;
+        decodeBinaryRequest( frame, &req );
+        if ( req.magic_ != BINARY_REQUEST_MAGIC ||
+             (size_t)req.keyLen_ + req.extrasLen_ > req.bodyLen_ ) {
+            pr_info( "Bad binary request on socket %d\n", conn->fd_ );
+            return READ_CLOSED;
+        }
+        bool isSet = req.opcode_ == BINARY_SET || req.opcode_ == BINARY_SETQ;
+        size_t valueLen = isSet ? req.bodyLen_ - req.keyLen_ - req.extrasLen_ : 0;
+        size_t frameLen = BINARY_HEADER_SIZE + req.bodyLen_ - valueLen;
+        if ( frameLen > BINARY_HEADER_SIZE + BINARY_MAX_BODY || valueLen > BINARY_MAX_VALUE ) {
+            pr_info( "Binary request too large on socket %d\n", conn->fd_ );
+            return READ_CLOSED;
+        }
+        // The frame stays in the read buffer until the next read.
+        status = conn->reader_.peek( &frame, frameLen );
+        if ( status != READ_OK ) {
+            return status;
+        }
+        conn->reader_.consume( frameLen );
+        countCommand();
+
+        const char *extras = frame + BINARY_HEADER_SIZE;
+        StringPiece key( extras + req.extrasLen_, req.keyLen_ );
+        ReplyBatch *batch = &conn->batch_;
+        switch ( req.opcode_ ) {
+        case BINARY_GET:
+        case BINARY_GETQ:
+        case BINARY_GETK:
+        case BINARY_GETKQ: {
+            uint64_t start = nowNanos();
+            handleBinaryGet( conn, &req, key );
+            recordLatency( threadStats.getLatency_, start );
+            break;
+        }
+        case BINARY_SET:
+        case BINARY_SETQ: {
+            // Bad extras are answered once the value is out of the way.
+            MCCommand *mcCommand = &conn->command_;
+            mcCommand->clear();
+            if ( req.extrasLen_ == BINARY_SET_EXTRAS ) {
+                mcCommand->command_ = COMMAND_SET;
+                mcCommand->flags = loadBE32( extras );
+                mcCommand->exptime = loadBE32( extras + 4 );
+            }
+            mcCommand->key = key;
+            mcCommand->size = valueLen;
+            conn->binaryOpcode_ = req.opcode_;
+            conn->binaryOpaque_ = req.opaque_;
+            startSet( conn );
+            break;
+        }
+        case BINARY_DELETE:
+        case BINARY_DELETEQ: {
+            uint64_t hash;
+            int p = remotePartition( conn, key, &hash );
+            if ( req.extrasLen_ != 0 || key.size == 0 || key.size > KEY_MAX_LENGTH ) {
+                batch->addError( req.opcode_, BINARY_STATUS_EINVAL, req.opaque_ );
+            } else if ( p >= 0 ) {
+                DeferredReply *reply = deferReply( conn, PARTITION_DELETE, req.opcode_,
+                                                   req.opaque_ );
+                PartitionMessage *msg = newMessage( conn, reply, PARTITION_DELETE, p );
+                msg->keyData_.assign( key.data, key.size );
+                msg->keys_.push_back( StringPiece( msg->keyData_.data(),
+                                                   msg->keyData_.size() ) );
+                msg->hashes_.push_back( hash );
+                sendMessage( conn, msg, p );
+            } else {
+                addBinaryDeleteReply( batch, req.opcode_, req.opaque_,
+                                      conn->loop_->cache_->deleteItem( key.data, key.size,
+                                                                       hash ) );
+            }
+            break;
+        }
+        case BINARY_NOOP:
+            batch->addResponse( req.opcode_, BINARY_STATUS_OK, req.opaque_ );
+            break;
+        default:
+            batch->addError( req.opcode_, BINARY_STATUS_UNKNOWN_COMMAND, req.opaque_ );
+            break;
+        }
+        if ( batch->iov_.size() >= MAX_IOVECS ) {
+            flushBatch( conn );
+        }
+        return READ_OK;
+    }
+
+    // Once we identify the command that has been recevied as get,
+    // this handle it by getting all its keys from the LRU cache in one
+    // pass and sending the whole response with a single writev when
+    // the socket can take it. The VALUE line of an item is stored right
+    // before its value, so a hit is one iovec pointing into the item
+    // and nothing is formatted or copied. The references we got on the
+    // items keep them alive until the reply is out.
+    void handleGetCommand( Connection *conn, MCCommand *mcCommand ) {
+        const uint64_t *hashes = NULL;
+        if ( perCore_ ) {
+            if ( forwardGet( conn, mcCommand ) ) {
+                return;
+            }
+            // All ours, forwardGet hashed them.
+            hashes = conn->loop_->hashes_.data();
+        }
+        vector< MemcachedItem * > items;
+        lookupItems( conn->loop_->cache_, mcCommand->keys, hashes, &items );
+        sendGetReply( conn, mcCommand->keys, items );
+    }
+
+    // The VALUE lines of the items found and the END. The reply takes
+    // over the references. The VALUE lines of gets are copies, see
+    // formatGetReply, which wait in line like the ones of flushBatch.
+    void sendGetReply( Connection *conn, const vector< StringPiece > &keys,
+                       const vector< MemcachedItem * > &items ) {
+        vector< struct iovec > iov;
+        iov.reserve( items.size() + 1 );
+        vector< MemcachedItem * > hits;
+        hits.reserve( items.size() );
+        for( size_t i = 0; i < items.size(); i++ ) {
+            if( items[i] == NULL ) {
+                pr_debug( "Key %.*s not present\n", (int)keys[i].size, keys[i].data );
+            } else {
+                pr_debug( "Get command key : %.*s\n", (int)keys[i].size, keys[i].data );
+            }
+        }
+        bool withCas = conn->command_.command_ == COMMAND_GETS;
+        list<string> *copyList = conn->deferred_.empty() ? &conn->writeCopies_ :
+                                 &readyReply( conn )->copies_;
+        formatGetReply( items, withCas, &iov, &hits, copyList );
+        sendReplyv( conn, iov.data(), iov.size(), hits.data(), hits.size() );
+        if ( withCas && conn->deferred_.empty() && !conn->hasPendingWrites() ) {
+            conn->writeCopies_.clear();
+        }
+    }
+
+    // Point iov at the VALUE lines and values of the items found and
+    // the END, and add the items to refs. The VALUE line of an item
+    // doesn't have its CAS unique, for gets the lines are formatted
+    // again with it, into a new string of copies.
+    static void formatGetReply( const vector< MemcachedItem * > &items, bool withCas,
+                                vector< struct iovec > *iov, vector< MemcachedItem * > *refs,
+                                list< string > *copies ) {
+        string *lines = NULL;
+        if ( withCas ) {
+            // Reserved so the iovecs into it stay put.
+            size_t bytes = 0;
+            for ( size_t i = 0; i < items.size(); i++ ) {
+                bytes += items[i] != NULL ? items[i]->headerLen_ + 21 : 0;
+            }
+            copies->push_back( string() );
+            lines = &copies->back();
+            lines->reserve( bytes );
+        }
+        for( size_t i = 0; i < items.size(); i++ ) {
+            MemcachedItem *mcItem = items[i];
+            if( mcItem == NULL ) {
                 continue;
+            }
+            if ( lines == NULL ) {
+                mcItem->replyIovecs( iov );
             } else {
-                pr_debug("Server: got connection from %s %d\n",inet_ntoa(clientaddr.sin_addr),newfd);
-                pthread_t threadId;
-                ThreadArg *tArg = new ThreadArg( this, newfd);
-                pthread_create( &threadId, NULL, workerFunc, tArg); 
+                size_t start = lines->size();
+                char cas[24];
+                int len = snprintf( cas, sizeof( cas ), " %llu\r\n",
+                                    (unsigned long long)mcItem->cas_ );
+                // The VALUE line without its \r\n.
+                lines->append( mcItem->header(), mcItem->headerLen_ - 2 );
+                lines->append( cas, len );
+                struct iovec v;
+                v.iov_base = &(*lines)[start];
+                v.iov_len = lines->size() - start;
+                iov->push_back( v );
+                mcItem->valueIovecs( 0, mcItem->size_, iov );
             }
- 
+            refs->push_back( mcItem );
+        }
+
+        struct iovec end;
+        end.iov_base = (void *)endReply;
+        end.iov_len = endReplySize;
+        iov->push_back( end );
+    }
+
+    // Per core mode. Ask the loops owning keys of the get for them, one
+    // message to every loop, and take the reply in line. Our own keys
+    // are looked up right away. If all keys are ours nothing is done,
+    // their hashes are left in hashes_ of the loop.
+    bool forwardGet( Connection *conn, MCCommand *mcCommand ) {
+        EventLoop *loop = conn->loop_;
+        const vector< StringPiece > &keys = mcCommand->keys;
+        vector< int > &owners = loop->owners_;
+        vector< uint64_t > &hashes = loop->hashes_;
+        owners.resize( keys.size() );
+        hashes.resize( keys.size() );
+        bool remote = false;
+        for ( size_t i = 0; i < keys.size(); i++ ) {
+            owners[i] = remotePartition( conn, keys[i], &hashes[i] );
+            remote = remote || owners[i] >= 0;
+        }
+        if ( !remote ) {
+            return false;
+        }
+
+        DeferredReply *reply = deferReply( conn, PARTITION_GET, 0, 0 );
+        reply->items_.assign( keys.size(), NULL );
+        vector< PartitionMessage * > &messages = loop->messages_;
+        messages.assign( numLoops_, NULL );
+        for ( size_t i = 0; i < keys.size(); i++ ) {
+            int p = owners[i];
+            if ( p < 0 ) {
+                reply->items_[i] = lookupItem( loop->cache_, keys[i].data, keys[i].size,
+                                               hashes[i] );
+                continue;
+            }
+            if ( messages[p] == NULL ) {
+                messages[p] = newMessage( conn, reply, PARTITION_GET, p );
+                // The keys point into keyData_, which must not move.
+                size_t bytes = 0;
+                for ( size_t k = i; k < keys.size(); k++ ) {
+                    bytes += owners[k] == p ? keys[k].size : 0;
+                }
+                messages[p]->keyData_.reserve( bytes );
+            }
+            PartitionMessage *msg = messages[p];
+            size_t offset = msg->keyData_.size();
+            msg->keyData_.append( keys[i].data, keys[i].size );
+            msg->keys_.push_back( StringPiece( msg->keyData_.data() + offset, keys[i].size ) );
+            msg->hashes_.push_back( hashes[i] );
+            msg->slots_.push_back( i );
         }
+        for ( int p = 0; p < numLoops_; p++ ) {
+            if ( messages[p] != NULL ) {
+                sendMessage( conn, messages[p], p );
+            }
+        }
+        return true;
     }
 
-    Memcached() {
-        lruCache_ = new LRUMemCache( MAX_LRU_CACHE_SIZE );
+    // Add up the counters of every event loop, UDP and background
+    // thread. Nothing is shared while they count, the cost is all here.
+    void sumThreadStats( ThreadStats *total ) {
+        vector< ThreadStats * > stats;
+        for ( size_t i = 0; i < loops_.size(); i++ ) {
+            stats.push_back( __atomic_load_n( &loops_[i]->stats_, __ATOMIC_ACQUIRE ) );
+        }
+        for ( size_t i = 0; i < udpWorkers_.size(); i++ ) {
+            stats.push_back( __atomic_load_n( &udpWorkers_[i]->stats_, __ATOMIC_ACQUIRE ) );
+        }
+        memset( total, 0, sizeof( *total ) );
+        for ( size_t i = 0; i < stats.size(); i++ ) {
+            if ( stats[i] != NULL ) {
+                addThreadStats( total, stats[i] );
+            }
+        }
+        addBackgroundStats( total );
     }
 
-    ~Memcached() {
-        delete lruCache_;
+    // Latency lines of one histogram: the samples, upper bounds of the
+    // percentiles and the count of every bucket that has one.
+    static void latencyStats( string *reply, const char *name, const uint64_t *histogram ) {
+        char line[128];
+        uint64_t samples = 0;
+        for ( int b = 0; b < LATENCY_BUCKETS; b++ ) {
+            samples += histogram[b];
+        }
+        snprintf( line, sizeof( line ), "STAT %s_samples %llu\r\n", name,
+                  (unsigned long long)samples );
+        *reply += line;
+
+        static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+        static const char *quantileNames[] = { "p50", "p90", "p99", "p999" };
+        for ( int q = 0; q < 4 && samples > 0; q++ ) {
+            uint64_t target = (uint64_t)( quantiles[q] * samples );
+            uint64_t seen = 0;
+            int b = 0;
+            for ( ; b < LATENCY_BUCKETS - 1; b++ ) {
+                seen += histogram[b];
+                if ( seen > target ) {
+                    break;
+                }
+            }
+            snprintf( line, sizeof( line ), "STAT %s_%s_ns %llu\r\n", name,
+                      quantileNames[q], 1ULL << b );
+            *reply += line;
+        }
+        for ( int b = 0; b < LATENCY_BUCKETS; b++ ) {
+            if ( histogram[b] == 0 ) {
+                continue;
+            }
+            if ( b < LATENCY_BUCKETS - 1 ) {
+                snprintf( line, sizeof( line ), "STAT %s_lt_%lluns %llu\r\n", name,
+                          1ULL << b, (unsigned long long)histogram[b] );
+            } else {
+                snprintf( line, sizeof( line ), "STAT %s_ge_%lluns %llu\r\n", name,
+                          1ULL << ( b - 1 ), (unsigned long long)histogram[b] );
+            }
+            *reply += line;
+        }
     }
-};
 
-void memcachedExit( int signo ) {
-    pr_info("mymemcached exiting\n");
-    exit(0);
-}
+    // "stats" reports the counters of the server as a whole, "stats
+    // items" the items and evictions of every slab class, "stats slabs"
+    // the counters of every slab class in use and of the slab allocator
+    // as a whole, and "stats latency" histograms of the time the loops
+    // took to serve gets and sets.
+    void handleStatsCommand( Connection *conn, MCCommand *mcCommand ) {
+        string reply;
+        char line[128];
 
-int main( void ) {
-    signal(SIGINT, memcachedExit);
-    Memcached memcachedServer;
+        if ( mcCommand->key.size == 0 ) {
+            ThreadStats total;
+            sumThreadStats( &total );
+            size_t items = 0, bytes = 0, limit = 0;
+            uint64_t evictions = 0, inlineEvictions = 0, backgroundEvictions = 0;
+            for ( size_t p = 0; p < partitions_.size(); p++ ) {
+                inlineEvictions += partitions_[p]->inlineEvictions();
+                backgroundEvictions += partitions_[p]->backgroundEvictions();
+                items += partitions_[p]->size();
+                bytes += partitions_[p]->usedBytes();
+                limit += partitions_[p]->memoryLimit();
+                vector< SlabClassStats > classStats;
+                partitions_[p]->slabs()->getClassStats( &classStats );
+                for ( size_t i = 0; i < classStats.size(); i++ ) {
+                    evictions += classStats[i].evictions;
+                }
+            }
+            time_t now = time( NULL );
+            snprintf( line, sizeof( line ),
+                      "STAT pid %d\r\n"
+                      "STAT uptime %ld\r\n"
+                      "STAT time %ld\r\n"
+                      "STAT threads %d\r\n"
+                      "STAT udp_threads %zu\r\n",
+                      (int)getpid(), (long)( now - startTime_ ), (long)now, numLoops_,
+                      udpWorkers_.size() );
+            reply += line;
+            snprintf( line, sizeof( line ),
+                      "STAT io_backend %s\r\n"
+                      "STAT commands %llu\r\n"
+                      "STAT io_syscalls %llu\r\n",
+                      ioBackendNames[backend_], (unsigned long long)total.commands_,
+                      (unsigned long long)total.syscalls_ );
+            reply += line;
+            snprintf( line, sizeof( line ),
+                      "STAT curr_connections %llu\r\n"
+                      "STAT total_connections %llu\r\n",
+                      (unsigned long long)( total.connsOpened_ - total.connsClosed_ ),
+                      (unsigned long long)total.connsOpened_ );
+            reply += line;
+            snprintf( line, sizeof( line ),
+                      "STAT cmd_get %llu\r\n"
+                      "STAT cmd_set %llu\r\n"
+                      "STAT get_hits %llu\r\n"
+                      "STAT get_misses %llu\r\n",
+                      (unsigned long long)( total.getHits_ + total.getMisses_ ),
+                      (unsigned long long)total.sets_,
+                      (unsigned long long)total.getHits_,
+                      (unsigned long long)total.getMisses_ );
+            reply += line;
+            snprintf( line, sizeof( line ),
+                      "STAT near_cache_hits %llu\r\n"
+                      "STAT near_cache_stale %llu\r\n",
+                      (unsigned long long)total.nearHits_,
+                      (unsigned long long)total.nearStale_ );
+            reply += line;
+            snprintf( line, sizeof( line ),
+                      "STAT delete_hits %llu\r\n"
+                      "STAT delete_misses %llu\r\n",
+                      (unsigned long long)total.deleteHits_,
+                      (unsigned long long)total.deleteMisses_ );
+            reply += line;
+            snprintf( line, sizeof( line ),
+                      "STAT incr_hits %llu\r\n"
+                      "STAT incr_misses %llu\r\n"
+                      "STAT touch_hits %llu\r\n"
+                      "STAT touch_misses %llu\r\n",
+                      (unsigned long long)total.incrHits_,
+                      (unsigned long long)total.incrMisses_,
+                      (unsigned long long)total.touchHits_,
+                      (unsigned long long)total.touchMisses_ );
+            reply += line;
+            snprintf( line, sizeof( line ),
+                      "STAT cas_hits %llu\r\n"
+                      "STAT cas_misses %llu\r\n"
+                      "STAT cas_badval %llu\r\n",
+                      (unsigned long long)total.casHits_,
+                      (unsigned long long)total.casMisses_,
+                      (unsigned long long)total.casBadval_ );
+            reply += line;
+            snprintf( line, sizeof( line ),
+                      "STAT curr_items %zu\r\n"
+                      "STAT bytes %zu\r\n"
+                      "STAT limit_maxbytes %zu\r\n"
+                      "STAT evictions %llu\r\n",
+                      items, bytes, limit, (unsigned long long)evictions );
+            reply += line;
+            snprintf( line, sizeof( line ),
+                      "STAT evictions_inline %llu\r\n"
+                      "STAT evictions_background %llu\r\n",
+                      (unsigned long long)inlineEvictions,
+                      (unsigned long long)backgroundEvictions );
+            reply += line;
+            snprintf( line, sizeof( line ),
+                      "STAT lock_waits %llu\r\n"
+                      "STAT lock_wait_us %llu\r\n",
+                      (unsigned long long)total.lockWaits_,
+                      (unsigned long long)( total.lockWaitNanos_ / 1000 ) );
+            reply += line;
+        } else if ( mcCommand->key.equals( "items", 5 ) ) {
+            // The slab classes are the same in every partition.
+            vector< SlabClassStats > items;
+            for ( size_t p = 0; p < partitions_.size(); p++ ) {
+                vector< SlabClassStats > classStats;
+                partitions_[p]->slabs()->getClassStats( &classStats );
+                for ( size_t i = 0; i < classStats.size(); i++ ) {
+                    size_t j = 0;
+                    while ( j < items.size() && items[j].id != classStats[i].id ) {
+                        j++;
+                    }
+                    if ( j == items.size() ) {
+                        items.push_back( classStats[i] );
+                    } else {
+                        items[j].usedChunks += classStats[i].usedChunks;
+                        items[j].evictions += classStats[i].evictions;
+                    }
+                }
+            }
+            for ( size_t i = 0; i < items.size(); i++ ) {
+                snprintf( line, sizeof( line ),
+                          "STAT items:%d:number %zu\r\n"
+                          "STAT items:%d:evicted %llu\r\n",
+                          items[i].id, items[i].usedChunks,
+                          items[i].id, (unsigned long long)items[i].evictions );
+                reply += line;
+            }
+        } else if ( mcCommand->key.equals( "latency", 7 ) ) {
+            ThreadStats total;
+            sumThreadStats( &total );
+            latencyStats( &reply, "get", total.getLatency_ );
+            latencyStats( &reply, "set", total.setLatency_ );
+        } else if ( mcCommand->key.equals( "slabs", 5 ) ) {
+            // In per core mode, of the partition of our loop.
+            SlabAllocator *slabs = conn->loop_->cache_->slabs();
+            vector< SlabClassStats > classStats;
+            slabs->getClassStats( &classStats );
+            for ( size_t i = 0; i < classStats.size(); i++ ) {
+                SlabClassStats *cs = &classStats[i];
+                snprintf( line, sizeof( line ),
+                          "STAT %d:chunk_size %zu\r\n"
+                          "STAT %d:chunks_per_page %zu\r\n"
+                          "STAT %d:total_pages %zu\r\n",
+                          cs->id, cs->chunkSize, cs->id, cs->chunksPerPage,
+                          cs->id, cs->totalPages );
+                reply += line;
+                snprintf( line, sizeof( line ),
+                          "STAT %d:used_chunks %zu\r\n"
+                          "STAT %d:free_chunks %zu\r\n"
+                          "STAT %d:evictions %llu\r\n"
+                          "STAT %d:fragmentation %.3f\r\n",
+                          cs->id, cs->usedChunks, cs->id, cs->freeChunks,
+                          cs->id, (unsigned long long)cs->evictions,
+                          cs->id, cs->fragmentation );
+                reply += line;
+            }
+
+            size_t totalPages, poolPages, largeItems, largeBytes;
+            uint64_t pagesMoved, rebalanceEvictions;
+            slabs->getGlobalStats( &totalPages, &poolPages, &pagesMoved,
+                                   &rebalanceEvictions, &largeItems, &largeBytes );
+            snprintf( line, sizeof( line ),
+                      "STAT active_slabs %zu\r\n"
+                      "STAT total_malloced %zu\r\n"
+                      "STAT pool_pages %zu\r\n",
+                      classStats.size(), totalPages * SLAB_PAGE_SIZE, poolPages );
+            reply += line;
+            snprintf( line, sizeof( line ),
+                      "STAT slabs_moved %llu\r\n"
+                      "STAT slab_reassign_evictions %llu\r\n"
+                      "STAT large_items %zu\r\n"
+                      "STAT large_bytes %zu\r\n",
+                      (unsigned long long)pagesMoved, 
+                      (unsigned long long)rebalanceEvictions,
+                      largeItems, largeBytes );
+            reply += line;
+        }
+        reply += endReply;
+        sendReply( conn, reply.data(), reply.size() );
+    }
+
+    // "cache_memlimit <megabytes>" changes the memory limit of the
+    // cache without a restart.
+    void handleCacheMemlimitCommand( Connection *conn, MCCommand *mcCommand ) {
+        if ( mcCommand->size <= 0 ) {
+            sendReply( conn, badFormatReply, badFormatReplySize );
+            return;
+        }
+        pr_info( "Memory limit set to %d MB\n", mcCommand->size );
+        size_t limit = (size_t)mcCommand->size * 1024 * 1024;
+        for ( size_t i = 0; i < partitions_.size(); i++ ) {
+            partitions_[i]->setMemoryLimit( limit / partitions_.size() );
+        }
+        sendReply( conn, okReply, okReplySize );
+    }
+
+    void handleInvalidCommand() {
+        pr_debug( "Invalid memcached command\n");
+    }
+
+    // Parse and serve as many commands as the socket has for us. Client
+    // can send as many commands as it may with a single connection.
+    // We stop when the socket is drained and continue on the next
+    // EPOLLIN. We also stop while replies are backed up in the write
+    // buffer and resume once flushWrites has drained it.
+    //
+    // The first byte tells whether the connection speaks the binary
+    // protocol. Its responses are batched and written out together
+    // when we leave.
+    void handleInput( Connection *conn ) {
+        ReadStatus status = READ_OK;
+        if ( conn->protocol_ == PROTOCOL_UNKNOWN ) {
+            char *first;
+            status = conn->reader_.peek( &first, 1 );
+            if ( status == READ_OK ) {
+                conn->protocol_ = (uint8_t)first[0] == BINARY_REQUEST_MAGIC ?
+                                  PROTOCOL_BINARY : PROTOCOL_TEXT;
+            }
+        }
+        while ( status == READ_OK && conn->state_ != CONN_CLOSING &&
+                !writesBlocked( conn ) ) {
+            if ( conn->state_ == CONN_READ_COMMAND &&
+                 conn->protocol_ == PROTOCOL_BINARY ) {
+                status = handleBinaryCommand( conn );
+            } else if ( conn->state_ == CONN_READ_COMMAND ) {
+                char *line;
+                size_t len;
+                status = conn->reader_.readCommand( &line, &len );
+                if ( status != READ_OK ) {
+                    break;
+                }
+
+                // The command points into the read buffer, it is served
+                // before we read anything else.
+                MCCommand *mcCommand = &conn->command_;
+                extractCommand( line, len, mcCommand );
+                countCommand();
+        
+                if  ( storageCommand( mcCommand->command_ ) && mcCommand->size >= 0 ) {
+                    mcCommand->printCommand();
+                    startSet( conn );
+                } else if ( storageCommand( mcCommand->command_ ) ) {
+                    // Missing or bad flags, exptime, size or CAS unique.
+                    sendReply( conn, badFormatReply, badFormatReplySize );
+                } else if ( ( mcCommand->command_ == COMMAND_GET ||
+                              mcCommand->command_ == COMMAND_GETS ) &&
+                            !mcCommand->keys.empty() ) {
+                    mcCommand->printCommand();
+                    uint64_t start = nowNanos();
+                    handleGetCommand( conn, mcCommand );
+                    recordLatency( threadStats.getLatency_, start );
+                } else if ( mcCommand->command_ == COMMAND_INCR ||
+                            mcCommand->command_ == COMMAND_DECR ||
+                            mcCommand->command_ == COMMAND_DELETE ||
+                            mcCommand->command_ == COMMAND_TOUCH ) {
+                    mcCommand->printCommand();
+                    handleUpdateCommand( conn, mcCommand );
+                } else if ( mcCommand->command_ == COMMAND_STATS ) {
+                    handleStatsCommand( conn, mcCommand );
+                } else if ( mcCommand->command_ == COMMAND_CACHE_MEMLIMIT ) {
+                    handleCacheMemlimitCommand( conn, mcCommand );
+                } else {
+                    // return error to client. Command is not supported.
+                    handleInvalidCommand();
+                } 
+            } else {
+                // A binary value comes without the \r\n.
+                bool binary = conn->protocol_ == PROTOCOL_BINARY;
+                status = readSetValue( conn, conn->command_.size + ( binary ? 0 : 2 ) );
+                if ( status != READ_OK ) {
+                    break;
+                }
+                uint64_t start = nowNanos();
+                if ( binary ) {
+                    handleBinarySet( conn );
+                } else {
+                    handleSetCommand( conn );
+                }
+                recordLatency( threadStats.setLatency_, start );
+                conn->state_ = CONN_READ_COMMAND;
+            }
+        }
+        flushBatch( conn );
+        if ( !conn->deferred_.empty() ) {
+            conn->deferredFull_ = conn->deferred_.size() >= MAX_DEFERRED_REPLIES;
+            flushDeferred( conn );
+        }
+
+        if ( status == READ_CLOSED ) {
+            conn->state_ = CONN_CLOSING;
+        }
+    }
+
+    // With io_uring the ring may still be receiving into the connection
+    // or sending from it. Shutting the socket down ends both, and the
+    // connection goes once the last of their completions came, when
+    // this is called again. In per core mode it also waits for its
+    // messages to come back from the other loops.
+    void closeConnection( EventLoop *loop, Connection *conn ) {
+        if ( !conn->shutdown_ ) {
+            pr_debug( "Closing connection %d on loop %d\n", conn->fd_, loop->id_ );
+            if ( conn->state_ == CONN_READ_VALUE && conn->item_ != NULL ) {
+                pr_info( "Connection closed waiting for value on key : %.*s\n", 
+                         conn->item_->keyLen_, conn->item_->key() );
+            }
+            if ( conn->item_ != NULL ) {
+                releaseItem( conn->item_ );
+                conn->item_ = NULL;
+            }
+            loop->idleListRemove( conn );
+            conn->state_ = CONN_CLOSING;
+            conn->shutdown_ = true;
+            if ( loop->ring_ != NULL ) {
+                countSyscall();
+                shutdown( conn->fd_, SHUT_RDWR );
+            }
+        }
+        if ( conn->inflight_ > 0 || conn->queued_ ) {
+            return;
+        }
+        releaseWrites( conn );
+        releaseDeferred( conn );
+        // Closing the fd also removes it from the epoll set.
+        countSyscall();
+        close( conn->fd_ );
+        statAdd( &threadStats.connsClosed_ );
+        delete conn;
+    }
+
+    // Per core mode. A message of conn to loop target, for reply. It
+    // goes out with sendMessage.
+    PartitionMessage * newMessage( Connection *conn, DeferredReply *reply, PartitionOp op,
+                                   int target ) {
+        EventLoop *loop = conn->loop_;
+        PartitionMessage *msg;
+        if ( loop->freeMessages_.empty() ) {
+            msg = new PartitionMessage();
+        } else {
+            msg = loop->freeMessages_.back();
+            loop->freeMessages_.pop_back();
+        }
+        msg->op_ = op;
+        msg->source_ = loop->id_;
+        msg->done_ = false;
+        msg->conn_ = conn;
+        msg->reply_ = reply;
+        msg->item_ = NULL;
+        msg->command_ = COMMAND_INVALID;
+        msg->number_ = 0;
+        msg->exptime_ = 0;
+        msg->stored_ = STORE_OK;
+        msg->deleted_ = false;
+        msg->value_ = 0;
+        reply->waiting_++;
+        conn->inflight_++;
+        return msg;
+    }
+
+    void sendMessage( Connection *conn, PartitionMessage *msg, int target ) {
+        if ( msg->op_ == PARTITION_GET ) {
+            // Sized here, the owner doesn't allocate for us.
+            msg->items_.resize( msg->keys_.size() );
+        }
+        conn->loop_->outbox_[target].push_back( msg );
+    }
+
+    void freeMessage( EventLoop *loop, PartitionMessage *msg ) {
+        msg->keyData_.clear();
+        msg->keys_.clear();
+        msg->hashes_.clear();
+        msg->slots_.clear();
+        msg->items_.clear();
+        loop->freeMessages_.push_back( msg );
+    }
+
+    // Move the messages of the loop to the queues of their targets, as
+    // many as fit, and wake the targets that got any.
+    void flushMessages( EventLoop *loop ) {
+        for ( int t = 0; t < numLoops_; t++ ) {
+            vector< PartitionMessage * > &outbox = loop->outbox_[t];
+            if ( outbox.empty() ) {
+                continue;
+            }
+            SpscQueue< PartitionMessage * > *queue = loops_[t]->inbox_[loop->id_];
+            size_t sent = 0;
+            while ( sent < outbox.size() && queue->push( outbox[sent] ) ) {
+                sent++;
+            }
+            outbox.erase( outbox.begin(), outbox.begin() + sent );
+            if ( sent > 0 ) {
+                wakeLoop( loops_[t] );
+            }
+        }
+    }
+
+    // The target either sees the messages we just queued before it
+    // blocks or has set sleeping_ by the time we look at it.
+    void wakeLoop( EventLoop *target ) {
+        __atomic_thread_fence( __ATOMIC_SEQ_CST );
+        if ( __atomic_exchange_n( &target->sleeping_, 0, __ATOMIC_SEQ_CST ) ) {
+            uint64_t one = 1;
+            countSyscall();
+            if ( write( target->notifyfd_, &one, sizeof( one ) ) < 0 ) {
+                pr_info( "Error waking event loop %d\n", target->id_ );
+            }
+        }
+    }
+
+    // Whether the loop may block waiting for events, with nothing in
+    // its queues and nothing of its own waiting for room.
+    bool prepareSleep( EventLoop *loop ) {
+        for ( int t = 0; t < numLoops_; t++ ) {
+            if ( !loop->outbox_[t].empty() ) {
+                return false;
+            }
+        }
+        __atomic_store_n( &loop->sleeping_, 1, __ATOMIC_SEQ_CST );
+        __atomic_thread_fence( __ATOMIC_SEQ_CST );
+        for ( int s = 0; s < numLoops_; s++ ) {
+            if ( loop->inbox_[s] != NULL && !loop->inbox_[s]->empty() ) {
+                __atomic_store_n( &loop->sleeping_, 0, __ATOMIC_RELAXED );
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Serve the requests other loops sent us and send them back, and
+    // finish the replies our own requests were waiting for.
+    void processMessages( EventLoop *loop ) {
+        for ( int s = 0; s < numLoops_; s++ ) {
+            SpscQueue< PartitionMessage * > *queue = loop->inbox_[s];
+            PartitionMessage *msg;
+            while ( queue != NULL && queue->pop( &msg ) ) {
+                if ( msg->done_ ) {
+                    completeMessage( loop, msg );
+                } else {
+                    serveMessage( loop, msg );
+                    loop->outbox_[s].push_back( msg );
+                }
+            }
+        }
+        drainDeferred( loop );
+    }
+
+    // A request of another loop for keys of our partition. The items of
+    // a get are referenced for the connection that asked.
+    void serveMessage( EventLoop *loop, PartitionMessage *msg ) {
+        LRUMemCache *cache = loop->cache_;
+        switch ( msg->op_ ) {
+        case PARTITION_GET:
+            cache->getItems( msg->keys_, msg->hashes_.data(), &msg->items_ );
+            break;
+        case PARTITION_SET:
+            msg->stored_ = storeItem( cache, msg->item_, msg->command_, msg->number_ );
+            msg->item_ = NULL;
+            break;
+        case PARTITION_DELETE:
+            msg->deleted_ = cache->deleteItem( msg->keys_[0].data, msg->keys_[0].size,
+                                               msg->hashes_[0] );
+            break;
+        case PARTITION_INCR:
+        case PARTITION_TOUCH:
+            msg->stored_ = updateKey( cache, msg->command_, msg->keys_[0], msg->hashes_[0],
+                                      msg->number_, msg->exptime_, &msg->value_ );
+            break;
+        }
+        msg->done_ = true;
+    }
+
+    // One of our requests came back.
+    void completeMessage( EventLoop *loop, PartitionMessage *msg ) {
+        Connection *conn = msg->conn_;
+        DeferredReply *reply = msg->reply_;
+        switch ( msg->op_ ) {
+        case PARTITION_GET:
+            for ( size_t k = 0; k < msg->slots_.size(); k++ ) {
+                reply->items_[msg->slots_[k]] = msg->items_[k];
+            }
+            break;
+        case PARTITION_SET:
+        case PARTITION_TOUCH:
+            reply->stored_ = msg->stored_;
+            break;
+        case PARTITION_INCR:
+            reply->stored_ = msg->stored_;
+            reply->value_ = msg->value_;
+            break;
+        case PARTITION_DELETE:
+            reply->deleted_ = msg->deleted_;
+            break;
+        }
+        freeMessage( loop, msg );
+        conn->inflight_--;
+        reply->waiting_--;
+        if ( conn->shutdown_ ) {
+            closeConnection( loop, conn );
+            return;
+        }
+        if ( reply->waiting_ == 0 ) {
+            formatReply( reply );
+            if ( conn->deferred_.front()->waiting_ == 0 && !conn->draining_ ) {
+                conn->draining_ = true;
+                loop->drainList_.push_back( conn );
+            }
+        }
+    }
+
+    // Turn the answers of a deferred reply into the reply.
+    void formatReply( DeferredReply *reply ) {
+        if ( reply->protocol_ != PROTOCOL_BINARY ) {
+            if ( reply->op_ == PARTITION_GET ) {
+                formatGetReply( reply->items_, reply->command_ == COMMAND_GETS, &reply->iov_,
+                                &reply->refs_, &reply->copies_ );
+            } else if ( reply->noreply_ ) {
+                // The client doesn't wait for it.
+            } else if ( reply->op_ == PARTITION_INCR && reply->stored_ == STORE_OK ) {
+                char line[24];
+                int len = snprintf( line, sizeof( line ), "%llu\r\n",
+                                    (unsigned long long)reply->value_ );
+                reply->copies_.push_back( string( line, len ) );
+                struct iovec iov;
+                iov.iov_base = (void *)reply->copies_.back().data();
+                iov.iov_len = len;
+                reply->iov_.push_back( iov );
+            } else if ( reply->op_ == PARTITION_DELETE ) {
+                reply->iov_.push_back( textReply( COMMAND_DELETE, reply->deleted_ ?
+                                                  STORE_OK : STORE_NOT_FOUND ) );
+            } else {
+                reply->iov_.push_back( textReply( reply->command_, reply->stored_ ) );
+            }
+            reply->items_.clear();
+            return;
+        }
+
+        ReplyBatch batch;
+        switch ( reply->op_ ) {
+        case PARTITION_GET:
+            addBinaryGetReply( &batch, reply->opcode_, reply->opaque_,
+                               StringPiece( reply->key_.data(), reply->key_.size() ),
+                               reply->items_[0] );
+            break;
+        case PARTITION_SET:
+            addBinarySetReply( &batch, reply->opcode_, reply->opaque_, reply->stored_ );
+            break;
+        case PARTITION_DELETE:
+            addBinaryDeleteReply( &batch, reply->opcode_, reply->opaque_, reply->deleted_ );
+            break;
+        default:
+            // Text only.
+            break;
+        }
+        reply->items_.clear();
+        reply->copies_.push_back( string() );
+        string &copies = reply->copies_.back();
+        copies.swap( batch.headers_ );
+        batch.finish( copies.data() );
+        reply->iov_.swap( batch.iov_ );
+        reply->refs_.swap( batch.refs_ );
+    }
+
+    // Send the replies at the front of the line that are complete, all
+    // with one sendNow.
+    void flushDeferred( Connection *conn ) {
+        EventLoop *loop = conn->loop_;
+        vector< struct iovec > &iov = loop->drainIov_;
+        vector< MemcachedItem * > &refs = loop->drainRefs_;
+        while ( !conn->deferred_.empty() && conn->deferred_.front()->waiting_ == 0 ) {
+            DeferredReply *reply = conn->deferred_.front();
+            conn->deferred_.pop_front();
+            conn->writeCopies_.splice( conn->writeCopies_.end(), reply->copies_ );
+            iov.insert( iov.end(), reply->iov_.begin(), reply->iov_.end() );
+            refs.insert( refs.end(), reply->refs_.begin(), reply->refs_.end() );
+            delete reply;
+        }
+        sendNow( conn, iov.data(), iov.size(), refs.data(), refs.size() );
+        iov.clear();
+        refs.clear();
+        if ( conn->deferred_.empty() && !conn->hasPendingWrites() ) {
+            conn->writeCopies_.clear();
+        }
+    }
+
+    // Send what completed for the connections of the drain list. Input
+    // that waited for their lines to get shorter is served now.
+    void drainDeferred( EventLoop *loop ) {
+        for ( size_t i = 0; i < loop->drainList_.size(); i++ ) {
+            loop->drainList_[i]->draining_ = false;
+            drainDeferred( loop, loop->drainList_[i] );
+        }
+        loop->drainList_.clear();
+    }
+
+    void drainDeferred( EventLoop *loop, Connection *conn ) {
+        flushDeferred( conn );
+        if ( conn->deferredFull_ && !writesBlocked( conn ) ) {
+            conn->deferredFull_ = false;
+            handleInput( conn );
+            if ( loop->ring_ != NULL && !conn->recvArmed_ && conn->state_ != CONN_CLOSING ) {
+                armRecv( loop, conn );
+            }
+        }
+        if ( conn->state_ == CONN_CLOSING ) {
+            closeConnection( loop, conn );
+        } else if ( loop->ring_ != NULL ) {
+            queueSend( loop, conn );
+        }
+    }
+
+    // Cut the reply in worker->pieces_ in datagrams to the sender of
+    // request i of the batch. frame is the frame header of the
+    // request, the reply carries its request id.
+    void addUdpReply( UdpWorker *worker, int i, const char *frame ) {
+        const size_t payload = UDP_MAX_DATAGRAM - UDP_HEADER_SIZE;
+        size_t total = 0;
+        for ( size_t p = 0; p < worker->pieces_.size(); p++ ) {
+            total += worker->pieces_[p].iov_len;
+        }
+        size_t count = ( total + payload - 1 ) / payload;
+
+        size_t piece = 0, offset = 0;
+        for ( size_t seq = 0; seq < count; seq++ ) {
+            worker->sendIovStart_.push_back( worker->sendIov_.size() );
+            size_t headerOffset = worker->frameHeaders_.size();
+            worker->frameHeaders_.resize( headerOffset + UDP_HEADER_SIZE );
+            char *header = &worker->frameHeaders_[headerOffset];
+            memcpy( header, frame, 2 );
+            storeBE16( header + 2, seq );
+            storeBE16( header + 4, count );
+            storeBE16( header + 6, 0 );
+
+            // Points at the header once the batch is complete.
+            struct iovec v;
+            v.iov_base = NULL;
+            v.iov_len = UDP_HEADER_SIZE;
+            worker->sendIov_.push_back( v );
+            size_t room = payload;
+            while ( room > 0 && piece < worker->pieces_.size() ) {
+                struct iovec *src = &worker->pieces_[piece];
+                size_t take = min( room, src->iov_len - offset );
+                v.iov_base = (char *)src->iov_base + offset;
+                v.iov_len = take;
+                worker->sendIov_.push_back( v );
+                room -= take;
+                offset += take;
+                if ( offset == src->iov_len ) {
+                    piece++;
+                    offset = 0;
+                }
+            }
+
+            struct mmsghdr msg;
+            memset( &msg, 0, sizeof( msg ) );
+            msg.msg_hdr.msg_name = &worker->recvAddrs_[i];
+            msg.msg_hdr.msg_namelen = worker->recvMsgs_[i].msg_hdr.msg_namelen;
+            worker->sendMsgs_.push_back( msg );
+        }
+    }
+
+    // Serve datagram i of the batch. Only single datagram gets are
+    // served, anything else gets an error back.
+    void handleUdpRequest( UdpWorker *worker, int i ) {
+        struct msghdr *hdr = &worker->recvMsgs_[i].msg_hdr;
+        size_t len = worker->recvMsgs_[i].msg_len;
+        char *frame = &worker->recvBuffers_[i * UDP_MAX_REQUEST];
+        if ( len < UDP_HEADER_SIZE || ( hdr->msg_flags & MSG_TRUNC ) ) {
+            pr_debug( "Dropping bad UDP request of %zu bytes\n", len );
+            return;
+        }
+
+        vector<struct iovec> &pieces = worker->pieces_;
+        pieces.clear();
+        struct iovec v;
+        if ( loadBE16( frame + 4 ) != 1 ) {
+            v.iov_base = (void *)udpMultiPacketReply;
+            v.iov_len = udpMultiPacketReplySize;
+            pieces.push_back( v );
+            addUdpReply( worker, i, frame );
+            return;
+        }
+
+        char *line = frame + UDP_HEADER_SIZE;
+        size_t lineLen = len - UDP_HEADER_SIZE;
+        char *nl = (char *)memchr( line, '\n', lineLen );
+        if ( nl != NULL ) {
+            lineLen = nl - line;
+            if ( lineLen > 0 && line[lineLen - 1] == '\r' ) {
+                lineLen--;
+            }
+        }
+        MCCommand *mcCommand = &worker->command_;
+        extractCommand( line, lineLen, mcCommand );
+        if ( mcCommand->command_ != COMMAND_GET || mcCommand->keys.empty() ) {
+            v.iov_base = (void *)udpGetOnlyReply;
+            v.iov_len = udpGetOnlyReplySize;
+            pieces.push_back( v );
+            addUdpReply( worker, i, frame );
+            return;
+        }
+
+        mcCommand->printCommand();
+        uint64_t start = nowNanos();
+        vector<MemcachedItem *> &items = worker->items_;
+        getItems( mcCommand->keys, &items );
+        size_t total = endReplySize;
+        for ( size_t k = 0; k < items.size(); k++ ) {
+            if ( items[k] != NULL ) {
+                items[k]->replyIovecs( &pieces );
+                total += items[k]->headerLen_ + items[k]->size_;
+            }
+        }
+        v.iov_base = (void *)endReply;
+        v.iov_len = endReplySize;
+        pieces.push_back( v );
+
+        // The datagram count of the frame header is 16 bits.
+        size_t payload = UDP_MAX_DATAGRAM - UDP_HEADER_SIZE;
+        bool tooLarge = ( total + payload - 1 ) / payload > 0xFFFF;
+        for ( size_t k = 0; k < items.size(); k++ ) {
+            if ( items[k] == NULL ) {
+                continue;
+            }
+            if ( tooLarge ) {
+                releaseItem( items[k] );
+            } else {
+                worker->refs_.push_back( items[k] );
+            }
+        }
+        if ( tooLarge ) {
+            pieces.clear();
+            v.iov_base = (void *)udpTooLargeReply;
+            v.iov_len = udpTooLargeReplySize;
+            pieces.push_back( v );
+        }
+        addUdpReply( worker, i, frame );
+        recordLatency( threadStats.getLatency_, start );
+    }
+
+    // Send every datagram of the batch, UIO_MAXIOV at a time, and drop
+    // the references the replies held.
+    void sendUdpReplies( UdpWorker *worker ) {
+        size_t count = worker->sendMsgs_.size();
+        for ( size_t m = 0; m < count; m++ ) {
+            size_t start = worker->sendIovStart_[m];
+            size_t end = m + 1 < count ? worker->sendIovStart_[m + 1] :
+                                         worker->sendIov_.size();
+            worker->sendIov_[start].iov_base = &worker->frameHeaders_[m * UDP_HEADER_SIZE];
+            worker->sendMsgs_[m].msg_hdr.msg_iov = &worker->sendIov_[start];
+            worker->sendMsgs_[m].msg_hdr.msg_iovlen = end - start;
+        }
+
+        size_t sent = 0;
+        while ( sent < count ) {
+            int n = sendmmsg( worker->fd_, &worker->sendMsgs_[sent],
+                              min( count - sent, (size_t)UIO_MAXIOV ), 0 );
+            if ( n < 0 ) {
+                if ( errno == EINTR ) {
+                    continue;
+                }
+                // The datagram can't go to its client, skip it.
+                pr_debug( "Error sending UDP reply %d\n", errno );
+                n = 1;
+            }
+            sent += n;
+        }
+
+        for ( size_t r = 0; r < worker->refs_.size(); r++ ) {
+            releaseItem( worker->refs_[r] );
+        }
+        worker->refs_.clear();
+        worker->sendMsgs_.clear();
+        worker->sendIovStart_.clear();
+        worker->sendIov_.clear();
+        worker->frameHeaders_.clear();
+    }
+
+    // Main function of a UDP thread.
+    void runUdpWorker( UdpWorker *worker ) {
+        while ( 1 ) {
+            for ( int i = 0; i < UDP_BATCH; i++ ) {
+                worker->recvMsgs_[i].msg_hdr.msg_namelen = sizeof( struct sockaddr_in );
+            }
+            int n = recvmmsg( worker->fd_, worker->recvMsgs_.data(), UDP_BATCH,
+                              MSG_WAITFORONE, NULL );
+            if ( n < 0 ) {
+                if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) {
+                    pr_info( "recvmmsg failed on UDP thread %d\n", worker->id_ );
+                }
+                // Idle for a second.
+                if ( threadNearCache != NULL ) {
+                    threadNearCache->sweep();
+                }
+                reclaimRetired();
+                continue;
+            }
+            for ( int i = 0; i < n; i++ ) {
+                handleUdpRequest( worker, i );
+            }
+            sendUdpReplies( worker );
+            reclaimRetired();
+        }
+    }
+
+    static void * udpWorkerFunc( void *arg ) {
+       UdpWorker *worker = (UdpWorker *)arg;
+       pr_info( "Started UDP thread %d on thread %lu \n", worker->id_,
+                (unsigned long)pthread_self() );
+       __atomic_store_n( &worker->stats_, &threadStats, __ATOMIC_RELEASE );
+       if ( worker->memcached_->nearEntries_ > 0 ) {
+           threadNearCache = new NearCache( worker->memcached_->nearEntries_ );
+       }
+
+       worker->memcached_->runUdpWorker( worker );
+
+       pthread_exit( NULL );
+    }
+
+    // Register the connections the accept loop has handed to us.
+    void registerPendingConnections( EventLoop *loop ) {
+        uint64_t count;
+        countSyscall();
+        if ( read( loop->notifyfd_, &count, sizeof( count ) ) < 0 ) {
+            // Spurious wakeup, nothing to do.
+        }
+
+        vector<int> fds;
+        pthread_mutex_lock( &loop->pendingLock_ );
+        fds.swap( loop->pendingFds_ );
+        pthread_mutex_unlock( &loop->pendingLock_ );
+
+        for ( size_t i = 0; i < fds.size(); i++ ) {
+            addConnection( loop, fds[i] );
+        }
+    }
+
+    void addConnection( EventLoop *loop, int fd ) {
+        Connection *conn = new Connection( fd );
+        statAdd( &threadStats.connsOpened_ );
+        conn->loop_ = loop;
+        conn->lastActive_ = loop->now_;
+        loop->idleListAppend( conn );
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        countSyscall();
+        if ( epoll_ctl( loop->epollfd_, EPOLL_CTL_ADD, conn->fd_, &ev ) < 0 ) {
+            pr_info( "Error adding connection %d to epoll\n", conn->fd_ );
+            closeConnection( loop, conn );
+            return;
+        }
+        pr_debug( "Loop %d serving connection %d\n", loop->id_, conn->fd_ );
+    }
+
+    // Per core mode. Take the connections waiting on the listening
+    // socket of the loop.
+    void acceptConnections( EventLoop *loop ) {
+        while ( 1 ) {
+            countSyscall();
+            int fd = accept4( loop->listenfd_, NULL, NULL, SOCK_NONBLOCK );
+            if ( fd < 0 ) {
+                if ( errno == EINTR ) {
+                    continue;
+                }
+                if ( errno != EAGAIN && errno != EWOULDBLOCK ) {
+                    pr_info( "Error accepting a client on loop %d\n", loop->id_ );
+                }
+                return;
+            }
+            int noDelay = 1;
+            countSyscall();
+            setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof( noDelay ) );
+            addConnection( loop, fd );
+        }
+    }
+
+    // Timer tick. Close the connections we have not heard from for
+    // connTimeOutSecs. The idle list is ordered by last activity so we
+    // only look at the connections that have actually expired. The
+    // timing wheels of the cache do the same for expired items.
+    void expireIdleConnections( EventLoop *loop ) {
+        uint64_t expirations;
+        countSyscall();
+        if ( read( loop->timerfd_, &expirations, sizeof( expirations ) ) < 0 ) {
+            // Spurious wakeup, nothing to do.
+        }
+
+        while ( loop->idleHead_ != NULL && 
+                loop->now_ - loop->idleHead_->lastActive_ > connTimeOutSecs ) {
+            closeConnection( loop, loop->idleHead_ );
+        }
+        // One loop is enough to take the expired items out, in per
+        // core mode every loop does its partition. The maintenance
+        // threads do it if there are any.
+        if ( maintainInterval_ == 0 && ( perCore_ || loop->id_ == 0 ) ) {
+            loop->cache_->expireItems();
+        }
+        if ( threadNearCache != NULL ) {
+            threadNearCache->sweep();
+        }
+        // Items whose replies we sent go back to the slabs.
+        reclaimRetired();
+    }
+
+    void handleConnectionEvent( EventLoop *loop, Connection *conn, 
+                                uint32_t events ) {
+        if ( conn->shutdown_ ) {
+            // Closed, waiting for its messages to come back.
+            return;
+        }
+        if ( events & EPOLLOUT ) {
+            bool wasBlocked = conn->hasPendingWrites();
+            if ( wasBlocked ) {
+                // A client slowly reading a big reply is not idle.
+                loop->touchConnection( conn );
+            }
+            flushWrites( conn );
+            // Input that arrived while we were backed up is still in
+            // the socket and edge triggered epoll won't tell us again.
+            if ( wasBlocked && !conn->hasPendingWrites() ) {
+                handleInput( conn );
+            }
+        }
+        if ( events & ( EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR ) ) {
+            loop->touchConnection( conn );
+            handleInput( conn );
+        }
+        if ( conn->state_ == CONN_CLOSING ) {
+            closeConnection( loop, conn );
+        }
+    }
+
+    // Main function of an event loop thread. It waits on epoll for
+    // client sockets, the timer and the new connection eventfd. In per
+    // core mode also for its listening socket, and it only blocks once
+    // no message is waiting for it.
+    void runEventLoop( EventLoop *loop ) {
+        struct epoll_event events[MAX_EPOLL_EVENTS];
+        while ( 1 ) {
+            int timeout = -1;
+            if ( perCore_ ) {
+                flushMessages( loop );
+                timeout = prepareSleep( loop ) ? -1 : 0;
+            }
+            countSyscall();
+            int n = epoll_wait( loop->epollfd_, events, MAX_EPOLL_EVENTS, timeout );
+            __atomic_store_n( &loop->sleeping_, 0, __ATOMIC_RELAXED );
+            if ( n < 0 ) {
+                if ( errno != EINTR ) {
+                    pr_info( "epoll_wait failed on loop %d\n", loop->id_ );
+                }
+                continue;
+            }
+
+            loop->now_ = time( NULL );
+            // The tick may close connections that still have events
+            // further down the batch, so it comes after them.
+            bool tick = false;
+            for ( int i = 0; i < n; i++ ) {
+                void *ptr = events[i].data.ptr;
+                if ( ptr == &loop->notifyfd_ ) {
+                    registerPendingConnections( loop );
+                } else if ( ptr == &loop->timerfd_ ) {
+                    tick = true;
+                } else if ( ptr == &loop->listenfd_ ) {
+                    acceptConnections( loop );
+                } else {
+                    handleConnectionEvent( loop, (Connection *)ptr, events[i].events );
+                }
+            }
+            if ( tick ) {
+                expireIdleConnections( loop );
+            }
+            if ( perCore_ ) {
+                processMessages( loop );
+            }
+        }
+    }
+
+    // Receive from the connection until it ends or we cancel it.
+    void armRecv( EventLoop *loop, Connection *conn ) {
+        if ( !loop->ring_->prepMultishotRecv( conn->fd_, uringData( conn, URING_OP_RECV ) ) ) {
+            conn->state_ = CONN_CLOSING;
+            return;
+        }
+        conn->recvArmed_ = true;
+        conn->inflight_++;
+    }
+
+    // Put the connection in the list of the ones to send to before the
+    // loop enters the kernel again.
+    void queueSend( EventLoop *loop, Connection *conn ) {
+        if ( !conn->queued_ && conn->hasPendingWrites() ) {
+            conn->queued_ = true;
+            loop->sendList_.push_back( conn );
+        }
+    }
+
+    // One sendmsg for every connection of the send list that has no
+    // send in flight, all of them go to the kernel with the next
+    // io_uring_enter. Filled only now because writeIov_ may move while
+    // replies are added, the kernel copies the iovecs on submission.
+    void submitSends( EventLoop *loop ) {
+        for ( size_t i = 0; i < loop->sendList_.size(); i++ ) {
+            Connection *conn = loop->sendList_[i];
+            conn->queued_ = false;
+            if ( conn->shutdown_ ) {
+                closeConnection( loop, conn );
+                continue;
+            }
+            if ( conn->sending_ || !conn->hasPendingWrites() ) {
+                continue;
+            }
+            size_t iovcnt = min( conn->writeIov_.size() - conn->writeIovPos_,
+                                 (size_t)MAX_IOVECS );
+            struct msghdr *msg = &conn->sendMsg_;
+            msg->msg_iov = &conn->writeIov_[conn->writeIovPos_];
+            msg->msg_iovlen = iovcnt;
+            conn->sendBytes_ = 0;
+            for ( size_t v = 0; v < iovcnt; v++ ) {
+                conn->sendBytes_ += msg->msg_iov[v].iov_len;
+            }
+            if ( !loop->ring_->prepSendmsg( conn->fd_, msg, uringData( conn, URING_OP_SEND ) ) ) {
+                closeConnection( loop, conn );
+                continue;
+            }
+            conn->sending_ = true;
+            conn->inflight_++;
+        }
+        loop->sendList_.clear();
+    }
+
+    // A connection the listening socket gave this loop.
+    void handleUringAccept( EventLoop *loop, int res, uint32_t flags ) {
+        if ( res >= 0 ) {
+            int noDelay = 1;
+            countSyscall();
+            setsockopt( res, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof( noDelay ) );
+            Connection *conn = new Connection( res );
+            statAdd( &threadStats.connsOpened_ );
+            conn->loop_ = loop;
+            conn->lastActive_ = loop->now_;
+            loop->idleListAppend( conn );
+            armRecv( loop, conn );
+            if ( conn->state_ == CONN_CLOSING ) {
+                closeConnection( loop, conn );
+            }
+            pr_debug( "Loop %d serving connection %d\n", loop->id_, res );
+        } else {
+            pr_info( "Error accepting a client on loop %d\n", loop->id_ );
+        }
+        if ( !( flags & IORING_CQE_F_MORE ) ) {
+            loop->ring_->prepMultishotAccept( loop->listenfd_,
+                                              uringData( loop, URING_OP_ACCEPT ) );
+        }
+    }
+
+    // Data the multishot receive of the connection put in a provided
+    // buffer. It is copied into the read buffer of the connection and
+    // the provided buffer goes straight back to the ring.
+    void handleUringRecv( EventLoop *loop, Connection *conn, int res, uint32_t flags ) {
+        IoUring *ring = loop->ring_;
+        if ( !( flags & IORING_CQE_F_MORE ) ) {
+            conn->recvArmed_ = false;
+            conn->inflight_--;
+        }
+        if ( flags & IORING_CQE_F_BUFFER ) {
+            unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+            if ( res > 0 && !conn->shutdown_ ) {
+                conn->reader_.feed( ring->buffer( bid ), res );
+            }
+            ring->returnBuffer( bid );
+        }
+        if ( conn->shutdown_ ) {
+            closeConnection( loop, conn );
+            return;
+        }
+
+        if ( res > 0 ) {
+            loop->touchConnection( conn );
+            handleInput( conn );
+        } else if ( res != -ENOBUFS && res != -ECANCELED ) {
+            // The client closed, or the receive failed.
+            conn->state_ = CONN_CLOSING;
+        }
+        if ( conn->state_ == CONN_CLOSING ) {
+            closeConnection( loop, conn );
+            return;
+        }
+
+        // A client that keeps sending without reading its replies has
+        // to wait, like the socket would make it wait with epoll.
+        bool tooMuch = conn->backedUp_ && conn->reader_.pendingBytes() > URING_MAX_BACKLOG;
+        if ( conn->recvArmed_ && tooMuch ) {
+            ring->prepCancel( uringData( conn, URING_OP_RECV ), uringData( NULL, URING_OP_CANCEL ) );
+        } else if ( !conn->recvArmed_ && !tooMuch ) {
+            // The receive ran out of buffers, they are back now.
+            armRecv( loop, conn );
+        }
+        queueSend( loop, conn );
+    }
+
+    // A send of the connection completed, res bytes went out.
+    void handleUringSend( EventLoop *loop, Connection *conn, int res ) {
+        conn->sending_ = false;
+        conn->inflight_--;
+        if ( conn->shutdown_ ) {
+            closeConnection( loop, conn );
+            return;
+        }
+        if ( res < 0 ) {
+            pr_info( "Error write to socket %d\n", conn->fd_ );
+            closeConnection( loop, conn );
+            return;
+        }
+
+        // Skip what went out, the last buffer may be partial.
+        size_t written = res;
+        while ( written > 0 ) {
+            struct iovec *v = &conn->writeIov_[conn->writeIovPos_];
+            if ( written < v->iov_len ) {
+                v->iov_base = (char *)v->iov_base + written;
+                v->iov_len -= written;
+                break;
+            }
+            written -= v->iov_len;
+            conn->writeIovPos_++;
+        }
+        if ( !conn->hasPendingWrites() ) {
+            releaseWrites( conn );
+        }
+
+        bool wasBlocked = conn->backedUp_;
+        conn->backedUp_ = (size_t)res < conn->sendBytes_;
+        if ( wasBlocked || conn->backedUp_ ) {
+            // A client slowly reading a big reply is not idle.
+            loop->touchConnection( conn );
+        }
+        if ( wasBlocked && !conn->backedUp_ ) {
+            // Serve the input that waited for us.
+            handleInput( conn );
+            if ( !conn->recvArmed_ && conn->state_ != CONN_CLOSING ) {
+                armRecv( loop, conn );
+            }
+        }
+        if ( conn->state_ == CONN_CLOSING ) {
+            closeConnection( loop, conn );
+            return;
+        }
+        queueSend( loop, conn );
+    }
+
+    // Main function of an event loop thread with the io_uring backend.
+    // Everything the loop wants done goes to the kernel with the one
+    // io_uring_enter that waits for the next completions: the replies of
+    // all connections served in the last round, receives to re-arm and
+    // the first accept and timer poll. In per core mode the eventfd
+    // other loops wake us with is polled too.
+    void runUringLoop( EventLoop *loop ) {
+        IoUring *ring = loop->ring_;
+        ring->prepMultishotAccept( loop->listenfd_, uringData( loop, URING_OP_ACCEPT ) );
+        ring->prepMultishotPoll( loop->timerfd_, uringData( loop, URING_OP_TIMER ) );
+        if ( perCore_ ) {
+            ring->prepMultishotPoll( loop->notifyfd_, uringData( loop, URING_OP_NOTIFY ) );
+        }
+        while ( 1 ) {
+            submitSends( loop );
+            unsigned waitFor = 1;
+            if ( perCore_ ) {
+                flushMessages( loop );
+                waitFor = prepareSleep( loop ) ? 1 : 0;
+            }
+            if ( ring->submit( waitFor ) < 0 && errno != EINTR && errno != EAGAIN &&
+                 errno != EBUSY ) {
+                pr_info( "io_uring_enter failed on loop %d\n", loop->id_ );
+            }
+            __atomic_store_n( &loop->sleeping_, 0, __ATOMIC_RELAXED );
+
+            loop->now_ = time( NULL );
+            struct io_uring_cqe *cqe;
+            while ( ( cqe = ring->peek() ) != NULL ) {
+                uint64_t data = cqe->user_data;
+                int res = cqe->res;
+                uint32_t flags = cqe->flags;
+                ring->seen();
+                void *ptr = (void *)(uintptr_t)( data & ~(uint64_t)URING_OP_MASK );
+                switch ( data & URING_OP_MASK ) {
+                case URING_OP_RECV:
+                    handleUringRecv( loop, (Connection *)ptr, res, flags );
+                    break;
+                case URING_OP_SEND:
+                    handleUringSend( loop, (Connection *)ptr, res );
+                    break;
+                case URING_OP_ACCEPT:
+                    handleUringAccept( loop, res, flags );
+                    break;
+                case URING_OP_TIMER:
+                    expireIdleConnections( loop );
+                    if ( !( flags & IORING_CQE_F_MORE ) ) {
+                        ring->prepMultishotPoll( loop->timerfd_,
+                                                 uringData( loop, URING_OP_TIMER ) );
+                    }
+                    break;
+                case URING_OP_NOTIFY: {
+                    uint64_t count;
+                    countSyscall();
+                    if ( read( loop->notifyfd_, &count, sizeof( count ) ) < 0 ) {
+                        // Spurious wakeup, nothing to do.
+                    }
+                    if ( !( flags & IORING_CQE_F_MORE ) ) {
+                        ring->prepMultishotPoll( loop->notifyfd_,
+                                                 uringData( loop, URING_OP_NOTIFY ) );
+                    }
+                    break;
+                }
+                default:
+                    // A cancel, the receive it ended tells us.
+                    break;
+                }
+            }
+            if ( perCore_ ) {
+                processMessages( loop );
+            }
+        }
+    }
+
+    // Thread function of the event loop threads.
+    static void * eventLoopFunc( void *arg ) {
+       EventLoop *loop = (EventLoop *)arg;
+       pr_info( "Started event loop %d on thread %lu \n", loop->id_, 
+                (unsigned long)pthread_self() );
+       __atomic_store_n( &loop->stats_, &threadStats, __ATOMIC_RELEASE );
+       if ( loop->memcached_->nearEntries_ > 0 ) {
+           threadNearCache = new NearCache( loop->memcached_->nearEntries_ );
+       }
+       if ( loop->memcached_->perCore_ ) {
+           // The loop keeps its partition and connections in the caches
+           // of one core.
+           cpu_set_t cpus;
+           CPU_ZERO( &cpus );
+           CPU_SET( loop->id_ % sysconf( _SC_NPROCESSORS_ONLN ), &cpus );
+           if ( pthread_setaffinity_np( pthread_self(), sizeof( cpus ), &cpus ) != 0 ) {
+               pr_info( "Error pinning event loop %d\n", loop->id_ );
+           }
+       }
+
+       if ( loop->ring_ != NULL ) {
+           loop->memcached_->runUringLoop( loop );
+       } else {
+           loop->memcached_->runEventLoop( loop );
+       }
+
+       pthread_exit( NULL ); 
+    }
+
+    // Set up the timer and the epoll instance and eventfd, or the ring,
+    // of a loop and start its thread.
+    void startEventLoop( EventLoop *loop ) {
+        if ( perCore_ ) {
+            loop->listenfd_ = tcpServerOpen( MEMCACHED_PORT, true );
+            setNonBlocking( loop->listenfd_ );
+        }
+        loop->timerfd_ = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK );
+        if ( loop->timerfd_ < 0 ) {
+            pr_info( " Error creating event loop %d \n", loop->id_ );
+            exit( 4 );
+        }
+        struct itimerspec tick;
+        tick.it_interval.tv_sec = 1;
+        tick.it_interval.tv_nsec = 0;
+        tick.it_value = tick.it_interval;
+        timerfd_settime( loop->timerfd_, 0, &tick, NULL );
+
+        if ( backend_ == IO_URING ) {
+            loop->ring_ = new IoUring();
+            if ( !loop->ring_->init( URING_ENTRIES ) ||
+                 !loop->ring_->setupBuffers( URING_BUFFERS, URING_BUFFER_SIZE ) ) {
+                pr_info( " Error creating the io_uring of event loop %d \n", loop->id_ );
+                exit( 4 );
+            }
+            loop->notifyfd_ = eventfd( 0, EFD_NONBLOCK );
+            if ( loop->notifyfd_ < 0 ) {
+                pr_info( " Error creating event loop %d \n", loop->id_ );
+                exit( 4 );
+            }
+            pthread_create( &loop->threadId_, NULL, eventLoopFunc, loop );
+            return;
+        }
+
+        loop->epollfd_ = epoll_create1( 0 );
+        loop->notifyfd_ = eventfd( 0, EFD_NONBLOCK );
+        if ( loop->epollfd_ < 0 || loop->notifyfd_ < 0 ) {
+            pr_info( " Error creating event loop %d \n", loop->id_ );
+            exit( 4 );
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &loop->notifyfd_;
+        epoll_ctl( loop->epollfd_, EPOLL_CTL_ADD, loop->notifyfd_, &ev );
+        ev.data.ptr = &loop->timerfd_;
+        epoll_ctl( loop->epollfd_, EPOLL_CTL_ADD, loop->timerfd_, &ev );
+        if ( perCore_ ) {
+            ev.events = EPOLLIN | EPOLLET;
+            ev.data.ptr = &loop->listenfd_;
+            epoll_ctl( loop->epollfd_, EPOLL_CTL_ADD, loop->listenfd_, &ev );
+        }
+
+        pthread_create( &loop->threadId_, NULL, eventLoopFunc, loop );
+    }
+
+    // Hand a newly accepted connection to the next event loop.
+    void dispatchConnection( int connfd ) {
+        EventLoop *loop = loops_[nextLoop_];
+        nextLoop_ = ( nextLoop_ + 1 ) % numLoops_;
+
+        pthread_mutex_lock( &loop->pendingLock_ );
+        loop->pendingFds_.push_back( connfd );
+        pthread_mutex_unlock( &loop->pendingLock_ );
+
+        uint64_t one = 1;
+        if ( write( loop->notifyfd_, &one, sizeof( one ) ) < 0 ) {
+            pr_info( "Error waking event loop %d\n", loop->id_ );
+        }
+    }
+
+    // Thread taking SIGINT and SIGTERM, which are blocked in every
+    // other thread. It saves a last snapshot before we exit, and one
+    // every snapshotInterval_ seconds meanwhile. The event loops keep
+    // serving while it saves.
+    static void * snapshotThreadFunc( void *arg ) {
+        Memcached *memcached = (Memcached *)arg;
+        registerBackgroundStats();
+        sigset_t signals;
+        sigemptyset( &signals );
+        sigaddset( &signals, SIGINT );
+        sigaddset( &signals, SIGTERM );
+        while ( 1 ) {
+            int signo;
+            if ( memcached->snapshotInterval_ > 0 ) {
+                struct timespec timeout;
+                timeout.tv_sec = memcached->snapshotInterval_;
+                timeout.tv_nsec = 0;
+                signo = sigtimedwait( &signals, NULL, &timeout );
+            } else {
+                signo = sigwaitinfo( &signals, NULL );
+            }
+            if ( signo < 0 ) {
+                if ( errno == EAGAIN ) {
+                    Snapshot::save( memcached->partitions_, memcached->snapshotPath_ );
+                }
+                continue;
+            }
+            pr_info( "mymemcached exiting\n" );
+            Snapshot::save( memcached->partitions_, memcached->snapshotPath_ );
+            exit( 0 );
+        }
+        return NULL;
+    }
+
+    // Main memcached server. Starts the event loops and hands every
+    // accepted connection to one of them. With io_uring the loops
+    // accept on the listening socket themselves, in per core mode each
+    // on its own.
+    void startServer() {
+        int sockfd = -1;
+        int newfd; 
+        struct sockaddr_in clientaddr;
+        // Warm up before we take any connection.
+        if ( snapshotPath_ != NULL ) {
+            Snapshot::load( partitions_, snapshotPath_, numLoops_ );
+        }
+        if ( perCore_ ) {
+            pr_info( "Per core mode, %d partitions\n", numLoops_ );
+        } else {
+            sockfd = tcpServerOpen( MEMCACHED_PORT );
+        }
+
+        if ( backend_ == IO_URING && !IoUring::supported() ) {
+            pr_info( "io_uring with multishot receive is not supported, using epoll\n" );
+            backend_ = IO_EPOLL;
+        }
+        pr_info( "I/O backend %s\n", ioBackendNames[backend_] );
+
+        for ( size_t i = 0; i < partitions_.size(); i++ ) {
+            partitions_[i]->startSlabRebalancer();
+            if ( maintainInterval_ > 0 ) {
+                partitions_[i]->startMaintainer( maintainInterval_ );
+            }
+        }
+
+        // All loops exist before any runs, stats and the messages of
+        // per core mode look at all of them.
+        for ( int i = 0; i < numLoops_; i++ ) {
+            EventLoop *loop = new EventLoop( this, i );
+            loop->listenfd_ = sockfd;
+            loop->cache_ = partitions_[perCore_ ? i : 0];
+            loops_.push_back( loop );
+        }
+        for ( int i = 0; perCore_ && i < numLoops_; i++ ) {
+            loops_[i]->inbox_.resize( numLoops_, NULL );
+            loops_[i]->outbox_.resize( numLoops_ );
+            for ( int s = 0; s < numLoops_; s++ ) {
+                if ( s != i ) {
+                    loops_[i]->inbox_[s] = 
+                        new SpscQueue< PartitionMessage * >( PARTITION_QUEUE_SIZE );
+                }
+            }
+        }
+        for ( int i = 0; i < numLoops_; i++ ) {
+            startEventLoop( loops_[i] );
+        }
+
+        if ( udpPort_ > 0 ) {
+            int udpfd = udpServerOpen( udpPort_ );
+            for ( int i = 0; i < numUdpThreads_; i++ ) {
+                UdpWorker *worker = new UdpWorker( this, i, udpfd );
+                udpWorkers_.push_back( worker );
+                pthread_create( &worker->threadId_, NULL, udpWorkerFunc, worker );
+            }
+        }
+
+        if ( snapshotPath_ != NULL ) {
+            pthread_t snapshotThread;
+            pthread_create( &snapshotThread, NULL, snapshotThreadFunc, this );
+        }
+
+        if ( backend_ == IO_URING || perCore_ ) {
+            for ( int i = 0; i < numLoops_; i++ ) {
+                pthread_join( loops_[i]->threadId_, NULL );
+            }
+            return;
+        }
+
+        while ( 1 ) {
+            socklen_t sin_size=sizeof(struct sockaddr_in);
+
+            newfd = accept( sockfd,(struct sockaddr *)&clientaddr,&sin_size );
+            if ( newfd < 0 ) {
+                pr_info("Error Accepting a client \n");
+                continue;
+            } else {
+                pr_debug("Server: got connection from %s %d\n",inet_ntoa(clientaddr.sin_addr),newfd);
+                if ( setNonBlocking( newfd ) < 0 ) {
+                    pr_info( "Error making connection %d non-blocking\n", newfd );
+                    close( newfd );
+                    continue;
+                }
+                // Replies are written as soon as they are ready, don't
+                // let Nagle hold them back waiting for a delayed ack.
+                int noDelay = 1;
+                setsockopt( newfd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof( noDelay ) );
+                dispatchConnection( newfd );
+            }
+ 
+        }
+    }
+
+    // In per core mode every loop gets an equal share of the memory
+    // limit in a partition with a single shard. Only the loop owning
+    // it takes the lock of the shard, other threads only drop
+    // references, which doesn't lock, except for the snapshot thread
+    // collecting the items to save and the maintenance thread of the
+    // partition, with -M.
+    Memcached( int numThreads, size_t memoryLimitMB, EvictionPolicy policy,
+               int udpPort, int numUdpThreads, IoBackend backend, bool perCore,
+               const char *snapshotPath, int snapshotInterval, int chunkKB,
+               int nearEntries, int maintainInterval ) {
+        size_t limit = memoryLimitMB * 1024 * 1024;
+        perCore_ = perCore;
+        if ( perCore_ ) {
+            for ( int i = 0; i < numThreads; i++ ) {
+                partitions_.push_back( new LRUMemCache( limit / numThreads, 1, policy ) );
+            }
+        } else {
+            partitions_.push_back( new LRUMemCache( limit, LRU_CACHE_SHARDS, policy ) );
+        }
+        for ( size_t i = 0; i < partitions_.size(); i++ ) {
+            partitions_[i]->setChunkSize( (size_t)chunkKB * 1024 );
+        }
+        numLoops_ = numThreads;
+        nextLoop_ = 0;
+        udpPort_ = udpPort;
+        numUdpThreads_ = numUdpThreads;
+        backend_ = backend;
+        startTime_ = time( NULL );
+        snapshotPath_ = snapshotPath;
+        snapshotInterval_ = snapshotInterval;
+        nearEntries_ = nearEntries;
+        maintainInterval_ = maintainInterval;
+    }
+
+    ~Memcached() {
+        for ( size_t i = 0; i < partitions_.size(); i++ ) {
+            delete partitions_[i];
+        }
+    }
+};
+
+void memcachedExit( int signo ) {
+    pr_info("mymemcached exiting\n");
+    exit(0);
+}
+
+void usage( const char *prog ) {
+    pr_info( "Usage: %s [-t threads] [-m megabytes] [-e policy] [-U port] "
+             "[-u threads] [-b backend] [-P] [-S file] [-I seconds] [-C kilobytes]\n"
+             "       [-N entries] [-M milliseconds]\n",
+             prog );
+    pr_info( "  -t <num>  number of event loop threads, default one per core\n" );
+    pr_info( "  -m <num>  memory limit for items in megabytes, default %d\n",
+             DEFAULT_MEMORY_LIMIT_MB );
+    pr_info( "  -e <name> eviction policy, lru, clock, slru or tinylfu, default %s\n",
+             evictionPolicyNames[DEFAULT_EVICTION_POLICY] );
+    pr_info( "  -U <num>  UDP port serving gets, default 0 for none\n" );
+    pr_info( "  -u <num>  number of UDP threads, default %d\n", DEFAULT_UDP_THREADS );
+    pr_info( "  -b <name> I/O backend, epoll or uring, default %s\n",
+             ioBackendNames[DEFAULT_IO_BACKEND] );
+    pr_info( "  -P        per core mode, every event loop thread pinned to a core\n"
+             "            with its own listening socket and partition of the cache\n" );
+    pr_info( "  -S <file> snapshot of the items, loaded at start and saved on\n"
+             "            SIGINT or SIGTERM\n" );
+    pr_info( "  -I <num>  also save the snapshot every num seconds, default 0 for never\n" );
+    pr_info( "  -C <num>  values over num kilobytes are stored in chunks of that size,\n"
+             "            %d to %d, default %d\n", ITEM_CHUNK_MIN_KB, ITEM_CHUNK_MAX_KB,
+             DEFAULT_ITEM_CHUNK_KB );
+    pr_info( "  -N <num>  entries of the per thread near cache of hot items, up to %d,\n"
+             "            default %d for none\n", NEAR_CACHE_MAX_ENTRIES,
+             DEFAULT_NEAR_CACHE_ENTRIES );
+    pr_info( "  -M <num>  a maintenance thread per cache partition evicts ahead of the\n"
+             "            sets, expires and frees items every num milliseconds, up to %d,\n"
+             "            default %d for none\n", MAINTAIN_INTERVAL_MAX_MS,
+             DEFAULT_MAINTAIN_INTERVAL_MS );
+}
+
+int main( int argc, char **argv ) {
+    int numThreads = sysconf( _SC_NPROCESSORS_ONLN );
+    int memoryLimitMB = DEFAULT_MEMORY_LIMIT_MB;
+    EvictionPolicy policy = DEFAULT_EVICTION_POLICY;
+    int udpPort = 0;
+    int numUdpThreads = DEFAULT_UDP_THREADS;
+    IoBackend backend = DEFAULT_IO_BACKEND;
+    bool perCore = false;
+    const char *snapshotPath = NULL;
+    int snapshotInterval = 0;
+    int chunkKB = DEFAULT_ITEM_CHUNK_KB;
+    int nearEntries = DEFAULT_NEAR_CACHE_ENTRIES;
+    int maintainInterval = DEFAULT_MAINTAIN_INTERVAL_MS;
+    int opt;
+
+    while ( ( opt = getopt( argc, argv, "t:m:e:U:u:b:PS:I:C:N:M:h" ) ) != -1 ) {
+        switch ( opt ) {
+        case 't':
+            numThreads = atoi( optarg );
+            break;
+        case 'm':
+            memoryLimitMB = atoi( optarg );
+            break;
+        case 'e':
+            if ( !parseEvictionPolicy( optarg, &policy ) ) {
+                usage( argv[0] );
+                return 1;
+            }
+            break;
+        case 'U':
+            udpPort = atoi( optarg );
+            break;
+        case 'u':
+            numUdpThreads = atoi( optarg );
+            break;
+        case 'b':
+            if ( !parseIoBackend( optarg, &backend ) ) {
+                usage( argv[0] );
+                return 1;
+            }
+            break;
+        case 'P':
+            perCore = true;
+            break;
+        case 'S':
+            snapshotPath = optarg;
+            break;
+        case 'I':
+            snapshotInterval = atoi( optarg );
+            break;
+        case 'C':
+            chunkKB = atoi( optarg );
+            break;
+        case 'N':
+            nearEntries = atoi( optarg );
+            break;
+        case 'M':
+            maintainInterval = atoi( optarg );
+            break;
+        default:
+            usage( argv[0] );
+            return 1;
+        }
+    }
+    if ( numThreads <= 0 ) {
+        numThreads = 1;
+    }
+    if ( memoryLimitMB <= 0 || udpPort < 0 || numUdpThreads <= 0 || snapshotInterval < 0 ||
+         ( snapshotInterval > 0 && snapshotPath == NULL ) ||
+         chunkKB < ITEM_CHUNK_MIN_KB || chunkKB > ITEM_CHUNK_MAX_KB ||
+         nearEntries < 0 || nearEntries > NEAR_CACHE_MAX_ENTRIES ||
+         maintainInterval < 0 || maintainInterval > MAINTAIN_INTERVAL_MAX_MS ) {
+        usage( argv[0] );
+        return 1;
+    }
+
+    if ( snapshotPath != NULL ) {
+        // Blocked before any thread starts, so they all inherit it and
+        // only the snapshot thread takes them.
+        sigset_t signals;
+        sigemptyset( &signals );
+        sigaddset( &signals, SIGINT );
+        sigaddset( &signals, SIGTERM );
+        pthread_sigmask( SIG_BLOCK, &signals, NULL );
+    } else {
+        signal(SIGINT, memcachedExit);
+    }
+    // A client going away while we write to it must not kill us.
+    signal(SIGPIPE, SIG_IGN);
+    pr_info( "Eviction policy %s\n", evictionPolicyNames[policy] );
+    Memcached memcachedServer( numThreads, memoryLimitMB, policy, udpPort, numUdpThreads,
+                               backend, perCore, snapshotPath, snapshotInterval, chunkKB,
+                               nearEntries, maintainInterval );
     memcachedServer.startServer();
     return 0;
 }
@@ -10,9 +10,19 @@
 #include <sys/types.h> 
 #include <sys/socket.h> 
 #include <netinet/in.h> 
+#include <netinet/tcp.h>
 #include <sys/time.h>
 #include <signal.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <stdint.h>
+#include <algorithm>
 #include <iostream>
 #include <vector>
 #include <list>
@@ -24,12 +34,78 @@ using namespace std;
 //#define DEBUG 1
 
 #define MEMCACHED_PORT 11211
-// Chunk size we try to read from the socket
-#define BUFFSIZE 1024
+// Initial size of the read buffer of a connection. It is refilled with
+// as much as fits, so one read can bring many pipelined commands.
+#define BUFFSIZE 16384
+// Longest command line we accept. The read buffer grows up to this
+// size for a long multi key get, longer lines close the connection.
+#define MAX_COMMAND_LINE ( 64 * 1024 )
+// Most iovecs we hand to a single writev.
+#ifdef IOV_MAX
+#define MAX_IOVECS IOV_MAX
+#else
+#define MAX_IOVECS 1024
+#endif
+// Longest key we store, as in memcached.
+#define KEY_MAX_LENGTH 250
 // Back log for listen system call.
 #define BACK_LOG 1024
-// Size at which we will start evicting from the LRU cache
-#define MAX_LRU_CACHE_SIZE 1024
+// Memory limit of the LRU cache in megabytes unless -m says otherwise.
+// We start evicting when the items take this much.
+#define DEFAULT_MEMORY_LIMIT_MB 64
+// Number of independently locked shards of the LRU cache. Must be a
+// power of two.
+#define LRU_CACHE_SHARDS 16
+// Eviction policy of the shards unless -e says otherwise. See
+// EvictionPolicy in LRUMemCache.h.
+#define DEFAULT_EVICTION_POLICY EVICT_SLRU
+// Items are stored in chunks carved out of pages of this size. Items
+// bigger than what fits in a page are malloced on their own.
+#define SLAB_PAGE_SIZE ( 1024 * 1024 )
+// Values bigger than this many kilobytes are cut in data chunks of
+// that size, chained to their item, unless -C says otherwise. -C
+// takes ITEM_CHUNK_MIN_KB to ITEM_CHUNK_MAX_KB, the smallest keeps the
+// chunk list of the biggest value in one page.
+#define DEFAULT_ITEM_CHUNK_KB 512
+#define ITEM_CHUNK_MIN_KB 16
+#define ITEM_CHUNK_MAX_KB 1000
+// Biggest value a set may store, bigger ones are read and dropped.
+#define ITEM_SIZE_MAX ( 1 << 30 )
+// Every thread serving gets may keep references to the hottest items in
+// a NearCache of this many entries, 0 turns it off unless -N says
+// otherwise. One shared hit in NEAR_CACHE_SAMPLE is sampled, a key
+// sampled NEAR_CACHE_ADMIT times more than it lost its candidate slot
+// is admitted if its value is at most NEAR_CACHE_VALUE_MAX bytes. One
+// hit of an entry in NEAR_CACHE_REFRESH goes to the shared cache, so
+// the LRU still sees it.
+#define DEFAULT_NEAR_CACHE_ENTRIES 0
+#define NEAR_CACHE_MAX_ENTRIES 65536
+#define NEAR_CACHE_SAMPLE 16
+#define NEAR_CACHE_ADMIT 4
+#define NEAR_CACHE_VALUE_MAX 4096
+#define NEAR_CACHE_REFRESH 64
+// Size of the smallest chunk and the factor between the chunk sizes of
+// two consecutive slab classes.
+#define SLAB_MIN_CHUNK 64
+#define SLAB_GROWTH_FACTOR 1.25
+// Seconds between two runs of the slab page rebalancer.
+#define SLAB_REBALANCE_INTERVAL 1
+// Most milliseconds between two passes of the maintenance thread of
+// each cache, 0 leaves eviction, expiry and freeing to the threads
+// serving requests unless -M says otherwise. While it finds items to
+// evict it comes back sooner, down to MAINTAIN_MIN_SLEEP_US. A pass
+// evicts until every shard has MAINTAIN_FREE_PERCENT of its budget
+// free, MAINTAIN_EVICT_BATCH items per hold of the lock and
+// MAINTAIN_EVICT_MAX per shard at most.
+#define DEFAULT_MAINTAIN_INTERVAL_MS 0
+#define MAINTAIN_INTERVAL_MAX_MS 1000
+#define MAINTAIN_MIN_SLEEP_US 500
+#define MAINTAIN_FREE_PERCENT 2
+#define MAINTAIN_EVICT_BATCH 32
+#define MAINTAIN_EVICT_MAX 4096
+// An exptime up to this many seconds is relative to now, a bigger one
+// is an absolute unix time, as in memcached.
+#define REALTIME_MAXDELTA ( 60 * 60 * 24 * 30 )
 
 // Constant for memcached protocol reply
 static const char *storedReply = "STORED\r\n";
@@ -38,11 +114,200 @@ static const char *endReply = "END\r\n";
 static const int storedReplySize = 8;
 static const int endReplySize = 5;
 static const char *getReplyStart = "VALUE";
+static const int getReplyStartSize = 5;
+static const char *outOfMemoryReply = "SERVER_ERROR out of memory storing object\r\n";
+static const int outOfMemoryReplySize = 43;
+static const char *tooLargeReply = "SERVER_ERROR object too large for cache\r\n";
+static const int tooLargeReplySize = 41;
+static const char *okReply = "OK\r\n";
+static const int okReplySize = 4;
+static const char *badFormatReply = "CLIENT_ERROR bad command line format\r\n";
+static const int badFormatReplySize = 38;
+static const char *notStoredReply = "NOT_STORED\r\n";
+static const int notStoredReplySize = 12;
+static const char *existsReply = "EXISTS\r\n";
+static const int existsReplySize = 8;
+static const char *notFoundReply = "NOT_FOUND\r\n";
+static const int notFoundReplySize = 11;
+static const char *deletedReply = "DELETED\r\n";
+static const int deletedReplySize = 9;
+static const char *touchedReply = "TOUCHED\r\n";
+static const int touchedReplySize = 9;
+static const char *notNumericReply =
+    "CLIENT_ERROR cannot increment or decrement non-numeric value\r\n";
+static const int notNumericReplySize = 62;
+
+// Maximum events we pick up from a single epoll_wait call.
+#define MAX_EPOLL_EVENTS 256
+
+// UDP frontend. Every datagram starts with the 8 byte frame header of
+// memcached: request id, sequence number, number of datagrams and a
+// reserved field, 16 bits each in network byte order.
+#define UDP_HEADER_SIZE 8
+// Replies are cut in datagrams of at most this size, header included.
+#define UDP_MAX_DATAGRAM 1400
+// Longest request datagram we take, requests must fit in one.
+#define UDP_MAX_REQUEST 8192
+// Datagrams a UDP thread receives with a single recvmmsg.
+#define UDP_BATCH 64
+// Number of UDP threads unless -u says otherwise.
+#define DEFAULT_UDP_THREADS 2
+static const char *udpMultiPacketReply = "SERVER_ERROR multi-packet request not supported\r\n";
+static const int udpMultiPacketReplySize = 49;
+static const char *udpGetOnlyReply = "CLIENT_ERROR only get is served over UDP\r\n";
+static const int udpGetOnlyReplySize = 42;
+static const char *udpTooLargeReply = "SERVER_ERROR reply too large for UDP\r\n";
+static const int udpTooLargeReplySize = 38;
+
+// How the event loops do their I/O.
+enum IoBackend {
+    // epoll on non-blocking sockets, a read and a writev per ready
+    // connection.
+    IO_EPOLL = 0,
+    // An io_uring per loop, with multishot accept and receive into
+    // provided buffers and sends handed in together. See IoUring.h.
+    IO_URING
+};
+
+static const char *ioBackendNames[] = { "epoll", "uring" };
+
+// Backend called name, false if there is none.
+static inline bool parseIoBackend( const char *name, IoBackend *backend ) {
+    for ( int i = IO_EPOLL; i <= IO_URING; i++ ) {
+        if ( strcmp( name, ioBackendNames[i] ) == 0 ) {
+            *backend = (IoBackend)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// I/O backend unless -b says otherwise. uring falls back to epoll on
+// kernels without multishot receive.
+#define DEFAULT_IO_BACKEND IO_EPOLL
+
+// Per core mode (-P). Every event loop has its own partition of the
+// cache and its own listening socket, and asks the loop owning a key
+// through a queue of PARTITION_QUEUE_SIZE messages from every other
+// loop. A power of two.
+#define PARTITION_QUEUE_SIZE 1024
+// Replies a connection may have waiting behind a request to another
+// loop before we stop reading its commands.
+#define MAX_DEFERRED_REPLIES 256
+
+// Buckets of the latency histograms of "stats latency". Bucket b
+// counts the commands that took [2^(b-1), 2^b) nanoseconds, the last
+// one everything from 2^(LATENCY_BUCKETS - 2) up, a second or more.
+#define LATENCY_BUCKETS 32
+
+// Counters of a thread for "stats". Only the owning thread writes
+// them, with plain stores, other threads read them through the
+// pointer its event loop or UDP worker keeps, or the one a background
+// thread registers, and add them up when stats are asked for. Aligned
+// on a cache line so the counters of two threads never share one.
+struct ThreadStats {
+    uint64_t syscalls_;        // System calls made for I/O.
+    uint64_t commands_;        // Commands served.
+    uint64_t getHits_;         // Keys looked up and found.
+    uint64_t getMisses_;
+    uint64_t sets_;            // Items stored.
+    uint64_t deleteHits_;
+    uint64_t deleteMisses_;
+    uint64_t incrHits_;        // incr and decr that changed a number.
+    uint64_t incrMisses_;
+    uint64_t casHits_;         // cas that stored.
+    uint64_t casMisses_;       // cas of a key that wasn't there.
+    uint64_t casBadval_;       // cas of a key another client changed.
+    uint64_t touchHits_;
+    uint64_t touchMisses_;
+    uint64_t lockWaits_;       // Shard locks found taken by another thread.
+    uint64_t lockWaitNanos_;   // Time spent waiting for them.
+    uint64_t nearHits_;        // Gets served from the NearCache of the thread.
+    uint64_t nearStale_;       // NearCache entries found replaced or expired.
+    uint64_t connsOpened_;
+    uint64_t connsClosed_;
+    uint64_t getLatency_[LATENCY_BUCKETS];
+    uint64_t setLatency_[LATENCY_BUCKETS];
+} __attribute__(( aligned( 64 ) ));
+
+static __thread ThreadStats threadStats;
+
+static inline void statAdd( uint64_t *counter, uint64_t n = 1 ) {
+    __atomic_store_n( counter, *counter + n, __ATOMIC_RELAXED );
+}
 
-// A thread service the connection will sleep for 1 second 
-// if it read zero bytes. If it slept for threadTimeOutSecs, 
-// it assume client has closed the connection and quits. 
-static const int threadTimeOutSecs = 5;
+static inline uint64_t statLoad( const uint64_t *counter ) {
+    return __atomic_load_n( counter, __ATOMIC_RELAXED );
+}
+
+// Add the counters of stats to total. Every field is a uint64_t.
+static inline void addThreadStats( ThreadStats *total, const ThreadStats *stats ) {
+    uint64_t *sum = (uint64_t *)total;
+    const uint64_t *counters = (const uint64_t *)stats;
+    for ( size_t c = 0; c < sizeof( ThreadStats ) / sizeof( uint64_t ); c++ ) {
+        sum[c] += statLoad( &counters[c] );
+    }
+}
+
+// The slab rebalancers, the cache maintainers and the snapshot thread
+// wait for shard locks too. They list their counters here when they
+// start, and run as long as the server does. The threads loading a
+// snapshot don't, they are done before the server serves anything and
+// the items they store are no sets of clients. The list is never
+// freed, the threads still run while exit() destroys static objects.
+static pthread_mutex_t backgroundStatsLock = PTHREAD_MUTEX_INITIALIZER;
+static vector< ThreadStats * > *backgroundStats;
+
+static inline void registerBackgroundStats() {
+    pthread_mutex_lock( &backgroundStatsLock );
+    if ( backgroundStats == NULL ) {
+        backgroundStats = new vector< ThreadStats * >();
+    }
+    backgroundStats->push_back( &threadStats );
+    pthread_mutex_unlock( &backgroundStatsLock );
+}
+
+// Add the counters of the background threads to total.
+static inline void addBackgroundStats( ThreadStats *total ) {
+    pthread_mutex_lock( &backgroundStatsLock );
+    for ( size_t i = 0; backgroundStats != NULL && i < backgroundStats->size(); i++ ) {
+        addThreadStats( total, (*backgroundStats)[i] );
+    }
+    pthread_mutex_unlock( &backgroundStatsLock );
+}
+
+static inline void countSyscall() {
+    statAdd( &threadStats.syscalls_ );
+}
+
+static inline void countCommand() {
+    statAdd( &threadStats.commands_ );
+}
+
+// Nanoseconds on the monotonic clock, read without a system call.
+static inline uint64_t nowNanos() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// The same in seconds, for the benchmarks and the timings we log.
+static inline double nowSecs() {
+    return nowNanos() / 1e9;
+}
+
+// Count a command that started at start, from nowNanos(), in the
+// latency histogram.
+static inline void recordLatency( uint64_t *histogram, uint64_t start ) {
+    uint64_t nanos = nowNanos() - start;
+    int bucket = nanos == 0 ? 0 : 64 - __builtin_clzll( nanos );
+    statAdd( &histogram[ min( bucket, LATENCY_BUCKETS - 1 ) ] );
+}
+
+// Every event loop has a timer firing once a second. A connection
+// that has not sent us anything for connTimeOutSecs is closed on
+// the next tick.
+static const int connTimeOutSecs = 5;
 
 #ifdef DEBUG
 #define pr_debug(fmt,arg...) \
@@ -57,61 +322,622 @@ static inline int pr_debug(const char * fmt, ...)
 #define pr_info(fmt,arg...) \
         fprintf( stderr,fmt,##arg)
 
+// Seconds on a clock that doesn't jump with the wall clock. Expiry
+// times of items are kept in it. The coarse clock is read without a
+// system call.
+static inline uint32_t currentTime() {
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC_COARSE, &ts );
+    return ts.tv_sec;
+}
+
+// Expiry time on currentTime() of an item set with exptime, 0 if it
+// never expires. A negative exptime, or an absolute one in the past,
+// expires the item right away.
+static inline uint32_t expiryTime( long exptime ) {
+    if ( exptime == 0 ) {
+        return 0;
+    }
+    uint32_t now = currentTime();
+    if ( exptime < 0 ) {
+        return now;
+    }
+    if ( exptime > REALTIME_MAXDELTA ) {
+        time_t realNow = time( NULL );
+        if ( exptime <= realNow ) {
+            return now;
+        }
+        exptime -= realNow;
+    }
+    return now + exptime;
+}
+
 class Memcached;
 
-// Set and get are only commands supported.
+// Commands we support.
 enum MemcacheCommand {
     COMMAND_INVALID = 0,
     COMMAND_GET,
-    COMMAND_SET
+    COMMAND_SET,
+    COMMAND_STATS,
+    COMMAND_CACHE_MEMLIMIT,
+    COMMAND_GETS,        // get with the CAS unique of every item.
+    COMMAND_CAS,         // set if the item is still the one gets returned.
+    COMMAND_APPEND,
+    COMMAND_PREPEND,
+    COMMAND_INCR,
+    COMMAND_DECR,
+    COMMAND_DELETE,
+    COMMAND_TOUCH
 };
 
-// We create a thread for handling each connection to memcached
-// server. This class is passed as arguement to the thread function.
-class ThreadArg {
-public:
-    Memcached *memcached_;
-    int sockfd_;
+static const char *commandNames[] = { "invalid", "get", "set", "stats",
+                                      "cache_memlimit", "gets", "cas", "append",
+                                      "prepend", "incr", "decr", "delete", "touch" };
+
+// Whether command is followed by a value block, like set.
+static inline bool storageCommand( MemcacheCommand command ) {
+    return command == COMMAND_SET || command == COMMAND_CAS ||
+           command == COMMAND_APPEND || command == COMMAND_PREPEND;
+}
+
+// Result of trying to read a command or value from a non-blocking
+// socket.
+enum ReadStatus {
+    READ_OK = 0,   // Command or value is complete.
+    READ_AGAIN,    // Socket is drained, wait for the next EPOLLIN.
+    READ_CLOSED    // Client closed the connection or read failed.
+};
+
+// A connection is either waiting for a command line or for the value
+// block of a set command it has already parsed.
+enum ConnState {
+    CONN_READ_COMMAND = 0,
+    CONN_READ_VALUE,
+    CONN_CLOSING
+};
+
+// Protocol a connection speaks, known once its first byte came in.
+enum ConnProtocol {
+    PROTOCOL_UNKNOWN = 0,
+    PROTOCOL_TEXT,
+    PROTOCOL_BINARY
+};
+
+// Outcome of storing the value of a set, or of changing an item in
+// place of the client.
+enum StoreResult {
+    STORE_OK = 0,
+    STORE_BAD_KEY,
+    STORE_NO_MEMORY,
+    STORE_TOO_LARGE,
+    STORE_NOT_STORED,    // append or prepend to a key that isn't there.
+    STORE_EXISTS,        // cas of an item changed since gets.
+    STORE_NOT_FOUND,     // cas, incr, decr or touch of a key that isn't there.
+    STORE_NOT_NUMERIC    // incr or decr of a value that isn't a number.
+};
+
+// What a message to the loop owning a key asks it for.
+enum PartitionOp {
+    PARTITION_GET = 0,
+    PARTITION_SET,       // Also cas, append and prepend.
+    PARTITION_DELETE,
+    PARTITION_INCR,      // Also decr.
+    PARTITION_TOUCH
+};
+
+// Bytes of a buffer owned by someone else, like a token of a command
+// line still sitting in the read buffer. Used to pass keys around
+// without copying them.
+struct StringPiece {
+    const char *data;
+    size_t size;
+
+    StringPiece() {
+        data = NULL;
+        size = 0;
+    }
+
+    StringPiece( const char *pData, size_t pSize ) {
+        data = pData;
+        size = pSize;
+    }
+
+    bool equals( const char *str, size_t len ) const {
+        return size == len && memcmp( data, str, len ) == 0;
+    }
 
-    ThreadArg( Memcached *pMemcached, int pSockfd) {
-        memcached_ = pMemcached;
-        sockfd_ = pSockfd;
+    // Value of a decimal number that may be negative. Returns false if
+    // it isn't one.
+    bool toInteger( long *value ) const {
+        if ( size > 0 && data[0] == '-' ) {
+            long number = StringPiece( data + 1, size - 1 ).toNumber();
+            *value = -number;
+            return number >= 0;
+        }
+        *value = toNumber();
+        return *value >= 0;
+    }
+
+    // Value of an unsigned 64 bit decimal number. Returns false if it
+    // isn't one or doesn't fit.
+    bool toUint64( uint64_t *value ) const {
+        if ( size == 0 || size > 20 ) {
+            return false;
+        }
+        uint64_t number = 0;
+        for ( size_t i = 0; i < size; i++ ) {
+            if ( data[i] < '0' || data[i] > '9' ) {
+                return false;
+            }
+            uint64_t digit = data[i] - '0';
+            if ( number > ( UINT64_MAX - digit ) / 10 ) {
+                return false;
+            }
+            number = number * 10 + digit;
+        }
+        *value = number;
+        return true;
+    }
+
+    // Value of a non negative decimal number, -1 if it isn't one.
+    long toNumber() const {
+        if ( size == 0 || size > 18 ) {
+            return -1;
+        }
+        long value = 0;
+        for ( size_t i = 0; i < size; i++ ) {
+            if ( data[i] < '0' || data[i] > '9' ) {
+                return -1;
+            }
+            value = value * 10 + ( data[i] - '0' );
+        }
+        return value;
     }
 };
 
-// Once we parse memcached commands we store it in this structure.
+// Once we parse memcached commands we store it in this structure. The
+// keys point into the command line they were parsed from.
 class MCCommand {
 public:
     MemcacheCommand command_;
-    string key;
-    int size;
+    StringPiece key;
+    vector< StringPiece > keys;   // All the keys of a get.
+    int size;                     // Value size of a set, -1 if malformed.
+    uint32_t flags;               // Opaque to us, returned with the value.
+    long exptime;                 // Also the one touch sets.
+    uint64_t number;              // CAS unique of cas, delta of incr and decr.
+    bool noreply;                 // Don't answer, the client doesn't wait.
+
+    MCCommand() {
+        clear();
+    }
+
+    // Ready for the next command. keys keeps its memory.
+    void clear() {
+        command_ = COMMAND_INVALID;
+        key = StringPiece();
+        keys.clear();
+        size = 0;
+        flags = 0;
+        exptime = 0;
+        number = 0;
+        noreply = false;
+    }
     
     void printCommand( void ) {
-        pr_debug( "Command:%s, Key:%s, Size:%d\n", 
-                  command_== COMMAND_GET ? "get" : "set",
-                  key.c_str(), size );
+        pr_debug( "Command:%s, Key:%.*s, Keys:%zu, Size:%d, Flags:%u, Exptime:%ld\n", 
+                  commandNames[command_],
+                  (int)key.size, key.data, keys.size(), size, flags, exptime );
     }
 
 };
 
+// Tokenize a command line, without its \r\n, and extract the command
+// into mcCommand. The tokens are not copied, the line has to stay
+// around as long as mcCommand is used. A command missing one of its
+// arguments, or with a bad one, has size -1. The optional noreply
+// comes after all of them.
+static inline void extractCommand( const char *line, size_t len,
+                                   MCCommand *mcCommand ) {
+    const char *end = line + len;
+    const char *p = line;
+    int i = 1;
+    int noreplyAt = 0;    // Token that may be noreply.
+    long casSize = 0;     // Size of a cas, valid once its unique came.
+    mcCommand->clear();
+    while ( 1 ) {
+        while ( p < end && *p == ' ' ) {
+            p++;
+        }
+        if ( p == end ) {
+            return;
+        }
+        const char *tokenEnd = (const char *)memchr( p, ' ', end - p );
+        if ( tokenEnd == NULL ) {
+            tokenEnd = end;
+        }
+        StringPiece token( p, tokenEnd - p );
+        p = tokenEnd;
+        MemcacheCommand command = mcCommand->command_;
+
+        if( i == 1) {
+            // Checking command
+            if ( token.equals( "get", 3 ) ) { 
+                mcCommand->command_ = COMMAND_GET;
+            } else if ( token.equals( "set", 3 ) ) {
+                mcCommand->command_ = COMMAND_SET;
+                noreplyAt = 6;
+            } else if ( token.equals( "gets", 4 ) ) {
+                mcCommand->command_ = COMMAND_GETS;
+            } else if ( token.equals( "cas", 3 ) ) {
+                mcCommand->command_ = COMMAND_CAS;
+                noreplyAt = 7;
+            } else if ( token.equals( "append", 6 ) ) {
+                mcCommand->command_ = COMMAND_APPEND;
+                noreplyAt = 6;
+            } else if ( token.equals( "prepend", 7 ) ) {
+                mcCommand->command_ = COMMAND_PREPEND;
+                noreplyAt = 6;
+            } else if ( token.equals( "incr", 4 ) ) {
+                mcCommand->command_ = COMMAND_INCR;
+                noreplyAt = 4;
+            } else if ( token.equals( "decr", 4 ) ) {
+                mcCommand->command_ = COMMAND_DECR;
+                noreplyAt = 4;
+            } else if ( token.equals( "delete", 6 ) ) {
+                mcCommand->command_ = COMMAND_DELETE;
+                noreplyAt = 3;
+            } else if ( token.equals( "touch", 5 ) ) {
+                mcCommand->command_ = COMMAND_TOUCH;
+                noreplyAt = 4;
+            } else if ( token.equals( "stats", 5 ) ) { 
+                mcCommand->command_ = COMMAND_STATS;
+            } else if ( token.equals( "cache_memlimit", 14 ) ) { 
+                mcCommand->command_ = COMMAND_CACHE_MEMLIMIT;
+            } else {
+                // Unsupported command
+                mcCommand->command_ = COMMAND_INVALID;
+                return;
+            }
+        } else if( i == 2 && command == COMMAND_CACHE_MEMLIMIT ) {
+            // New limit in megabytes.
+            mcCommand->size = token.toNumber();
+            return;
+        } else if( command == COMMAND_GET || command == COMMAND_GETS ) {
+            // Every token after get is a key.
+            mcCommand->keys.push_back( token );
+        } else if( i == 2 ) {
+            mcCommand->key = token;
+            if ( command == COMMAND_STATS ) {
+                // For stats the key is the kind of stats asked for.
+                return;
+            }
+            // Malformed until we have seen the rest, delete has none.
+            mcCommand->size = command == COMMAND_DELETE ? 0 : -1;
+        } else if ( i == noreplyAt ) {
+            mcCommand->noreply = token.equals( "noreply", 7 );
+            return;
+        } else if ( command == COMMAND_INCR || command == COMMAND_DECR ) {
+            // i == 3, the delta.
+            if ( !token.toUint64( &mcCommand->number ) ) {
+                return;
+            }
+            mcCommand->size = 0;
+        } else if ( command == COMMAND_TOUCH ) {
+            // i == 3, the new exptime.
+            if ( !token.toInteger( &mcCommand->exptime ) ) {
+                return;
+            }
+            mcCommand->size = 0;
+        } else if ( i == 3 ) {
+            long flags = token.toNumber();
+            if ( flags < 0 || flags > UINT32_MAX ) {
+                return;
+            }
+            mcCommand->flags = flags;
+        } else if ( i == 4 ) {
+            if ( !token.toInteger( &mcCommand->exptime ) ) {
+                return;
+            }
+        }  else if ( i == 5 ) {
+            // Extract size of get. Too big for an int is malformed,
+            // over ITEM_SIZE_MAX the set is answered as too large.
+            long size = token.toNumber();
+            size = size > INT_MAX - 2 ? -1 : size;
+            if ( command != COMMAND_CAS ) {
+                mcCommand->size = size;
+            } else {
+                casSize = size;
+            }
+        } else if ( i == 6 ) {
+            // The CAS unique of cas.
+            if ( !token.toUint64( &mcCommand->number ) ) {
+                return;
+            }
+            mcCommand->size = casSize;
+        }
+        i++;
+    }
+}
+
+// Flags in MemcachedItem::iflags_
+#define ITEM_LINKED  0x1    // Item is in the index and LRU list of a shard.
+#define ITEM_SLABBED 0x2    // Chunk is free and sits in a slab free list.
+#define ITEM_ACTIVE  0x4    // Got a hit since it was last looked at by eviction.
+#define ITEM_PROTECTED 0x8  // In the protected list of a segmented LRU shard.
+#define ITEM_CHAINED 0x10   // The value is in data chunks, see ItemChain.
+#define ITEM_CHUNK   0x20   // Data chunk of a chained item, prev_ is the item.
+#define ITEM_WINDOW  0x40   // In the window list of a W-TinyLFU shard.
+
+class MemcachedItem;
+
+// Data chunks of a chained item, listed after its VALUE line at the
+// next 8 byte boundary. A data chunk is a MemcachedItem without key
+// or VALUE line whose size_ bytes of value follow its header, so the
+// slab allocator hands it out and frees it like any item. Every chunk
+// but the last holds chunkBytes_ of the value, \r\n included.
+struct ItemChain {
+    uint32_t count_;
+    uint32_t chunkBytes_;
+    MemcachedItem *chunks_[];
+};
+
+// Number of decimal digits of value.
+static inline int decimalDigits( unsigned long value ) {
+    int digits = 1;
+    while ( value >= 10 ) {
+        value /= 10;
+        digits++;
+    }
+    return digits;
+}
+
 // Each key-value pair is maintained as this Class in the LRU cache. 
-// LRU cache is list of these items.
+// The item is only a header. It is placed at the start of a chunk
+// handed out by SlabAllocator and the VALUE line of a get reply and
+// the value follow it in the same chunk, so an item is a single
+// allocation and a hit goes out as a single iovec. The key is kept
+// inside the VALUE line. Items link themselves into the LRU list of
+// their shard. A value too big for one chunk is chained instead, see
+// ItemChain, and goes out as an iovec per chunk. Code that doesn't
+// know the size of the value goes through valueAt().
+//
+// Items are reference counted. The cache holds one reference while the
+// item is linked and every get holds one until its reply has been
+// written out. Once the count drops to zero the chunk is retired and
+// freed when no lock free get can be looking at it any more.
+//
+// Gets don't lock and replies point into the item until they are
+// sent, so the value of a linked item never changes. incr, append and
+// cas link a new item in its place. Only the expiry time changes, for
+// touch, and is read with expiry().
 class MemcachedItem {
 public: 
-    string key_;
-    int size_;
-    char *value_;
-   
-    MemcachedItem( string key, int size, char *buffer ) {
-        key_ = key;
+    MemcachedItem *prev_;   // Towards the most recently used item.
+    MemcachedItem *next_;   // Towards the least recently used item.
+    MemcachedItem *wheelNext_;     // Next item in the same timing wheel slot.
+    MemcachedItem **wheelPrev_;    // What points at us there, NULL if not in the wheel.
+    uint64_t hash_;         // Hash of the key, computed once at set time.
+    uint64_t cas_;          // CAS unique, given by the shard linking the item.
+    int size_;              // Size of the value including \r\n.
+    int keyLen_;
+    int refcount_;
+    uint32_t flags_;        // Flags of the set, also in the VALUE line.
+    uint32_t exptime_;      // Expiry on currentTime(), 0 for never.
+    uint16_t headerLen_;    // Length of the VALUE line.
+    uint8_t slabClass_;     // 0 if the item was too big for any class.
+    uint8_t iflags_;
+    char data_[];           // "VALUE <key> <flags> <bytes>\r\n" followed by the value.
+
+    // Length of the VALUE line of an item with this key, flags and
+    // value size.
+    static size_t headerSize( size_t keyLen, uint32_t flags, size_t size ) {
+        return getReplyStartSize + 1 + keyLen + 1 + decimalDigits( flags ) + 1 +
+               decimalDigits( size - 2 ) + 2;
+    }
+
+    // Bytes needed for an item with this key, flags and value size.
+    static size_t totalSize( size_t keyLen, uint32_t flags, size_t size ) {
+        return sizeof( MemcachedItem ) + headerSize( keyLen, flags, size ) + size;
+    }
+
+    // Offset in data_ of the ItemChain of a chained item.
+    static size_t chainOffset( size_t headerLen ) {
+        return ( headerLen + 7 ) & ~(size_t)7;
+    }
+
+    // Bytes of the item itself when its value is in chunks data chunks.
+    static size_t chainedSize( size_t headerLen, size_t chunks ) {
+        return sizeof( MemcachedItem ) + chainOffset( headerLen ) + sizeof( ItemChain ) +
+               chunks * sizeof( MemcachedItem * );
+    }
+
+    // Set up the header in a chunk just handed out by the allocator.
+    // The caller owns the only reference.
+    void init( const char *key, size_t keyLen, uint32_t flags, uint32_t exptime,
+               int size ) {
+        prev_ = NULL;
+        next_ = NULL;
+        wheelNext_ = NULL;
+        wheelPrev_ = NULL;
+        hash_ = 0;
+        cas_ = 0;
         size_ = size;
-        value_ = ( char *) malloc( sizeof( char ) * size );
-        memcpy( value_, buffer, size_ );
+        keyLen_ = keyLen;
+        refcount_ = 1;
+        flags_ = flags;
+        exptime_ = exptime;
+        iflags_ = 0;
+
+        char *p = data_;
+        memcpy( p, getReplyStart, getReplyStartSize );
+        p += getReplyStartSize;
+        *p++ = ' ';
+        memcpy( p, key, keyLen_ );
+        p += keyLen_;
+        // size includes \r\n, the VALUE line doesn't.
+        p += sprintf( p, " %u %d\r\n", flags, size - 2 );
+        headerLen_ = p - data_;
+    }
+
+    // exptime_ of an item that may be touched meanwhile.
+    uint32_t expiry() {
+        return __atomic_load_n( &exptime_, __ATOMIC_RELAXED );
+    }
+
+    // Whether the item has expired at now, a time on currentTime().
+    bool expiredAt( uint32_t now ) {
+        uint32_t exptime = expiry();
+        return exptime != 0 && exptime <= now;
     }
 
-    ~MemcachedItem() {
-        free( value_ );
-    }           
+    // Take count more references.
+    void ref( int count = 1 ) {
+        __atomic_add_fetch( &refcount_, count, __ATOMIC_RELAXED );
+    }
+
+    // Take a reference found without the lock. Fails if the last one
+    // is already gone, the item is on its way out then.
+    bool tryRef() {
+        int count = __atomic_load_n( &refcount_, __ATOMIC_RELAXED );
+        while ( count > 0 ) {
+            if ( __atomic_compare_exchange_n( &refcount_, &count, count + 1, true,
+                                              __ATOMIC_ACQUIRE, __ATOMIC_RELAXED ) ) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Drop a reference. Returns true if it was the last one and the
+    // chunk can be freed.
+    bool unref() {
+        return __atomic_sub_fetch( &refcount_, 1, __ATOMIC_ACQ_REL ) == 0;
+    }
+
+    // Remember the hit for eviction. Only written when not set yet so
+    // hot items don't bounce their cache line between cores.
+    void markActive() {
+        if ( !( __atomic_load_n( &iflags_, __ATOMIC_RELAXED ) & ITEM_ACTIVE ) ) {
+            __atomic_fetch_or( &iflags_, ITEM_ACTIVE, __ATOMIC_RELAXED );
+        }
+    }
+
+    char *key() {
+        return data_ + getReplyStartSize + 1;
+    }
+
+    // VALUE line and value, which is what a get sends for this item.
+    char *header() {
+        return data_;
+    }
+
+    // Value of an item that isn't chained.
+    char *value() {
+        return data_ + headerLen_;
+    }
+
+    bool chained() {
+        return __atomic_load_n( &iflags_, __ATOMIC_RELAXED ) & ITEM_CHAINED;
+    }
+
+    ItemChain *chain() {
+        return (ItemChain *)( data_ + chainOffset( headerLen_ ) );
+    }
+
+    // The value from offset on, as far as it is contiguous, which is
+    // *len bytes.
+    char *valueAt( size_t offset, size_t *len ) {
+        if ( !chained() ) {
+            *len = size_ - offset;
+            return value() + offset;
+        }
+        ItemChain *ch = chain();
+        MemcachedItem *chunk = ch->chunks_[offset / ch->chunkBytes_];
+        size_t in = offset % ch->chunkBytes_;
+        *len = chunk->size_ - in;
+        return chunk->data_ + in;
+    }
+
+    // Copy len bytes into the value at offset.
+    void copyIn( size_t offset, const char *data, size_t len ) {
+        while ( len > 0 ) {
+            size_t room;
+            char *p = valueAt( offset, &room );
+            size_t n = min( room, len );
+            memcpy( p, data, n );
+            offset += n;
+            data += n;
+            len -= n;
+        }
+    }
+
+    // Copy len bytes of the value at offset out to data.
+    void copyOut( size_t offset, char *data, size_t len ) {
+        while ( len > 0 ) {
+            size_t room;
+            char *p = valueAt( offset, &room );
+            size_t n = min( room, len );
+            memcpy( data, p, n );
+            offset += n;
+            data += n;
+            len -= n;
+        }
+    }
+
+    // Copy len bytes of the value of src at srcOffset into the value
+    // at offset.
+    void copyFrom( size_t offset, MemcachedItem *src, size_t srcOffset, size_t len ) {
+        while ( len > 0 ) {
+            size_t room;
+            char *p = src->valueAt( srcOffset, &room );
+            size_t n = min( room, len );
+            copyIn( offset, p, n );
+            offset += n;
+            srcOffset += n;
+            len -= n;
+        }
+    }
+
+    // Point iov at len bytes of the value from offset on, one entry
+    // per contiguous piece.
+    void valueIovecs( size_t offset, size_t len, vector< struct iovec > *iov ) {
+        while ( len > 0 ) {
+            struct iovec v;
+            size_t room;
+            v.iov_base = valueAt( offset, &room );
+            v.iov_len = min( room, len );
+            iov->push_back( v );
+            offset += v.iov_len;
+            len -= v.iov_len;
+        }
+    }
+
+    // Point iov at the VALUE line and the value, what a get sends.
+    void replyIovecs( vector< struct iovec > *iov ) {
+        struct iovec v;
+        v.iov_base = data_;
+        if ( !chained() ) {
+            v.iov_len = headerLen_ + size_;
+            iov->push_back( v );
+            return;
+        }
+        v.iov_len = headerLen_;
+        iov->push_back( v );
+        valueIovecs( 0, size_, iov );
+    }
+
+    size_t totalSize() {
+        if ( chained() ) {
+            return chainedSize( headerLen_, chain()->count_ );
+        }
+        return sizeof( MemcachedItem ) + headerLen_ + size_;
+    }
+
+    bool hasKey( const char *key, size_t len ) {
+        return (size_t)keyLen_ == len && memcmp( this->key(), key, len ) == 0;
+    }
 };
 
 #endif // _MEMCACHED_H
@@ -0,0 +1,533 @@
+#include "Memcached.h"
+#include "LRUMemCache.h"
+#include "BufferedReader.h"
+#include "NearCache.h"
+#include "Zipf.h"
+
+// Microbenchmarks of the pieces a request goes through, each driven
+// directly in this process: LRUMemCache gets and sets from one and
+// from several contending threads, with mostly hits, mostly misses
+// and under eviction churn, and BufferedReader with extractCommand
+// over pipelined command streams held in memory. The zipf benchmarks
+// draw keys with Zipf skew, with and without a NearCache per thread,
+// and check that no get returns a value older than one the thread
+// stored or saw before. There is no socket and no event loop in the
+// numbers. -s 1 runs the cache on a single shard, like the globally
+// locked cache, to see what the shards buy. Every result is a row of
+// CSV or an object of JSON, so the runs of two commits can be diffed
+// or loaded into a script.
+
+// Keys eviction churn draws from per key the cache holds.
+#define MICROBENCH_EVICT_FACTOR 4
+// Operations between two reclaimRetired calls of a thread, like an
+// event loop does after a round of events.
+#define MICROBENCH_RECLAIM_OPS 1024
+// Commands in a parse stream, which is fed again and again.
+#define MICROBENCH_STREAM_COMMANDS 1000
+
+struct MicroConfig {
+    int maxThreads;
+    int numShards;
+    int numKeys;
+    int memoryMB;
+    long numOps;           // Per thread for the cache, in total for parsing.
+    int valueSize;
+    int keysPerGet;
+    double zipfTheta;
+    int nearEntries;       // Of the NearCache of every thread.
+    const char *filter;    // Only run benchmarks whose name has this.
+    bool json;
+};
+
+struct CacheWorkload {
+    const char *name;
+    int getPercent;        // The others are sets.
+    int hitPercent;        // Gets of keys that are in the cache.
+    bool evict;            // Sets of keys the cache has no room for.
+    bool zipf;             // Keys of a Zipf distribution, values versioned.
+    bool near;             // Gets through a NearCache.
+};
+
+struct Result {
+    string name;
+    int threads;
+    long ops;
+    double secs;
+    long gets;
+    long hits;
+    uint64_t evictions;
+    long stale;            // Gets that went back to an older value.
+};
+
+struct BenchThread {
+    pthread_t threadId;
+    int id;
+    MicroConfig *config;
+    const CacheWorkload *workload;
+    LRUMemCache *cache;
+    const vector< string > *keys;       // Set before the run.
+    const vector< string > *missKeys;   // Never set.
+    ZipfGenerator *zipf;
+    int numThreads;
+    pthread_barrier_t *barrier;
+    long gets;
+    long hits;
+    long stale;
+};
+
+static string keyName( const char *prefix, long i ) {
+    return prefix + to_string( (long long int)i );
+}
+
+static void setKey( LRUMemCache *cache, const string &key, const string &value ) {
+    MemcachedItem *item = cache->allocItem( key.data(), key.size(), value.size() );
+    if ( item == NULL ) {
+        return;
+    }
+    item->copyIn( 0, value.data(), value.size() );
+    if ( !cache->setItem( item ) ) {
+        cache->releaseItem( item );
+    }
+}
+
+// Zipf workloads. The value of a key starts with its version, 0 as
+// loaded. Thread t is the only one setting the keys i with
+// i % threads == t, with increasing versions, so a get of one of its
+// keys must see the version it set last and a get of any other key
+// must not see one older than the thread saw before.
+static void setVersion( LRUMemCache *cache, const string &key, string *value,
+                        uint64_t version ) {
+    memcpy( &(*value)[0], &version, sizeof( version ) );
+    setKey( cache, key, *value );
+}
+
+static uint64_t getVersion( MemcachedItem *item ) {
+    uint64_t version = 0;
+    item->copyOut( 0, (char *)&version, sizeof( version ) );
+    return version;
+}
+
+static uint64_t totalEvictions( LRUMemCache *cache ) {
+    vector< SlabClassStats > stats;
+    cache->slabs()->getClassStats( &stats );
+    uint64_t evictions = 0;
+    for ( size_t i = 0; i < stats.size(); i++ ) {
+        evictions += stats[i].evictions;
+    }
+    return evictions;
+}
+
+static void * benchThreadFunc( void *arg ) {
+    BenchThread *bt = (BenchThread *)arg;
+    MicroConfig *config = bt->config;
+    const CacheWorkload *workload = bt->workload;
+    uint64_t rand = 0x9E3779B97F4A7C15ULL * ( bt->id + 1 );
+    string value( config->valueSize, 'v' );
+    size_t numKeys = bt->keys->size();
+    long gets = 0;
+    long hits = 0;
+
+    pthread_barrier_wait( bt->barrier );
+    for ( long i = 0; i < config->numOps; i++ ) {
+        uint64_t r = zipfRandom( &rand );
+        const string &key = (*bt->keys)[ r % numKeys ];
+        if ( (int)( ( r >> 32 ) % 100 ) < workload->getPercent ) {
+            // Sets only go to the loaded keys, so the misses stay misses.
+            const string &getKey = ( (int)( ( r >> 16 ) % 100 ) < workload->hitPercent ) ?
+                                   key : (*bt->missKeys)[ r % bt->missKeys->size() ];
+            MemcachedItem *item = bt->cache->getItem( getKey.data(), getKey.size() );
+            gets++;
+            if ( item != NULL ) {
+                hits++;
+                bt->cache->releaseItem( item );
+            }
+        } else {
+            setKey( bt->cache, key, value );
+        }
+        if ( i % MICROBENCH_RECLAIM_OPS == 0 ) {
+            bt->cache->reclaimRetired();
+        }
+    }
+    bt->cache->reclaimRetired();
+    bt->gets = gets;
+    bt->hits = hits;
+    return NULL;
+}
+
+static void * zipfThreadFunc( void *arg ) {
+    BenchThread *bt = (BenchThread *)arg;
+    MicroConfig *config = bt->config;
+    const CacheWorkload *workload = bt->workload;
+    uint64_t rand = 0x9E3779B97F4A7C15ULL * ( bt->id + 1 );
+    size_t numKeys = bt->keys->size();
+    size_t threads = bt->numThreads;
+    string value( max( config->valueSize, (int)sizeof( uint64_t ) ), 'v' );
+    vector< uint64_t > seen( numKeys, 0 );
+    uint64_t version = 0;
+    NearCache *near = workload->near ? new NearCache( config->nearEntries ) : NULL;
+    long gets = 0;
+    long hits = 0;
+    long stale = 0;
+
+    pthread_barrier_wait( bt->barrier );
+    for ( long i = 0; i < config->numOps; i++ ) {
+        size_t k = bt->zipf->next( &rand );
+        if ( (int)( zipfRandom( &rand ) % 100 ) >= workload->getPercent ) {
+            // The key of ours next to the one drawn.
+            k = k - k % threads + bt->id;
+            if ( k >= numKeys ) {
+                k -= threads;
+            }
+            setVersion( bt->cache, (*bt->keys)[k], &value, ++version );
+            seen[k] = version;
+            continue;
+        }
+        const string &key = (*bt->keys)[k];
+        uint64_t hash = LRUMemCache::hashKey( key.data(), key.size() );
+        MemcachedItem *item = near != NULL ?
+                              near->lookup( bt->cache, key.data(), key.size(), hash ) :
+                              bt->cache->getItem( key.data(), key.size(), hash );
+        gets++;
+        if ( item != NULL ) {
+            hits++;
+            uint64_t got = getVersion( item );
+            bool ours = k % threads == (size_t)bt->id;
+            if ( ours ? got != seen[k] : got < seen[k] ) {
+                stale++;
+            }
+            seen[k] = max( seen[k], got );
+            if ( near != NULL ) {
+                near->release( bt->cache, item );
+            } else {
+                bt->cache->releaseItem( item );
+            }
+        }
+        if ( i % MICROBENCH_RECLAIM_OPS == 0 ) {
+            bt->cache->reclaimRetired();
+        }
+    }
+    delete near;
+    bt->cache->reclaimRetired();
+    bt->gets = gets;
+    bt->hits = hits;
+    bt->stale = stale;
+    return NULL;
+}
+
+// Bytes of cache that hold count items of the benchmark, measured on
+// the chunk an item really takes.
+static size_t cacheBytesFor( MicroConfig *config, const string &key, size_t count ) {
+    LRUMemCache probe( (size_t)config->memoryMB * 1024 * 1024, 1 );
+    MemcachedItem *item = probe.allocItem( key.data(), key.size(), config->valueSize );
+    size_t bytes = probe.slabs()->chunkSize( item );
+    probe.releaseItem( item );
+    return bytes * count;
+}
+
+static Result runCacheBench( MicroConfig *config, const CacheWorkload *workload,
+                             int numThreads, const vector< string > &keys,
+                             const vector< string > &missKeys, ZipfGenerator *zipf ) {
+    size_t limitBytes = (size_t)config->memoryMB * 1024 * 1024;
+    const vector< string > *setKeys = &keys;
+    const vector< string > *loadKeys = &keys;
+    vector< string > churnKeys;
+    if ( workload->evict ) {
+        // The cache holds numKeys items and the sets go to
+        // MICROBENCH_EVICT_FACTOR times as many keys, so most of them
+        // evict an item.
+        limitBytes = cacheBytesFor( config, keys.back(), keys.size() );
+        for ( size_t i = 0; i < keys.size() * MICROBENCH_EVICT_FACTOR; i++ ) {
+            churnKeys.push_back( keyName( "key:", i ) );
+        }
+        setKeys = &churnKeys;
+    }
+
+    LRUMemCache cache( limitBytes, config->numShards );
+    string value( workload->zipf ? max( config->valueSize, (int)sizeof( uint64_t ) ) :
+                                   config->valueSize, 'v' );
+    for ( size_t i = 0; i < loadKeys->size(); i++ ) {
+        if ( workload->zipf ) {
+            setVersion( &cache, (*loadKeys)[i], &value, 0 );
+        } else {
+            setKey( &cache, (*loadKeys)[i], value );
+        }
+    }
+    cache.reclaimRetired();
+    uint64_t evictionsBefore = totalEvictions( &cache );
+
+    pthread_barrier_t barrier;
+    pthread_barrier_init( &barrier, NULL, numThreads + 1 );
+    vector< BenchThread > threads( numThreads );
+    for ( int i = 0; i < numThreads; i++ ) {
+        threads[i].id = i;
+        threads[i].config = config;
+        threads[i].workload = workload;
+        threads[i].cache = &cache;
+        threads[i].keys = setKeys;
+        threads[i].missKeys = &missKeys;
+        threads[i].zipf = zipf;
+        threads[i].numThreads = numThreads;
+        threads[i].barrier = &barrier;
+        threads[i].gets = 0;
+        threads[i].hits = 0;
+        threads[i].stale = 0;
+        pthread_create( &threads[i].threadId, NULL,
+                        workload->zipf ? zipfThreadFunc : benchThreadFunc, &threads[i] );
+    }
+
+    pthread_barrier_wait( &barrier );
+    double start = nowSecs();
+    for ( int i = 0; i < numThreads; i++ ) {
+        pthread_join( threads[i].threadId, NULL );
+    }
+    double elapsed = nowSecs() - start;
+    pthread_barrier_destroy( &barrier );
+
+    Result result;
+    result.name = string( "cache_" ) + workload->name;
+    result.threads = numThreads;
+    result.ops = config->numOps * numThreads;
+    result.secs = elapsed;
+    result.gets = 0;
+    result.hits = 0;
+    result.stale = 0;
+    for ( int i = 0; i < numThreads; i++ ) {
+        result.gets += threads[i].gets;
+        result.hits += threads[i].hits;
+        result.stale += threads[i].stale;
+    }
+    result.evictions = totalEvictions( &cache ) - evictionsBefore;
+    return result;
+}
+
+// Run numOps commands of stream through a BufferedReader fed from
+// memory, reading the values of sets, the way a connection does
+// before it touches the cache.
+static Result runParseBench( MicroConfig *config, const char *name,
+                             const string &stream ) {
+    BufferedReader reader( -1 );
+    MCCommand mcCommand;
+    vector< char > value( config->valueSize + 2 );
+    long commands = 0;
+    long keys = 0;
+
+    double start = nowSecs();
+    while ( commands < config->numOps ) {
+        reader.feed( stream.data(), stream.size() );
+        char *line;
+        size_t len;
+        while ( reader.readCommand( &line, &len ) == READ_OK ) {
+            extractCommand( line, len, &mcCommand );
+            if ( mcCommand.command_ == COMMAND_SET ) {
+                int bytesRead;
+                reader.readValue( value.data(), mcCommand.size + 2, &bytesRead );
+                keys++;
+            } else {
+                keys += mcCommand.keys.size();
+            }
+            commands++;
+        }
+    }
+    double elapsed = nowSecs() - start;
+
+    Result result;
+    result.name = string( "parse_" ) + name;
+    result.threads = 1;
+    result.ops = commands;
+    result.secs = elapsed;
+    // Keys are reported as gets, there is nothing to hit.
+    result.gets = keys;
+    result.hits = 0;
+    result.evictions = 0;
+    result.stale = 0;
+    return result;
+}
+
+static void printHeader( MicroConfig *config ) {
+    if ( config->json ) {
+        printf( "{\n  \"config\": {\"keys\": %d, \"shards\": %d, \"memory_mb\": %d, "
+                "\"ops\": %ld, \"value_size\": %d, \"keys_per_get\": %d, "
+                "\"max_threads\": %d},\n  \"results\": [\n",
+                config->numKeys, config->numShards, config->memoryMB, config->numOps,
+                config->valueSize, config->keysPerGet, config->maxThreads );
+    } else {
+        printf( "# keys=%d shards=%d memory=%dMB ops=%ld valueSize=%d keysPerGet=%d\n",
+                config->numKeys, config->numShards, config->memoryMB, config->numOps,
+                config->valueSize, config->keysPerGet );
+        printf( "benchmark,threads,ops,secs,ops_per_sec,ns_per_op,hit_ratio,"
+                "keys_or_gets,evictions\n" );
+    }
+}
+
+// ns_per_op is the time of one operation on one thread. hit_ratio is
+// empty, or null, when the benchmark does no gets of the cache.
+static void printResult( MicroConfig *config, const Result &r, bool first ) {
+    double opsPerSec = r.ops / r.secs;
+    double nsPerOp = r.secs * 1e9 * r.threads / r.ops;
+    bool cache = r.name.compare( 0, 6, "cache_" ) == 0;
+    char hitRatio[32];
+    if ( cache && r.gets > 0 ) {
+        snprintf( hitRatio, sizeof( hitRatio ), "%.4f", (double)r.hits / r.gets );
+    } else {
+        snprintf( hitRatio, sizeof( hitRatio ), "%s", config->json ? "null" : "" );
+    }
+
+    if ( config->json ) {
+        printf( "%s    {\"benchmark\": \"%s\", \"threads\": %d, \"ops\": %ld, "
+                "\"secs\": %.6f, \"ops_per_sec\": %.0f, \"ns_per_op\": %.1f, "
+                "\"hit_ratio\": %s, \"keys_or_gets\": %ld, \"evictions\": %llu}",
+                first ? "" : ",\n", r.name.c_str(), r.threads, r.ops, r.secs,
+                opsPerSec, nsPerOp, hitRatio, r.gets,
+                (unsigned long long)r.evictions );
+    } else {
+        printf( "%s,%d,%ld,%.6f,%.0f,%.1f,%s,%ld,%llu\n", r.name.c_str(), r.threads,
+                r.ops, r.secs, opsPerSec, nsPerOp, hitRatio, r.gets,
+                (unsigned long long)r.evictions );
+    }
+    fflush( stdout );
+}
+
+static bool selected( MicroConfig *config, const string &name ) {
+    return config->filter == NULL || name.find( config->filter ) != string::npos;
+}
+
+static void usage( const char *prog ) {
+    fprintf( stderr, "Usage: %s [-t maxThreads] [-s shards] [-k keys] "
+             "[-m memoryMB] [-n ops] [-v valueSize] [-K keysPerGet] "
+             "[-z zipfTheta] [-N nearEntries] [-b benchmark] [-f csv|json]\n", prog );
+}
+
+int main( int argc, char **argv ) {
+    MicroConfig config;
+    config.maxThreads = sysconf( _SC_NPROCESSORS_ONLN );
+    config.numShards = LRU_CACHE_SHARDS;
+    config.numKeys = 100000;
+    config.memoryMB = DEFAULT_MEMORY_LIMIT_MB;
+    config.numOps = 1000000;
+    config.valueSize = 32;
+    config.keysPerGet = 10;
+    config.zipfTheta = 0.99;
+    config.nearEntries = 1024;
+    config.filter = NULL;
+    config.json = false;
+
+    int opt;
+    while ( ( opt = getopt( argc, argv, "t:s:k:m:n:v:K:z:N:b:f:h" ) ) != -1 ) {
+        switch ( opt ) {
+        case 't': config.maxThreads = atoi( optarg ); break;
+        case 's': config.numShards = atoi( optarg ); break;
+        case 'k': config.numKeys = atoi( optarg ); break;
+        case 'm': config.memoryMB = atoi( optarg ); break;
+        case 'n': config.numOps = atol( optarg ); break;
+        case 'v': config.valueSize = atoi( optarg ); break;
+        case 'K': config.keysPerGet = atoi( optarg ); break;
+        case 'z': config.zipfTheta = atof( optarg ); break;
+        case 'N': config.nearEntries = atoi( optarg ); break;
+        case 'b': config.filter = optarg; break;
+        case 'f':
+            if ( strcmp( optarg, "json" ) == 0 ) {
+                config.json = true;
+            } else if ( strcmp( optarg, "csv" ) != 0 ) {
+                usage( argv[0] );
+                return 1;
+            }
+            break;
+        default:
+            usage( argv[0] );
+            return 1;
+        }
+    }
+    if ( config.maxThreads <= 0 || config.numShards <= 0 || config.numKeys <= 0 ||
+         config.memoryMB <= 0 || config.numOps <= 0 || config.valueSize < 0 ||
+         config.keysPerGet <= 0 || config.zipfTheta <= 0 || config.zipfTheta >= 1 ||
+         config.nearEntries <= 0 ) {
+        usage( argv[0] );
+        return 1;
+    }
+
+    vector< string > keys;
+    vector< string > missKeys;
+    for ( int i = 0; i < config.numKeys; i++ ) {
+        keys.push_back( keyName( "key:", i ) );
+        missKeys.push_back( keyName( "miss:", i ) );
+    }
+
+    // Powers of two up to maxThreads, and maxThreads itself.
+    vector< int > threadCounts;
+    for ( int threads = 1; threads < config.maxThreads; threads *= 2 ) {
+        threadCounts.push_back( threads );
+    }
+    threadCounts.push_back( config.maxThreads );
+
+    static const CacheWorkload cacheWorkloads[] = {
+        { "get_hit",    100, 100, false, false, false },
+        { "get_miss",   100,   0, false, false, false },
+        { "mixed_hit",   90, 100, false, false, false },   // Hit heavy, nine gets for a set.
+        { "mixed_miss",  90,  10, false, false, false },   // Miss heavy.
+        { "set",          0, 100, false, false, false },   // Replaces items, never evicts.
+        { "evict",        0, 100, true,  false, false },
+        { "zipf",        95, 100, false, true,  false },   // One set in twenty.
+        { "zipf_near",   95, 100, false, true,  true  },
+    };
+    ZipfGenerator zipf( config.numKeys, config.zipfTheta );
+
+    string value( config.valueSize, 'v' );
+    string getStream, multiStream, setStream, mixedStream;
+    for ( long i = 0; i < MICROBENCH_STREAM_COMMANDS; i++ ) {
+        getStream += "get " + keyName( "key:", i ) + "\r\n";
+
+        string multi = "get";
+        for ( int k = 0; k < config.keysPerGet; k++ ) {
+            multi += " " + keyName( "key:", i * config.keysPerGet + k );
+        }
+        multiStream += multi + "\r\n";
+
+        string set = "set " + keyName( "key:", i ) + " 0 0 " +
+                     to_string( (long long int)config.valueSize ) + "\r\n" +
+                     value + "\r\n";
+        setStream += set;
+
+        mixedStream += ( i % 10 == 0 ) ? set : "get " + keyName( "key:", i ) + "\r\n";
+    }
+    struct {
+        const char *name;
+        const string *stream;
+    } parseWorkloads[] = {
+        { "get", &getStream },
+        { "multiget", &multiStream },
+        { "set", &setStream },
+        { "mixed", &mixedStream },
+    };
+
+    printHeader( &config );
+    bool first = true;
+    bool stale = false;
+    for ( size_t w = 0; w < sizeof( cacheWorkloads ) / sizeof( cacheWorkloads[0] ); w++ ) {
+        if ( !selected( &config, string( "cache_" ) + cacheWorkloads[w].name ) ) {
+            continue;
+        }
+        for ( size_t t = 0; t < threadCounts.size(); t++ ) {
+            Result result = runCacheBench( &config, &cacheWorkloads[w], threadCounts[t],
+                                           keys, missKeys, &zipf );
+            printResult( &config, result, first );
+            first = false;
+            if ( result.stale > 0 ) {
+                fprintf( stderr, "%s with %d threads: %ld gets returned a stale value\n",
+                         result.name.c_str(), result.threads, result.stale );
+                stale = true;
+            }
+        }
+    }
+    for ( size_t w = 0; w < sizeof( parseWorkloads ) / sizeof( parseWorkloads[0] ); w++ ) {
+        if ( !selected( &config, string( "parse_" ) + parseWorkloads[w].name ) ) {
+            continue;
+        }
+        printResult( &config, runParseBench( &config, parseWorkloads[w].name,
+                                             *parseWorkloads[w].stream ), first );
+        first = false;
+    }
+    if ( config.json ) {
+        printf( "\n  ]\n}\n" );
+    }
+    return stale ? 1 : 0;
+}
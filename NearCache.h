@@ -0,0 +1,256 @@
+#ifndef _NEAR_CACHE_H
+#define _NEAR_CACHE_H
+
+#include "Memcached.h"
+#include "LRUMemCache.h"
+
+// References to the hottest items, kept by one thread so their gets
+// skip the shard and above all the reference count of the item, a
+// cache line every core serving the key would write.
+//
+// Hot keys are found by sampling. One shared hit in NEAR_CACHE_SAMPLE
+// is counted in a table of candidates, where a slot keeps the key that
+// comes back more often than the others hashing to it. A key counted
+// NEAR_CACHE_ADMIT times takes an entry, which holds a reference of
+// its item until it is dropped.
+//
+// An item doesn't change once it is in the cache: a set, cas, incr or
+// append stores a new item and unlinks the old one, and a delete, an
+// eviction or the expiry unlink it. So the linked flag is the version
+// of the item. Only touch changes an item in place, its expiry time,
+// which a hit checks along with the flag, dropping the entry if its item
+// is no longer the one the cache serves. Shards clear the flag before
+// the index lets go of the item, so a get that found the new item is
+// never followed by a near hit of the old one.
+//
+// A hit doesn't take a reference, it lends the one of the entry and
+// counts the loan there. Every item lookup returned goes back through
+// release, on the thread owning the NearCache, which returns the loan.
+// An entry dropped with loans out turns them into real references.
+class NearCache {
+private:
+    static const size_t ways_ = 4;
+
+    struct Entry {
+        MemcachedItem *item_;    // Referenced, NULL if the entry is free.
+        LRUMemCache *cache_;     // The item came from there.
+        uint64_t hash_;
+        uint32_t loans_;         // Hits not released yet.
+        uint32_t hits_;
+    };
+
+    struct Candidate {
+        uint64_t hash_;
+        uint32_t count_;
+    };
+
+    vector< Entry > entries_;    // Sets of ways_ entries.
+    size_t setMask_;
+    vector< Candidate > candidates_;
+    size_t candidateMask_;
+    uint32_t sampleCountdown_;
+    size_t sweepPos_;            // Next entry sample checks.
+
+    Entry *setOf( uint64_t hash ) {
+        return &entries_[ ( hash & setMask_ ) * ways_ ];
+    }
+
+    Entry *find( uint64_t hash ) {
+        Entry *set = setOf( hash );
+        for ( size_t i = 0; i < ways_; i++ ) {
+            if ( set[i].item_ != NULL && set[i].hash_ == hash ) {
+                return &set[i];
+            }
+        }
+        return NULL;
+    }
+
+    // Whether the item of e is still the one the cache serves.
+    static bool current( Entry *e ) {
+        MemcachedItem *item = e->item_;
+        if ( !( __atomic_load_n( &item->iflags_, __ATOMIC_ACQUIRE ) & ITEM_LINKED ) ) {
+            return false;
+        }
+        return !item->expiredAt( currentTime() );
+    }
+
+    static bool eligible( MemcachedItem *item ) {
+        return !item->chained() && item->size_ <= NEAR_CACHE_VALUE_MAX;
+    }
+
+    void drop( Entry *e ) {
+        if ( e->loans_ > 0 ) {
+            e->item_->ref( e->loans_ );
+        }
+        e->cache_->releaseItem( e->item_ );
+        e->item_ = NULL;
+    }
+
+    void dropStale( Entry *e ) {
+        statAdd( &threadStats.nearStale_ );
+        drop( e );
+    }
+
+    // Give item an entry, in place of the entry of the same key or of
+    // the one of its set with the fewest hits.
+    void admit( LRUMemCache *cache, MemcachedItem *item ) {
+        Entry *set = setOf( item->hash_ );
+        Entry *victim = NULL;
+        for ( size_t i = 0; i < ways_; i++ ) {
+            Entry *e = &set[i];
+            if ( e->item_ != NULL && e->hash_ == item->hash_ ) {
+                if ( e->item_ == item ) {
+                    return;
+                }
+                victim = e;
+                break;
+            }
+            if ( victim == NULL ||
+                 ( victim->item_ != NULL &&
+                   ( e->item_ == NULL || e->hits_ < victim->hits_ ) ) ) {
+                victim = e;
+            }
+        }
+        // Older hits count less, so a key that cooled down makes room.
+        for ( size_t i = 0; i < ways_; i++ ) {
+            set[i].hits_ >>= 1;
+        }
+        if ( victim->item_ != NULL ) {
+            drop( victim );
+        }
+        item->ref();
+        victim->item_ = item;
+        victim->cache_ = cache;
+        victim->hash_ = item->hash_;
+        victim->loans_ = 0;
+        victim->hits_ = 0;
+    }
+
+    // Count a shared hit of item if it is sampled, admitting the key
+    // once it proved hot. Every sample also checks one entry, so the
+    // stale ones go without waiting for sweep.
+    void sample( LRUMemCache *cache, MemcachedItem *item ) {
+        if ( --sampleCountdown_ > 0 ) {
+            return;
+        }
+        sampleCountdown_ = NEAR_CACHE_SAMPLE;
+        Entry *e = &entries_[sweepPos_];
+        sweepPos_ = ( sweepPos_ + 1 ) % entries_.size();
+        if ( e->item_ != NULL && !current( e ) ) {
+            dropStale( e );
+        }
+
+        if ( !eligible( item ) ) {
+            return;
+        }
+        Candidate *c = &candidates_[ ( item->hash_ >> 32 ) & candidateMask_ ];
+        if ( c->hash_ != item->hash_ ) {
+            if ( c->count_ > 0 ) {
+                c->count_--;
+                return;
+            }
+            c->hash_ = item->hash_;
+        }
+        if ( ++c->count_ >= NEAR_CACHE_ADMIT ) {
+            c->count_ = 0;
+            admit( cache, item );
+        }
+    }
+
+public:
+    // entries is rounded up to a power of two of at least ways_.
+    NearCache( size_t entries ) {
+        size_t count = ways_;
+        while ( count < entries ) {
+            count <<= 1;
+        }
+        Entry free = { NULL, NULL, 0, 0, 0 };
+        entries_.assign( count, free );
+        setMask_ = count / ways_ - 1;
+        Candidate none = { 0, 0 };
+        candidates_.assign( count * 2, none );
+        candidateMask_ = count * 2 - 1;
+        sampleCountdown_ = NEAR_CACHE_SAMPLE;
+        sweepPos_ = 0;
+    }
+
+    // Every loan must be back by now.
+    ~NearCache() {
+        clear();
+    }
+
+    // getItem of cache, which owns key, served from an entry if it has
+    // a current one. The item must be given back with release.
+    MemcachedItem *lookup( LRUMemCache *cache, const char *key, size_t keyLen,
+                           uint64_t hash ) {
+        Entry *e = find( hash );
+        if ( e != NULL && !e->item_->hasKey( key, keyLen ) ) {
+            e = NULL;
+        }
+        if ( e != NULL && current( e ) && ++e->hits_ % NEAR_CACHE_REFRESH != 0 ) {
+            e->loans_++;
+            statAdd( &threadStats.getHits_ );
+            statAdd( &threadStats.nearHits_ );
+            return e->item_;
+        }
+
+        MemcachedItem *item = cache->getItem( key, keyLen, hash );
+        if ( e == NULL ) {
+            if ( item != NULL ) {
+                sample( cache, item );
+            }
+        } else if ( item != e->item_ ) {
+            // Replaced, deleted or expired. A new item of the key is as
+            // hot as the old one was.
+            dropStale( e );
+            if ( item != NULL && eligible( item ) ) {
+                admit( cache, item );
+            }
+        }
+        return item;
+    }
+
+    // Take back the loan of an item lookup returned. False if it
+    // holds a reference of its own, which the caller drops.
+    bool returnLoan( MemcachedItem *item ) {
+        Entry *set = setOf( item->hash_ );
+        for ( size_t i = 0; i < ways_; i++ ) {
+            if ( set[i].item_ == item && set[i].loans_ > 0 ) {
+                set[i].loans_--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Give back an item lookup returned.
+    void release( LRUMemCache *cache, MemcachedItem *item ) {
+        if ( !returnLoan( item ) ) {
+            cache->releaseItem( item );
+        }
+    }
+
+    // Drop the entries whose items were replaced or expired, so they
+    // don't keep the chunks from being freed or their pages from being
+    // moved. Called once a second by the owning thread.
+    void sweep() {
+        for ( size_t i = 0; i < entries_.size(); i++ ) {
+            if ( entries_[i].item_ != NULL && !current( &entries_[i] ) ) {
+                dropStale( &entries_[i] );
+            }
+        }
+    }
+
+    void clear() {
+        for ( size_t i = 0; i < entries_.size(); i++ ) {
+            if ( entries_[i].item_ != NULL ) {
+                drop( &entries_[i] );
+            }
+        }
+    }
+};
+
+// NearCache of the calling thread, NULL if it has none.
+static __thread NearCache *threadNearCache;
+
+#endif // _NEAR_CACHE_H
@@ -0,0 +1,586 @@
+#include "Memcached.h"
+#include "BinaryProtocol.h"
+#include "Zipf.h"
+
+// Client benchmark comparing the text and the binary protocol against
+// a running server. Every thread has its own connection and sends
+// pipelined batches of requests, then reads all the responses of the
+// batch before sending the next one. The binary workloads are run
+// with the plain commands, answered one by one, and with their quiet
+// variants ended by a NOOP, where the server only answers hits.
+//
+// With -U the gets are also sent over UDP, every thread from its own
+// socket, as a batch of datagrams sent with one sendmmsg. The replies
+// are put back together from their frame headers. Requests whose reply
+// didn't come back complete within UDP_REPLY_TIMEOUT_MS count as lost.
+//
+// Every batch is timed from sending it to its last response, the
+// percentiles are of these round trips, of single requests with -d 1.
+// The "stats" of the server before and after a workload give the
+// system calls its event loops made per request, to compare the I/O
+// backends of the server (-b epoll or uring) on the same workload.
+
+#define UDP_REPLY_TIMEOUT_MS 200
+
+struct ProtoConfig {
+    const char *host;
+    int port;
+    int numThreads;
+    long numRequests;     // Per connection.
+    int depth;            // Requests per batch.
+    int numKeys;
+    int valueSize;
+    int udpPort;          // 0 to skip the UDP workload.
+};
+
+enum Workload {
+    TEXT_SET = 0,
+    BINARY_SET_PLAIN,
+    BINARY_SET_QUIET,
+    TEXT_GET,
+    BINARY_GET_PLAIN,
+    BINARY_GET_QUIET,
+    UDP_GET,
+    NUM_WORKLOADS
+};
+
+static const char *workloadNames[] = { "text set", "binary set", "binary setq",
+                                       "text get", "binary get", "binary getkq",
+                                       "udp get" };
+
+struct ProtoThread {
+    pthread_t threadId;
+    int id;
+    ProtoConfig *config;
+    Workload workload;
+    vector< string > *keys;
+    pthread_barrier_t *barrier;
+    long hits;
+    long lost;
+    bool failed;
+    vector< float > latencies;   // Microseconds per batch.
+};
+
+// Blocking connection with a read buffer for parsing the responses.
+class ClientConn {
+private:
+    int fd_;
+    vector< char > buff_;
+    size_t start_;
+    size_t end_;
+
+    bool fill() {
+        if ( start_ == end_ ) {
+            start_ = end_ = 0;
+        } else if ( end_ == buff_.size() ) {
+            memmove( buff_.data(), buff_.data() + start_, end_ - start_ );
+            end_ -= start_;
+            start_ = 0;
+        }
+        ssize_t n = read( fd_, buff_.data() + end_, buff_.size() - end_ );
+        if ( n <= 0 ) {
+            return false;
+        }
+        end_ += n;
+        return true;
+    }
+
+public:
+    ClientConn() : buff_( 1 << 20 ) {
+        fd_ = -1;
+        start_ = 0;
+        end_ = 0;
+    }
+
+    ~ClientConn() {
+        if ( fd_ >= 0 ) {
+            close( fd_ );
+        }
+    }
+
+    bool connectTo( const char *host, int port ) {
+        struct sockaddr_in addr;
+        memset( &addr, 0, sizeof( addr ) );
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons( port );
+        if ( inet_pton( AF_INET, host, &addr.sin_addr ) != 1 ) {
+            return false;
+        }
+        fd_ = socket( AF_INET, SOCK_STREAM, 0 );
+        return fd_ >= 0 && connect( fd_, (struct sockaddr *)&addr, sizeof( addr ) ) == 0;
+    }
+
+    bool writeAll( const string &data ) {
+        size_t offset = 0;
+        while ( offset < data.size() ) {
+            ssize_t n = write( fd_, data.data() + offset, data.size() - offset );
+            if ( n <= 0 ) {
+                return false;
+            }
+            offset += n;
+        }
+        return true;
+    }
+
+    // Point *data at the next len bytes and consume them. len must
+    // fit in the buffer.
+    bool readBytes( const char **data, size_t len ) {
+        while ( end_ - start_ < len ) {
+            if ( !fill() ) {
+                return false;
+            }
+        }
+        *data = buff_.data() + start_;
+        start_ += len;
+        return true;
+    }
+
+    // Skip len bytes, which may not fit in the buffer.
+    bool skip( size_t len ) {
+        while ( len > 0 ) {
+            if ( start_ == end_ && !fill() ) {
+                return false;
+            }
+            size_t n = min( len, end_ - start_ );
+            start_ += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    // Next line without its \r\n.
+    bool readLine( string *line ) {
+        size_t scanned = 0;
+        while ( 1 ) {
+            char *begin = buff_.data() + start_;
+            char *nl = (char *)memchr( begin + scanned, '\n', end_ - start_ - scanned );
+            if ( nl != NULL ) {
+                size_t len = nl - begin;
+                line->assign( begin, len > 0 && begin[len - 1] == '\r' ? len - 1 : len );
+                start_ += len + 1;
+                return true;
+            }
+            scanned = end_ - start_;
+            if ( !fill() ) {
+                return false;
+            }
+        }
+    }
+};
+
+static void appendBinary( string *out, uint8_t opcode, const string &key,
+                          const char *extras, uint8_t extrasLen, const string &value ) {
+    char header[BINARY_HEADER_SIZE];
+    encodeBinaryRequest( header, opcode, key.size(), extrasLen,
+                         extrasLen + key.size() + value.size(), 0 );
+    out->append( header, sizeof( header ) );
+    out->append( extras, extrasLen );
+    out->append( key );
+    out->append( value );
+}
+
+// Read one binary response. *hit is set if it carried a value.
+static bool readBinaryResponse( ClientConn *conn, uint8_t *opcode, bool *hit ) {
+    const char *header;
+    if ( !conn->readBytes( &header, BINARY_HEADER_SIZE ) ) {
+        return false;
+    }
+    *opcode = header[1];
+    *hit = loadBE16( header + 6 ) == BINARY_STATUS_OK && header[4] != 0;
+    return conn->skip( loadBE32( header + 8 ) );
+}
+
+// Send one batch of the workload and read all its responses.
+static bool runBatch( ProtoThread *pt, ClientConn *conn, uint64_t *rand, int count,
+                      const string &value, string *out ) {
+    ProtoConfig *config = pt->config;
+    vector< string > &keys = *pt->keys;
+    char extras[BINARY_SET_EXTRAS] = { 0 };
+    string textValue = value + "\r\n";
+    string sizeToken = to_string( (long long int)value.size() );
+
+    out->clear();
+    for ( int i = 0; i < count; i++ ) {
+        const string &key = keys[zipfRandom( rand ) % config->numKeys];
+        switch ( pt->workload ) {
+        case TEXT_SET:
+            out->append( "set " + key + " 0 0 " + sizeToken + "\r\n" + textValue );
+            break;
+        case BINARY_SET_PLAIN:
+            appendBinary( out, BINARY_SET, key, extras, sizeof( extras ), value );
+            break;
+        case BINARY_SET_QUIET:
+            appendBinary( out, BINARY_SETQ, key, extras, sizeof( extras ), value );
+            break;
+        case TEXT_GET:
+            out->append( "get " + key + "\r\n" );
+            break;
+        case BINARY_GET_PLAIN:
+            appendBinary( out, BINARY_GET, key, NULL, 0, "" );
+            break;
+        case BINARY_GET_QUIET:
+            appendBinary( out, BINARY_GETKQ, key, NULL, 0, "" );
+            break;
+        default:
+            break;
+        }
+    }
+    bool quiet = pt->workload == BINARY_SET_QUIET || pt->workload == BINARY_GET_QUIET;
+    if ( quiet ) {
+        appendBinary( out, BINARY_NOOP, "", NULL, 0, "" );
+    }
+    if ( !conn->writeAll( *out ) ) {
+        return false;
+    }
+
+    string line;
+    if ( pt->workload == TEXT_SET || pt->workload == TEXT_GET ) {
+        int responses = 0;
+        while ( responses < count ) {
+            if ( !conn->readLine( &line ) ) {
+                return false;
+            }
+            if ( line.compare( 0, 6, "VALUE " ) == 0 ) {
+                size_t lastSpace = line.rfind( ' ' );
+                pt->hits++;
+                if ( !conn->skip( atol( line.c_str() + lastSpace + 1 ) + 2 ) ) {
+                    return false;
+                }
+                continue;
+            }
+            responses++;
+        }
+        return true;
+    }
+
+    // Plain commands answer each request, quiet ones up to the NOOP.
+    int responses = 0;
+    while ( quiet || responses < count ) {
+        uint8_t opcode;
+        bool hit;
+        if ( !readBinaryResponse( conn, &opcode, &hit ) ) {
+            return false;
+        }
+        if ( hit ) {
+            pt->hits++;
+        }
+        if ( quiet && opcode == BINARY_NOOP ) {
+            break;
+        }
+        responses++;
+    }
+    return true;
+}
+
+// Open a UDP socket connected to the server.
+static int udpConnect( ProtoConfig *config ) {
+    struct sockaddr_in addr;
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons( config->udpPort );
+    if ( inet_pton( AF_INET, config->host, &addr.sin_addr ) != 1 ) {
+        return -1;
+    }
+    int fd = socket( AF_INET, SOCK_DGRAM, 0 );
+    if ( fd < 0 ) {
+        return -1;
+    }
+    struct timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = UDP_REPLY_TIMEOUT_MS * 1000;
+    setsockopt( fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof( timeout ) );
+    if ( connect( fd, (struct sockaddr *)&addr, sizeof( addr ) ) < 0 ) {
+        close( fd );
+        return -1;
+    }
+    return fd;
+}
+
+// Send the gets over UDP in batches of depth datagrams and wait for
+// all their replies, or for the timeout.
+static void runUdpGets( ProtoThread *pt, int fd ) {
+    ProtoConfig *config = pt->config;
+    vector< string > &keys = *pt->keys;
+    uint64_t rand = 0x9E3779B97F4A7C15ULL * ( pt->id + 1 );
+    // Datagrams still missing from the reply to each request id, -1
+    // until its first datagram tells how many there are.
+    vector< int > missing( 0x10000, 0 );
+    vector< string > requests( config->depth );
+    vector< struct iovec > iov( config->depth );
+    vector< struct mmsghdr > msgs( config->depth );
+    vector< char > replies( UDP_BATCH * UDP_MAX_DATAGRAM );
+    vector< struct iovec > replyIov( UDP_BATCH );
+    vector< struct mmsghdr > replyMsgs( UDP_BATCH );
+    uint16_t nextId = 0;
+
+    for ( long done = 0; done < config->numRequests; done += config->depth ) {
+        int count = min( (long)config->depth, config->numRequests - done );
+        memset( msgs.data(), 0, sizeof( struct mmsghdr ) * count );
+        for ( int i = 0; i < count; i++ ) {
+            uint16_t id = nextId++;
+            char frame[UDP_HEADER_SIZE];
+            storeBE16( frame, id );
+            storeBE16( frame + 2, 0 );
+            storeBE16( frame + 4, 1 );
+            storeBE16( frame + 6, 0 );
+            requests[i].assign( frame, sizeof( frame ) );
+            requests[i] += "get " + keys[zipfRandom( &rand ) % config->numKeys] + "\r\n";
+            iov[i].iov_base = (void *)requests[i].data();
+            iov[i].iov_len = requests[i].size();
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            missing[id] = -1;
+        }
+        double batchStart = nowSecs();
+        int sent = 0;
+        while ( sent < count ) {
+            int n = sendmmsg( fd, &msgs[sent], count - sent, 0 );
+            if ( n < 0 ) {
+                pt->failed = true;
+                return;
+            }
+            sent += n;
+        }
+
+        int pending = count;
+        while ( pending > 0 ) {
+            memset( replyMsgs.data(), 0, sizeof( struct mmsghdr ) * UDP_BATCH );
+            for ( int i = 0; i < UDP_BATCH; i++ ) {
+                replyIov[i].iov_base = &replies[i * UDP_MAX_DATAGRAM];
+                replyIov[i].iov_len = UDP_MAX_DATAGRAM;
+                replyMsgs[i].msg_hdr.msg_iov = &replyIov[i];
+                replyMsgs[i].msg_hdr.msg_iovlen = 1;
+            }
+            int n = recvmmsg( fd, replyMsgs.data(), UDP_BATCH, MSG_WAITFORONE, NULL );
+            if ( n < 0 ) {
+                // Timed out, the rest of the batch is lost.
+                pt->lost += pending;
+                break;
+            }
+            for ( int i = 0; i < n; i++ ) {
+                const char *reply = &replies[i * UDP_MAX_DATAGRAM];
+                if ( replyMsgs[i].msg_len < UDP_HEADER_SIZE ) {
+                    continue;
+                }
+                uint16_t id = loadBE16( reply );
+                if ( missing[id] == 0 ) {
+                    // Late reply of a lost batch.
+                    continue;
+                }
+                if ( missing[id] < 0 ) {
+                    missing[id] = loadBE16( reply + 4 );
+                }
+                if ( loadBE16( reply + 2 ) == 0 &&
+                     memcmp( reply + UDP_HEADER_SIZE, "VALUE ", 6 ) == 0 ) {
+                    pt->hits++;
+                }
+                if ( --missing[id] == 0 ) {
+                    pending--;
+                }
+            }
+        }
+        pt->latencies.push_back( ( nowSecs() - batchStart ) * 1e6 );
+        // Forget what is left of a lost batch.
+        for ( int i = 0; i < count; i++ ) {
+            missing[loadBE16( requests[i].data() )] = 0;
+        }
+    }
+}
+
+static void * protoThreadFunc( void *arg ) {
+    ProtoThread *pt = (ProtoThread *)arg;
+    ProtoConfig *config = pt->config;
+    uint64_t rand = 0x9E3779B97F4A7C15ULL * ( pt->id + 1 );
+    string value( config->valueSize, 'v' );
+    string out;
+
+    if ( pt->workload == UDP_GET ) {
+        int fd = udpConnect( config );
+        pthread_barrier_wait( pt->barrier );
+        if ( fd < 0 ) {
+            pt->failed = true;
+            return NULL;
+        }
+        runUdpGets( pt, fd );
+        close( fd );
+        return NULL;
+    }
+
+    ClientConn conn;
+    bool connected = conn.connectTo( config->host, config->port );
+    pthread_barrier_wait( pt->barrier );
+    if ( !connected ) {
+        pt->failed = true;
+        return NULL;
+    }
+    for ( long done = 0; done < config->numRequests; done += config->depth ) {
+        int count = min( (long)config->depth, config->numRequests - done );
+        double batchStart = nowSecs();
+        if ( !runBatch( pt, &conn, &rand, count, value, &out ) ) {
+            pt->failed = true;
+            return NULL;
+        }
+        pt->latencies.push_back( ( nowSecs() - batchStart ) * 1e6 );
+    }
+    return NULL;
+}
+
+// Counters of the "stats" of the server. False if it has none.
+struct ServerStats {
+    string backend;
+    uint64_t commands;
+    uint64_t syscalls;
+};
+
+static bool readServerStats( ProtoConfig *config, ServerStats *stats ) {
+    ClientConn conn;
+    if ( !conn.connectTo( config->host, config->port ) || !conn.writeAll( "stats\r\n" ) ) {
+        return false;
+    }
+    bool found = false;
+    string line;
+    while ( conn.readLine( &line ) && line != "END" ) {
+        char name[64], value[64];
+        if ( sscanf( line.c_str(), "STAT %63s %63s", name, value ) != 2 ) {
+            continue;
+        }
+        if ( strcmp( name, "io_backend" ) == 0 ) {
+            stats->backend = value;
+        } else if ( strcmp( name, "commands" ) == 0 ) {
+            stats->commands = strtoull( value, NULL, 10 );
+        } else if ( strcmp( name, "io_syscalls" ) == 0 ) {
+            stats->syscalls = strtoull( value, NULL, 10 );
+            found = true;
+        }
+    }
+    return found;
+}
+
+static float percentile( vector< float > &sorted, double p ) {
+    if ( sorted.empty() ) {
+        return 0;
+    }
+    return sorted[min( sorted.size() - 1, (size_t)( p * sorted.size() ) )];
+}
+
+// Run one workload on every connection at once and print its rate.
+static bool runWorkload( ProtoConfig *config, Workload workload, vector< string > *keys ) {
+    ServerStats before, after;
+    bool haveStats = readServerStats( config, &before );
+    pthread_barrier_t barrier;
+    pthread_barrier_init( &barrier, NULL, config->numThreads + 1 );
+    vector< ProtoThread > threads( config->numThreads );
+    for ( int i = 0; i < config->numThreads; i++ ) {
+        threads[i].id = i;
+        threads[i].config = config;
+        threads[i].workload = workload;
+        threads[i].keys = keys;
+        threads[i].barrier = &barrier;
+        threads[i].hits = 0;
+        threads[i].lost = 0;
+        threads[i].failed = false;
+        pthread_create( &threads[i].threadId, NULL, protoThreadFunc, &threads[i] );
+    }
+
+    pthread_barrier_wait( &barrier );
+    double start = nowSecs();
+    long hits = 0, lost = 0;
+    bool failed = false;
+    vector< float > latencies;
+    for ( int i = 0; i < config->numThreads; i++ ) {
+        pthread_join( threads[i].threadId, NULL );
+        hits += threads[i].hits;
+        lost += threads[i].lost;
+        failed = failed || threads[i].failed;
+        latencies.insert( latencies.end(), threads[i].latencies.begin(),
+                          threads[i].latencies.end() );
+    }
+    double elapsed = nowSecs() - start;
+    haveStats = haveStats && readServerStats( config, &after );
+    pthread_barrier_destroy( &barrier );
+    if ( failed ) {
+        pr_info( "%s failed, is the server running on %s:%d?\n", workloadNames[workload],
+                 config->host, config->port );
+        return false;
+    }
+
+    long requests = config->numRequests * config->numThreads;
+    sort( latencies.begin(), latencies.end() );
+    printf( "%-14s %14.0f %12ld %10ld %9.1f %9.1f", workloadNames[workload],
+            requests / elapsed, hits, lost, percentile( latencies, 0.5 ),
+            percentile( latencies, 0.99 ) );
+    // The UDP threads are not event loops, they count neither the gets nor
+    // the system calls, only the stats request of the benchmark would.
+    uint64_t commands = after.commands - before.commands;
+    if ( haveStats && workload != UDP_GET && commands > 0 ) {
+        printf( " %12.3f\n", (double)( after.syscalls - before.syscalls ) / commands );
+    } else {
+        printf( " %12s\n", "-" );
+    }
+    return true;
+}
+
+static void usage( const char *prog ) {
+    fprintf( stderr, "Usage: %s [-H host] [-p port] [-c connections] [-n requests] "
+             "[-d depth] [-k keys] [-v valueSize] [-U udpPort]\n", prog );
+}
+
+int main( int argc, char **argv ) {
+    ProtoConfig config;
+    config.host = "127.0.0.1";
+    config.port = MEMCACHED_PORT;
+    config.numThreads = 4;
+    config.numRequests = 200000;
+    config.depth = 32;
+    config.numKeys = 10000;
+    config.valueSize = 100;
+    config.udpPort = 0;
+
+    int opt;
+    while ( ( opt = getopt( argc, argv, "H:p:c:n:d:k:v:U:h" ) ) != -1 ) {
+        switch ( opt ) {
+        case 'H': config.host = optarg; break;
+        case 'p': config.port = atoi( optarg ); break;
+        case 'c': config.numThreads = atoi( optarg ); break;
+        case 'n': config.numRequests = atol( optarg ); break;
+        case 'd': config.depth = atoi( optarg ); break;
+        case 'k': config.numKeys = atoi( optarg ); break;
+        case 'v': config.valueSize = atoi( optarg ); break;
+        case 'U': config.udpPort = atoi( optarg ); break;
+        default:
+            usage( argv[0] );
+            return 1;
+        }
+    }
+    if ( config.numThreads <= 0 || config.numRequests <= 0 || config.depth <= 0 ||
+         config.numKeys <= 0 || config.valueSize < 0 ) {
+        usage( argv[0] );
+        return 1;
+    }
+    signal( SIGPIPE, SIG_IGN );
+
+    vector< string > keys;
+    for ( int i = 0; i < config.numKeys; i++ ) {
+        keys.push_back( "key:" + to_string( (long long int)i ) );
+    }
+
+    printf( "# connections=%d requests=%ld depth=%d keys=%d valueSize=%d\n",
+            config.numThreads, config.numRequests, config.depth, config.numKeys,
+            config.valueSize );
+    ServerStats stats;
+    if ( readServerStats( &config, &stats ) ) {
+        printf( "# server io_backend=%s\n", stats.backend.c_str() );
+    }
+    printf( "%-14s %14s %12s %10s %9s %9s %12s\n", "workload", "requests/s", "hits", "lost",
+            "p50 us", "p99 us", "syscalls/req" );
+    // Sets come first so the gets find the keys.
+    for ( int i = 0; i < NUM_WORKLOADS; i++ ) {
+        if ( i == UDP_GET && config.udpPort == 0 ) {
+            continue;
+        }
+        if ( !runWorkload( &config, (Workload)i, &keys ) ) {
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,550 @@
+#ifndef _SLAB_ALLOCATOR_H
+#define _SLAB_ALLOCATOR_H
+
+#include "Memcached.h"
+
+// Slab allocator for items. Memory is taken from the system in pages
+// of SLAB_PAGE_SIZE and every page belongs to one slab class, which
+// cuts it in chunks of the same size. Chunk sizes grow geometrically
+// by SLAB_GROWTH_FACTOR from SLAB_MIN_CHUNK up to a single chunk per
+// page. An item goes in the smallest chunk its header, key and value
+// fit in, so allocating and freeing an item never goes to malloc and
+// the heap doesn't fragment under churn. Values bigger than the chunk
+// size of the cache are chained, their data chunks come from the
+// slabs like any item, see allocChunks. Items bigger than a page are
+// the exception and are malloced on their own.
+//
+// When the mix of item sizes changes, a class can end up with lots of
+// free chunks that other classes can't use. A background rebalancer
+// takes a page away from such a class, evicting the items still in
+// it, and puts it in a pool the other classes take pages from.
+
+#define MAX_SLAB_CLASSES 64
+// Chunks start after the page header, on a cache line boundary.
+#define SLAB_PAGE_HEADER 64
+
+// Header at the start of every page. Pages are aligned to their size
+// so the page of a chunk is found by masking its address.
+struct SlabPage {
+    int classId_;
+    int used_;       // Chunks handed out.
+    bool moving_;    // Being emptied by the rebalancer.
+};
+
+// Implemented by the owner of the items, so that the rebalancer can
+// get rid of the items in a page it wants to move.
+class SlabEvictor {
+public:
+    virtual ~SlabEvictor() {}
+    // Unlink and free the item if it is still in the cache.
+    virtual void evictForRebalance( MemcachedItem *item ) = 0;
+    // Free what evictForRebalance has let go of but still holds back,
+    // so the chunks can come back to the page.
+    virtual void reclaimEvicted() {}
+};
+
+class SlabClass {
+public:
+    size_t chunkSize_;
+    size_t chunksPerPage_;
+    vector< SlabPage * > pages_;
+    MemcachedItem *freeList_;  // Doubly linked through prev_ and next_.
+    size_t freeChunks_;
+    size_t usedChunks_;
+    size_t requestedBytes_;    // Sum of totalSize() of the used chunks.
+    uint64_t evictions_;
+    pthread_mutex_t lock_;
+};
+
+// Point in time copy of the counters of a slab class.
+struct SlabClassStats {
+    int id;
+    size_t chunkSize;
+    size_t chunksPerPage;
+    size_t totalPages;
+    size_t usedChunks;
+    size_t freeChunks;
+    uint64_t evictions;
+    // Fraction of the bytes in used chunks that items don't use.
+    double fragmentation;
+};
+
+class SlabAllocator {
+private:
+    SlabClass classes_[MAX_SLAB_CLASSES];  // Class 0 is not used.
+    int numClasses_;                       // Highest class id.
+
+    pthread_mutex_t poolLock_;
+    vector< SlabPage * > pool_;     // Pages not owned by any class.
+    size_t totalPages_;             // Pages taken from the system.
+    uint64_t systemPageAllocs_;     // Times a class had to go to the system.
+    size_t largeItems_;             // Items malloced outside the slabs.
+    size_t largeBytes_;
+    uint64_t pagesMoved_;
+    uint64_t rebalanceEvictions_;
+
+    // Page the rebalancer is emptying. Only the rebalancer thread
+    // touches this.
+    SlabPage *movingPage_;
+    uint64_t lastSystemPageAllocs_;
+    SlabEvictor *evictor_;
+    int rebalanceInterval_;
+    pthread_t rebalancer_;
+
+    // Pages kept in the pool before we give them back to the system.
+    static const size_t poolSparePages_ = 4;
+
+    static SlabPage *pageOf( MemcachedItem *item ) {
+        return (SlabPage *)( (uintptr_t)item & ~( (uintptr_t)SLAB_PAGE_SIZE - 1 ) );
+    }
+
+    static MemcachedItem *chunkAt( SlabClass *cls, SlabPage *page, size_t i ) {
+        return (MemcachedItem *)( (char *)page + SLAB_PAGE_HEADER +
+                                  i * cls->chunkSize_ );
+    }
+
+    static void freeListPush( SlabClass *cls, MemcachedItem *chunk ) {
+        chunk->prev_ = NULL;
+        chunk->next_ = cls->freeList_;
+        if ( cls->freeList_ ) {
+            cls->freeList_->prev_ = chunk;
+        }
+        cls->freeList_ = chunk;
+        cls->freeChunks_++;
+    }
+
+    static void freeListRemove( SlabClass *cls, MemcachedItem *chunk ) {
+        if ( chunk->prev_ ) {
+            chunk->prev_->next_ = chunk->next_;
+        } else {
+            cls->freeList_ = chunk->next_;
+        }
+        if ( chunk->next_ ) {
+            chunk->next_->prev_ = chunk->prev_;
+        }
+        chunk->prev_ = NULL;
+        chunk->next_ = NULL;
+        cls->freeChunks_--;
+    }
+
+    // Smallest class whose chunks fit bytes, 0 if none does.
+    int classFor( size_t bytes ) {
+        int low = 1, high = numClasses_;
+        if ( bytes > classes_[high].chunkSize_ ) {
+            return 0;
+        }
+        while ( low < high ) {
+            int mid = ( low + high ) / 2;
+            if ( classes_[mid].chunkSize_ < bytes ) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        return low;
+    }
+
+    // Give a page to the class, from the pool if it has one, and put
+    // all its chunks on the free list. Called with the class lock held.
+    bool addPage( int id ) {
+        SlabClass *cls = &classes_[id];
+        SlabPage *page = NULL;
+
+        pthread_mutex_lock( &poolLock_ );
+        if ( !pool_.empty() ) {
+            page = pool_.back();
+            pool_.pop_back();
+        }
+        pthread_mutex_unlock( &poolLock_ );
+
+        if ( page == NULL ) {
+            void *mem;
+            if ( posix_memalign( &mem, SLAB_PAGE_SIZE, SLAB_PAGE_SIZE ) != 0 ) {
+                return false;
+            }
+            page = (SlabPage *)mem;
+            pthread_mutex_lock( &poolLock_ );
+            totalPages_++;
+            systemPageAllocs_++;
+            pthread_mutex_unlock( &poolLock_ );
+        }
+
+        page->classId_ = id;
+        page->used_ = 0;
+        page->moving_ = false;
+        cls->pages_.push_back( page );
+        for ( size_t i = cls->chunksPerPage_; i > 0; i-- ) {
+            MemcachedItem *chunk = chunkAt( cls, page, i - 1 );
+            chunk->slabClass_ = id;
+            chunk->iflags_ = ITEM_SLABBED;
+            freeListPush( cls, chunk );
+        }
+        return true;
+    }
+
+    // Take the page away from its class. All its chunks must be off
+    // the free list. Called with the class lock held.
+    void removePage( SlabClass *cls, SlabPage *page ) {
+        for ( size_t i = 0; i < cls->pages_.size(); i++ ) {
+            if ( cls->pages_[i] == page ) {
+                cls->pages_.erase( cls->pages_.begin() + i );
+                break;
+            }
+        }
+        pthread_mutex_lock( &poolLock_ );
+        pool_.push_back( page );
+        pagesMoved_++;
+        pthread_mutex_unlock( &poolLock_ );
+    }
+
+    // Take the free chunks of a page off the free list of its class.
+    // Called with the class lock held. allocChunks marks the data
+    // chunks it got with ITEM_CHUNK after the lock is let go, so the
+    // flags are read atomically.
+    void detachFreeChunks( SlabClass *cls, SlabPage *page ) {
+        for ( size_t i = 0; i < cls->chunksPerPage_; i++ ) {
+            MemcachedItem *chunk = chunkAt( cls, page, i );
+            if ( __atomic_load_n( &chunk->iflags_, __ATOMIC_ACQUIRE ) & ITEM_SLABBED ) {
+                freeListRemove( cls, chunk );
+            }
+        }
+    }
+
+    // Give completely free pages back to the pool while a class has at
+    // least two pages worth of free chunks. Then, if other classes
+    // are short of pages, that is they had to take new ones from the
+    // system since the last run, start emptying the least used page of
+    // such a class. Its free chunks are taken off the free list right
+    // away so nothing new lands in it, the items still in it are
+    // evicted by continuePageMove. The page already being moved is
+    // left to continuePageMove, its chunks are not on the free list.
+    void startPageMove( bool demand ) {
+        for ( int id = 1; id <= numClasses_; id++ ) {
+            SlabClass *cls = &classes_[id];
+            pthread_mutex_lock( &cls->lock_ );
+            while ( cls->freeChunks_ >= 2 * cls->chunksPerPage_ ) {
+                SlabPage *victim = NULL;
+                for ( size_t i = 0; i < cls->pages_.size(); i++ ) {
+                    if ( cls->pages_[i]->moving_ ) {
+                        continue;
+                    }
+                    if ( victim == NULL || cls->pages_[i]->used_ < victim->used_ ) {
+                        victim = cls->pages_[i];
+                    }
+                }
+                if ( victim == NULL ) {
+                    break;
+                }
+                if ( victim->used_ == 0 ) {
+                    detachFreeChunks( cls, victim );
+                    removePage( cls, victim );
+                    continue;
+                }
+                if ( demand && movingPage_ == NULL ) {
+                    victim->moving_ = true;
+                    detachFreeChunks( cls, victim );
+                    movingPage_ = victim;
+                }
+                break;
+            }
+            pthread_mutex_unlock( &cls->lock_ );
+        }
+    }
+
+    // Evict what is left in the moving page and, once all its chunks
+    // have come back, hand the page to the pool. Items that are not in
+    // the cache (a set still reading its value, a get reply still being
+    // sent) keep the page busy until they are freed, we retry on the
+    // next run. A data chunk goes with its item, which may be freed
+    // meanwhile, but its page can't leave the class while we are here,
+    // pages only move on this thread.
+    void continuePageMove() {
+        SlabPage *page = movingPage_;
+        SlabClass *cls = &classes_[page->classId_];
+
+        for ( size_t i = 0; i < cls->chunksPerPage_; i++ ) {
+            MemcachedItem *chunk = chunkAt( cls, page, i );
+            if ( !( __atomic_load_n( &chunk->iflags_, __ATOMIC_ACQUIRE ) & ITEM_SLABBED ) ) {
+                evictor_->evictForRebalance( chunk );
+            }
+        }
+        evictor_->reclaimEvicted();
+
+        pthread_mutex_lock( &cls->lock_ );
+        if ( page->used_ == 0 ) {
+            pr_debug( "Moved page of slab class %d to the pool\n", page->classId_ );
+            removePage( cls, page );
+            movingPage_ = NULL;
+        }
+        pthread_mutex_unlock( &cls->lock_ );
+    }
+
+    // Give pool pages nobody asked for back to the system.
+    void trimPool() {
+        pthread_mutex_lock( &poolLock_ );
+        while ( pool_.size() > poolSparePages_ ) {
+            free( pool_.back() );
+            pool_.pop_back();
+            totalPages_--;
+        }
+        pthread_mutex_unlock( &poolLock_ );
+    }
+
+    static void * rebalancerFunc( void *arg ) {
+        SlabAllocator *slabs = (SlabAllocator *)arg;
+        registerBackgroundStats();
+        while ( 1 ) {
+            sleep( slabs->rebalanceInterval_ );
+            slabs->rebalance();
+        }
+        return NULL;
+    }
+
+public:
+    SlabAllocator() {
+        numClasses_ = 0;
+        double size = SLAB_MIN_CHUNK;
+        size_t maxChunk = SLAB_PAGE_SIZE - SLAB_PAGE_HEADER;
+        while ( numClasses_ < MAX_SLAB_CLASSES - 2 ) {
+            // Chunks are 8 byte aligned so item headers are too.
+            size_t chunkSize = ( (size_t)size + 7 ) & ~(size_t)7;
+            if ( chunkSize > maxChunk / 2 ) {
+                break;
+            }
+            initClass( ++numClasses_, chunkSize );
+            size *= SLAB_GROWTH_FACTOR;
+        }
+        // The last class holds one item per page.
+        initClass( ++numClasses_, maxChunk );
+
+        pthread_mutex_init( &poolLock_, NULL );
+        totalPages_ = 0;
+        systemPageAllocs_ = 0;
+        lastSystemPageAllocs_ = 0;
+        largeItems_ = 0;
+        largeBytes_ = 0;
+        pagesMoved_ = 0;
+        rebalanceEvictions_ = 0;
+        movingPage_ = NULL;
+        evictor_ = NULL;
+        rebalanceInterval_ = SLAB_REBALANCE_INTERVAL;
+    }
+
+    ~SlabAllocator() {
+        for ( int id = 1; id <= numClasses_; id++ ) {
+            for ( size_t i = 0; i < classes_[id].pages_.size(); i++ ) {
+                free( classes_[id].pages_[i] );
+            }
+            pthread_mutex_destroy( &classes_[id].lock_ );
+        }
+        for ( size_t i = 0; i < pool_.size(); i++ ) {
+            free( pool_[i] );
+        }
+        pthread_mutex_destroy( &poolLock_ );
+    }
+
+    void initClass( int id, size_t chunkSize ) {
+        SlabClass *cls = &classes_[id];
+        cls->chunkSize_ = chunkSize;
+        cls->chunksPerPage_ = ( SLAB_PAGE_SIZE - SLAB_PAGE_HEADER ) / chunkSize;
+        cls->freeList_ = NULL;
+        cls->freeChunks_ = 0;
+        cls->usedChunks_ = 0;
+        cls->requestedBytes_ = 0;
+        cls->evictions_ = 0;
+        pthread_mutex_init( &cls->lock_, NULL );
+    }
+
+    // Memory for an item of bytes total size. The caller initializes
+    // the header. Returns NULL if we are out of memory.
+    MemcachedItem *allocItem( size_t bytes ) {
+        int id = classFor( bytes );
+        if ( id == 0 ) {
+            MemcachedItem *item = (MemcachedItem *)malloc( bytes );
+            if ( item == NULL ) {
+                return NULL;
+            }
+            item->slabClass_ = 0;
+            item->iflags_ = 0;
+            pthread_mutex_lock( &poolLock_ );
+            largeItems_++;
+            largeBytes_ += bytes;
+            pthread_mutex_unlock( &poolLock_ );
+            return item;
+        }
+
+        SlabClass *cls = &classes_[id];
+        pthread_mutex_lock( &cls->lock_ );
+        if ( cls->freeList_ == NULL && !addPage( id ) ) {
+            pthread_mutex_unlock( &cls->lock_ );
+            return NULL;
+        }
+        MemcachedItem *item = cls->freeList_;
+        freeListRemove( cls, item );
+        pageOf( item )->used_++;
+        cls->usedChunks_++;
+        cls->requestedBytes_ += bytes;
+        item->iflags_ = 0;
+        pthread_mutex_unlock( &cls->lock_ );
+        return item;
+    }
+
+    // Give the item a chain of count data chunks for its value, the
+    // last one short if size_ isn't a multiple of chunkBytes. The item
+    // must have been allocated with MemcachedItem::chainedSize() bytes.
+    // False if we are out of memory, freeItem then frees the chunks the
+    // item got.
+    bool allocChunks( MemcachedItem *item, size_t count, size_t chunkBytes ) {
+        ItemChain *chain = item->chain();
+        chain->count_ = count;
+        chain->chunkBytes_ = chunkBytes;
+        __atomic_fetch_or( &item->iflags_, ITEM_CHAINED, __ATOMIC_RELAXED );
+        size_t left = item->size_;
+        for ( size_t i = 0; i < count; i++ ) {
+            size_t bytes = min( left, chunkBytes );
+            MemcachedItem *chunk = allocItem( sizeof( MemcachedItem ) + bytes );
+            chain->chunks_[i] = chunk;
+            if ( chunk == NULL ) {
+                for ( i++; i < count; i++ ) {
+                    chain->chunks_[i] = NULL;
+                }
+                return false;
+            }
+            // The rebalancer finds the item through prev_ and hash_.
+            chunk->prev_ = item;
+            chunk->next_ = NULL;
+            chunk->hash_ = item->hash_;
+            chunk->size_ = bytes;
+            chunk->keyLen_ = 0;
+            chunk->headerLen_ = 0;
+            __atomic_store_n( &chunk->iflags_, ITEM_CHUNK, __ATOMIC_RELEASE );
+            left -= bytes;
+        }
+        return true;
+    }
+
+    // Return the chunk of an item that is no longer in the cache, and
+    // its data chunks if it is chained.
+    void freeItem( MemcachedItem *item ) {
+        if ( item->chained() ) {
+            ItemChain *chain = item->chain();
+            for ( size_t i = 0; i < chain->count_; i++ ) {
+                if ( chain->chunks_[i] != NULL ) {
+                    freeItem( chain->chunks_[i] );
+                }
+            }
+        }
+        if ( item->slabClass_ == 0 ) {
+            pthread_mutex_lock( &poolLock_ );
+            largeItems_--;
+            largeBytes_ -= item->totalSize();
+            pthread_mutex_unlock( &poolLock_ );
+            free( item );
+            return;
+        }
+
+        SlabClass *cls = &classes_[item->slabClass_];
+        SlabPage *page = pageOf( item );
+        pthread_mutex_lock( &cls->lock_ );
+        page->used_--;
+        cls->usedChunks_--;
+        cls->requestedBytes_ -= item->totalSize();
+        __atomic_store_n( &item->iflags_, ITEM_SLABBED, __ATOMIC_RELEASE );
+        // Chunks of a page being moved stay off the free list.
+        if ( !page->moving_ ) {
+            freeListPush( cls, item );
+        }
+        pthread_mutex_unlock( &cls->lock_ );
+    }
+
+    // Size of the chunk the item occupies, with its data chunks if it
+    // is chained, which is what it really costs us.
+    size_t chunkSize( MemcachedItem *item ) {
+        size_t bytes = 0;
+        if ( item->chained() ) {
+            ItemChain *chain = item->chain();
+            for ( size_t i = 0; i < chain->count_; i++ ) {
+                bytes += chunkSize( chain->chunks_[i] );
+            }
+        }
+        if ( item->slabClass_ == 0 ) {
+            return bytes + item->totalSize();
+        }
+        return bytes + classes_[item->slabClass_].chunkSize_;
+    }
+
+    // The cache evicted the item to make room.
+    void noteEviction( MemcachedItem *item ) {
+        if ( item->slabClass_ == 0 ) {
+            return;
+        }
+        SlabClass *cls = &classes_[item->slabClass_];
+        pthread_mutex_lock( &cls->lock_ );
+        cls->evictions_++;
+        pthread_mutex_unlock( &cls->lock_ );
+    }
+
+    void noteRebalanceEviction() {
+        __atomic_add_fetch( &rebalanceEvictions_, 1, __ATOMIC_RELAXED );
+    }
+
+    // One run of the rebalancer: release free pages, keep emptying the
+    // page being moved or pick a new one, and trim the pool.
+    void rebalance() {
+        pthread_mutex_lock( &poolLock_ );
+        bool demand = systemPageAllocs_ != lastSystemPageAllocs_;
+        lastSystemPageAllocs_ = systemPageAllocs_;
+        pthread_mutex_unlock( &poolLock_ );
+
+        startPageMove( demand );
+        if ( movingPage_ != NULL && evictor_ != NULL ) {
+            continuePageMove();
+        }
+        trimPool();
+    }
+
+    // Start the background rebalancer. evictor is called for items in
+    // a page being moved.
+    void startRebalancer( SlabEvictor *evictor, int intervalSecs ) {
+        evictor_ = evictor;
+        rebalanceInterval_ = intervalSecs;
+        pthread_create( &rebalancer_, NULL, rebalancerFunc, this );
+    }
+
+    void getClassStats( vector< SlabClassStats > *stats ) {
+        for ( int id = 1; id <= numClasses_; id++ ) {
+            SlabClass *cls = &classes_[id];
+            SlabClassStats s;
+            pthread_mutex_lock( &cls->lock_ );
+            s.id = id;
+            s.chunkSize = cls->chunkSize_;
+            s.chunksPerPage = cls->chunksPerPage_;
+            s.totalPages = cls->pages_.size();
+            s.usedChunks = cls->usedChunks_;
+            s.freeChunks = cls->freeChunks_;
+            s.evictions = cls->evictions_;
+            size_t usedBytes = cls->usedChunks_ * cls->chunkSize_;
+            s.fragmentation = usedBytes == 0 ? 0 :
+                1.0 - (double)cls->requestedBytes_ / usedBytes;
+            pthread_mutex_unlock( &cls->lock_ );
+            if ( s.totalPages > 0 ) {
+                stats->push_back( s );
+            }
+        }
+    }
+
+    void getGlobalStats( size_t *totalPages, size_t *poolPages,
+                         uint64_t *pagesMoved, uint64_t *rebalanceEvictions,
+                         size_t *largeItems, size_t *largeBytes ) {
+        pthread_mutex_lock( &poolLock_ );
+        *totalPages = totalPages_;
+        *poolPages = pool_.size();
+        *pagesMoved = pagesMoved_;
+        *largeItems = largeItems_;
+        *largeBytes = largeBytes_;
+        pthread_mutex_unlock( &poolLock_ );
+        *rebalanceEvictions = __atomic_load_n( &rebalanceEvictions_, __ATOMIC_RELAXED );
+    }
+};
+
+#endif // _SLAB_ALLOCATOR_H
@@ -0,0 +1,359 @@
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Memcached.h"
+#include "LRUMemCache.h"
+
+// Snapshot of the items of the cache in a file, so a restarted server
+// comes back warm. The file is
+//
+//   SnapshotHeader
+//   SnapshotSegment for every segment
+//   the records of every segment, one after the other
+//
+// A segment holds the items of one shard from the one eviction would
+// take first to the most recently used. Loading sets them in that
+// order, so the most recently used ones end up in front again. Every
+// record is a SnapshotRecord, the key and the value without its \r\n,
+// padded to 8 bytes. Items a get marked active, or that SLRU
+// protects, are marked active again when loaded, so CLOCK and SLRU
+// keep them over the others as they would have. The expiry time is
+// stored as the seconds the item had left, the time between saving
+// and loading is taken off. Numbers are in the byte order of the host.
+//
+// Segments carry their own checksum, so they can be checked and loaded
+// on several threads at once, and a damaged one is skipped without
+// losing the others. The header checksums the segment table.
+
+#define SNAPSHOT_MAGIC "MYMCSNAP"
+#define SNAPSHOT_VERSION 1
+// Records are written out in buffers of about this size.
+#define SNAPSHOT_WRITE_BUFFER ( 1024 * 1024 )
+
+struct SnapshotHeader {
+    char magic_[8];
+    uint32_t version_;
+    uint32_t segments_;
+    uint64_t savedAt_;       // Unix time of the snapshot.
+    uint64_t items_;
+    uint64_t fileSize_;
+    uint64_t checksum_;      // Of the segment table.
+    char pad_[16];
+};
+
+struct SnapshotSegment {
+    uint64_t offset_;        // From the start of the file.
+    uint64_t length_;        // A multiple of 8.
+    uint64_t items_;
+    uint64_t checksum_;
+};
+
+struct SnapshotRecord {
+    uint32_t flags_;
+    uint32_t ttl_;           // Seconds left, 0 if the item never expires.
+    uint32_t size_;          // Of the value without \r\n.
+    uint16_t keyLen_;
+    uint16_t hot_;           // Read since it was set, or protected by SLRU.
+};
+
+static inline size_t snapshotPadded( size_t len ) {
+    return ( len + 7 ) & ~(size_t)7;
+}
+
+// Checksum of len bytes, a multiple of 8, continuing from h. A multiply
+// and a shift per word, so checking a segment costs little next to
+// setting its items.
+static inline uint64_t snapshotChecksum( uint64_t h, const char *data, size_t len ) {
+    for ( size_t i = 0; i < len; i += 8 ) {
+        uint64_t word;
+        memcpy( &word, data + i, 8 );
+        h = ( h ^ word ) * 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+class Snapshot {
+private:
+    struct LoadThread {
+        pthread_t threadId_;
+        const char *base_;
+        const SnapshotHeader *header_;
+        const SnapshotSegment *table_;
+        const vector< LRUMemCache * > *caches_;
+        uint32_t *nextSegment_;
+        long elapsed_;       // Seconds between saving and loading.
+        uint64_t loaded_;
+        uint64_t skipped_;   // Expired, or not stored for want of memory.
+    };
+
+    static bool writeAll( int fd, const char *data, size_t len, off_t offset ) {
+        while ( len > 0 ) {
+            ssize_t written = pwrite( fd, data, len, offset );
+            if ( written < 0 ) {
+                if ( errno == EINTR ) {
+                    continue;
+                }
+                return false;
+            }
+            data += written;
+            len -= written;
+            offset += written;
+        }
+        return true;
+    }
+
+    // Set the items of one segment in the caches they belong to.
+    static void loadSegment( LoadThread *lt, const SnapshotSegment *segment ) {
+        const char *p = lt->base_ + segment->offset_;
+        const char *end = p + segment->length_;
+        uint32_t now = currentTime();
+        while ( p < end ) {
+            SnapshotRecord record;
+            if ( (size_t)( end - p ) < sizeof( record ) ) {
+                break;
+            }
+            memcpy( &record, p, sizeof( record ) );
+            const char *key = p + sizeof( record );
+            const char *value = key + record.keyLen_;
+            size_t len = snapshotPadded( sizeof( record ) + record.keyLen_ + record.size_ );
+            if ( len > (size_t)( end - p ) ) {
+                break;
+            }
+            p += len;
+
+            uint32_t exptime = 0;
+            if ( record.ttl_ != 0 ) {
+                if ( (long)record.ttl_ <= lt->elapsed_ ) {
+                    lt->skipped_++;
+                    continue;
+                }
+                exptime = now + record.ttl_ - lt->elapsed_;
+            }
+            const vector< LRUMemCache * > &caches = *lt->caches_;
+            uint64_t hash = LRUMemCache::hashKey( key, record.keyLen_ );
+            LRUMemCache *cache = caches[ partitionIndex( hash, caches.size() ) ];
+            MemcachedItem *item = cache->allocItem( key, record.keyLen_, hash,
+                                                    record.size_ + 2, record.flags_,
+                                                    exptime );
+            if ( item == NULL ) {
+                lt->skipped_++;
+                continue;
+            }
+            item->copyIn( 0, value, record.size_ );
+            item->copyIn( record.size_, "\r\n", 2 );
+            if ( record.hot_ ) {
+                item->markActive();
+            }
+            if ( !cache->setItem( item ) ) {
+                cache->releaseItem( item );
+                lt->skipped_++;
+                continue;
+            }
+            lt->loaded_++;
+        }
+    }
+
+    static void * loadThreadFunc( void *arg ) {
+        LoadThread *lt = (LoadThread *)arg;
+        while ( 1 ) {
+            uint32_t s = __atomic_fetch_add( lt->nextSegment_, 1, __ATOMIC_RELAXED );
+            if ( s >= lt->header_->segments_ ) {
+                break;
+            }
+            const SnapshotSegment *segment = &lt->table_[s];
+            if ( snapshotChecksum( 0, lt->base_ + segment->offset_, segment->length_ ) !=
+                 segment->checksum_ ) {
+                pr_info( "Snapshot segment %u is damaged, skipping its %llu items\n", s,
+                         (unsigned long long)segment->items_ );
+                continue;
+            }
+            loadSegment( lt, segment );
+        }
+        for ( size_t i = 0; i < lt->caches_->size(); i++ ) {
+            (*lt->caches_)[i]->reclaimRetired();
+        }
+        return NULL;
+    }
+
+public:
+    // Write the items of caches to path. The file is written next to
+    // it and renamed over it once complete, so a crash while saving
+    // leaves the last snapshot as it was. The lock of a shard is only
+    // held while its items are collected, the copying happens without.
+    static bool save( const vector< LRUMemCache * > &caches, const char *path ) {
+        double start = nowSecs();
+        string tmpPath = string( path ) + ".tmp";
+        int fd = open( tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+        if ( fd < 0 ) {
+            pr_info( "Error creating snapshot %s: %s\n", tmpPath.c_str(), strerror( errno ) );
+            return false;
+        }
+
+        vector< SnapshotSegment > table;
+        for ( size_t c = 0; c < caches.size(); c++ ) {
+            table.resize( table.size() + caches[c]->numShards() );
+        }
+        off_t offset = sizeof( SnapshotHeader ) + table.size() * sizeof( SnapshotSegment );
+        uint64_t totalItems = 0;
+        uint64_t savedAt = time( NULL );
+        uint32_t now = currentTime();
+        bool ok = true;
+
+        vector< MemcachedItem * > items;
+        string buffer;
+        size_t s = 0;
+        for ( size_t c = 0; c < caches.size(); c++ ) {
+            for ( int shard = 0; shard < caches[c]->numShards(); shard++, s++ ) {
+                SnapshotSegment *segment = &table[s];
+                segment->offset_ = offset;
+                segment->length_ = 0;
+                segment->items_ = 0;
+                segment->checksum_ = 0;
+
+                items.clear();
+                caches[c]->collectItems( shard, &items );
+                for ( size_t i = 0; i < items.size(); i++ ) {
+                    MemcachedItem *item = items[i];
+                    if ( ok && !item->expiredAt( now ) ) {
+                        SnapshotRecord record;
+                        record.flags_ = item->flags_;
+                        uint32_t exptime = item->expiry();
+                        record.ttl_ = exptime == 0 ? 0 : exptime - now;
+                        record.size_ = item->size_ - 2;
+                        record.keyLen_ = item->keyLen_;
+                        uint8_t iflags = __atomic_load_n( &item->iflags_, __ATOMIC_RELAXED );
+                        record.hot_ = ( iflags & ( ITEM_ACTIVE | ITEM_PROTECTED ) ) != 0;
+                        buffer.append( (const char *)&record, sizeof( record ) );
+                        buffer.append( item->key(), item->keyLen_ );
+                        size_t at = buffer.size();
+                        buffer.resize( at + record.size_ );
+                        item->copyOut( 0, &buffer[at], record.size_ );
+                        buffer.resize( snapshotPadded( buffer.size() ), '\0' );
+                        segment->items_++;
+                    }
+                    caches[c]->releaseItem( item );
+
+                    if ( buffer.size() >= SNAPSHOT_WRITE_BUFFER ||
+                         ( i + 1 == items.size() && !buffer.empty() ) ) {
+                        ok = ok && writeAll( fd, buffer.data(), buffer.size(), offset );
+                        segment->checksum_ = snapshotChecksum( segment->checksum_,
+                                                               buffer.data(), buffer.size() );
+                        segment->length_ += buffer.size();
+                        offset += buffer.size();
+                        buffer.clear();
+                    }
+                }
+                caches[c]->reclaimRetired();
+                totalItems += segment->items_;
+            }
+        }
+
+        SnapshotHeader header;
+        memset( &header, 0, sizeof( header ) );
+        memcpy( header.magic_, SNAPSHOT_MAGIC, sizeof( header.magic_ ) );
+        header.version_ = SNAPSHOT_VERSION;
+        header.segments_ = table.size();
+        header.savedAt_ = savedAt;
+        header.items_ = totalItems;
+        header.fileSize_ = offset;
+        header.checksum_ = snapshotChecksum( 0, (const char *)table.data(),
+                                             table.size() * sizeof( SnapshotSegment ) );
+        ok = ok && writeAll( fd, (const char *)table.data(),
+                             table.size() * sizeof( SnapshotSegment ), sizeof( header ) );
+        ok = ok && writeAll( fd, (const char *)&header, sizeof( header ), 0 );
+        ok = ok && fsync( fd ) == 0;
+        if ( close( fd ) != 0 ) {
+            ok = false;
+        }
+        if ( !ok || rename( tmpPath.c_str(), path ) != 0 ) {
+            pr_info( "Error writing snapshot %s: %s\n", path, strerror( errno ) );
+            unlink( tmpPath.c_str() );
+            return false;
+        }
+        pr_info( "Saved %llu items to %s in %.2f s\n", (unsigned long long)totalItems,
+                 path, nowSecs() - start );
+        return true;
+    }
+
+    // Set the items of the snapshot at path in caches, spreading the
+    // segments over numThreads threads. Returns the number of items
+    // loaded, 0 if there is no usable snapshot.
+    static uint64_t load( const vector< LRUMemCache * > &caches, const char *path,
+                          int numThreads ) {
+        double start = nowSecs();
+        int fd = open( path, O_RDONLY );
+        if ( fd < 0 ) {
+            if ( errno != ENOENT ) {
+                pr_info( "Error opening snapshot %s: %s\n", path, strerror( errno ) );
+            }
+            return 0;
+        }
+        struct stat st;
+        if ( fstat( fd, &st ) < 0 || (size_t)st.st_size < sizeof( SnapshotHeader ) ) {
+            pr_info( "Snapshot %s is too short, not loading it\n", path );
+            close( fd );
+            return 0;
+        }
+        void *map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+        close( fd );
+        if ( map == MAP_FAILED ) {
+            pr_info( "Error mapping snapshot %s: %s\n", path, strerror( errno ) );
+            return 0;
+        }
+        madvise( map, st.st_size, MADV_SEQUENTIAL );
+
+        const char *base = (const char *)map;
+        const SnapshotHeader *header = (const SnapshotHeader *)base;
+        const SnapshotSegment *table = (const SnapshotSegment *)( header + 1 );
+        size_t tableSize = (size_t)header->segments_ * sizeof( SnapshotSegment );
+        bool valid = memcmp( header->magic_, SNAPSHOT_MAGIC, sizeof( header->magic_ ) ) == 0 &&
+                     header->version_ == SNAPSHOT_VERSION &&
+                     header->fileSize_ == (uint64_t)st.st_size &&
+                     sizeof( SnapshotHeader ) + tableSize <= (size_t)st.st_size &&
+                     snapshotChecksum( 0, (const char *)table, tableSize ) == header->checksum_;
+        for ( uint32_t s = 0; valid && s < header->segments_; s++ ) {
+            valid = table[s].offset_ <= (uint64_t)st.st_size &&
+                    table[s].length_ <= st.st_size - table[s].offset_ &&
+                    table[s].length_ % 8 == 0;
+        }
+        if ( !valid ) {
+            pr_info( "Snapshot %s is not one we can read, not loading it\n", path );
+            munmap( map, st.st_size );
+            return 0;
+        }
+
+        long elapsed = (long)time( NULL ) - (long)header->savedAt_;
+        uint32_t nextSegment = 0;
+        vector< LoadThread > threads( max( numThreads, 1 ) );
+        for ( size_t i = 0; i < threads.size(); i++ ) {
+            LoadThread *lt = &threads[i];
+            lt->base_ = base;
+            lt->header_ = header;
+            lt->table_ = table;
+            lt->caches_ = &caches;
+            lt->nextSegment_ = &nextSegment;
+            lt->elapsed_ = max( elapsed, 0L );
+            lt->loaded_ = 0;
+            lt->skipped_ = 0;
+            pthread_create( &lt->threadId_, NULL, loadThreadFunc, lt );
+        }
+        uint64_t loaded = 0, skipped = 0;
+        for ( size_t i = 0; i < threads.size(); i++ ) {
+            pthread_join( threads[i].threadId_, NULL );
+            loaded += threads[i].loaded_;
+            skipped += threads[i].skipped_;
+        }
+        uint64_t items = header->items_;
+        munmap( map, st.st_size );
+        pr_info( "Loaded %llu of %llu items from %s in %.2f s on %zu threads, "
+                 "%llu expired or not stored\n", (unsigned long long)loaded,
+                 (unsigned long long)items, path, nowSecs() - start,
+                 threads.size(), (unsigned long long)skipped );
+        return loaded;
+    }
+};
+
+#endif // _SNAPSHOT_H
@@ -0,0 +1,71 @@
+#ifndef _SPSC_QUEUE_H
+#define _SPSC_QUEUE_H
+
+#include "Memcached.h"
+
+// Bounded lock-free queue with a single producer thread and a single
+// consumer thread, a ring of capacity slots, a power of two. The
+// producer only writes tail_ and the consumer only writes head_, each
+// on its own cache line. Both keep a copy of the other end and only
+// read the real one when their copy says the ring is full or empty,
+// so the two cores don't pull each other's line on every message.
+template< typename T >
+class SpscQueue {
+private:
+    T *slots_;
+    size_t mask_;
+    char pad0_[64];
+    size_t head_;            // Next slot to pop, written by the consumer.
+    size_t tailCache_;       // Consumer's copy of tail_.
+    char pad1_[64];
+    size_t tail_;            // Next slot to push, written by the producer.
+    size_t headCache_;       // Producer's copy of head_.
+    char pad2_[64];
+
+public:
+    SpscQueue( size_t capacity ) {
+        slots_ = new T[capacity];
+        mask_ = capacity - 1;
+        head_ = 0;
+        tailCache_ = 0;
+        tail_ = 0;
+        headCache_ = 0;
+    }
+
+    ~SpscQueue() {
+        delete [] slots_;
+    }
+
+    // Producer only. False if the ring is full.
+    bool push( const T &value ) {
+        if ( tail_ - headCache_ > mask_ ) {
+            headCache_ = __atomic_load_n( &head_, __ATOMIC_ACQUIRE );
+            if ( tail_ - headCache_ > mask_ ) {
+                return false;
+            }
+        }
+        slots_[tail_ & mask_] = value;
+        __atomic_store_n( &tail_, tail_ + 1, __ATOMIC_RELEASE );
+        return true;
+    }
+
+    // Consumer only. False if the ring is empty.
+    bool pop( T *value ) {
+        if ( head_ == tailCache_ ) {
+            tailCache_ = __atomic_load_n( &tail_, __ATOMIC_ACQUIRE );
+            if ( head_ == tailCache_ ) {
+                return false;
+            }
+        }
+        *value = slots_[head_ & mask_];
+        __atomic_store_n( &head_, head_ + 1, __ATOMIC_RELEASE );
+        return true;
+    }
+
+    // Consumer only.
+    bool empty() {
+        return head_ == __atomic_load_n( &tail_, __ATOMIC_ACQUIRE );
+    }
+};
+
+#endif // _SPSC_QUEUE_H
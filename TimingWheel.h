@@ -0,0 +1,135 @@
+#ifndef _TIMING_WHEEL_H
+#define _TIMING_WHEEL_H
+
+#include "Memcached.h"
+
+// Hierarchical timing wheel of the items of a shard that have an
+// expiry time, so expired items are found without looking at the
+// others. Time is in seconds of currentTime().
+//
+// There are WHEEL_LEVELS levels of WHEEL_SLOTS slots. A slot of level 0
+// holds the items expiring in one second, a slot of level L the ones of
+// WHEEL_SLOTS^L seconds. An item goes to the lowest level whose period
+// it shares with the current time, into the slot of its expiry in that
+// level. When the current time enters a new period of a level, the
+// slot of that period is emptied into the levels below. So adding or
+// removing an item is O(1), and every second only the due slots are
+// looked at, each item moving down at most once per level.
+//
+// Slots are intrusive lists through wheelNext_. wheelPrev_ points at
+// whatever points at the item, so it can be taken out without knowing
+// its slot. Not thread safe, the shard lock protects it.
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS ( 1 << WHEEL_BITS )
+#define WHEEL_MASK ( WHEEL_SLOTS - 1 )
+// 2^24 seconds, expiries further out are put back in the top level
+// when their slot comes up.
+#define WHEEL_LEVELS 4
+
+class TimingWheel {
+private:
+    MemcachedItem *slots_[WHEEL_LEVELS][WHEEL_SLOTS];
+    uint32_t time_;       // Next second to be processed.
+    size_t count_;        // Items in the wheel.
+
+    static uint32_t periodOf( uint32_t time, int level ) {
+        return (uint64_t)time >> ( WHEEL_BITS * level );
+    }
+
+    void push( MemcachedItem **slot, MemcachedItem *item ) {
+        item->wheelNext_ = *slot;
+        if ( *slot != NULL ) {
+            (*slot)->wheelPrev_ = &item->wheelNext_;
+        }
+        item->wheelPrev_ = slot;
+        *slot = item;
+    }
+
+    // Put the item in its slot, for an expiry of at least time_.
+    void place( MemcachedItem *item ) {
+        uint32_t expiry = max( item->exptime_, time_ );
+        int level = 0;
+        while ( level < WHEEL_LEVELS - 1 &&
+                periodOf( expiry, level + 1 ) != periodOf( time_, level + 1 ) ) {
+            level++;
+        }
+        push( &slots_[level][periodOf( expiry, level ) & WHEEL_MASK], item );
+    }
+
+    // Take the whole list of a slot out.
+    MemcachedItem *takeSlot( int level, int index ) {
+        MemcachedItem *item = slots_[level][index];
+        slots_[level][index] = NULL;
+        return item;
+    }
+
+public:
+    TimingWheel() {
+        memset( slots_, 0, sizeof( slots_ ) );
+        time_ = currentTime();
+        count_ = 0;
+    }
+
+    // Add an item with a non zero exptime_. One already expired comes
+    // out of the next advance.
+    void add( MemcachedItem *item ) {
+        place( item );
+        count_++;
+    }
+
+    // Take the item out if it is in the wheel.
+    void remove( MemcachedItem *item ) {
+        if ( item->wheelPrev_ == NULL ) {
+            return;
+        }
+        *item->wheelPrev_ = item->wheelNext_;
+        if ( item->wheelNext_ != NULL ) {
+            item->wheelNext_->wheelPrev_ = item->wheelPrev_;
+        }
+        item->wheelPrev_ = NULL;
+        item->wheelNext_ = NULL;
+        count_--;
+    }
+
+    // Process every second up to now. The items that expired are taken
+    // out of the wheel and appended to expired.
+    void advance( uint32_t now, vector< MemcachedItem * > *expired ) {
+        while ( time_ <= now ) {
+            if ( count_ == 0 ) {
+                time_ = now + 1;
+                return;
+            }
+            // Entering a new period of a level, hand its slot down.
+            // Higher levels first, their items may land in the slots
+            // of the lower ones we are about to process.
+            for ( int level = WHEEL_LEVELS - 1; level > 0; level-- ) {
+                if ( ( time_ & ( ( 1U << ( WHEEL_BITS * level ) ) - 1 ) ) != 0 ) {
+                    continue;
+                }
+                MemcachedItem *item = takeSlot( level, periodOf( time_, level ) & WHEEL_MASK );
+                while ( item != NULL ) {
+                    MemcachedItem *next = item->wheelNext_;
+                    place( item );
+                    item = next;
+                }
+            }
+            MemcachedItem *item = takeSlot( 0, time_ & WHEEL_MASK );
+            while ( item != NULL ) {
+                MemcachedItem *next = item->wheelNext_;
+                item->wheelPrev_ = NULL;
+                item->wheelNext_ = NULL;
+                count_--;
+                expired->push_back( item );
+                item = next;
+            }
+            time_++;
+        }
+    }
+
+    size_t size() {
+        return count_;
+    }
+};
+
+#endif // _TIMING_WHEEL_H
@@ -0,0 +1,292 @@
+#include "Memcached.h"
+#include "LRUMemCache.h"
+#include "Zipf.h"
+#include <unordered_map>
+
+// Replays a key trace against LRUMemCache once per eviction policy and
+// prints the hit ratio and ops/sec of each, so a policy can be compared
+// against strict LRU on the same requests. The gain column is the hit
+// ratio of the policy minus the one of the first policy replayed, lru
+// unless -e says otherwise. Gets are cache-aside, a miss
+// is followed by a set of the key like a client filling the cache.
+//
+// A trace file has one request per line:
+//   get <key>
+//   set <key> [bytes]
+//   <key>                 same as get
+// Without a file a Zipf trace is generated, with a share of requests
+// going to keys that are read only once, like a scan would.
+
+struct ReplayConfig {
+    int numThreads;
+    int numShards;
+    int memoryMB;
+    int valueSize;
+    long numKeys;
+    long numOps;
+    double theta;
+    int scanPercent;
+};
+
+struct TraceOp {
+    uint32_t key;       // Index into the key table.
+    uint32_t size;      // Value size for sets and fills.
+    bool set;
+};
+
+struct Trace {
+    vector< string > keys;
+    vector< TraceOp > ops;
+};
+
+struct ReplayThread {
+    pthread_t threadId;
+    int id;
+    int numThreads;
+    LRUMemCache *cache;
+    Trace *trace;
+    const char *value;
+    pthread_barrier_t *barrier;
+    long gets;
+    long hits;
+    long ops;
+};
+
+static void storeKey( LRUMemCache *cache, const string &key, uint32_t size,
+                      const char *value ) {
+    MemcachedItem *item = cache->allocItem( key.data(), key.size(), size );
+    if ( item == NULL ) {
+        return;
+    }
+    item->copyIn( 0, value, size );
+    cache->setItem( item );
+}
+
+// Every thread replays the whole trace starting at its own offset, so
+// they don't walk through it in lock step.
+static void * replayThreadFunc( void *arg ) {
+    ReplayThread *rt = (ReplayThread *)arg;
+    vector< TraceOp > &ops = rt->trace->ops;
+    vector< string > &keys = rt->trace->keys;
+    size_t count = ops.size();
+    size_t start = count / rt->numThreads * rt->id;
+
+    pthread_barrier_wait( rt->barrier );
+    for ( size_t i = 0; i < count; i++ ) {
+        TraceOp &op = ops[( start + i ) % count];
+        const string &key = keys[op.key];
+        if ( op.set ) {
+            storeKey( rt->cache, key, op.size, rt->value );
+            continue;
+        }
+        rt->gets++;
+        MemcachedItem *item = rt->cache->getItem( key.data(), key.size() );
+        if ( item != NULL ) {
+            rt->hits++;
+            rt->cache->releaseItem( item );
+        } else {
+            storeKey( rt->cache, key, op.size, rt->value );
+        }
+    }
+    rt->ops = count;
+    return NULL;
+}
+
+// Returns the hit ratio in percent.
+static double replay( ReplayConfig *config, Trace *trace, EvictionPolicy policy,
+                      const char *value, double baseline ) {
+    LRUMemCache cache( (size_t)config->memoryMB * 1024 * 1024, config->numShards, policy );
+
+    pthread_barrier_t barrier;
+    pthread_barrier_init( &barrier, NULL, config->numThreads + 1 );
+    vector< ReplayThread > threads( config->numThreads );
+    for ( int i = 0; i < config->numThreads; i++ ) {
+        threads[i].id = i;
+        threads[i].numThreads = config->numThreads;
+        threads[i].cache = &cache;
+        threads[i].trace = trace;
+        threads[i].value = value;
+        threads[i].barrier = &barrier;
+        threads[i].gets = 0;
+        threads[i].hits = 0;
+        threads[i].ops = 0;
+        pthread_create( &threads[i].threadId, NULL, replayThreadFunc, &threads[i] );
+    }
+
+    pthread_barrier_wait( &barrier );
+    double start = nowSecs();
+    long gets = 0, hits = 0, ops = 0;
+    for ( int i = 0; i < config->numThreads; i++ ) {
+        pthread_join( threads[i].threadId, NULL );
+        gets += threads[i].gets;
+        hits += threads[i].hits;
+        ops += threads[i].ops;
+    }
+    double elapsed = nowSecs() - start;
+    pthread_barrier_destroy( &barrier );
+
+    double hitRatio = gets > 0 ? 100.0 * hits / gets : 0.0;
+    printf( "%-8s %14.0f %9.2f%% %+8.2f %12zu\n", evictionPolicyNames[policy],
+            ops / elapsed, hitRatio, baseline < 0 ? 0.0 : hitRatio - baseline,
+            cache.size() );
+    return hitRatio;
+}
+
+static bool loadTrace( const char *path, ReplayConfig *config, Trace *trace ) {
+    FILE *file = fopen( path, "r" );
+    if ( file == NULL ) {
+        perror( path );
+        return false;
+    }
+    unordered_map< string, uint32_t > index;
+    char line[MAX_COMMAND_LINE];
+    while ( fgets( line, sizeof( line ), file ) != NULL ) {
+        char *words[3];
+        int count = 0;
+        char *save;
+        for ( char *word = strtok_r( line, " \t\r\n", &save ); word != NULL && count < 3;
+              word = strtok_r( NULL, " \t\r\n", &save ) ) {
+            words[count++] = word;
+        }
+        if ( count == 0 ) {
+            continue;
+        }
+        TraceOp op;
+        op.set = false;
+        op.size = config->valueSize;
+        const char *key = words[0];
+        if ( count > 1 && ( strcmp( words[0], "get" ) == 0 ||
+                            strcmp( words[0], "set" ) == 0 ) ) {
+            op.set = words[0][0] == 's';
+            key = words[1];
+            if ( count > 2 ) {
+                op.size = atoi( words[2] );
+            }
+        }
+        if ( strlen( key ) > KEY_MAX_LENGTH ) {
+            continue;
+        }
+        pair< unordered_map< string, uint32_t >::iterator, bool > found =
+            index.insert( make_pair( string( key ), (uint32_t)trace->keys.size() ) );
+        if ( found.second ) {
+            trace->keys.push_back( key );
+        }
+        op.key = found.first->second;
+        trace->ops.push_back( op );
+    }
+    fclose( file );
+    return true;
+}
+
+static void generateTrace( ReplayConfig *config, Trace *trace ) {
+    ZipfGenerator zipf( config->numKeys, config->theta );
+    uint64_t rand = 0x9E3779B97F4A7C15ULL;
+    for ( long i = 0; i < config->numKeys; i++ ) {
+        trace->keys.push_back( "key:" + to_string( (long long int)i ) );
+    }
+    long scanned = 0;
+    for ( long i = 0; i < config->numOps; i++ ) {
+        TraceOp op;
+        op.set = false;
+        op.size = config->valueSize;
+        if ( (int)( zipfRandom( &rand ) % 100 ) < config->scanPercent ) {
+            op.key = trace->keys.size();
+            trace->keys.push_back( "scan:" + to_string( (long long int)scanned++ ) );
+        } else {
+            op.key = zipf.next( &rand );
+        }
+        trace->ops.push_back( op );
+    }
+}
+
+static void usage( const char *prog ) {
+    fprintf( stderr, "Usage: %s [-t threads] [-s shards] [-m memoryMB] [-v valueSize] "
+             "[-k keys] [-n ops] [-z theta] [-S scanPercent] [-e lru|clock|slru|tinylfu] "
+             "[traceFile]\n", prog );
+}
+
+int main( int argc, char **argv ) {
+    ReplayConfig config;
+    config.numThreads = 1;
+    config.numShards = LRU_CACHE_SHARDS;
+    config.memoryMB = 16;
+    config.valueSize = 100;
+    config.numKeys = 1000000;
+    config.numOps = 10000000;
+    config.theta = 0.99;
+    config.scanPercent = 10;
+    vector< EvictionPolicy > policies;
+
+    int opt;
+    while ( ( opt = getopt( argc, argv, "t:s:m:v:k:n:z:S:e:h" ) ) != -1 ) {
+        switch ( opt ) {
+        case 't': config.numThreads = atoi( optarg ); break;
+        case 's': config.numShards = atoi( optarg ); break;
+        case 'm': config.memoryMB = atoi( optarg ); break;
+        case 'v': config.valueSize = atoi( optarg ); break;
+        case 'k': config.numKeys = atol( optarg ); break;
+        case 'n': config.numOps = atol( optarg ); break;
+        case 'z': config.theta = atof( optarg ); break;
+        case 'S': config.scanPercent = atoi( optarg ); break;
+        case 'e': {
+            EvictionPolicy policy;
+            if ( !parseEvictionPolicy( optarg, &policy ) ) {
+                usage( argv[0] );
+                return 1;
+            }
+            policies.push_back( policy );
+            break;
+        }
+        default:
+            usage( argv[0] );
+            return 1;
+        }
+    }
+    if ( config.numThreads <= 0 || config.numShards <= 0 || config.memoryMB <= 0 ||
+         config.valueSize <= 0 || config.numKeys <= 0 || config.numOps <= 0 ||
+         config.theta <= 0 || config.theta >= 1 || config.scanPercent < 0 ||
+         config.scanPercent > 100 ) {
+        usage( argv[0] );
+        return 1;
+    }
+    if ( policies.empty() ) {
+        for ( int i = EVICT_LRU; i <= EVICT_TINYLFU; i++ ) {
+            policies.push_back( (EvictionPolicy)i );
+        }
+    }
+
+    Trace trace;
+    if ( optind < argc ) {
+        if ( !loadTrace( argv[optind], &config, &trace ) ) {
+            return 1;
+        }
+        printf( "# trace=%s", argv[optind] );
+    } else {
+        generateTrace( &config, &trace );
+        printf( "# zipf keys=%ld theta=%.2f scan=%d%%", config.numKeys, config.theta,
+                config.scanPercent );
+    }
+    printf( " ops=%zu keys=%zu memory=%dMB threads=%d\n", trace.ops.size(),
+            trace.keys.size(), config.memoryMB, config.numThreads );
+    if ( trace.ops.empty() ) {
+        return 0;
+    }
+
+    // Values in the trace may be bigger than -v.
+    size_t maxSize = 0;
+    for ( size_t i = 0; i < trace.ops.size(); i++ ) {
+        maxSize = max( maxSize, (size_t)trace.ops[i].size );
+    }
+    string value( maxSize, 'v' );
+
+    printf( "%-8s %14s %10s %8s %12s\n", "policy", "ops/s", "hit ratio", "gain",
+            "items" );
+    double baseline = -1;
+    for ( size_t i = 0; i < policies.size(); i++ ) {
+        double hitRatio = replay( &config, &trace, policies[i], value.data(), baseline );
+        if ( i == 0 ) {
+            baseline = hitRatio;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,78 @@
+#ifndef _ZIPF_H
+#define _ZIPF_H
+
+#include <math.h>
+#include "Memcached.h"
+
+// Key popularity for the benchmarks. Draws ranks in [0, items) where
+// rank r comes up with a probability proportional to 1 / (r + 1)^theta,
+// with the method of Gray et al. ("Quickly generating billion-record
+// synthetic databases") that YCSB uses. Setting it up is O(items),
+// every draw is O(1).
+
+// xorshift64, cheap enough not to show up in the numbers.
+static inline uint64_t zipfRandom( uint64_t *state ) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+// Uniform in [0, 1).
+static inline double zipfRandomUnit( uint64_t *state ) {
+    return ( zipfRandom( state ) >> 11 ) * ( 1.0 / 9007199254740992.0 );
+}
+
+class ZipfGenerator {
+private:
+    uint64_t items_;
+    double theta_;
+    double zetan_;
+    double alpha_;
+    double eta_;
+    double half_;     // 1 + 0.5^theta, the bound of rank 1.
+
+    static double zeta( uint64_t n, double theta ) {
+        double sum = 0;
+        for ( uint64_t i = 1; i <= n; i++ ) {
+            sum += 1.0 / pow( (double)i, theta );
+        }
+        return sum;
+    }
+
+public:
+    // theta must be in (0, 1), 0.99 is the usual skew of caches.
+    ZipfGenerator( uint64_t items, double theta ) {
+        items_ = items;
+        theta_ = theta;
+        zetan_ = zeta( items, theta );
+        double zeta2 = zeta( 2, theta );
+        alpha_ = 1.0 / ( 1.0 - theta );
+        eta_ = ( 1.0 - pow( 2.0 / items, 1.0 - theta ) ) / ( 1.0 - zeta2 / zetan_ );
+        half_ = 1.0 + pow( 0.5, theta );
+    }
+
+    // Rank for a uniform u in [0, 1), 0 is the most popular.
+    uint64_t rank( double u ) {
+        double uz = u * zetan_;
+        if ( uz < 1.0 ) {
+            return 0;
+        }
+        if ( uz < half_ ) {
+            return 1;
+        }
+        uint64_t r = (uint64_t)( items_ * pow( eta_ * u - eta_ + 1.0, alpha_ ) );
+        return r < items_ ? r : items_ - 1;
+    }
+
+    // Next rank, scattered over [0, items) so that the popular ones
+    // are not all next to each other.
+    uint64_t next( uint64_t *state ) {
+        uint64_t r = rank( zipfRandomUnit( state ) );
+        return ( r * 0x9E3779B97F4A7C15ULL ) % items_;
+    }
+};
+
+#endif // _ZIPF_H